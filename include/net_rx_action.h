@@ -15,10 +15,21 @@
 #define NET_RX_BUCKET_8  5000
 
 /* bucket 9 is anything > than bucket 8 */
-/* bucket 10 is errors */
+/* bucket 10 is calls not timed: nested deeper than
+ * NET_RX_MAX_DEPTH, started before the probes attached or
+ * whose return was missed
+ */
 
 #define NET_RX_NUM_BKTS  11
-#define NET_RX_ERR_BKT (NET_RX_NUM_BKTS-1)
+#define NET_RX_MISS_BKT (NET_RX_NUM_BKTS-1)
+
+/* max nested calls timed per cpu; must be a power of 2 */
+#define NET_RX_MAX_DEPTH	4
+
+/* no call runs this long; an older in-progress entry means its
+ * return was missed (e.g., kretprobe maxactive exceeded)
+ */
+#define NET_RX_STALE_NS		1000000000ULL
 
 struct net_rx_hist_val {
 	__u64 buckets[NET_RX_NUM_BKTS];
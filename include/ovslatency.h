@@ -13,6 +13,34 @@
 /* bucket 6 is > 5 */
 /* bucket 7 is total number of packets */
 
+/* max nested ovs_vport_receive calls timed per cpu; power of 2 */
+#define OVSLAT_MAX_DEPTH	4
+
+/* no call runs this long; an older in-progress entry means its
+ * return was missed (e.g., kretprobe maxactive exceeded)
+ */
+#define OVSLAT_STALE_NS		1000000000ULL
+
+/* calls to ovs_vport_receive that were not timed */
+enum ovslat_err {
+	OVSLAT_ERR_OVERFLOW,	/* nested deeper than OVSLAT_MAX_DEPTH */
+	OVSLAT_ERR_STALE,	/* stack reset after a missed return */
+	OVSLAT_ERR_MAX,
+};
+
+/* max number of (vport, upcall) histograms */
+#define OVSLAT_MAP_ENTRIES 256
+
+/* histograms are per ingress vport device; with upcall tracking on,
+ * packets that missed the flow table and went to userspace are
+ * counted separately
+ */
+struct ovslat_key {
+	__u32 ifindex;
+	__u8  upcall;
+	__u8  pad[3];
+};
+
 struct ovslat_hist_val {
 	__u64 buckets[8];
 };
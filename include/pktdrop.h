@@ -13,16 +13,16 @@ struct data {
 	__u64	time;
 	__u64	location;
 	__u64	netns;
+	__u16	cpu;
 	__u8	event_type;
-	__u8	cpu;
 	__u8	nr_frags;
-	__u8	pkt_type;
 	__u16	gso_size;
 	__be16	protocol;
 	__u32	ifindex;
 	__u16	vlan_tci;
 	__be16	vlan_proto;
 	__u32	pkt_len;
+	__u8	pkt_type;
 	__u8	pkt_data[64];
 };
 
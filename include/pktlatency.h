@@ -16,16 +16,48 @@
  */
 #define PKTLAT_MAX_BUCKETS 9
 
-struct pktlat_ctl {
+/* default number of processes tracked */
+#define PKTLAT_MAP_ENTRIES 512
+
+/* max number of ingress devices with a PTP hardware clock */
+#define PKTLAT_MAX_DEVS 64
+
+/* tasks in a tap read or tcp/udp recvmsg at the same time */
+#define PKTLAT_RECV_ENTRIES 4096
+
+/* conversion of a device's PHC time to MONOTONIC, keyed by ifindex:
+ *    mono = mono_ref + (ptp - ptp_ref) * (1 + drift_ppb / 1e9)
+ */
+struct pktlat_ptp_ref {
 	__u64 ptp_ref;
 	__u64 mono_ref;
+	__s64 drift_ppb;
+};
+
+/* measurement points; all feed the same histogram map */
+enum pktlat_hook {
+	PKTLAT_HOOK_TAP,	/* copy to a tap user, e.g., vhost */
+	PKTLAT_HOOK_TCP,	/* copy in tcp recvmsg */
+	PKTLAT_HOOK_UDP,	/* copy in udp recvmsg */
+	PKTLAT_HOOK_TUN_XMIT,	/* stack hands packet to a tap device */
+	PKTLAT_HOOK_MAX,
+};
+
+struct pktlat_ctl {
 	int ifindex_min;  /* used to ignore packets on eth0, eth1 */
 	__u32 latency_gen_sample;  /* latency at which a sample is generated */
+	__u32 hooks;  /* bitmask of enabled pktlat_hook */
 	__u8  gen_samples;  /* send samples to userspace as well as histogram */
 };
 
+/* copy hooks are tracked per process; tun_net_xmit, which runs in
+ * softirq, per tap device with pid 0
+ */
 struct pktlat_hist_key {
 	__u32 pid;
+	__u32 ifindex;
+	__u8  hook;
+	__u8  pad[3];
 };
 
 struct pktlat_hist_val {
@@ -43,9 +75,11 @@ struct data {
 	__u32	ifindex;
 	__u32	pkt_len;
 	__u32	pid;
-	__u8	event_type;
-	__u8	cpu;
+	__u32	iif;	/* ingress device; selects the PHC */
+	__u16	cpu;
 	__be16	protocol;
+	__u8	event_type;
+	__u8	hook;
 	__u8	pkt_data[64];
 };
 
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _PKTSTAGES_H_
+#define _PKTSTAGES_H_
+
+/* stages of the rx path in the order a packet passes them */
+enum pktstage {
+	PKTSTAGE_GRO,		/* napi_gro_receive */
+	PKTSTAGE_NETIF,		/* netif_receive_skb */
+	PKTSTAGE_OVS,		/* ovs_vport_receive */
+	PKTSTAGE_TUN,		/* tun_net_xmit */
+	PKTSTAGE_COPY,		/* copy to userspace */
+	PKTSTAGE_MAX,
+};
+
+/* histogram index for first stage seen to copy to userspace */
+#define PKTSTAGE_TOTAL	PKTSTAGE_MAX
+
+/* default number of packets in flight tracked */
+#define PKTSTAGE_SKB_ENTRIES	16384
+
+#define PKTSTAGE_BUCKET_0     1
+#define PKTSTAGE_BUCKET_1     2
+#define PKTSTAGE_BUCKET_2     5
+#define PKTSTAGE_BUCKET_3    10
+#define PKTSTAGE_BUCKET_4    25
+#define PKTSTAGE_BUCKET_5    50
+#define PKTSTAGE_BUCKET_6   100
+#define PKTSTAGE_BUCKET_7   500
+/* bucket 8 is > bucket 7
+ * bucket 9 is running sum in nsec
+ */
+#define PKTSTAGE_MAX_BUCKETS 10
+
+/* time from the previous stage seen to this one (usec buckets) */
+struct pktstage_hist_val {
+	__u64 buckets[PKTSTAGE_MAX_BUCKETS];
+};
+
+/* packet in flight, keyed by skb address */
+struct pktstage_skb {
+	__u64 t_first;
+	__u64 t_last;
+	__u32 stage;
+};
+
+/* order of arguments from
+ * /sys/kernel/tracing/events/net/netif_receive_skb/format
+ * common fields represented by 'unsigned long long unused;'
+
+	field:void * skbaddr;	offset:8;	size:8;	signed:0;
+	field:unsigned int len;	offset:16;	size:4;	signed:0;
+	field:__data_loc char[] name;	offset:20;	size:4;	signed:1;
+ */
+struct netif_rx_args {
+	unsigned long long unused;
+
+	void *skbaddr;
+	unsigned int len;
+	int name;
+};
+
+/* see skb_dg_iov_args in pktlatency.h */
+struct pktstage_copy_args {
+	unsigned long long unused;
+
+	void *skbaddr;
+	int len;
+};
+
+#endif
@@ -3,6 +3,13 @@
 
 #include <linux/if_ether.h>
 
+/* One vm_info map, keyed by tap device index, is shared by the VM
+ * programs of all VMs. Per-VM ACL tables hang off hash of maps with
+ * the same key (rx_acl_maps, tx_acl_maps), so one program instance
+ * serves all taps and adding a VM is a map update.
+ */
+#define VM_INFO_ENTRIES		512
+
 struct vm_info
 {
 	__u32		vmid;
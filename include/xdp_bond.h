@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _XDP_BOND_H_
+#define _XDP_BOND_H_
+
+/* Egress bond for packets redirected from VMs by xdp_vmegress. A hash
+ * of the flow selects one of the active members, host NICs with link
+ * up. Userspace (vm_bond) manages the members and the hash; the
+ * program only reads the active list.
+ */
+#define BOND_MAX_MEMBERS	16	/* power of 2 */
+#define BOND_RSS_KEY_LEN	40
+
+enum bond_hash {
+	BOND_HASH_XOR,		/* xor of addresses and ports (default) */
+	BOND_HASH_JHASH,	/* jhash of addresses and ports, seeded */
+	BOND_HASH_TOEPLITZ,	/* RSS hash as computed by NICs */
+	BOND_HASH_MAX,
+};
+
+struct bond_config {
+	__u32 hash;				/* enum bond_hash */
+	__u32 seed;				/* jhash initval */
+	__u32 n_members;
+	__u32 members[BOND_MAX_MEMBERS];	/* configured, by ifindex */
+	__u32 n_active;
+	__u32 active[BOND_MAX_MEMBERS];		/* members with link up */
+	__u8  rss_key[BOND_RSS_KEY_LEN];	/* toeplitz key */
+};
+
+#endif
@@ -3,16 +3,113 @@
 
 #include <linux/if_ether.h>
 
+/* what happened to a packet; PASS reasons say why it fell off the
+ * fast path to the kernel stack
+ */
+enum l2fwd_verdict {
+	L2FWD_FWD,		/* redirected, static entry */
+	L2FWD_FWD_LEARNED,	/* redirected, learned entry */
+	L2FWD_FLOOD,		/* broadcast/multicast to the vlan flood group */
+	L2FWD_PASS_NO_VLAN,	/* not 802.1Q tagged */
+	L2FWD_PASS_VLAN0,	/* priority tag only */
+	L2FWD_PASS_FDB_MISS,	/* no FDB entry for <vlan,dmac> */
+	L2FWD_PASS_NO_DEV,	/* FDB entry without a device */
+	L2FWD_PASS_DEVMAP_MISS,	/* FDB device not in ports map */
+	L2FWD_PASS_SAME_PORT,	/* learned on the ingress port */
+	L2FWD_PASS_ADJUST_HEAD,	/* failed to pop the VLAN header */
+	L2FWD_DROP_MALFORMED,	/* truncated headers */
+	L2FWD_VERDICT_MAX,
+};
+
+/* per-cpu counters keyed by ingress device, egress device (0 for
+ * packets not redirected) and verdict
+ */
+struct xdp_stats_key {
+	__u32 ifindex_in;
+	__u32 ifindex_out;
+	__u32 verdict;
+};
+
 struct xdp_stats {
-	__u64 bytes_fwd;
-	__u64 pkts_fwd;
-	__u64 dropped;
+	__u64 bytes;
+	__u64 pkts;
+};
+
+#define XDP_STATS_ENTRIES	4096
+
+/* Broadcast and multicast for a vlan are flooded to the ports of its
+ * flood group: all ports in xdp_flood_ports get a copy and a devmap
+ * program drops it on ports that are not members of the vlan.
+ */
+#define FLOOD_PORTS		512
+#define FLOOD_MEMBERS		4096
+
+struct flood_member_key {
+	__u32 ifindex;
+	__u16 vlan;
+	__u16 pad;
+};
+
+#define FLOOD_F_UNTAG		(1 << 0)	/* pop the VLAN tag, e.g. VMs */
+
+struct flood_member {
+	__u32 flags;
 };
 
+/* vlan is the 802.1Q tag, or with Q-in-Q the inner (customer) tag
+ * and outer_vlan the 802.1ad service tag. outer_vlan is 0 for single
+ * tagged frames.
+ */
 struct fdb_key
 {
 	__u8  mac[ETH_ALEN];
 	__u16 vlan;
+	__u16 outer_vlan;
+	__u16 pad;
+};
+
+/* what to do with the tags of a frame forwarded by a static entry */
+enum fdb_action {
+	FDB_ACT_STRIP,		/* remove all tags (default; e.g., VM port) */
+	FDB_ACT_KEEP,		/* forward as received (trunk) */
+	FDB_ACT_POP_OUTER,	/* remove the outermost tag only */
+	FDB_ACT_REWRITE,	/* set the outermost tag's VID to vlan */
+	FDB_ACT_PUSH,		/* push an 802.1ad tag with VID vlan */
+	FDB_ACT_MAX,
+};
+
+struct fdb_val {
+	__u32 ifindex;
+	__u16 action;		/* enum fdb_action */
+	__u16 vlan;		/* VID for rewrite and push */
+};
+
+/* static entries (fdb_map) are managed by userspace and never aged.
+ * Learned entries live in a separate LRU hash so learning can not
+ * evict a static entry.
+ */
+#define FDB_STATIC_ENTRIES	512
+#define FDB_LEARN_ENTRIES	65536
+
+struct fdb_learn_val {
+	__u32 ifindex;
+	__u32 pad;
+	__u64 last_seen;	/* bpf_ktime_get_ns */
+};
+
+/* last_seen is only refreshed once this old to limit writes */
+#define FDB_REFRESH_NS		1000000000ULL
+
+/* default age for learned entries, seconds */
+#define FDB_AGE_DEFAULT		300
+
+/* The static FDB is double buffered: fdb_map and fdb_map_shadow.
+ * Userspace fills the inactive one and flips active, so replacing the
+ * whole FDB is a single update from the program's point of view.
+ */
+struct fdb_config {
+	__u32 learn;		/* learn <vlan,smac> to ingress device */
+	__u32 active;		/* static FDB in use: 0 fdb_map, 1 shadow */
 };
 
 #endif
@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _XDP_L3FWD_H_
+#define _XDP_L3FWD_H_
+
+#include <linux/if_ether.h>
+
+/* what happened to a packet; PASS reasons say why it fell off the
+ * fast path to the kernel stack. For L3FWD_PASS_FIB the
+ * BPF_FIB_LKUP_RET_* code is in the fib_rc field of the key.
+ */
+enum l3fwd_verdict {
+	L3FWD_FWD,		/* redirected after a FIB lookup */
+	L3FWD_FWD_CACHED,	/* redirected from the FIB cache */
+	L3FWD_PASS_TTL,		/* ttl or hop limit <= 1 */
+	L3FWD_PASS_PROTO,	/* not IPv4 or IPv6 */
+	L3FWD_PASS_FIB,		/* FIB lookup failed; see fib_rc */
+	L3FWD_PASS_DEVMAP_MISS,	/* egress device not in ports map */
+	L3FWD_DROP_MALFORMED,	/* truncated headers */
+	L3FWD_VERDICT_MAX,
+};
+
+/* per-cpu counters keyed by ingress device, egress device (0 if not
+ * known), verdict and FIB lookup result
+ */
+struct l3fwd_stats_key {
+	__u32 ifindex_in;
+	__u32 ifindex_out;
+	__u32 verdict;
+	__u32 fib_rc;
+};
+
+struct l3fwd_stats {
+	__u64 bytes;
+	__u64 pkts;
+};
+
+#define L3FWD_STATS_ENTRIES	4096
+
+/* default size of the egress ports map; a hash keyed by ifindex, so
+ * any device can be a port
+ */
+#define L3FWD_PORTS		512
+
+/* per egress port settings applied by the devmap program */
+struct l3fwd_port {
+	__u16 vlan;		/* push an 802.1Q tag with this vid if not 0 */
+	__u16 pad;
+};
+
+/* Cache of FIB lookup results. Entries are per-cpu and tagged with
+ * the generation they were added in; userspace bumps the generation
+ * on route, neighbor, address and link changes, which invalidates
+ * every entry at once. Generation 0 is never used so unset per-cpu
+ * values are misses.
+ */
+#define L3FWD_CACHE_ENTRIES	16384
+
+#define L3FWD_CACHE_F_ENABLED	(1 << 0)
+#define L3FWD_CACHE_F_DST_ONLY	(1 << 1)	/* key by dst, not flow */
+
+struct l3fwd_cache_cfg {
+	__u32 gen;
+	__u32 flags;
+};
+
+struct l3fwd_cache_key {
+	__u32 ifindex;		/* ingress */
+	__u32 family;
+	__u32 dst[4];		/* ipv4 uses dst[0] */
+	__u32 src[4];		/* 0 with L3FWD_CACHE_F_DST_ONLY */
+};
+
+struct l3fwd_cache_val {
+	__u32 gen;
+	__u32 ifindex;		/* egress */
+	__u8  dmac[ETH_ALEN];
+	__u8  smac[ETH_ALEN];
+	/* largest packet the FIB lookup has passed the MTU check for;
+	 * bigger ones take the full lookup
+	 */
+	__u16 max_len;
+	__u16 pad;
+};
+
+#endif
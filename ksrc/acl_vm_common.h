@@ -44,11 +44,14 @@ static __always_inline bool ipv6_any(const struct in6_addr *a1)
 	       a1->s6_addr32[3] == 0;
 }
 
-/* returns true if packet should be dropped; false to continue */
+/* returns true if packet should be dropped; false to continue.
+ * acl_map is the VM's ACL table from the hash of maps; NULL if the VM
+ * has none.
+ */
 static __always_inline bool drop_packet(void *data, void *data_end,
 					struct vm_info *vi,
 					u32 dev_idx, bool rx, struct flow *fl,
-					struct bpf_map_def *acl_map)
+					void *acl_map)
 {
 	struct ethhdr *eth = data;
 	struct acl_key key = {};
@@ -108,6 +111,9 @@ static __always_inline bool drop_packet(void *data, void *data_end,
 	if (rc)
 		return rc > 0 ? false : true;
 
+	if (!acl_map)
+		return false;
+
 	key.protocol = fl->protocol;
 	if (key.protocol == IPPROTO_TCP || key.protocol == IPPROTO_UDP)
 		key.port = fl->ports.dport;
@@ -8,18 +8,23 @@
 
 #include "acl_vm_common.h"
 
-struct bpf_map_def SEC("maps") __rx_acl_map = {
-	.type = BPF_MAP_TYPE_HASH,
-	.key_size = sizeof(struct acl_key),
-	.value_size = sizeof(struct acl_val),
-	.max_entries = 64,
+/* per-VM ACL tables by device index. Inner maps are hash maps of
+ * struct acl_key to struct acl_val; the outer map has to be created
+ * with an inner map template and passed in when loading (see
+ * scripts/l2fwd-demo.sh).
+ */
+struct bpf_map_def SEC("maps") __rx_acl_maps = {
+	.type = BPF_MAP_TYPE_HASH_OF_MAPS,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(u32),
+	.max_entries = VM_INFO_ENTRIES,
 };
 
 struct bpf_map_def SEC("maps") __vm_info_map = {
 	.type = BPF_MAP_TYPE_HASH,
 	.key_size = sizeof(u32),
 	.value_size = sizeof(struct vm_info),
-	.max_entries = 1,
+	.max_entries = VM_INFO_ENTRIES,
 };
 
 SEC("classifier/acl_vm_rx")
@@ -30,13 +35,15 @@ int tc_acl_vm_rx_prog(struct __sk_buff *skb)
 	u32 idx = skb->ifindex;
 	struct flow fl = {};
 	struct vm_info *vi;
+	void *acl_map;
 	bool rc;
 
 	vi = bpf_map_lookup_elem(&__vm_info_map, &idx);
 	if (!vi)
 		return TC_ACT_OK;
 
-	rc = drop_packet(data, data_end, vi, idx, true, &fl, &__rx_acl_map);
+	acl_map = bpf_map_lookup_elem(&__rx_acl_maps, &idx);
+	rc = drop_packet(data, data_end, vi, idx, true, &fl, acl_map);
 
 	return rc ? TC_ACT_SHOT : TC_ACT_OK;
 }
@@ -49,13 +56,15 @@ int xdp_acl_vm_rx_prog(struct xdp_md *ctx)
 	u32 idx = ctx->ingress_ifindex;
 	struct flow fl = {};
 	struct vm_info *vi;
+	void *acl_map;
 	bool rc;
 
 	vi = bpf_map_lookup_elem(&__vm_info_map, &idx);
 	if (!vi)
 		return XDP_PASS;
 
-	rc = drop_packet(data, data_end, vi, idx, true, &fl, &__rx_acl_map);
+	acl_map = bpf_map_lookup_elem(&__rx_acl_maps, &idx);
+	rc = drop_packet(data, data_end, vi, idx, true, &fl, acl_map);
 
 	return rc ? XDP_DROP : XDP_PASS;
 }
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __BOND_HASH_H
+#define __BOND_HASH_H
+
+/* flow hashes for selecting a bond member */
+
+#include "xdp_bond.h"
+#include "flow.h"
+
+#define BOND_JHASH_INITVAL	0xdeadbeef
+
+static __always_inline u32 bond_rol32(u32 word, unsigned int shift)
+{
+	return (word << shift) | (word >> ((-shift) & 31));
+}
+
+/* jhash_3words from include/linux/jhash.h */
+static __always_inline u32 bond_jhash_3words(u32 a, u32 b, u32 c,
+					     u32 initval)
+{
+	a += BOND_JHASH_INITVAL;
+	b += BOND_JHASH_INITVAL;
+	c += initval;
+
+	c ^= b; c -= bond_rol32(b, 14);
+	a ^= c; a -= bond_rol32(c, 11);
+	b ^= a; b -= bond_rol32(a, 25);
+	c ^= b; c -= bond_rol32(b, 16);
+	a ^= c; a -= bond_rol32(c, 4);
+	b ^= a; b -= bond_rol32(a, 14);
+	c ^= b; c -= bond_rol32(b, 24);
+
+	return c;
+}
+
+/* Toeplitz hash over len bytes of data as NICs compute the RSS hash;
+ * the key must be at least len + 4 bytes
+ */
+static __always_inline u32 bond_toeplitz(const u8 *key, const u8 *data,
+					 int len)
+{
+	u32 hash = 0, v;
+	int i, b;
+
+	v = (key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3];
+
+#pragma unroll
+	for (i = 0; i < BOND_RSS_KEY_LEN - 4; i++) {
+		if (i >= len)
+			break;
+#pragma unroll
+		for (b = 0; b < 8; b++) {
+			if (data[i] & (0x80 >> b))
+				hash ^= v;
+			v <<= 1;
+			if (key[i + 4] & (0x80 >> b))
+				v |= 1;
+		}
+	}
+
+	return hash;
+}
+
+static __always_inline bool flow_has_ports(const struct flow *fl)
+{
+	return fl->protocol == IPPROTO_TCP || fl->protocol == IPPROTO_UDP;
+}
+
+/* RSS input is src addr, dst addr, src port, dst port */
+static __always_inline u32 bond_hash_toeplitz(const struct bond_config *cfg,
+					      const struct flow *fl)
+{
+	u8 data[BOND_RSS_KEY_LEN - 4] = {};
+	int len;
+
+	if (fl->family == AF_INET) {
+		__builtin_memcpy(data, &fl->saddr.ipv4, 4);
+		__builtin_memcpy(data + 4, &fl->daddr.ipv4, 4);
+		len = 8;
+	} else {
+		__builtin_memcpy(data, &fl->saddr.ipv6, 16);
+		__builtin_memcpy(data + 16, &fl->daddr.ipv6, 16);
+		len = 32;
+	}
+
+	if (flow_has_ports(fl)) {
+		__builtin_memcpy(data + len, &fl->ports, 4);
+		len += 4;
+	}
+
+	return bond_toeplitz(cfg->rss_key, data, len);
+}
+
+static __always_inline u32 bond_hash_flow(const struct bond_config *cfg,
+					  struct flow *fl)
+{
+	u32 hash, saddr, daddr;
+
+	if (cfg->hash == BOND_HASH_TOEPLITZ &&
+	    (fl->family == AF_INET || fl->family == AF_INET6))
+		return bond_hash_toeplitz(cfg, fl);
+
+	/* flow_icmp and flow_ports are a union in flow
+	 * and both are u32 in size
+	 */
+	__builtin_memcpy(&hash, &fl->ports, sizeof(hash));
+
+	if (fl->family == AF_INET) {
+		saddr = fl->saddr.ipv4;
+		daddr = fl->daddr.ipv4;
+	} else if (fl->family == AF_INET6) {
+		saddr = ipv6_addr_hash(&fl->saddr.ipv6);
+		daddr = ipv6_addr_hash(&fl->daddr.ipv6);
+	} else {
+		saddr = 0;
+		daddr = 0;
+	}
+
+	if (cfg->hash == BOND_HASH_JHASH)
+		return bond_jhash_3words(saddr, daddr, hash, cfg->seed);
+
+	hash ^= daddr ^ saddr;
+	hash ^= (hash >> 16);
+	hash ^= (hash >> 8);
+
+	return hash >> 1;
+}
+
+#endif
@@ -1,4 +1,7 @@
 
+/* MAX_CPUS is only a default; userspace resizes the map to the
+ * number of possible cpus before the object is loaded.
+ */
 struct bpf_map_def SEC("maps") channel = {
  	.type = BPF_MAP_TYPE_PERF_EVENT_ARRAY,
  	.key_size = sizeof(int),
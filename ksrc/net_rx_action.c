@@ -20,9 +20,15 @@ struct bpf_map_def SEC("maps") net_rx_map = {
 	.max_entries = 1,
 };
 
+/* entry times of in-progress calls on this cpu. depth counts
+ * calls deeper than the stack holds so returns stay matched; those
+ * are not timed and count as missed. If a return is missed the
+ * stack is reset once the innermost timed entry is older than
+ * NET_RX_STALE_NS; that call counts as missed too.
+ */
 struct net_rx_enter {
-	u64 t_enter;
-	int cpu;
+	u64 t_enter[NET_RX_MAX_DEPTH];
+	u32 depth;
 };
 
 struct bpf_map_def SEC("maps") net_rx_enter_map = {
@@ -32,33 +38,48 @@ struct bpf_map_def SEC("maps") net_rx_enter_map = {
 	.max_entries    = 1
 };
 
+static __always_inline void inc_missed(void)
+{
+	struct net_rx_hist_val *hist;
+	u32 idx = 0;
+
+	hist = bpf_map_lookup_elem(&net_rx_map, &idx);
+	if (hist)
+		__sync_fetch_and_add(&hist->buckets[NET_RX_MISS_BKT], 1);
+}
+
 SEC("kprobe/net_rx_action")
 int bpf_net_rx_kprobe(struct pt_regs *ctx)
 {
 	struct net_rx_enter *e;
-	bool inc_error = false;
 	u32 idx = 0;
+	u32 d, top;
+	u64 now;
 
 	e = bpf_map_lookup_elem(&net_rx_enter_map, &idx);
-	if (e) {
-		if (e->t_enter || e->cpu != -1)
-			inc_error = true;
-
-		e->t_enter = bpf_ktime_get_ns();
-		e->cpu = bpf_get_smp_processor_id();
-	} else {
-		inc_error = true;
+	if (!e) {
+		inc_missed();
+		return 0;
 	}
 
-	if (inc_error) {
-		struct net_rx_hist_val *hist;
-		u32 idx = 0;
-
-		hist = bpf_map_lookup_elem(&net_rx_map, &idx);
-		if (hist)
-			__sync_fetch_and_add(&hist->buckets[NET_RX_ERR_BKT], 1);
+	now = bpf_ktime_get_ns();
+	d = e->depth;
+	if (d) {
+		top = (d < NET_RX_MAX_DEPTH ? d : NET_RX_MAX_DEPTH) - 1;
+		if (now - e->t_enter[top & (NET_RX_MAX_DEPTH - 1)] >
+		    NET_RX_STALE_NS) {
+			inc_missed();
+			d = 0;
+		}
 	}
 
+	if (d < NET_RX_MAX_DEPTH)
+		e->t_enter[d & (NET_RX_MAX_DEPTH - 1)] = now;
+	else
+		inc_missed();
+
+	e->depth = d + 1;
+
 	return 0;
 }
 
@@ -67,53 +88,55 @@ int bpf_net_rx_kprobe_ret(struct pt_regs *ctx)
 {
 	struct net_rx_hist_val *hist;
 	struct net_rx_enter *e;
+	u64 dt, *c;
 	u32 idx = 0;
+	u32 d;
 
 	e = bpf_map_lookup_elem(&net_rx_enter_map, &idx);
 	if (!e)
 		return 0;
 
+	/* return from a call that started before the probes attached */
+	if (!e->depth) {
+		inc_missed();
+		return 0;
+	}
+
+	d = --e->depth;
+	if (d >= NET_RX_MAX_DEPTH)
+		return 0;
+
 	hist = bpf_map_lookup_elem(&net_rx_map, &idx);
 	if (!hist)
-		goto out;
+		return 0;
 
-	if (e->cpu != bpf_get_smp_processor_id() || !e->t_enter) {
-		__sync_fetch_and_add(&hist->buckets[NET_RX_ERR_BKT], 1);
-		goto out;
-	}
+	/* nsec to usec */
+	dt = (bpf_ktime_get_ns() - e->t_enter[d & (NET_RX_MAX_DEPTH - 1)]) / 1000;
+
+	/* update hist entry */
+	if (dt <= NET_RX_BUCKET_0)
+		c = &hist->buckets[0];
+	else if (dt <= NET_RX_BUCKET_1)
+		c = &hist->buckets[1];
+	else if (dt <= NET_RX_BUCKET_2)
+		c = &hist->buckets[2];
+	else if (dt <= NET_RX_BUCKET_3)
+		c = &hist->buckets[3];
+	else if (dt <= NET_RX_BUCKET_4)
+		c = &hist->buckets[4];
+	else if (dt <= NET_RX_BUCKET_5)
+		c = &hist->buckets[5];
+	else if (dt <= NET_RX_BUCKET_6)
+		c = &hist->buckets[6];
+	else if (dt <= NET_RX_BUCKET_7)
+		c = &hist->buckets[7];
+	else if (dt <= NET_RX_BUCKET_8)
+		c = &hist->buckets[8];
+	else
+		c = &hist->buckets[9];
+
+	__sync_fetch_and_add(c, 1);
 
-	if (e->t_enter) {
-		u64 t = bpf_ktime_get_ns();
-		u64 dt = (t - e->t_enter) / 1000;  /* nsec to usec */
-		u64 *c;
-
-		/* update hist entry */
-		if (dt <= NET_RX_BUCKET_0)
-			c = &hist->buckets[0];
-		else if (dt <= NET_RX_BUCKET_1)
-			c = &hist->buckets[1];
-		else if (dt <= NET_RX_BUCKET_2)
-			c = &hist->buckets[2];
-		else if (dt <= NET_RX_BUCKET_3)
-			c = &hist->buckets[3];
-		else if (dt <= NET_RX_BUCKET_4)
-			c = &hist->buckets[4];
-		else if (dt <= NET_RX_BUCKET_5)
-			c = &hist->buckets[5];
-		else if (dt <= NET_RX_BUCKET_6)
-			c = &hist->buckets[6];
-		else if (dt <= NET_RX_BUCKET_7)
-			c = &hist->buckets[7];
-		else if (dt <= NET_RX_BUCKET_8)
-			c = &hist->buckets[8];
-		else
-			c = &hist->buckets[9];
-
-		__sync_fetch_and_add(c, 1);
-	}
-out:
-	e->t_enter = 0;
-	e->cpu = -1;
 	return 0;
 }
 
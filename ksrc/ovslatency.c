@@ -8,21 +8,36 @@
 #include <uapi/linux/bpf.h>
 #include <uapi/linux/ptrace.h>
 #include <linux/version.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 
 #include "ovslatency.h"
 
 struct bpf_map_def SEC("maps") ovslat_map = {
-	.type = BPF_MAP_TYPE_ARRAY,
-	.key_size = sizeof(u32),
+	.type = BPF_MAP_TYPE_HASH,
+	.key_size = sizeof(struct ovslat_key),
 	.value_size = sizeof(struct ovslat_hist_val),
-	.max_entries = 1,
+	.max_entries = OVSLAT_MAP_ENTRIES,
 };
 
-struct ovs_enter {
+struct ovs_frame {
 	u64 t_enter;
 	void *skb;
+	u32 ifindex;
+	u8 upcall;
+};
+
+/* in-progress calls on this cpu; ovs_vport_receive nests when a
+ * tunnel vport decaps a packet. Calls deeper than the stack holds
+ * still bump depth so returns stay matched, but are not timed. If
+ * a return is missed the stack is reset once the innermost timed
+ * entry is older than OVSLAT_STALE_NS.
+ */
+struct ovs_enter {
+	struct ovs_frame frames[OVSLAT_MAX_DEPTH];
+	u32 depth;
 };
 
 struct bpf_map_def SEC("maps") ovs_enter_map = {
@@ -32,64 +47,153 @@ struct bpf_map_def SEC("maps") ovs_enter_map = {
 	.max_entries    = 1
 };
 
+/* counters for calls not timed; key is enum ovslat_err */
+struct bpf_map_def SEC("maps") ovslat_err_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(u64),
+	.max_entries = OVSLAT_ERR_MAX,
+};
+
+static __always_inline void inc_err(u32 err)
+{
+	u64 *c;
+
+	c = bpf_map_lookup_elem(&ovslat_err_map, &err);
+	if (c)
+		__sync_fetch_and_add(c, 1);
+}
+
 SEC("kprobe/ovs_vport_receive")
 int bpf_ovs_kprobe(struct pt_regs *ctx)
 {
+	struct sk_buff *skb = (struct sk_buff *)PT_REGS_PARM2(ctx);
+	struct net_device *dev;
+	struct ovs_frame *f;
 	struct ovs_enter *e;
 	u32 idx = 0;
+	u32 d, top;
+	u64 now;
 
 	e = bpf_map_lookup_elem(&ovs_enter_map, &idx);
-	if (e) {
-		e->t_enter = bpf_ktime_get_ns();
-		e->skb = (void *)PT_REGS_PARM1(ctx);
+	if (!e)
+		return 0;
+
+	now = bpf_ktime_get_ns();
+	d = e->depth;
+	if (d) {
+		top = (d < OVSLAT_MAX_DEPTH ? d : OVSLAT_MAX_DEPTH) - 1;
+		f = &e->frames[top & (OVSLAT_MAX_DEPTH - 1)];
+		if (now - f->t_enter > OVSLAT_STALE_NS) {
+			inc_err(OVSLAT_ERR_STALE);
+			d = 0;
+		}
+	}
+
+	e->depth = d + 1;
+	if (d >= OVSLAT_MAX_DEPTH) {
+		inc_err(OVSLAT_ERR_OVERFLOW);
+		return 0;
 	}
 
+	f = &e->frames[d & (OVSLAT_MAX_DEPTH - 1)];
+	f->t_enter = now;
+	f->skb = skb;
+	f->upcall = 0;
+	f->ifindex = 0;
+
+	/* skb->dev is the vport device the packet came in on */
+	if (!bpf_probe_read(&dev, sizeof(dev), &skb->dev) && dev)
+		bpf_probe_read(&f->ifindex, sizeof(f->ifindex),
+			       &dev->ifindex);
+
+	return 0;
+}
+
+/* flow table miss; packet is queued to ovs-vswitchd. The upcall is
+ * made by the innermost ovs_vport_receive.
+ */
+SEC("kprobe/ovs_dp_upcall")
+int bpf_ovs_upcall(struct pt_regs *ctx)
+{
+	struct sk_buff *skb = (struct sk_buff *)PT_REGS_PARM2(ctx);
+	struct ovs_frame *f;
+	struct ovs_enter *e;
+	u32 idx = 0;
+	u32 d;
+
+	e = bpf_map_lookup_elem(&ovs_enter_map, &idx);
+	if (!e || !e->depth)
+		return 0;
+
+	d = e->depth - 1;
+	if (d >= OVSLAT_MAX_DEPTH)
+		return 0;
+
+	f = &e->frames[d & (OVSLAT_MAX_DEPTH - 1)];
+	if (f->skb == skb)
+		f->upcall = 1;
+
 	return 0;
 }
 
 SEC("kprobe/ovs_vport_receive_ret")
 int bpf_ovs_kprobe_ret(struct pt_regs *ctx)
 {
+	struct ovslat_hist_val *hist;
+	struct ovslat_key key = {};
+	struct ovs_frame *f;
 	struct ovs_enter *e;
+	u64 dt, *c;
 	u32 idx = 0;
+	u32 d;
 
 	e = bpf_map_lookup_elem(&ovs_enter_map, &idx);
-	if (!e)
-		goto out;
-
-	if (e->t_enter) {
-		struct ovslat_hist_val *hist;
-		u64 t = bpf_ktime_get_ns();
-		u64 dt = (t - e->t_enter) / 1000;  /* nsec to usec */
-
-		hist = bpf_map_lookup_elem(&ovslat_map, &idx);
-		if (hist) {
-			u64 *c;
-
-			__sync_fetch_and_add(&hist->buckets[7], 1);
-
-			/* update hist entry */
-			if (dt <= OVS_BUCKET_0)
-				c = &hist->buckets[0];
-			else if (dt <= OVS_BUCKET_1)
-				c = &hist->buckets[1];
-			else if (dt <= OVS_BUCKET_2)
-				c = &hist->buckets[2];
-			else if (dt <= OVS_BUCKET_3)
-				c = &hist->buckets[3];
-			else if (dt <= OVS_BUCKET_4)
-				c = &hist->buckets[4];
-			else if (dt <= OVS_BUCKET_5)
-				c = &hist->buckets[5];
-			else
-				c = &hist->buckets[6];
-
-			__sync_fetch_and_add(c, 1);
-		}
+	if (!e || !e->depth)
+		return 0;
+
+	d = --e->depth;
+	if (d >= OVSLAT_MAX_DEPTH)
+		return 0;
+
+	f = &e->frames[d & (OVSLAT_MAX_DEPTH - 1)];
+	dt = (bpf_ktime_get_ns() - f->t_enter) / 1000;  /* nsec to usec */
+	key.ifindex = f->ifindex;
+	key.upcall = f->upcall;
+
+	hist = bpf_map_lookup_elem(&ovslat_map, &key);
+	if (!hist) {
+		struct ovslat_hist_val hist0 = {};
+
+		/* first packet for the port; entry may be created
+		 * by another cpu first, so do not replace one
+		 */
+		bpf_map_update_elem(&ovslat_map, &key, &hist0, BPF_NOEXIST);
+		hist = bpf_map_lookup_elem(&ovslat_map, &key);
+		if (!hist)
+			return 0;
 	}
-	e->t_enter = 0;
-	e->skb = NULL;
-out:
+
+	__sync_fetch_and_add(&hist->buckets[7], 1);
+
+	/* update hist entry */
+	if (dt <= OVS_BUCKET_0)
+		c = &hist->buckets[0];
+	else if (dt <= OVS_BUCKET_1)
+		c = &hist->buckets[1];
+	else if (dt <= OVS_BUCKET_2)
+		c = &hist->buckets[2];
+	else if (dt <= OVS_BUCKET_3)
+		c = &hist->buckets[3];
+	else if (dt <= OVS_BUCKET_4)
+		c = &hist->buckets[4];
+	else if (dt <= OVS_BUCKET_5)
+		c = &hist->buckets[5];
+	else
+		c = &hist->buckets[6];
+
+	__sync_fetch_and_add(c, 1);
+
 	return 0;
 }
 
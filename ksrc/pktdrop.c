@@ -24,7 +24,7 @@ int bpf_kfree_skb(struct kfree_skb_args *ctx)
 	struct data data = {
 		.time = bpf_ktime_get_ns(),
 		.event_type = EVENT_SAMPLE,
-		.cpu = (u8) bpf_get_smp_processor_id(),
+		.cpu = (u16) bpf_get_smp_processor_id(),
 	};
 	struct sk_buff *skb = ctx->skbaddr;
 	struct net_device *dev;
@@ -111,7 +111,7 @@ int bpf_fib_net_exit(struct pt_regs *ctx)
 	struct data data = {
 		.time = bpf_ktime_get_ns(),
 		.event_type = EVENT_EXIT,
-		.cpu = (u8) bpf_get_smp_processor_id(),
+		.cpu = (u16) bpf_get_smp_processor_id(),
 	};
 	struct net *net = (struct net *)ctx->di;
 
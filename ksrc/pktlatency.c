@@ -1,35 +1,42 @@
 // SPDX-License-Identifier: GPL-2.0
 /* Monitor packet latency. Latency is measured as the time between
- * PTP timestamping in the NIC and handoff to process (currently
- * only users of skb_copy_datagram_iovec - e.g., virtual machines).
+ * PTP timestamping in the NIC and a measurement point: the copy to
+ * a tap user (e.g., virtual machines), the copy in tcp or udp recvmsg,
+ * or tun_net_xmit handing the packet to a tap device.
  *
- * Data is collected as a histogram per process id with samples
+ * Data is collected as a histogram per process id and measurement
+ * point (per device for tun_net_xmit) with samples
  * exceeding a threshold sent to userspace for further analysis
  * (e.g., to show affected flow).
  *
- * Userspace updates control map with a conversion between ptp
- * and monotonic timestamps (good enough for the purpose at hand)
- * as well threshold for generating samples.
+ * Userspace updates a per-device map with a conversion between the
+ * device's ptp clock and monotonic timestamps, and the control map
+ * with the threshold for generating samples.
  *
  * Copyright (c) 2019-2020 David Ahern <dsahern@gmail.com>
  */
 
 #define KBUILD_MODNAME "pktlatency"
 #include <uapi/linux/bpf.h>
+#include <uapi/linux/ptrace.h>
 #include <linux/version.h>
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
 
 #include "pktlatency.h"
 
 #include "channel_map.c"
 
+/* per-cpu so buckets can be updated without atomics; userspace sums
+ * the cpus. max_entries can be changed at load time (pktlatency -m).
+ */
 struct bpf_map_def SEC("maps") pktlat_map = {
-	.type = BPF_MAP_TYPE_HASH,  // BPF_MAP_TYPE_PERCPU_HASH
+	.type = BPF_MAP_TYPE_PERCPU_HASH,
 	.key_size = sizeof(struct pktlat_hist_key),
 	.value_size = sizeof(struct pktlat_hist_val),
-	.max_entries = 512,
+	.max_entries = PKTLAT_MAP_ENTRIES,
 };
 
 struct bpf_map_def SEC("maps") pktlat_ctl_map = {
@@ -39,22 +46,67 @@ struct bpf_map_def SEC("maps") pktlat_ctl_map = {
 	.max_entries = 1,
 };
 
+/* ptp reference per ingress device; key is ifindex. Key 0 is the
+ * default for devices without an entry (e.g., vlans on the NIC).
+ */
+struct bpf_map_def SEC("maps") pktlat_ptp_map = {
+	.type = BPF_MAP_TYPE_HASH,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(struct pktlat_ptp_ref),
+	.max_entries = PKTLAT_MAX_DEVS,
+};
+
+/* hook of the read or recvmsg a task is in; key is pid_tgid. Set by
+ * the entry probes and read by the copy tracepoint.
+ */
+struct bpf_map_def SEC("maps") pktlat_recv_map = {
+	.type = BPF_MAP_TYPE_HASH,
+	.key_size = sizeof(u64),
+	.value_size = sizeof(u32),
+	.max_entries = PKTLAT_RECV_ENTRIES,
+};
+
+/* convert ptp time to monotonic, correcting for clock drift */
+static __always_inline u64 ptp_to_mono(const struct pktlat_ptp_ref *ref,
+				       u64 tstamp)
+{
+	u64 dt, adj;
+	s64 drift;
+
+	if (tstamp > ref->ptp_ref)
+		dt = tstamp - ref->ptp_ref;
+	else
+		dt = ref->ptp_ref - tstamp;
+
+	drift = ref->drift_ppb;
+	if (drift < 0) {
+		adj = dt * (u64)(-drift) / 1000000000;
+		dt -= adj;
+	} else {
+		adj = dt * (u64)drift / 1000000000;
+		dt += adj;
+	}
+
+	if (tstamp > ref->ptp_ref)
+		return ref->mono_ref + dt;
+
+	return ref->mono_ref - dt;
+}
+
 static __always_inline int update_stats(struct pktlat_hist_val *hist,
 					struct pktlat_ctl *ctl,
+					struct pktlat_ptp_ref *ref,
 					u64 tstamp)
 {
 	u64 hw_mono, dt, t;
 
-	if (!tstamp) {
+	/* no reference for the ingress device counts as missing too */
+	if (!tstamp || !ref) {
 		hist->buckets[7]++;
 		return 0;
 	}
 
-	/* convert ptp time to monotonic */
-	if (tstamp > ctl->ptp_ref)
-		hw_mono = ctl->mono_ref + (tstamp - ctl->ptp_ref);
-	else
-		hw_mono = ctl->mono_ref - (ctl->ptp_ref - tstamp);
+	hw_mono = ptp_to_mono(ref, tstamp);
 
 	t = bpf_ktime_get_ns();
 	dt = (t - hw_mono)/1000;
@@ -84,8 +136,9 @@ static __always_inline int update_stats(struct pktlat_hist_val *hist,
 	return 0;
 }
 
-static __always_inline void gen_sample(struct skb_dg_iov_args *ctx,
-				       u64 tstamp, int ifindex, u32 pid,
+static __always_inline void gen_sample(void *ctx, struct sk_buff *skb,
+				       int len, u64 tstamp, int ifindex,
+				       u32 iif, struct pktlat_hist_key *hkey,
 				       bool with_skb_data)
 {
 	struct data data;
@@ -94,15 +147,16 @@ static __always_inline void gen_sample(struct skb_dg_iov_args *ctx,
 
 	data.event_type = EVENT_SAMPLE;
 	data.time = bpf_ktime_get_ns();
-	data.cpu = (u8) bpf_get_smp_processor_id();
+	data.cpu = (u16) bpf_get_smp_processor_id();
 
 	data.tstamp = tstamp;
 	data.ifindex = ifindex;
-	data.pid = pid;
-	data.pkt_len = ctx->len;
+	data.iif = iif;
+	data.pid = hkey->pid;
+	data.hook = hkey->hook;
+	data.pkt_len = len;
 
 	if (with_skb_data) {
-		struct sk_buff *skb = ctx->skbaddr;
 		unsigned char *head;
 		u16 mac_header;
 		u8 *skbdata;
@@ -139,55 +193,220 @@ static __always_inline void get_skb_tstamp(struct sk_buff *skb, u64 *tstamp)
 	}
 }
 
+/* common backend for all hooks: convert the timestamp using the
+ * reference of the ingress device, update the histogram for hkey and
+ * send a sample if requested or over the latency threshold
+ */
+static __always_inline void pktlat_record(void *ctx, struct pktlat_ctl *ctl,
+					  struct pktlat_hist_key *hkey,
+					  struct sk_buff *skb, int len,
+					  int ifindex)
+{
+	struct pktlat_ptp_ref *ref = NULL;
+	struct pktlat_hist_val *hist;
+	bool with_skb_data = false;
+	u64 tstamp = 0;
+	u32 key = 0;
+	u32 iif = 0;
+
+	get_skb_tstamp(skb, &tstamp);
+
+	/* timestamp is from the PHC of the device the packet came in on */
+	if (tstamp) {
+		bpf_probe_read(&iif, sizeof(iif), &skb->skb_iif);
+		ref = bpf_map_lookup_elem(&pktlat_ptp_map, &iif);
+		if (!ref)
+			ref = bpf_map_lookup_elem(&pktlat_ptp_map, &key);
+	}
+
+	hist = bpf_map_lookup_elem(&pktlat_map, hkey);
+	if (hist) {
+		if (update_stats(hist, ctl, ref, tstamp))
+			with_skb_data = true;
+	} else {
+		struct pktlat_hist_val hist2;
+
+		memset(&hist2, 0, sizeof(hist2));
+		if (update_stats(&hist2, ctl, ref, tstamp))
+			with_skb_data = true;
+
+		/* another cpu can create the entry first; do not reset it,
+		 * add to this cpu's copy instead
+		 */
+		if (bpf_map_update_elem(&pktlat_map, hkey, &hist2,
+					BPF_NOEXIST)) {
+			hist = bpf_map_lookup_elem(&pktlat_map, hkey);
+			if (hist) {
+				#pragma unroll
+				for (int i = 0; i < PKTLAT_MAX_BUCKETS; i++)
+					hist->buckets[i] += hist2.buckets[i];
+			}
+		}
+	}
+
+	if ((tstamp && ctl->gen_samples) || with_skb_data)
+		gen_sample(ctx, skb, len, tstamp, ifindex, iif, hkey,
+			   with_skb_data);
+}
+
+/* skb_copy_datagram_iter is used by tun reads as well as tcp and udp
+ * recvmsg. The skb alone does not tell them apart (e.g., udp skbs have
+ * no socket once queued), so the probe on each caller records its hook
+ * for the task and the copy uses it. Copies outside of those are ignored.
+ */
+static __always_inline int recv_enter(u32 hook)
+{
+	u64 id = bpf_get_current_pid_tgid();
+
+	bpf_map_update_elem(&pktlat_recv_map, &id, &hook, BPF_ANY);
+
+	return 0;
+}
+
+static __always_inline int recv_exit(void)
+{
+	u64 id = bpf_get_current_pid_tgid();
+
+	bpf_map_delete_elem(&pktlat_recv_map, &id);
+
+	return 0;
+}
+
+SEC("kprobe/tun_chr_read_iter")
+int bpf_tun_chr_read_iter(struct pt_regs *ctx)
+{
+	return recv_enter(PKTLAT_HOOK_TAP);
+}
+
+SEC("kprobe/tun_chr_read_iter_ret")
+int bpf_tun_chr_read_iter_ret(struct pt_regs *ctx)
+{
+	return recv_exit();
+}
+
+/* vhost-net */
+SEC("kprobe/tun_recvmsg")
+int bpf_tun_recvmsg(struct pt_regs *ctx)
+{
+	return recv_enter(PKTLAT_HOOK_TAP);
+}
+
+SEC("kprobe/tun_recvmsg_ret")
+int bpf_tun_recvmsg_ret(struct pt_regs *ctx)
+{
+	return recv_exit();
+}
+
+SEC("kprobe/tcp_recvmsg")
+int bpf_tcp_recvmsg(struct pt_regs *ctx)
+{
+	return recv_enter(PKTLAT_HOOK_TCP);
+}
+
+SEC("kprobe/tcp_recvmsg_ret")
+int bpf_tcp_recvmsg_ret(struct pt_regs *ctx)
+{
+	return recv_exit();
+}
+
+SEC("kprobe/udp_recvmsg")
+int bpf_udp_recvmsg(struct pt_regs *ctx)
+{
+	return recv_enter(PKTLAT_HOOK_UDP);
+}
+
+SEC("kprobe/udp_recvmsg_ret")
+int bpf_udp_recvmsg_ret(struct pt_regs *ctx)
+{
+	return recv_exit();
+}
+
+SEC("kprobe/udpv6_recvmsg")
+int bpf_udpv6_recvmsg(struct pt_regs *ctx)
+{
+	return recv_enter(PKTLAT_HOOK_UDP);
+}
+
+SEC("kprobe/udpv6_recvmsg_ret")
+int bpf_udpv6_recvmsg_ret(struct pt_regs *ctx)
+{
+	return recv_exit();
+}
+
 SEC("tracepoint/skb/skb_copy_datagram_iovec")
 int bpf_skb_dg_iov(struct skb_dg_iov_args *ctx)
 {
 	struct sk_buff *skb = ctx->skbaddr;
 	struct pktlat_hist_key hkey = {};
-	struct pktlat_hist_val *hist;
-	bool with_skb_data = false;
 	struct pktlat_ctl *ctl;
 	struct net_device *dev;
 	int ifindex = -1;
-	u64 tstamp = 0;
 	u32 key = 0;
+	u32 *phook;
+	u32 hook;
+	u64 id;
 
 	ctl = bpf_map_lookup_elem(&pktlat_ctl_map, &key);
 	if (!ctl)
 		return 0;
 
-	if (bpf_probe_read(&dev, sizeof(dev), &skb->dev))
-		ifindex = -2;
-	else if (!dev)
-		ifindex = -3;
-	else if (bpf_probe_read(&ifindex, sizeof(ifindex), &dev->ifindex))
-		ifindex = -4;
+	id = bpf_get_current_pid_tgid();
+	phook = bpf_map_lookup_elem(&pktlat_recv_map, &id);
+	if (!phook)
+		return 0;
 
-	/* this should limit samples to tap devices only */
-	if (ifindex < ctl->ifindex_min)
-		goto out;
+	hook = *phook;
+	if (hook >= PKTLAT_HOOK_TUN_XMIT || !(ctl->hooks & (1 << hook)))
+		return 0;
 
-	get_skb_tstamp(skb, &tstamp);
+	if (hook == PKTLAT_HOOK_TAP) {
+		if (bpf_probe_read(&dev, sizeof(dev), &skb->dev))
+			ifindex = -2;
+		else if (!dev)
+			ifindex = -3;
+		else if (bpf_probe_read(&ifindex, sizeof(ifindex),
+					&dev->ifindex))
+			ifindex = -4;
+
+		/* this should limit samples to tap devices only */
+		if (ifindex < ctl->ifindex_min)
+			return 0;
+	} else {
+		/* udp reuses skb->dev as scratch space once queued */
+		bpf_probe_read(&ifindex, sizeof(ifindex), &skb->skb_iif);
+	}
 
-	hkey.pid = (u32) (bpf_get_current_pid_tgid() >> 32);
+	hkey.pid = (u32) (id >> 32);
+	hkey.hook = hook;
 
-	hist = bpf_map_lookup_elem(&pktlat_map, &hkey);
-	if (hist) {
-		if (update_stats(hist, ctl, tstamp))
-			with_skb_data = true;
-	} else {
-		struct pktlat_hist_val hist2;
+	pktlat_record(ctx, ctl, &hkey, skb, ctx->len, ifindex);
 
-		memset(&hist2, 0, sizeof(hist2));
-		if (update_stats(&hist2, ctl, tstamp))
-			with_skb_data = true;
-		bpf_map_update_elem(&pktlat_map, &hkey, &hist2, BPF_ANY);
-	}
+	return 0;
+}
 
-	if ((tstamp && ctl->gen_samples) || with_skb_data)
-		gen_sample(ctx, tstamp, ifindex, hkey.pid, with_skb_data);
+SEC("kprobe/tun_net_xmit")
+int bpf_tun_net_xmit(struct pt_regs *ctx)
+{
+	struct sk_buff *skb = (struct sk_buff *)PT_REGS_PARM1(ctx);
+	struct net_device *dev = (struct net_device *)PT_REGS_PARM2(ctx);
+	struct pktlat_hist_key hkey = {};
+	struct pktlat_ctl *ctl;
+	int ifindex = 0;
+	u32 key = 0;
+	u32 len = 0;
+
+	ctl = bpf_map_lookup_elem(&pktlat_ctl_map, &key);
+	if (!ctl || !(ctl->hooks & (1 << PKTLAT_HOOK_TUN_XMIT)))
+		return 0;
+
+	bpf_probe_read(&ifindex, sizeof(ifindex), &dev->ifindex);
+	bpf_probe_read(&len, sizeof(len), &skb->len);
+
+	hkey.ifindex = ifindex;
+	hkey.hook = PKTLAT_HOOK_TUN_XMIT;
+
+	pktlat_record(ctx, ctl, &hkey, skb, len, ifindex);
 
-out:
 	return 0;
 }
 
@@ -197,18 +416,29 @@ int bpf_sched_exit(struct sched_exit_args *ctx)
 	struct pktlat_hist_key hkey = {
 		.pid = (u32)(bpf_get_current_pid_tgid() >> 32),
 	};
+	u64 id = bpf_get_current_pid_tgid();
+	bool found = false;
 	struct data data;
 
-	if (!bpf_map_lookup_elem(&pktlat_map, &hkey))
-		return 0;
+	/* in case a recvmsg return was missed */
+	bpf_map_delete_elem(&pktlat_recv_map, &id);
 
-	bpf_map_delete_elem(&pktlat_map, &hkey);
+	/* per process hooks */
+	#pragma unroll
+	for (int i = PKTLAT_HOOK_TAP; i <= PKTLAT_HOOK_UDP; i++) {
+		hkey.hook = i;
+		if (!bpf_map_delete_elem(&pktlat_map, &hkey))
+			found = true;
+	}
+
+	if (!found)
+		return 0;
 
 	memset(&data, 0, sizeof(data));
 	data.event_type = EVENT_EXIT,
 	data.time = bpf_ktime_get_ns();
 	data.pid = ctx->pid;
-	data.cpu = (u8) bpf_get_smp_processor_id();
+	data.cpu = (u16) bpf_get_smp_processor_id();
 
 	if (bpf_perf_event_output(ctx, &channel, BPF_F_CURRENT_CPU,
 				  &data, sizeof(data)) < 0) {
@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Break down rx latency by stage. Packets are timestamped as they
+ * pass each stage of the host stack - napi_gro_receive,
+ * netif_receive_skb, ovs_vport_receive, tun_net_xmit and the copy to
+ * userspace - keyed by skb address, and the time between stages is
+ * added to a histogram per stage.
+ *
+ * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
+ */
+
+#define KBUILD_MODNAME "pktstages"
+#include <uapi/linux/bpf.h>
+#include <uapi/linux/ptrace.h>
+#include <linux/version.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+#include "pktstages.h"
+
+/* packets in flight. The hash is shared since a packet can move
+ * between cpus (e.g., rps or the vhost thread doing the copy), but
+ * the LRU lists are per-cpu to avoid a global lock on every packet.
+ * max_entries can be changed at load time (pktstages -m).
+ */
+struct bpf_map_def SEC("maps") pktstage_skb_map = {
+	.type = BPF_MAP_TYPE_LRU_HASH,
+	.key_size = sizeof(u64),
+	.value_size = sizeof(struct pktstage_skb),
+	.max_entries = PKTSTAGE_SKB_ENTRIES,
+	.map_flags = BPF_F_NO_COMMON_LRU,
+};
+
+/* per stage histograms plus the total; per-cpu so no atomics */
+struct bpf_map_def SEC("maps") pktstage_hist_map = {
+	.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(struct pktstage_hist_val),
+	.max_entries = PKTSTAGE_MAX + 1,
+};
+
+static __always_inline void update_hist(u32 idx, u64 dt)
+{
+	struct pktstage_hist_val *hist;
+	u64 usecs = dt / 1000;
+
+	hist = bpf_map_lookup_elem(&pktstage_hist_map, &idx);
+	if (!hist)
+		return;
+
+	if (usecs <= PKTSTAGE_BUCKET_0)
+		hist->buckets[0]++;
+	else if (usecs <= PKTSTAGE_BUCKET_1)
+		hist->buckets[1]++;
+	else if (usecs <= PKTSTAGE_BUCKET_2)
+		hist->buckets[2]++;
+	else if (usecs <= PKTSTAGE_BUCKET_3)
+		hist->buckets[3]++;
+	else if (usecs <= PKTSTAGE_BUCKET_4)
+		hist->buckets[4]++;
+	else if (usecs <= PKTSTAGE_BUCKET_5)
+		hist->buckets[5]++;
+	else if (usecs <= PKTSTAGE_BUCKET_6)
+		hist->buckets[6]++;
+	else if (usecs <= PKTSTAGE_BUCKET_7)
+		hist->buckets[7]++;
+	else
+		hist->buckets[8]++;
+
+	hist->buckets[9] += dt;
+}
+
+static __always_inline void do_stage(void *skb, u32 stage)
+{
+	u64 key = (u64)skb;
+	struct pktstage_skb *e;
+	u64 now;
+
+	now = bpf_ktime_get_ns();
+
+	e = bpf_map_lookup_elem(&pktstage_skb_map, &key);
+
+	/* no entry, or an earlier stage means the skb was freed and
+	 * reused (gro is always the first stage); start tracking the
+	 * packet here. Copy only ends a packet; it does not start one.
+	 */
+	if (!e || e->stage > stage || stage == PKTSTAGE_GRO) {
+		struct pktstage_skb new = {
+			.t_first = now,
+			.t_last = now,
+			.stage = stage,
+		};
+
+		if (stage == PKTSTAGE_COPY) {
+			if (e)
+				bpf_map_delete_elem(&pktstage_skb_map, &key);
+			return;
+		}
+
+		bpf_map_update_elem(&pktstage_skb_map, &key, &new, BPF_ANY);
+		return;
+	}
+
+	/* same stage again, e.g., netif_receive_skb for a bridge
+	 * delivering locally; keep the first time
+	 */
+	if (e->stage == stage)
+		return;
+
+	update_hist(stage, now - e->t_last);
+
+	if (stage == PKTSTAGE_COPY) {
+		update_hist(PKTSTAGE_TOTAL, now - e->t_first);
+		bpf_map_delete_elem(&pktstage_skb_map, &key);
+		return;
+	}
+
+	e->t_last = now;
+	e->stage = stage;
+}
+
+SEC("kprobe/napi_gro_receive")
+int bpf_gro_receive(struct pt_regs *ctx)
+{
+	do_stage((void *)PT_REGS_PARM2(ctx), PKTSTAGE_GRO);
+
+	return 0;
+}
+
+SEC("tracepoint/net/netif_receive_skb")
+int bpf_netif_receive_skb(struct netif_rx_args *ctx)
+{
+	do_stage(ctx->skbaddr, PKTSTAGE_NETIF);
+
+	return 0;
+}
+
+SEC("kprobe/ovs_vport_receive")
+int bpf_ovs_vport_receive(struct pt_regs *ctx)
+{
+	do_stage((void *)PT_REGS_PARM2(ctx), PKTSTAGE_OVS);
+
+	return 0;
+}
+
+SEC("kprobe/tun_net_xmit")
+int bpf_tun_net_xmit(struct pt_regs *ctx)
+{
+	do_stage((void *)PT_REGS_PARM1(ctx), PKTSTAGE_TUN);
+
+	return 0;
+}
+
+SEC("tracepoint/skb/skb_copy_datagram_iovec")
+int bpf_skb_copy(struct pktstage_copy_args *ctx)
+{
+	do_stage(ctx->skbaddr, PKTSTAGE_COPY);
+
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
+int _version SEC("version") = LINUX_VERSION_CODE;
@@ -1,6 +1,9 @@
 // SPDX-License-Identifier: GPL-2.0
 /* Example of L2 forwarding via XDP. FDB is a <vlan,dmac> hash table
- * returning device index to redirect packet.
+ * (<outer vlan,inner vlan,dmac> for Q-in-Q) returning device index to
+ * redirect packet and what to do with the tags. Optionally <vlan,smac>
+ * is learned from received packets into an LRU hash; userspace ages
+ * learned entries.
  *
  * Copyright (c) 2019-2020 David Ahern <dsahern@gmail.com>
  */
@@ -14,6 +17,7 @@
 #include <bpf/bpf_endian.h>
 
 #include "xdp_fdb.h"
+#include "xdp_vlan.h"
 
 /* For TX-traffic redirect requires net_device ifindex to be in this devmap */
 struct bpf_map_def SEC("maps") xdp_fwd_ports = {
@@ -23,79 +27,362 @@ struct bpf_map_def SEC("maps") xdp_fwd_ports = {
 	.max_entries = 512,
 };
 
-/* <vlan,dmac> to device index map */
+/* <vlan,dmac> to device index and action; static entries from userspace */
 struct bpf_map_def SEC("maps") fdb_map = {
 	.type = BPF_MAP_TYPE_HASH,
 	.key_size = sizeof(struct fdb_key),
+	.value_size = sizeof(struct fdb_val),
+	.max_entries = FDB_STATIC_ENTRIES,
+};
+
+/* inactive copy of the static FDB for replacing it atomically */
+struct bpf_map_def SEC("maps") fdb_map_shadow = {
+	.type = BPF_MAP_TYPE_HASH,
+	.key_size = sizeof(struct fdb_key),
+	.value_size = sizeof(struct fdb_val),
+	.max_entries = FDB_STATIC_ENTRIES,
+};
+
+/* learned <vlan,smac> to ingress device. Sizes of the FDB maps can
+ * be changed by creating them with xdp_l2fwd -S and reusing them at load.
+ */
+struct bpf_map_def SEC("maps") fdb_learn_map = {
+	.type = BPF_MAP_TYPE_LRU_HASH,
+	.key_size = sizeof(struct fdb_key),
+	.value_size = sizeof(struct fdb_learn_val),
+	.max_entries = FDB_LEARN_ENTRIES,
+};
+
+struct bpf_map_def SEC("maps") fdb_config_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(struct fdb_config),
+	.max_entries = 1,
+};
+
+#ifdef HAVE_XDP_BROADCAST
+/* from the bpf_redirect_map flags enum in the kernel uapi header */
+#define XDP_F_BROADCAST		(1ULL << 3)
+#define XDP_F_EXCLUDE_INGRESS	(1ULL << 4)
+
+/* every port in any flood group; entries run xdp_l2fwd_flood */
+struct bpf_map_def SEC("maps") xdp_flood_ports = {
+	.type = BPF_MAP_TYPE_DEVMAP_HASH,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(struct bpf_devmap_val),
+	.max_entries = FLOOD_PORTS,
+};
+
+/* <port,vlan> membership of flood groups */
+struct bpf_map_def SEC("maps") flood_mbr_map = {
+	.type = BPF_MAP_TYPE_HASH,
+	.key_size = sizeof(struct flood_member_key),
+	.value_size = sizeof(struct flood_member),
+	.max_entries = FLOOD_MEMBERS,
+};
+
+/* non-0 if the vlan has a flood group */
+struct bpf_map_def SEC("maps") flood_vlan_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(u32),
 	.value_size = sizeof(u32),
-	.max_entries = 512,
+	.max_entries = VLAN_N_VID,
+};
+#endif
+
+struct bpf_map_def SEC("maps") xdp_stats_map = {
+	.type = BPF_MAP_TYPE_PERCPU_HASH,
+	.key_size = sizeof(struct xdp_stats_key),
+	.value_size = sizeof(struct xdp_stats),
+	.max_entries = XDP_STATS_ENTRIES,
 };
 
+/* count the packet and return the XDP action */
+static __always_inline int l2fwd_done(struct xdp_md *ctx, u32 out,
+				      u32 verdict, int action)
+{
+	struct xdp_stats_key key = {
+		.ifindex_in = ctx->ingress_ifindex,
+		.ifindex_out = out,
+		.verdict = verdict,
+	};
+	u64 bytes = ctx->data_end - ctx->data;
+	struct xdp_stats *stats;
+
+	stats = bpf_map_lookup_elem(&xdp_stats_map, &key);
+	if (!stats) {
+		struct xdp_stats new = {
+			.bytes = bytes,
+			.pkts = 1,
+		};
+
+		/* map full is not worth failing the packet for */
+		bpf_map_update_elem(&xdp_stats_map, &key, &new, BPF_NOEXIST);
+		return action;
+	}
+
+	/* per-cpu; no atomics needed */
+	stats->bytes += bytes;
+	stats->pkts++;
+
+	return action;
+}
+
+static __always_inline struct fdb_val *fdb_lookup(struct fdb_config *cfg,
+						  struct fdb_key *key)
+{
+	if (cfg && cfg->active)
+		return bpf_map_lookup_elem(&fdb_map_shadow, key);
+
+	return bpf_map_lookup_elem(&fdb_map, key);
+}
+
+static __always_inline void fdb_learn(struct xdp_md *ctx,
+				      struct fdb_config *cfg,
+				      const struct fdb_key *vkey,
+				      const u8 *smac)
+{
+	struct fdb_learn_val *val, new = {};
+	u32 ifindex = ctx->ingress_ifindex;
+	struct fdb_key key;
+	u64 now;
+
+	if (!cfg || !cfg->learn)
+		return;
+
+	/* multicast and broadcast sources are bogus */
+	if (smac[0] & 1)
+		return;
+
+	__builtin_memset(&key, 0, sizeof(key));
+	key.vlan = vkey->vlan;
+	key.outer_vlan = vkey->outer_vlan;
+	__builtin_memcpy(key.mac, smac, ETH_ALEN);
+
+	/* static entries take precedence */
+	if (fdb_lookup(cfg, &key))
+		return;
+
+	now = bpf_ktime_get_ns();
+	val = bpf_map_lookup_elem(&fdb_learn_map, &key);
+	if (val && val->ifindex == ifindex) {
+		if (now - val->last_seen > FDB_REFRESH_NS)
+			val->last_seen = now;
+		return;
+	}
+
+	/* new or moved station; only learn ports packets can be
+	 * redirected to
+	 */
+	if (!bpf_map_lookup_elem(&xdp_fwd_ports, &ifindex))
+		return;
+
+	new.ifindex = ifindex;
+	new.last_seen = now;
+	bpf_map_update_elem(&fdb_learn_map, &key, &new, BPF_ANY);
+}
+
+/* apply the tag action of a static entry. Returns 0 or -1 on error. */
+static __always_inline int fdb_do_action(struct xdp_md *ctx,
+					 const struct fdb_val *val,
+					 bool qinq)
+{
+	void *data_end, *data;
+	struct vlan_hdr *vhdr;
+	u16 tci;
+
+	switch (val->action) {
+	case FDB_ACT_KEEP:
+		return 0;
+	case FDB_ACT_STRIP:
+		if (qinq && xdp_vlan_pop_outer(ctx))
+			return -1;
+		/* fall through */
+	case FDB_ACT_POP_OUTER:
+		return xdp_vlan_pop_outer(ctx) ? -1 : 0;
+	case FDB_ACT_REWRITE:
+		data = (void *)(long)ctx->data;
+		data_end = (void *)(long)ctx->data_end;
+		vhdr = data + sizeof(struct ethhdr);
+		if (vhdr + 1 > data_end)
+			return -1;
+
+		/* keep the priority bits */
+		tci = ntohs(vhdr->h_vlan_TCI) & ~VLAN_VID_MASK;
+		vhdr->h_vlan_TCI = htons(tci | (val->vlan & VLAN_VID_MASK));
+		return 0;
+	case FDB_ACT_PUSH:
+		return xdp_vlan_push_proto(ctx, htons(ETH_P_8021AD),
+					   htons(val->vlan & VLAN_VID_MASK));
+	}
+
+	return -1;
+}
+
 SEC("xdp_l2fwd")
 int xdp_l2fwd_prog(struct xdp_md *ctx)
 {
 	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
-	struct bpf_devmap_val *entry;
+	struct fdb_learn_val *lentry;
+	struct fdb_config *cfg;
 	struct vlan_hdr *vhdr;
+	struct fdb_val *val;
 	struct ethhdr *eth;
 	struct fdb_key key;
-	u8 smac[ETH_ALEN];
-	u16 h_proto = 0;
-	void *nh;
-	int rc;
+	bool qinq = false;
+	u32 ifindex;
+	u32 idx = 0;
 
 	/* data in context points to ethernet header */
 	eth = data;
 
 	/* set pointer to header after ethernet header */
-	nh = data + sizeof(*eth);
-	if (nh > data_end)
-		return XDP_DROP; // malformed packet
+	vhdr = data + sizeof(*eth);
+	if (vhdr > data_end)
+		return l2fwd_done(ctx, 0, L2FWD_DROP_MALFORMED, XDP_DROP);
 
-	/* expecting VLAN tag for VM traffic, but not Q-in-Q */
-	if (eth->h_proto != htons(ETH_P_8021Q))
-		return XDP_PASS;
+	__builtin_memset(&key, 0, sizeof(key));
+
+	/* expecting VLAN tag for VM traffic; 802.1ad must carry an
+	 * 802.1Q customer tag
+	 */
+	if (eth->h_proto == htons(ETH_P_8021AD)) {
+		if (vhdr + 1 > data_end)
+			return l2fwd_done(ctx, 0, L2FWD_DROP_MALFORMED,
+					  XDP_DROP);
+
+		key.outer_vlan = ntohs(vhdr->h_vlan_TCI) & VLAN_VID_MASK;
+		if (vhdr->h_vlan_encapsulated_proto != htons(ETH_P_8021Q))
+			return l2fwd_done(ctx, 0, L2FWD_PASS_NO_VLAN,
+					  XDP_PASS);
+		vhdr++;
+		qinq = true;
+	} else if (eth->h_proto != htons(ETH_P_8021Q)) {
+		return l2fwd_done(ctx, 0, L2FWD_PASS_NO_VLAN, XDP_PASS);
+	}
 
-	vhdr = nh;
 	if (vhdr + 1 > data_end)
-		return XDP_DROP; // malformed packet
+		return l2fwd_done(ctx, 0, L2FWD_DROP_MALFORMED, XDP_DROP);
 
-	__builtin_memset(&key, 0, sizeof(key));
 	key.vlan = ntohs(vhdr->h_vlan_TCI) & VLAN_VID_MASK;
-	if (key.vlan == 0)
-		return XDP_PASS;
+	if (key.vlan == 0 || (qinq && key.outer_vlan == 0))
+		return l2fwd_done(ctx, 0, L2FWD_PASS_VLAN0, XDP_PASS);
+
+	cfg = bpf_map_lookup_elem(&fdb_config_map, &idx);
+	fdb_learn(ctx, cfg, &key, eth->h_source);
 
 	__builtin_memcpy(key.mac, eth->h_dest, ETH_ALEN);
 
-	entry = bpf_map_lookup_elem(&fdb_map, &key);
-	if (!entry || entry->ifindex == 0)
-		return XDP_PASS;
+	val = fdb_lookup(cfg, &key);
+	if (!val) {
+		/* learned ports are forwarded as received, tag and all;
+		 * same port means the kernel sorts it out
+		 */
+		lentry = bpf_map_lookup_elem(&fdb_learn_map, &key);
+		if (!lentry) {
+#ifdef HAVE_XDP_BROADCAST
+			u32 vlan = key.vlan, *flood = NULL;
+
+			/* replicate broadcast and multicast to the vlan
+			 * flood group, other than the ingress port
+			 */
+			if ((key.mac[0] & 1) && !qinq)
+				flood = bpf_map_lookup_elem(&flood_vlan_map,
+							    &vlan);
+			if (flood && *flood)
+				return l2fwd_done(ctx, 0, L2FWD_FLOOD,
+					bpf_redirect_map(&xdp_flood_ports, 0,
+							 XDP_F_BROADCAST |
+							 XDP_F_EXCLUDE_INGRESS));
+#endif
+			return l2fwd_done(ctx, 0, L2FWD_PASS_FDB_MISS,
+					  XDP_PASS);
+		}
+
+		if (lentry->ifindex == ctx->ingress_ifindex)
+			return l2fwd_done(ctx, 0, L2FWD_PASS_SAME_PORT,
+					  XDP_PASS);
+
+		/* port may have been removed since it was learned */
+		if (!bpf_map_lookup_elem(&xdp_fwd_ports, &lentry->ifindex))
+			return l2fwd_done(ctx, lentry->ifindex,
+					  L2FWD_PASS_DEVMAP_MISS, XDP_PASS);
+
+		return l2fwd_done(ctx, lentry->ifindex, L2FWD_FWD_LEARNED,
+				  bpf_redirect_map(&xdp_fwd_ports,
+						   lentry->ifindex, 0));
+	}
+
+	ifindex = val->ifindex;
+	if (ifindex == 0)
+		return l2fwd_done(ctx, 0, L2FWD_PASS_NO_DEV, XDP_PASS);
 
 	/* Verify redirect index exists in port map */
-	if (!bpf_map_lookup_elem(&xdp_fwd_ports, &entry->ifindex))
+	if (!bpf_map_lookup_elem(&xdp_fwd_ports, &ifindex))
+		return l2fwd_done(ctx, ifindex, L2FWD_PASS_DEVMAP_MISS,
+				  XDP_PASS);
+
+	/* by default remove VLAN header(s) before hand off to VM */
+	if (fdb_do_action(ctx, val, qinq))
+		return l2fwd_done(ctx, ifindex, L2FWD_PASS_ADJUST_HEAD,
+				  XDP_PASS);
+
+	return l2fwd_done(ctx, ifindex, L2FWD_FWD,
+			  bpf_redirect_map(&xdp_fwd_ports, ifindex, 0));
+}
+
+#ifdef HAVE_XDP_BROADCAST
+/* runs on each copy of a flooded packet: drop it on ports not in
+ * the vlan flood group and pop the tag for ports that want it
+ */
+SEC("xdp_devmap/l2fwd_flood")
+int xdp_l2fwd_flood(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct flood_member_key key = {};
+	struct flood_member *m;
+	u8 dmac[ETH_ALEN], smac[ETH_ALEN];
+	struct vlan_hdr *vhdr;
+	struct ethhdr *eth;
+	u16 h_proto;
+
+	eth = data;
+	vhdr = data + sizeof(*eth);
+	if (vhdr + 1 > data_end)
+		return XDP_DROP;
+
+	key.ifindex = ctx->egress_ifindex;
+	key.vlan = ntohs(vhdr->h_vlan_TCI) & VLAN_VID_MASK;
+
+	m = bpf_map_lookup_elem(&flood_mbr_map, &key);
+	if (!m)
+		return XDP_DROP;
+
+	if (!(m->flags & FLOOD_F_UNTAG))
 		return XDP_PASS;
 
-	/* remove VLAN header before hand off to VM */
 	h_proto = vhdr->h_vlan_encapsulated_proto;
+	__builtin_memcpy(dmac, eth->h_dest, ETH_ALEN);
 	__builtin_memcpy(smac, eth->h_source, ETH_ALEN);
 
 	if (bpf_xdp_adjust_head(ctx, sizeof(*vhdr)))
-		return XDP_PASS;
+		return XDP_DROP;
 
-	/* reset data pointers after adjust */
 	data = (void *)(long)ctx->data;
 	data_end = (void *)(long)ctx->data_end;
 	eth = data;
 	if (eth + 1 > data_end)
 		return XDP_DROP;
 
-	__builtin_memcpy(eth->h_dest, key.mac, ETH_ALEN);
+	__builtin_memcpy(eth->h_dest, dmac, ETH_ALEN);
 	__builtin_memcpy(eth->h_source, smac, ETH_ALEN);
 	eth->h_proto = h_proto;
 
-	return bpf_redirect_map(&xdp_fwd_ports, entry->ifindex, 0);
+	return XDP_PASS;
 }
+#endif
 
 char _license[] SEC("license") = "GPL";
 int _version SEC("version") = LINUX_VERSION_CODE;
@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 /* Example of L3 forwarding via XDP and use of bpf FIB lookup helper.
+ * FIB results can be cached per-cpu to skip the lookup for repeated
+ * flows; userspace invalidates the cache on route and neighbor changes.
  *
  * Copyright (c) 2017-18 David Ahern <dsahern@gmail.com>
  */
@@ -14,15 +16,82 @@
 
 #include <bpf/bpf_helpers.h>
 
+#include "xdp_l3fwd.h"
+#include "xdp_vlan.h"
+
 #define IPV6_FLOWINFO_MASK              cpu_to_be32(0x0FFFFFFF)
 
+/* For TX-traffic redirect requires net_device ifindex to be in this
+ * devmap. Entries can run an egress program (xdp_l3fwd_vlan).
+ */
 struct bpf_map_def SEC("maps") xdp_l3fwd_ports = {
-	.type = BPF_MAP_TYPE_DEVMAP,
-	.key_size = sizeof(int),
-	.value_size = sizeof(int),
-	.max_entries = 512,
+	.type = BPF_MAP_TYPE_DEVMAP_HASH,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(struct bpf_devmap_val),
+	.max_entries = L3FWD_PORTS,
+};
+
+/* egress port settings, keyed by ifindex */
+struct bpf_map_def SEC("maps") l3fwd_port_map = {
+	.type = BPF_MAP_TYPE_HASH,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(struct l3fwd_port),
+	.max_entries = L3FWD_PORTS,
+};
+
+struct bpf_map_def SEC("maps") l3fwd_cache_map = {
+	.type = BPF_MAP_TYPE_LRU_PERCPU_HASH,
+	.key_size = sizeof(struct l3fwd_cache_key),
+	.value_size = sizeof(struct l3fwd_cache_val),
+	.max_entries = L3FWD_CACHE_ENTRIES,
+};
+
+struct bpf_map_def SEC("maps") l3fwd_cache_cfg_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(struct l3fwd_cache_cfg),
+	.max_entries = 1,
+};
+
+struct bpf_map_def SEC("maps") l3fwd_stats_map = {
+	.type = BPF_MAP_TYPE_PERCPU_HASH,
+	.key_size = sizeof(struct l3fwd_stats_key),
+	.value_size = sizeof(struct l3fwd_stats),
+	.max_entries = L3FWD_STATS_ENTRIES,
 };
 
+/* count the packet and return the XDP action */
+static __always_inline int l3fwd_done(struct xdp_md *ctx, u32 out,
+				      u32 verdict, u32 fib_rc, int action)
+{
+	struct l3fwd_stats_key key = {
+		.ifindex_in = ctx->ingress_ifindex,
+		.ifindex_out = out,
+		.verdict = verdict,
+		.fib_rc = fib_rc,
+	};
+	u64 bytes = ctx->data_end - ctx->data;
+	struct l3fwd_stats *stats;
+
+	stats = bpf_map_lookup_elem(&l3fwd_stats_map, &key);
+	if (!stats) {
+		struct l3fwd_stats new = {
+			.bytes = bytes,
+			.pkts = 1,
+		};
+
+		/* map full is not worth failing the packet for */
+		bpf_map_update_elem(&l3fwd_stats_map, &key, &new, BPF_NOEXIST);
+		return action;
+	}
+
+	/* per-cpu; no atomics needed */
+	stats->bytes += bytes;
+	stats->pkts++;
+
+	return action;
+}
+
 /* from include/net/ip.h */
 static __always_inline int ip_decrease_ttl(struct iphdr *iph)
 {
@@ -37,17 +106,22 @@ static __always_inline int xdp_l3fwd_flags(struct xdp_md *ctx, u32 flags)
 {
 	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
+	struct l3fwd_cache_key ckey = {};
 	struct bpf_fib_lookup fib_params;
+	struct l3fwd_cache_cfg *cfg;
+	struct l3fwd_cache_val *cval = NULL;
+	u32 verdict = L3FWD_FWD;
 	struct ethhdr *eth = data;
 	struct ipv6hdr *ip6h;
 	struct iphdr *iph;
+	u32 idx = 0;
 	u16 h_proto;
 	u64 nh_off;
 	int rc;
 
 	nh_off = sizeof(*eth);
 	if (data + nh_off > data_end)
-		return XDP_DROP;
+		return l3fwd_done(ctx, 0, L3FWD_DROP_MALFORMED, 0, XDP_DROP);
 
 	__builtin_memset(&fib_params, 0, sizeof(fib_params));
 
@@ -56,10 +130,11 @@ static __always_inline int xdp_l3fwd_flags(struct xdp_md *ctx, u32 flags)
 		iph = data + nh_off;
 
 		if (iph + 1 > data_end)
-			return XDP_DROP;
+			return l3fwd_done(ctx, 0, L3FWD_DROP_MALFORMED, 0,
+					  XDP_DROP);
 
 		if (iph->ttl <= 1)
-			return XDP_PASS;
+			return l3fwd_done(ctx, 0, L3FWD_PASS_TTL, 0, XDP_PASS);
 
 		fib_params.family	= AF_INET;
 		fib_params.tos		= iph->tos;
@@ -73,10 +148,11 @@ static __always_inline int xdp_l3fwd_flags(struct xdp_md *ctx, u32 flags)
 
 		ip6h = data + nh_off;
 		if (ip6h + 1 > data_end)
-			return XDP_DROP;
+			return l3fwd_done(ctx, 0, L3FWD_DROP_MALFORMED, 0,
+					  XDP_DROP);
 
 		if (ip6h->hop_limit <= 1)
-			return XDP_PASS;
+			return l3fwd_done(ctx, 0, L3FWD_PASS_TTL, 0, XDP_PASS);
 
 		fib_params.family	= AF_INET6;
 		fib_params.flowinfo	= *(__be32 *)ip6h & IPV6_FLOWINFO_MASK;
@@ -85,15 +161,62 @@ static __always_inline int xdp_l3fwd_flags(struct xdp_md *ctx, u32 flags)
 		*src			= ip6h->saddr;
 		*dst			= ip6h->daddr;
 	} else {
-		return XDP_PASS;
+		return l3fwd_done(ctx, 0, L3FWD_PASS_PROTO, 0, XDP_PASS);
 	}
 
 	fib_params.ifindex = ctx->ingress_ifindex;
 
-	rc = bpf_fib_lookup(ctx, &fib_params, sizeof(fib_params), flags);
+	cfg = bpf_map_lookup_elem(&l3fwd_cache_cfg_map, &idx);
+	if (cfg && !(cfg->flags & L3FWD_CACHE_F_ENABLED))
+		cfg = NULL;
+
+	if (cfg) {
+		ckey.ifindex = fib_params.ifindex;
+		ckey.family = fib_params.family;
+		__builtin_memcpy(ckey.dst, fib_params.ipv6_dst, sizeof(ckey.dst));
+		if (!(cfg->flags & L3FWD_CACHE_F_DST_ONLY))
+			__builtin_memcpy(ckey.src, fib_params.ipv6_src,
+					 sizeof(ckey.src));
+
+		cval = bpf_map_lookup_elem(&l3fwd_cache_map, &ckey);
+	}
+
+	if (cval && cval->gen == cfg->gen &&
+	    fib_params.tot_len <= cval->max_len) {
+		fib_params.ifindex = cval->ifindex;
+		__builtin_memcpy(fib_params.dmac, cval->dmac, ETH_ALEN);
+		__builtin_memcpy(fib_params.smac, cval->smac, ETH_ALEN);
+		rc = BPF_FIB_LKUP_RET_SUCCESS;
+		verdict = L3FWD_FWD_CACHED;
+	} else {
+		rc = bpf_fib_lookup(ctx, &fib_params, sizeof(fib_params),
+				    flags);
+		if (rc == BPF_FIB_LKUP_RET_SUCCESS && cfg) {
+			struct l3fwd_cache_val new = {
+				.gen = cfg->gen,
+				.ifindex = fib_params.ifindex,
+				.max_len = fib_params.tot_len,
+			};
+
+			/* same route seen with a bigger packet; keep
+			 * the larger size
+			 */
+			if (cval && cval->gen == cfg->gen &&
+			    cval->ifindex == new.ifindex &&
+			    cval->max_len > new.max_len)
+				new.max_len = cval->max_len;
+
+			__builtin_memcpy(new.dmac, fib_params.dmac, ETH_ALEN);
+			__builtin_memcpy(new.smac, fib_params.smac, ETH_ALEN);
+			bpf_map_update_elem(&l3fwd_cache_map, &ckey, &new,
+					    BPF_ANY);
+		}
+	}
+
 	if (rc == BPF_FIB_LKUP_RET_SUCCESS) {
 		if (!bpf_map_lookup_elem(&xdp_l3fwd_ports, &fib_params.ifindex))
-			return XDP_PASS;
+			return l3fwd_done(ctx, fib_params.ifindex,
+					  L3FWD_PASS_DEVMAP_MISS, rc, XDP_PASS);
 
 		if (h_proto == htons(ETH_P_IP))
 			ip_decrease_ttl(iph);
@@ -102,11 +225,34 @@ static __always_inline int xdp_l3fwd_flags(struct xdp_md *ctx, u32 flags)
 
 		__builtin_memcpy(eth->h_dest, fib_params.dmac, ETH_ALEN);
 		__builtin_memcpy(eth->h_source, fib_params.smac, ETH_ALEN);
-		return bpf_redirect_map(&xdp_l3fwd_ports, fib_params.ifindex, 0);
+		return l3fwd_done(ctx, fib_params.ifindex, verdict, rc,
+				  bpf_redirect_map(&xdp_l3fwd_ports,
+						   fib_params.ifindex, 0));
 	}
 
+	/* the lookup sets the egress device before resolving the neighbor */
+	return l3fwd_done(ctx, rc == BPF_FIB_LKUP_RET_NO_NEIGH ?
+			  fib_params.ifindex : 0, L3FWD_PASS_FIB, rc, XDP_PASS);
+}
+
+#ifdef HAVE_EGRESS_IFINDEX
+/* devmap program for ports that want packets tagged */
+SEC("xdp_devmap/l3fwd_vlan")
+int xdp_l3fwd_vlan(struct xdp_md *ctx)
+{
+	u32 ifindex = ctx->egress_ifindex;
+	struct l3fwd_port *port;
+
+	port = bpf_map_lookup_elem(&l3fwd_port_map, &ifindex);
+	if (!port || !port->vlan)
+		return XDP_PASS;
+
+	if (xdp_vlan_push(ctx, htons(port->vlan)) < 0)
+		return XDP_DROP;
+
 	return XDP_PASS;
 }
+#endif
 
 SEC("xdp_l3fwd")
 int xdp_l3fwd_prog(struct xdp_md *ctx)
@@ -11,7 +11,9 @@
 #include <linux/if_vlan.h>
 #include <bpf/bpf_helpers.h>
 
-static __always_inline int xdp_vlan_push(struct xdp_md *ctx, __be16 vlan)
+/* push a tag with ethertype proto (802.1Q or 802.1ad) */
+static __always_inline int xdp_vlan_push_proto(struct xdp_md *ctx,
+					       __be16 proto, __be16 vlan)
 {
 	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
@@ -44,7 +46,55 @@ static __always_inline int xdp_vlan_push(struct xdp_md *ctx, __be16 vlan)
 
 	__builtin_memcpy(eth->h_dest, dmac, ETH_ALEN);
 	__builtin_memcpy(eth->h_source, smac, ETH_ALEN);
-	eth->h_proto = htons(ETH_P_8021Q);
+	eth->h_proto = proto;
+
+	return 0;
+}
+
+static __always_inline int xdp_vlan_push(struct xdp_md *ctx, __be16 vlan)
+{
+	return xdp_vlan_push_proto(ctx, htons(ETH_P_8021Q), vlan);
+}
+
+/* pop the outermost tag, 802.1Q or 802.1ad, whatever its vlan.
+ * return -1 on error, 1 if the frame is not tagged
+ */
+static __always_inline int xdp_vlan_pop_outer(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	u8 smac[ETH_ALEN], dmac[ETH_ALEN];
+	struct ethhdr *eth = data;
+	struct vlan_hdr *vhdr;
+	u16 h_proto;
+
+	if (eth + 1 > data_end)
+		return -1;
+
+	if (eth->h_proto != htons(ETH_P_8021Q) &&
+	    eth->h_proto != htons(ETH_P_8021AD))
+		return 1;
+
+	vhdr = data + sizeof(*eth);
+	if (vhdr + 1 > data_end)
+		return -1;
+
+	__builtin_memcpy(smac, eth->h_source, ETH_ALEN);
+	__builtin_memcpy(dmac, eth->h_dest, ETH_ALEN);
+	h_proto = vhdr->h_vlan_encapsulated_proto;
+
+	if (bpf_xdp_adjust_head(ctx, sizeof(*vhdr)))
+		return -1;
+
+	data = (void *)(long)ctx->data;
+	data_end = (void *)(long)ctx->data_end;
+	eth = data;
+	if (eth + 1 > data_end)
+		return -1;
+
+	__builtin_memcpy(eth->h_dest, dmac, ETH_ALEN);
+	__builtin_memcpy(eth->h_source, smac, ETH_ALEN);
+	eth->h_proto = h_proto;
 
 	return 0;
 }
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
-/* Handle traffic from a VM. Expects host NICs to be into a bond
- * configured with L3+L4 hashing to spread traffic across ports.
+/* Handle traffic from a VM. Packets are redirected to one of the host
+ * NICs in the bond config map, selected by a hash of the flow, so the
+ * NICs are expected to be in a bond configured with L3+L4 hashing.
  *
  * Copyright (c) 2019-20 David Ahern <dsahern@gmail.com>
  */
@@ -13,56 +14,56 @@
 
 #include "xdp_vlan.h"
 #include "acl_vm_common.h"
-
-/* TO-DO: pull this from a map */
-#define EGRESS_ETH0   2
-#define EGRESS_ETH1   3
+#include "bond_hash.h"
 
 /* For TX-traffic redirect requires net_device ifindex to be in this devmap */
 struct bpf_map_def SEC("maps") __egress_ports = {
 	.type = BPF_MAP_TYPE_DEVMAP_HASH,
 	.key_size = sizeof(u32),
 	.value_size = sizeof(struct bpf_devmap_val),
-	.max_entries = 2,
+	.max_entries = BOND_MAX_MEMBERS,
+};
+
+/* bond members and hash; shared by all VMs and updated by vm_bond */
+struct bpf_map_def SEC("maps") __bond_config = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(struct bond_config),
+	.max_entries = 1,
 };
 
-struct bpf_map_def SEC("maps") __acl_map = {
-        .type = BPF_MAP_TYPE_HASH,
-        .key_size = sizeof(struct acl_key),
-        .value_size = sizeof(struct acl_val),
-        .max_entries = 64,
+/* per-VM rx ACL tables by tap device index; as in acl_vm_rx */
+struct bpf_map_def SEC("maps") __rx_acl_maps = {
+	.type = BPF_MAP_TYPE_HASH_OF_MAPS,
+	.key_size = sizeof(u32),
+	.value_size = sizeof(u32),
+	.max_entries = VM_INFO_ENTRIES,
 };
 
 struct bpf_map_def SEC("maps") __vm_info_map = {
 	.type = BPF_MAP_TYPE_HASH,
 	.key_size = sizeof(u32),
 	.value_size = sizeof(struct vm_info),
-	.max_entries = 1,
+	.max_entries = VM_INFO_ENTRIES,
 };
 
-static __always_inline u32 bond_hash(struct flow *fl)
+/* egress device for the flow; 0 if there is no active member */
+static __always_inline u32 bond_select(struct flow *fl)
 {
-	u32 hash, idx;
-
-	/* flow_icmp and flow_ports are a union in flow
-	 * and both are u32 in size
-	 */
-	__builtin_memcpy(&hash, &fl->ports, sizeof(hash));
+	struct bond_config *cfg;
+	u32 key = 0, n, idx;
 
-	if (fl->family == AF_INET) {
-		hash ^= fl->daddr.ipv4 ^ fl->saddr.ipv4;
-	} else if (fl->family == AF_INET6) {
-		hash ^= ipv6_addr_hash(&fl->daddr.ipv6);
-		hash ^= ipv6_addr_hash(&fl->saddr.ipv6);
-	}
+	cfg = bpf_map_lookup_elem(&__bond_config, &key);
+	if (!cfg)
+		return 0;
 
-	hash ^= (hash >> 16);
-	hash ^= (hash >> 8);
-	hash = (hash >> 1);
+	n = cfg->n_active;
+	if (!n || n > BOND_MAX_MEMBERS)
+		return 0;
 
-	idx = hash & 1 ? EGRESS_ETH1 : EGRESS_ETH0;
+	idx = bond_hash_flow(cfg, fl) % n;
 
-	return idx;
+	return cfg->active[idx & (BOND_MAX_MEMBERS - 1)];
 }
 
 SEC("xdp/egress")
@@ -74,6 +75,7 @@ int xdp_egress_prog(struct xdp_md *ctx)
 	struct ethhdr *eth = data;
 	struct flow fl = {};
 	struct vm_info *vi;
+	void *acl_map;
 	u16 h_proto;
 	int rc;
 
@@ -81,17 +83,21 @@ int xdp_egress_prog(struct xdp_md *ctx)
 	if (!vi)
 		return XDP_PASS;
 
-        if (drop_packet(data, data_end, vi, idx, true, &fl, &__acl_map))
+	acl_map = bpf_map_lookup_elem(&__rx_acl_maps, &idx);
+	if (drop_packet(data, data_end, vi, idx, true, &fl, acl_map))
 		return XDP_DROP;
 
 	/* don't redirect broadcast frames */
 	if (eth->h_dest[0] == 0xff)
 		return XDP_PASS;
 
-	if (vi->vlan_TCI && xdp_vlan_push(ctx, vi->vlan_TCI) < 0)
+	/* no usable member; leave it to the kernel bond */
+	idx = bond_select(&fl);
+	if (!idx || !bpf_map_lookup_elem(&__egress_ports, &idx))
 		return XDP_PASS;
 
-	idx = bond_hash(&fl);
+	if (vi->vlan_TCI && xdp_vlan_push(ctx, vi->vlan_TCI) < 0)
+		return XDP_PASS;
 
 	return bpf_redirect_map(&__egress_ports, idx, 0);
 }
@@ -120,6 +120,20 @@ pr_msg "- map holds data about all interfaces - public, private and mgmt"
 run_cmd ${BPFTOOL} map create ${BPFFS}/map/vm_info \
        type hash key 4 value 32 entries 500 name vm_info_map
 
+echo
+pr_msg "Create ACL map of maps"
+pr_msg "- per-VM ACL tables by tap device index, for packets from (rx) and"
+pr_msg "  to (tx) VMs; acl_inner is the template for the per-VM tables"
+
+run_cmd ${BPFTOOL} map create ${BPFFS}/map/acl_inner \
+       type hash key 4 value 36 entries 32 name acl_inner
+run_cmd ${BPFTOOL} map create ${BPFFS}/map/rx_acl_maps \
+       type hash_of_maps key 4 value 4 entries 500 name rx_acl_maps \
+       inner_map pinned ${BPFFS}/map/acl_inner
+run_cmd ${BPFTOOL} map create ${BPFFS}/map/tx_acl_maps \
+       type hash_of_maps key 4 value 4 entries 500 name tx_acl_maps \
+       inner_map pinned ${BPFFS}/map/acl_inner
+
 echo
 pr_msg "Create ports map"
 pr_msg "- global map used for bulking redirected packets"
@@ -136,6 +150,14 @@ run_cmd ${BPFTOOL} map update pinned ${BPFFS}/map/xdp_fwd_ports \
 run_cmd ${BPFTOOL} map update pinned ${BPFFS}/map/xdp_fwd_ports \
 	key hex 3 0 0 0 value hex 3 0 0 0 0 0 0 0
 
+echo
+pr_msg "Create bond config map; VM egress is spread across eth0 and eth1"
+pr_msg "- members with link down are skipped while vm_bond -w runs"
+run_cmd ${BPFTOOL} map create ${BPFFS}/map/bond_config \
+       type array key 4 value 184 entries 1 name bond_config
+run_cmd src/bin/vm_bond -a eth0 -a eth1 -H jhash
+run_cmd src/bin/vm_bond -P
+
 read ans
 
 
@@ -145,8 +167,12 @@ clear
 echo
 pr_msg "load l2fwd program and attach to eth0 and eth1"
 
+run_cmd src/bin/xdp_l2fwd -S 4096 -D ${BPFFS}/map
 run_cmd ${BPFTOOL} prog load ksrc/obj/xdp_l2fwd.o ${BPFFS}/prog/xdp_l2fwd \
-    map name xdp_fwd_ports name xdp_fwd_ports
+    map name xdp_fwd_ports name xdp_fwd_ports \
+    map name fdb_map pinned ${BPFFS}/map/fdb_map \
+    map name fdb_map_shadow pinned ${BPFFS}/map/fdb_map_shadow \
+    map name fdb_learn_map pinned ${BPFFS}/map/fdb_learn_map
 run_cmd ${BPFTOOL} net attach xdp pinned ${BPFFS}/prog/xdp_l2fwd dev eth0
 run_cmd ${BPFTOOL} net attach xdp pinned ${BPFFS}/prog/xdp_l2fwd dev eth1
 
@@ -188,6 +214,9 @@ run_cmd ${BPFTOOL} map create ${BPFFS}/map/tx_acl_${VMID} \
 run_cmd ${BPFTOOL} map create ${BPFFS}/map/rx_acl_${VMID} \
     type hash key 4 value 36 entries 32 name rx_acl_${VMID}
 
+run_cmd src/bin/vm_info -d tapext${VMID} \
+    -R ${BPFFS}/map/rx_acl_${VMID} -T ${BPFFS}/map/tx_acl_${VMID}
+
 echo
 pr_msg "At this point ACL entries can be created for this VM"
 
@@ -210,20 +239,23 @@ read ans
 ################################################################################
 clear
 echo
-pr_msg "Load ACL programs for this VM and attach to tap device"
+pr_msg "Load ACL programs and attach to tap device"
+pr_msg "- one instance of each program serves all VMs; further VMs only need"
+pr_msg "  vm_info entries and attaching to their tap devices"
 run_cmd ${BPFTOOL} prog loadall \
-    ksrc/obj/acl_vm_tx.o ${BPFFS}/prog/acl_tx_${VMID} \
+    ksrc/obj/acl_vm_tx.o ${BPFFS}/prog/acl_tx \
     map name __vm_info_map name vm_info_map \
-    map name __tx_acl_map  name tx_acl_${VMID}
+    map name __tx_acl_maps name tx_acl_maps
 
 run_cmd ${BPFTOOL} prog loadall \
-    ksrc/obj/xdp_vmegress.o ${BPFFS}/prog/vm_egress_${VMID} \
+    ksrc/obj/xdp_vmegress.o ${BPFFS}/prog/vm_egress \
     map name __egress_ports name xdp_fwd_ports \
+    map name __bond_config name bond_config \
     map name __vm_info_map name vm_info_map \
-    map name __acl_map  name rx_acl_${VMID}
+    map name __rx_acl_maps name rx_acl_maps
 
 run_cmd ${BPFTOOL} net attach xdp \
-    pinned ${BPFFS}/prog/vm_egress_${VMID}/xdp_egress dev tapext${VMID}
+    pinned ${BPFFS}/prog/vm_egress/xdp_egress dev tapext${VMID}
 
 show_status
 
@@ -235,7 +267,7 @@ echo
 pr_msg "Add FDB and port map entries for this VM"
 pr_msg "- adds Tx ACL (packets to VM) to map entry"
 run_cmd src/bin/xdp_l2fwd -v ${PVLAN} -m ${PMAC} -d tapext${VMID} \
-    -p ${BPFFS}/prog/acl_tx_${VMID}/xdp_devmap_acl_vm_tx
+    -p ${BPFFS}/prog/acl_tx/xdp_devmap_acl_vm_tx
 
 run_cmd src/bin/xdp_l2fwd -P
 
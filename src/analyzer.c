@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Common code for commands that collect data in bpf maps and
+ * periodically report on it. Used by the standalone histogram
+ * commands and by bpfmon which hosts several of them.
+ *
+ * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
+ */
+#include <linux/bpf.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <locale.h>
+#include <time.h>
+#include <bpf/bpf.h>
+
+#include "analyzer.h"
+#include "libbpf_helpers.h"
+#include "output.h"
+#include "timestamps.h"
+
+int analyzer_map_fd(struct analyzer *a, const char *name)
+{
+	struct bpf_map *map;
+
+	map = bpf_object__find_map_by_name(a->obj, name);
+	if (!map) {
+		fprintf(stderr, "%s: Failed to get %s map in obj file\n",
+			a->name, name);
+		return -1;
+	}
+
+	return bpf_map__fd(map);
+}
+
+void analyzer_disable(struct analyzer *a)
+{
+	if (a->ch) {
+		perf_channel_close(a->ch);
+		a->ch = NULL;
+	}
+
+	if (a->fini && a->obj)
+		a->fini(a);
+
+	if (a->probes)
+		kprobe_cleanup(a->probes, a->nprobes);
+
+	if (a->tp_fds) {
+		tracepoint_cleanup(a->tp_fds, a->ntps);
+		free(a->tp_fds);
+		a->tp_fds = NULL;
+	}
+
+	if (a->obj) {
+		bpf_object__close(a->obj);
+		a->obj = NULL;
+	}
+
+	a->enabled = false;
+}
+
+int analyzer_enable(struct analyzer *a, const char *objfile)
+{
+	struct bpf_prog_load_attr prog_load_attr = { };
+	unsigned int i;
+
+	if (a->enabled)
+		return 0;
+
+	if (load_obj_file(&prog_load_attr, &a->obj, objfile ? : a->objfile,
+			  objfile != NULL))
+		return 1;
+
+	if (a->init && a->init(a))
+		goto err;
+
+	if (a->probes && kprobe_init(a->obj, a->probes, a->nprobes))
+		goto err;
+
+	if (a->tps) {
+		for (a->ntps = 0; a->tps[a->ntps]; a->ntps++)
+			;
+
+		a->tp_fds = calloc(a->ntps, sizeof(int));
+		if (!a->tp_fds) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			goto err;
+		}
+		for (i = 0; i < a->ntps; ++i)
+			a->tp_fds[i] = -1;
+
+		if (tracepoint_init(a->obj, a->tps, a->tp_fds))
+			goto err;
+	}
+
+	if (a->events) {
+		a->ch = perf_channel_open(a->obj, a->events);
+		if (!a->ch)
+			goto err;
+	}
+
+	a->enabled = true;
+
+	return 0;
+err:
+	analyzer_disable(a);
+	return 1;
+}
+
+static bool done;
+
+static void sig_handler(int signo)
+{
+	printf("Terminating by signal %d\n", signo);
+	done = true;
+}
+
+/* state of the standalone event loop */
+struct analyzer_loop {
+	struct analyzer	*a;
+	const char	*metrics_file;
+	bool		metrics_addr;
+	__u64		rate;
+	__u64		t_dump;
+};
+
+/* one round of the event loop; same as bpfmon for a single analyzer */
+static int analyzer_round(void *arg)
+{
+	struct analyzer_loop *l = arg;
+	struct analyzer *a = l->a;
+	__u64 t_now;
+
+	if (a->poll && a->poll(a))
+		fprintf(stderr, "%s: poll failed\n", a->name);
+
+	if (l->metrics_addr) {
+		/* maps are only read when scraped */
+		if (metrics_server_poll(0))
+			return 1;
+	} else {
+		t_now = get_time_ns(CLOCK_MONOTONIC);
+		if (t_now >= l->t_dump) {
+			l->t_dump = t_now + l->rate;
+
+			if (l->metrics_file) {
+				if (metrics_textfile_write(l->metrics_file,
+							   a->metrics, a))
+					return 1;
+			} else if (a->dump && a->dump(a)) {
+				return 1;
+			}
+		}
+	}
+
+	/* one write per round */
+	if (out_flush())
+		return 1;
+
+	return done;
+}
+
+static int analyzer_event_loop(struct analyzer *a, const char *metrics_addr,
+			       const char *metrics_file, int display_rate)
+{
+	struct analyzer_loop l = {
+		.a		= a,
+		.metrics_file	= metrics_file,
+		.metrics_addr	= metrics_addr != NULL,
+		.rate		= display_rate * NSEC_PER_SEC,
+	};
+	int rc;
+
+	l.t_dump = get_time_ns(CLOCK_MONOTONIC) + l.rate;
+
+	rc = perf_event_loop_fd(&a->ch, 1, metrics_server_fd(), NULL,
+				analyzer_round, &l);
+
+	return rc == LIBBPF_PERF_EVENT_ERROR;
+}
+
+static void print_usage(struct analyzer *a, char *prog)
+{
+	printf(
+	"usage: %s OPTS\n\n"
+	"	-f bpf-file    bpf filename to load\n"
+	"	-t rate        time rate (seconds) to dump stats\n"
+	"	-e [addr:]port export OpenMetrics over http\n"
+	"	-E file        write metrics to textfile every rate seconds\n"
+	"	-O format      stats output format: text (default), json or csv\n"
+	"%s"
+	, basename(prog), a->usage ? : "");
+}
+
+int analyzer_main(struct analyzer *a, int argc, char **argv)
+{
+	const char *metrics_file = NULL;
+	const char *metrics_addr = NULL;
+	const char *objfile = NULL;
+	int display_rate = 10;
+	char optstr[64];
+	int rc, tmp;
+
+	snprintf(optstr, sizeof(optstr), "f:t:e:E:O:%s", a->optstr ? : "");
+
+	while ((rc = getopt(argc, argv, optstr)) != -1)
+	{
+		switch(rc) {
+		case 'f':
+			objfile = optarg;
+			break;
+		case 't':
+			tmp = atoi(optarg);
+			if (!tmp) {
+				fprintf(stderr, "Invalid display rate\n");
+				return 1;
+			}
+			display_rate = tmp;
+			break;
+		case 'e':
+			metrics_addr = optarg;
+			break;
+		case 'E':
+			metrics_file = optarg;
+			break;
+		case 'O':
+			if (out_set_format(optarg))
+				return 1;
+			break;
+		default:
+			if (rc != '?' && a->parse_opt &&
+			    !a->parse_opt(a, rc, optarg))
+				break;
+			print_usage(a, argv[0]);
+			return 1;
+		}
+	}
+
+	if (signal(SIGINT, sig_handler) ||
+	    signal(SIGHUP, sig_handler) ||
+	    signal(SIGTERM, sig_handler)) {
+		perror("signal");
+		return 1;
+	}
+
+	if ((metrics_addr || metrics_file) && !a->metrics) {
+		fprintf(stderr, "%s does not export metrics\n", a->name);
+		return 1;
+	}
+
+	setlinebuf(stdout);
+	setlinebuf(stderr);
+	setlocale(LC_NUMERIC, "en_US.utf-8");
+
+	if (metrics_addr &&
+	    metrics_server_open(metrics_addr, a->metrics, a))
+		return 1;
+
+	rc = 1;
+	if (analyzer_enable(a, objfile))
+		goto out;
+
+	/* perf events need to be read as they arrive */
+	if (a->ch) {
+		rc = analyzer_event_loop(a, metrics_addr, metrics_file,
+					 display_rate);
+		goto out;
+	}
+
+	rc = 0;
+	if (metrics_addr) {
+		/* maps are only read when scraped */
+		rc = metrics_server_run(&done);
+		goto out;
+	}
+
+	while (!done) {
+		sleep(display_rate);
+		if (metrics_file) {
+			if (metrics_textfile_write(metrics_file, a->metrics, a))
+				break;
+		} else if (a->dump && (a->dump(a) || out_flush())) {
+			break;
+		}
+	}
+
+out:
+	metrics_server_close();
+	analyzer_disable(a);
+
+	return rc;
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __ANALYZER_H
+#define __ANALYZER_H
+
+#include <bpf/libbpf.h>
+
+#include "metrics.h"
+#include "perf_events.h"
+
+/* An analyzer is a bpf object plus the probes it attaches to and
+ * the functions to report on the data it collects. Analyzers can
+ * run standalone (analyzer_main) or be hosted with others in a
+ * single process (bpfmon) and enabled or disabled at runtime.
+ *
+ * Analyzers that emit perf events set events; the channel is opened
+ * on enable and read by the host's event loop along with the
+ * channels of the other analyzers.
+ */
+struct analyzer {
+	const char		*name;
+	const char		*desc;
+	const char		*objfile;
+
+	struct kprobe_data	*probes;
+	unsigned int		nprobes;
+	const char		**tps;	/* NULL terminated */
+	struct perf_channel_opts *events;
+
+	/* analyzer specific command line options for standalone use */
+	const char		*optstr;
+	const char		*usage;
+	int (*parse_opt)(struct analyzer *a, int opt, const char *arg);
+
+	/* called after the object is loaded, before probes are attached */
+	int (*init)(struct analyzer *a);
+	/* undo init, including a failed one; before probes are detached */
+	void (*fini)(struct analyzer *a);
+	/* called every event loop round (at least once a second) */
+	int (*poll)(struct analyzer *a);
+	/* print stats since the last dump; optional */
+	int (*dump)(struct analyzer *a);
+	/* append OpenMetrics families; arg is the analyzer; optional */
+	int (*metrics)(struct mbuf *mb, void *arg);
+
+	/* runtime state */
+	struct bpf_object	*obj;
+	int			*tp_fds;
+	unsigned int		ntps;
+	struct perf_channel	*ch;
+	bool			enabled;
+};
+
+int analyzer_enable(struct analyzer *a, const char *objfile);
+void analyzer_disable(struct analyzer *a);
+
+int analyzer_map_fd(struct analyzer *a, const char *name);
+
+/* common main for standalone histogram commands */
+int analyzer_main(struct analyzer *a, int argc, char **argv);
+
+extern struct analyzer ovslatency_analyzer;
+extern struct analyzer napi_poll_analyzer;
+extern struct analyzer net_rx_action_analyzer;
+extern struct analyzer devmap_xmit_analyzer;
+extern struct analyzer kvm_nested_analyzer;
+extern struct analyzer pktstages_analyzer;
+extern struct analyzer pktlatency_analyzer;
+extern struct analyzer tcp_probe_analyzer;
+
+#endif
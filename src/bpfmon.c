@@ -0,0 +1,342 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Host multiple analyzers in a single process. Analyzers share one
+ * event loop and one metrics endpoint and can be enabled or disabled
+ * at runtime by editing the config file and sending SIGHUP. Perf
+ * event channels of all enabled analyzers are polled together.
+ *
+ * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
+ */
+#include <linux/kernel.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <locale.h>
+#include <time.h>
+
+#include "analyzer.h"
+#include "output.h"
+#include "str_utils.h"
+#include "timestamps.h"
+
+static struct analyzer *analyzers[] = {
+	&ovslatency_analyzer,
+	&napi_poll_analyzer,
+	&net_rx_action_analyzer,
+	&devmap_xmit_analyzer,
+	&kvm_nested_analyzer,
+	&pktstages_analyzer,
+	&pktlatency_analyzer,
+	&tcp_probe_analyzer,
+};
+
+static bool done;
+static bool reload;
+
+static const char *metrics_file;
+static const char *metrics_addr;
+static __u64 display_rate = 10 * NSEC_PER_SEC;
+static __u64 t_dump;
+static int exit_rc;
+
+static int find_analyzer(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(analyzers); ++i) {
+		if (!strcmp(analyzers[i]->name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+/* wanted[i] is set for each analyzer listed in the config file.
+ * Lines are analyzer names; '#' starts a comment.
+ */
+static int read_config(const char *file, bool *wanted)
+{
+	char line[256];
+	int rc = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		fprintf(stderr, "Failed to open config file %s: %s\n",
+			file, strerror(errno));
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *fields[2];
+		char *p;
+		int i;
+
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+
+		if (parsestr(line, " \t\n", fields, ARRAY_SIZE(fields)) < 1)
+			continue;
+
+		i = find_analyzer(fields[0]);
+		if (i < 0) {
+			fprintf(stderr, "Unknown analyzer \"%s\" in %s\n",
+				fields[0], file);
+			rc = 1;
+			continue;
+		}
+		wanted[i] = true;
+	}
+	fclose(fp);
+
+	return rc;
+}
+
+/* bring the set of running analyzers in line with wanted */
+static void apply_config(const bool *wanted)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(analyzers); ++i) {
+		struct analyzer *a = analyzers[i];
+
+		if (a->enabled && !wanted[i]) {
+			analyzer_disable(a);
+			printf("%s: disabled\n", a->name);
+		} else if (!a->enabled && wanted[i]) {
+			if (analyzer_enable(a, NULL))
+				fprintf(stderr, "%s: failed to enable\n", a->name);
+			else
+				printf("%s: enabled\n", a->name);
+		}
+	}
+}
+
+static int bpfmon_metrics(struct mbuf *mb, void *arg)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(analyzers); ++i) {
+		struct analyzer *a = analyzers[i];
+
+		if (a->enabled && a->metrics && a->metrics(mb, a))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void bpfmon_dump(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(analyzers); ++i) {
+		struct analyzer *a = analyzers[i];
+
+		if (!a->enabled || !a->dump)
+			continue;
+
+		if (out_text())
+			printf("[%s] ", a->name);
+		if (a->dump(a))
+			fprintf(stderr, "%s: failed to dump stats\n", a->name);
+	}
+}
+
+/* called every round of the event loop, or every second when no
+ * analyzer has event channels; nonzero ends the event loop to exit
+ * or to rebuild the channel set after a reload
+ */
+static int bpfmon_round(void *arg)
+{
+	__u64 t_now;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(analyzers); ++i) {
+		struct analyzer *a = analyzers[i];
+
+		if (a->enabled && a->poll && a->poll(a))
+			fprintf(stderr, "%s: poll failed\n", a->name);
+	}
+
+	if (metrics_addr) {
+		/* maps are only read when scraped */
+		if (metrics_server_poll(0)) {
+			exit_rc = 1;
+			done = true;
+		}
+	} else {
+		t_now = get_time_ns(CLOCK_MONOTONIC);
+		if (t_now >= t_dump) {
+			t_dump = t_now + display_rate;
+
+			if (!metrics_file)
+				bpfmon_dump();
+			else if (metrics_textfile_write(metrics_file,
+							bpfmon_metrics, NULL))
+				done = true;
+		}
+	}
+
+	/* one write per round */
+	if (out_flush())
+		done = true;
+
+	return done || reload;
+}
+
+static void sig_handler(int signo)
+{
+	if (signo == SIGHUP) {
+		reload = true;
+		return;
+	}
+
+	printf("Terminating by signal %d\n", signo);
+	done = true;
+}
+
+static void print_usage(char *prog)
+{
+	int i;
+
+	printf(
+	"usage: %s OPTS [analyzer ...]\n\n"
+	"	-c file        file with analyzers to enable; re-read on SIGHUP\n"
+	"	-t rate        time rate (seconds) to dump stats\n"
+	"	-e [addr:]port export OpenMetrics over http\n"
+	"	-E file        write metrics to textfile every rate seconds\n"
+	"	-O format      stats output format: text (default), json or csv\n"
+	"\nanalyzers (default all):\n"
+	, basename(prog));
+
+	for (i = 0; i < ARRAY_SIZE(analyzers); ++i)
+		printf("	%-14s %s\n", analyzers[i]->name, analyzers[i]->desc);
+}
+
+int main(int argc, char **argv)
+{
+	struct perf_channel *chs[ARRAY_SIZE(analyzers)];
+	bool wanted[ARRAY_SIZE(analyzers)] = {};
+	const char *config = NULL;
+	int rc, i, nch, tmp;
+
+	while ((rc = getopt(argc, argv, "c:t:e:E:O:")) != -1)
+	{
+		switch(rc) {
+		case 'c':
+			config = optarg;
+			break;
+		case 't':
+			tmp = atoi(optarg);
+			if (!tmp) {
+				fprintf(stderr, "Invalid display rate\n");
+				return 1;
+			}
+			display_rate = tmp * NSEC_PER_SEC;
+			break;
+		case 'e':
+			metrics_addr = optarg;
+			break;
+		case 'E':
+			metrics_file = optarg;
+			break;
+		case 'O':
+			if (out_set_format(optarg))
+				return 1;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (config) {
+		if (read_config(config, wanted))
+			return 1;
+	} else if (optind == argc) {
+		for (i = 0; i < ARRAY_SIZE(analyzers); ++i)
+			wanted[i] = true;
+	}
+
+	for (; optind < argc; optind++) {
+		i = find_analyzer(argv[optind]);
+		if (i < 0) {
+			fprintf(stderr, "Unknown analyzer \"%s\"\n",
+				argv[optind]);
+			return 1;
+		}
+		wanted[i] = true;
+	}
+
+	if (signal(SIGINT, sig_handler) ||
+	    signal(SIGHUP, sig_handler) ||
+	    signal(SIGTERM, sig_handler)) {
+		perror("signal");
+		return 1;
+	}
+
+	setlinebuf(stdout);
+	setlinebuf(stderr);
+	setlocale(LC_NUMERIC, "en_US.utf-8");
+
+	if (set_reftime())
+		return 1;
+
+	if (metrics_addr &&
+	    metrics_server_open(metrics_addr, bpfmon_metrics, NULL))
+		return 1;
+
+	apply_config(wanted);
+
+	t_dump = get_time_ns(CLOCK_MONOTONIC) + display_rate;
+	while (!done) {
+		if (reload) {
+			reload = false;
+			if (!config) {
+				fprintf(stderr, "No config file to reload\n");
+			} else {
+				bool new_wanted[ARRAY_SIZE(analyzers)] = {};
+
+				if (!read_config(config, new_wanted))
+					apply_config(new_wanted);
+			}
+		}
+
+		for (i = 0, nch = 0; i < ARRAY_SIZE(analyzers); ++i) {
+			if (analyzers[i]->enabled && analyzers[i]->ch)
+				chs[nch++] = analyzers[i]->ch;
+		}
+
+		if (nch) {
+			/* wake up for scrapes as well as events */
+			rc = perf_event_loop_fd(chs, nch, metrics_server_fd(),
+						NULL, bpfmon_round, NULL);
+			if (rc == LIBBPF_PERF_EVENT_ERROR) {
+				exit_rc = 1;
+				break;
+			}
+			continue;
+		}
+
+		if (metrics_addr) {
+			if (metrics_server_poll(1000)) {
+				exit_rc = 1;
+				break;
+			}
+		} else {
+			sleep(1);
+		}
+		bpfmon_round(NULL);
+	}
+
+	metrics_server_close();
+	for (i = 0; i < ARRAY_SIZE(analyzers); ++i)
+		analyzer_disable(analyzers[i]);
+
+	return exit_rc;
+}
@@ -5,6 +5,7 @@
  */
 #include <stdbool.h>
 #include <linux/bpf.h>
+#include <linux/kernel.h>
 #include <linux/rbtree.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,17 +13,17 @@
 #include <signal.h>
 #include <libgen.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 
 #include "execsnoop.h"
 #include "libbpf_helpers.h"
+#include "output.h"
 #include "perf_events.h"
 #include "timestamps.h"
 
-#include "perf_events.c"
-
 static bool print_time = true;
 static bool print_dt;
 static bool success_only = true;
@@ -139,9 +140,34 @@ static void show_timestamps(__u64 start, __u64 end)
 	printf("  ");
 }
 
+static void out_event(struct task *task, struct data *data,
+		      const char *event, const char *comm)
+{
+	char args[MAXARG * ARGSIZE];
+	size_t len = 0;
+	int i;
+
+	args[0] = '\0';
+	for (i = 0; i < task->narg && len < sizeof(args); ++i)
+		len += snprintf(args + len, sizeof(args) - len, "%s%s",
+				i ? " " : "", task->arg[i]);
+
+	out_begin();
+	out_u64("time", timestamp_ns(task->time));
+	out_u64("dt", data->time - task->time);
+	out_str("event", event);
+	out_u64("cpu", data->cpu);
+	out_u64("ppid", task->ppid);
+	out_u64("pid", task->pid);
+	out_s64("ret", data->retval);
+	out_str("comm", comm);
+	out_str("args", args);
+	out_end();
+}
+
 static const char *event_names[] = { "start", "arg", "ret", "exit" };
 
-static int print_bpf_output(void *_data, int size)
+static int print_bpf_output(void *ctx, void *_data, int size)
 {
 	struct data *data = _data;
 	struct task *task;
@@ -178,7 +204,10 @@ static int print_bpf_output(void *_data, int size)
 		task->narg++;
 		break;
 	case EVENT_RET:
-		if (!success_only || data->retval == 0) {
+		if (!out_text()) {
+			if (!success_only || data->retval == 0)
+				out_event(task, data, "exec", task->comm);
+		} else if (!success_only || data->retval == 0) {
 			if (print_time || print_dt)
 				show_timestamps(task->time, data->time);
 			printf("[%02u] %6d %6d %6d   %s ->",
@@ -192,6 +221,11 @@ static int print_bpf_output(void *_data, int size)
 			remove_task(task);
 		break;
 	case EVENT_EXIT:
+		if (!out_text()) {
+			out_event(task, data, "exit", data->comm);
+			remove_task(task);
+			break;
+		}
 		if (print_time || print_dt)
 			show_timestamps(task->time, data->time);
 		printf("[%02u] %6d %6d %6s   %s [EXIT]\n",
@@ -203,13 +237,12 @@ out:
 	return LIBBPF_PERF_EVENT_CONT;
 }
 
-static void process_event(struct data *data)
+static int execsnoop_complete(void *arg)
 {
-	/* nothing to do */
-}
+	/* one write per round */
+	if (out_flush())
+		return 1;
 
-static int execsnoop_complete(void)
-{
 	return done;
 }
 
@@ -227,6 +260,9 @@ static void print_usage(char *prog)
 	"	-T             do not show timestamps (default on)\n"
 	"	-D             show syscall time (default off)\n"
 	"	-A             show all execs (default only successful exec)\n"
+	"	-O format      output format: text (default), json or csv\n"
+	"	-w msec        sort events across cpus using a reorder window\n"
+	"	-B num         max events queued for sorting (default unlimited)\n"
 	, basename(prog));
 }
 
@@ -245,10 +281,17 @@ int main(int argc, char **argv)
 	};
 	char *objfile = "execsnoop.o";
 	bool filename_set = false;
+	struct perf_channel_opts opts = {
+		PERF_CHANNEL_UNSORTED(struct data),
+		.handler = print_bpf_output,
+		.nevents = 100,
+		.cpu = -1,
+	};
+	struct perf_channel_stats stats;
+	struct perf_channel *ch = NULL;
 	struct bpf_object *obj;
-	int nevents = 100;
 	int attr_type;
-	int rc;
+	int rc, tmp;
 
 	attr_type = kprobe_event_type();
 	if (attr_type < 0) {
@@ -258,7 +301,7 @@ int main(int argc, char **argv)
 		objfile = "execsnoop_legacy.o";
 	}
 
-	while ((rc = getopt(argc, argv, "f:TDA")) != -1)
+	while ((rc = getopt(argc, argv, "f:TDAw:B:O:")) != -1)
 	{
 		switch(rc) {
 		case 'f':
@@ -274,6 +317,30 @@ int main(int argc, char **argv)
 		case 'A':
 			success_only = false;
 			break;
+		case 'w':
+			tmp = atoi(optarg);
+			if (tmp <= 0) {
+				fprintf(stderr, "Invalid reorder window\n");
+				return 1;
+			}
+			/* exec and exit can be seen on different cpus */
+			opts.time_off = offsetof(struct data, time);
+			opts.cpu_off = offsetof(struct data, cpu);
+			opts.cpu_size = sizeof(((struct data *)0)->cpu);
+			opts.reorder_window = tmp * NSEC_PER_MSEC;
+			break;
+		case 'B':
+			tmp = atoi(optarg);
+			if (tmp <= 0) {
+				fprintf(stderr, "Invalid backlog limit\n");
+				return 1;
+			}
+			opts.max_backlog = tmp;
+			break;
+		case 'O':
+			if (out_set_format(optarg))
+				return 1;
+			break;
 		default:
 			print_usage(argv[0]);
 			return 1;
@@ -301,15 +368,24 @@ int main(int argc, char **argv)
 	    do_tracepoint(obj, tps))
 		goto out;
 
-	if (configure_perf_event_channel(obj, nevents))
+	ch = perf_channel_open(obj, &opts);
+	if (!ch)
 		goto out;
 
-	print_header();
+	if (out_text())
+		print_header();
 
 	/* main event loop */
-	rc = perf_event_loop(print_bpf_output, NULL, execsnoop_complete);
+	rc = perf_event_loop(&ch, 1, NULL, execsnoop_complete, NULL);
+
+	out_flush();
+
+	perf_channel_get_stats(ch, &stats);
+	if (stats.lost || stats.overflow)
+		fprintf(stderr, "%llu events lost, %llu released out of order\n",
+			stats.lost, stats.overflow);
 out:
-	close_perf_event_channel();
+	perf_channel_close(ch);
 	kprobe_cleanup(probes, ARRAY_SIZE(probes));
 
 	return rc;
@@ -4,167 +4,120 @@
  * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
  */
 #include <linux/bpf.h>
-#include <ctype.h>
-#include <signal.h>
+#include <linux/kernel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <libgen.h>
-#include <locale.h>
 #include <bpf/bpf.h>
 
+#include "analyzer.h"
 #include "libbpf_helpers.h"
-#include "perf_events.h"
+#include "output.h"
 #include "timestamps.h"
 
-#define MAX_CPUS        128
+static int map_fd = -1;
 
-struct data {
-	__u64 time;
-	__u32 cpu;
-};
-
-#include "perf_events.c"
+static int dump_entry(const void *key, const void *value, void *arg)
+{
+	__u64 pid = *(const __u64 *)key;
+	__u64 val = *(const __u64 *)value;
+
+	if (!out_text()) {
+		out_begin();
+		out_u64("time", timestamp_ns(0));
+		out_str("hist", "kvm_nested");
+		out_u64("tgid", (__u32)(pid >> 32));
+		out_u64("pid", (__u32)pid);
+		out_u64("count", val);
+		out_end();
+		return 0;
+	}
 
-bool done;
+	printf("    tgid %u pid %u count %llu\n",
+		(__u32)(pid >> 32), (__u32)pid, val);
 
-static void process_event(struct data *data)
-{
-	/* nothing to do */
+	return 0;
 }
 
-static int dump_map(int map_fd)
+static int dump_map(struct analyzer *a)
 {
-	__u64 *key, *prev_key = NULL, val, pid;
 	char buf[64];
-	int err;
 
-	key = calloc(1, sizeof(*key));
-	if (!key) {
-		fprintf(stderr, "Failed to allocate memory for key\n");
-		return 1;
-	}
+	if (out_text())
+		printf("\n%s:\n", timestamp(buf, sizeof(buf), 0));
 
-	printf("\n%s:\n", timestamp(buf, sizeof(buf), 0));
-	while(1) {
-		err = bpf_map_get_next_key(map_fd, prev_key, key);
-		if (err) {
-			if (errno == ENOENT)
-				err = 0;
-			break;
-		}
-
-		val = 0;
-		if (!bpf_map_lookup_elem(map_fd, key, &val)) {
-			pid = *key;
-			printf("    tgid %u pid %u count %llu\n",
-				(__u32)(pid >> 32), (__u32)pid, val);
-		}
-
-		prev_key = key;
-	}
-
-	free(key);
-	return err;
+	return bpf_map_walk(map_fd, dump_entry, NULL, false) ? 1 : 0;
 }
 
-static void sig_handler(int signo)
+static int metrics_entry(const void *key, const void *value, void *arg)
 {
-	printf("Terminating by signal %d\n", signo);
-	done = true;
+	__u64 pid = *(const __u64 *)key;
+	char labels[64];
+
+	snprintf(labels, sizeof(labels), "tgid=\"%u\",pid=\"%u\"",
+		 (__u32)(pid >> 32), (__u32)pid);
+	metrics_counter(arg, "kvm_nested_vmexits", labels,
+			*(const __u64 *)value);
+
+	return 0;
 }
 
-static void print_usage(char *prog)
+static int kvm_nested_metrics(struct mbuf *mb, void *arg)
 {
-	printf(
-	"usage: %s OPTS\n\n"
-	"	-f bpf-file    bpf filename to load\n"
-	"	-t rate        time rate (seconds) to dump stats\n"
-	, basename(prog));
+	metrics_family(mb, "kvm_nested_vmexits", METRICS_COUNTER,
+		       "Nested virtualization vmexits by task");
+
+	return bpf_map_walk(map_fd, metrics_entry, mb, false) ? 1 : 0;
 }
 
-int main(int argc, char **argv)
+static int kvm_nested_init(struct analyzer *a)
 {
-	struct bpf_prog_load_attr prog_load_attr = { };
-	char *objfile = "kvm-nested.o";
-	struct kprobe_data probes[] = {
-		{ .func = "handle_vmresume", .fd = -1 },
-	};
-	const char *tps[] = {
-		"kvm/kvm_nested_vmexit",
-		"sched/sched_process_exit",
-		NULL
-	};
-	bool filename_set = false;
-	bool use_kprobe = false;
-	struct bpf_object *obj;
-	int display_rate = 10;
-	struct bpf_map *map;
-	int rc, tmp;
-	int map_fd;
-
-	while ((rc = getopt(argc, argv, "f:t:k")) != -1)
-	{
-		switch(rc) {
-		case 'f':
-			objfile = optarg;
-			filename_set = true;
-			break;
-		case 't':
-			tmp = atoi(optarg);
-			if (!tmp) {
-				fprintf(stderr, "Invalid display rate\n");
-				return 1;
-			}
-			display_rate = tmp;
-			break;
-		case 'k':
-			use_kprobe = true;
-			break;
-		default:
-			print_usage(argv[0]);
-			return 1;
-		}
-	}
+	map_fd = analyzer_map_fd(a, "nested_virt_map");
 
-	if (signal(SIGINT, sig_handler) ||
-	    signal(SIGHUP, sig_handler) ||
-	    signal(SIGTERM, sig_handler)) {
-		perror("signal");
-		return 1;
-	}
+	return map_fd < 0 ? 1 : 0;
+}
 
-	setlinebuf(stdout);
-	setlinebuf(stderr);
+static struct kprobe_data probes[] = {
+	{ .func = "handle_vmresume", .fd = -1 },
+};
 
-	if (load_obj_file(&prog_load_attr, &obj, objfile, filename_set))
-		return 1;
+static const char *tps[] = {
+	"kvm/kvm_nested_vmexit",
+	"sched/sched_process_exit",
+	NULL
+};
 
-	map = bpf_object__find_map_by_name(obj, "nested_virt_map");
-	if (!map) {
-		printf("Failed to get map in obj file\n");
-		return 1;
-	}
-	map_fd = bpf_map__fd(map);
-
-	rc = 1;
-	if (use_kprobe) {
-		if (kprobe_init(obj, probes, ARRAY_SIZE(probes)))
-			goto out;
-	} else {
-		if (do_tracepoint(obj, tps))
-			goto out;
+static int kvm_nested_parse_opt(struct analyzer *a, int opt, const char *arg)
+{
+	switch (opt) {
+	case 'k':
+		a->probes = probes;
+		a->nprobes = ARRAY_SIZE(probes);
+		a->tps = NULL;
+		return 0;
 	}
 
-	rc = 0;
-	while (!done) {
-		sleep(display_rate);
-		if (dump_map(map_fd))
-			break;
-	}
+	return 1;
+}
+
+struct analyzer kvm_nested_analyzer = {
+	.name		= "kvm-nested",
+	.desc		= "users of nested virtualization",
+	.objfile	= "kvm-nested.o",
+	.tps		= tps,
+	.optstr		= "k",
+	.usage		= "	-k             use kprobe on handle_vmresume\n",
+	.parse_opt	= kvm_nested_parse_opt,
+	.init		= kvm_nested_init,
+	.dump		= dump_map,
+	.metrics	= kvm_nested_metrics,
+};
 
-out:
-	return rc;
+#ifndef ANALYZER_NO_MAIN
+int main(int argc, char **argv)
+{
+	return analyzer_main(&kvm_nested_analyzer, argc, argv);
 }
+#endif
@@ -6,9 +6,13 @@
  */
 
 #include <linux/if_link.h>
+#include <linux/kernel.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -16,6 +20,111 @@
 
 #include "libbpf_helpers.h"
 
+/* perf event channels need an entry per possible cpu. The compiled in
+ * size is a default; grow or shrink it to the running system before
+ * the object is loaded.
+ */
+static int size_channel_map(struct bpf_object *obj)
+{
+	struct bpf_map *map;
+	int ncpus;
+
+	map = bpf_object__find_map_by_name(obj, "channel");
+	if (!map || bpf_map__type(map) != BPF_MAP_TYPE_PERF_EVENT_ARRAY)
+		return 0;
+
+	ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 0) {
+		fprintf(stderr, "Failed to get number of possible cpus\n");
+		return ncpus;
+	}
+
+	return bpf_map__set_max_entries(map, ncpus);
+}
+
+/* map sizes requested by the command; applied by load_obj_file */
+static struct {
+	const char *name;
+	__u32 max_entries;
+} map_sizes[8];
+
+int load_obj_set_max_entries(const char *name, __u32 max_entries)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(map_sizes); i++) {
+		if (!map_sizes[i].name || !strcmp(map_sizes[i].name, name)) {
+			map_sizes[i].name = name;
+			map_sizes[i].max_entries = max_entries;
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "Too many map size overrides\n");
+	return 1;
+}
+
+static int size_maps(struct bpf_object *obj)
+{
+	struct bpf_map *map;
+	int i, err;
+
+	for (i = 0; i < ARRAY_SIZE(map_sizes) && map_sizes[i].name; i++) {
+		map = bpf_object__find_map_by_name(obj, map_sizes[i].name);
+		if (!map) {
+			fprintf(stderr, "Failed to get %s map in obj file\n",
+				map_sizes[i].name);
+			return -ENOENT;
+		}
+
+		err = bpf_map__set_max_entries(map, map_sizes[i].max_entries);
+		if (err)
+			return err;
+	}
+
+	return size_channel_map(obj);
+}
+
+/* bpf_prog_load_xattr with a hook between open and load */
+static int __load_obj_file(struct bpf_prog_load_attr *attr,
+			   struct bpf_object **pobj)
+{
+	struct bpf_program *prog;
+	struct bpf_object *obj;
+	int err;
+
+	obj = bpf_object__open_file(attr->file, NULL);
+	err = libbpf_get_error(obj);
+	if (err)
+		goto out;
+
+	bpf_object__for_each_program(prog, obj) {
+		/* devmap programs keep the attach type of their section */
+		if (attr->prog_type != BPF_PROG_TYPE_UNSPEC &&
+		    bpf_program__get_expected_attach_type(prog) != BPF_XDP_DEVMAP) {
+			bpf_program__set_type(prog, attr->prog_type);
+			bpf_program__set_expected_attach_type(prog,
+						attr->expected_attach_type);
+		}
+		if (attr->ifindex)
+			bpf_program__set_ifindex(prog, attr->ifindex);
+	}
+
+	err = size_maps(obj);
+	if (!err)
+		err = bpf_object__load(obj);
+	if (err) {
+		bpf_object__close(obj);
+		goto out;
+	}
+
+	*pobj = obj;
+	return 0;
+out:
+	errno = -err;
+	return err;
+}
+
 int load_obj_file(struct bpf_prog_load_attr *attr,
 		  struct bpf_object **obj,
 		  const char *objfile, bool user_set)
@@ -28,11 +137,11 @@ int load_obj_file(struct bpf_prog_load_attr *attr,
 		NULL,
 	};
 	char path[PATH_MAX];
-	int prog_fd, i = 0;
+	int i = 0;
 
 	if (user_set) {
 		attr->file = objfile;
-		return bpf_prog_load_xattr(attr, obj, &prog_fd);
+		return __load_obj_file(attr, obj);
 	}
 
 	attr->file = path;
@@ -43,7 +152,7 @@ int load_obj_file(struct bpf_prog_load_attr *attr,
 			 expected_paths[i], objfile);
 
 		if (stat(path, &sbuf) == 0) {
-			if (!bpf_prog_load_xattr(attr, obj, &prog_fd))
+			if (!__load_obj_file(attr, obj))
 				return 0;
 
 			if (errno != ENOENT)
@@ -56,6 +165,156 @@ int load_obj_file(struct bpf_prog_load_attr *attr,
 	return 1;
 }
 
+/* kernel internal; returned for maps without batch support */
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+#define MAP_WALK_BATCH	256
+
+static bool map_is_percpu(__u32 type)
+{
+	return type == BPF_MAP_TYPE_PERCPU_HASH ||
+	       type == BPF_MAP_TYPE_PERCPU_ARRAY ||
+	       type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+}
+
+static int map_walk_slow(int fd, const struct bpf_map_info *info,
+			 void *key, void *prev, void *val,
+			 map_entry_fn fn, void *arg, bool delete)
+{
+	void *prev_key = NULL;
+	int err;
+
+	while (1) {
+		/* after a delete the walk restarts at the first key */
+		if (bpf_map_get_next_key(fd, delete ? NULL : prev_key, key))
+			return errno == ENOENT ? 0 : -errno;
+
+		if (bpf_map_lookup_elem(fd, key, val))
+			goto next;
+
+		if (delete && bpf_map_delete_elem(fd, key))
+			return -errno;
+
+		err = fn(key, val, arg);
+		if (err)
+			return err;
+next:
+		memcpy(prev, key, info->key_size);
+		prev_key = prev;
+	}
+}
+
+int bpf_map_walk(int fd, map_entry_fn fn, void *arg, bool delete)
+{
+	void *keys = NULL, *vals = NULL, *prev = NULL;
+	__u64 in_batch[8], out_batch[8];
+	struct bpf_map_info info = {};
+	__u32 len = sizeof(info);
+	__u32 batch = MAP_WALK_BATCH;
+	size_t vsize;
+	void *in = NULL;
+	bool no_batch = false;
+	__u32 count, i;
+	int err, ncpus = 1;
+
+	if (bpf_obj_get_info_by_fd(fd, &info, &len)) {
+		fprintf(stderr, "Failed to get map info: %s\n",
+			strerror(errno));
+		return -errno;
+	}
+
+	if (map_is_percpu(info.type)) {
+		ncpus = libbpf_num_possible_cpus();
+		if (ncpus < 0)
+			return ncpus;
+	}
+
+	if (map_is_percpu(info.type))
+		vsize = (size_t)((info.value_size + 7) & ~7) * ncpus;
+	else
+		vsize = info.value_size;
+
+	/* batch token is a key for arrays and a bucket for hash maps */
+	if (info.key_size > sizeof(in_batch))
+		no_batch = true;
+
+	if (info.max_entries && info.max_entries < batch)
+		batch = info.max_entries;
+realloc:
+	free(keys);
+	free(vals);
+	free(prev);
+	keys = calloc(batch, info.key_size);
+	vals = calloc(batch, vsize);
+	prev = calloc(1, info.key_size);
+	if (!keys || !vals || !prev) {
+		fprintf(stderr, "Failed to allocate memory for map walk\n");
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (no_batch) {
+		err = map_walk_slow(fd, &info, keys, prev, vals, fn, arg,
+				    delete);
+		goto out;
+	}
+
+	while (1) {
+		count = batch;
+		if (delete)
+			err = bpf_map_lookup_and_delete_batch(fd, in, out_batch,
+							      keys, vals,
+							      &count, NULL);
+		else
+			err = bpf_map_lookup_batch(fd, in, out_batch, keys,
+						   vals, &count, NULL);
+		if (err) {
+			err = -errno;
+
+			/* a bucket has more entries than fit; retry bigger */
+			if (err == -ENOSPC && !count) {
+				batch *= 2;
+				goto realloc;
+			}
+			/* kernel or map type without batch support; decided
+			 * per walk since other maps may well have it
+			 */
+			if (!in && (err == -EINVAL || err == -ENOTSUPP ||
+				    err == -EOPNOTSUPP)) {
+				no_batch = true;
+				goto realloc;
+			}
+			if (err != -ENOENT)
+				break;
+		}
+
+		for (i = 0; i < count; i++) {
+			int rc = fn(keys + i * info.key_size,
+				    vals + i * vsize, arg);
+			if (rc) {
+				err = rc;
+				goto out;
+			}
+		}
+
+		/* ENOENT: no more entries */
+		if (err)
+			break;
+
+		memcpy(in_batch, out_batch, sizeof(in_batch));
+		in = in_batch;
+	}
+	if (err == -ENOENT)
+		err = 0;
+out:
+	free(keys);
+	free(vals);
+	free(prev);
+	return err;
+}
+
 int bpf_map_get_fd_by_name(const char *name)
 {
 	struct bpf_map_info info = {};
@@ -82,6 +341,35 @@ int bpf_map_get_fd_by_name(const char *name)
 	return -1;
 }
 
+int bpf_prog_get_fd_by_name(const char *name)
+{
+	struct bpf_prog_info info = {};
+	__u32 len = sizeof(info);
+	__u32 id = 0;
+	int err, fd;
+
+	while (1) {
+		err = bpf_prog_get_next_id(id, &id);
+		if (err)
+			break;
+
+		fd = bpf_prog_get_fd_by_id(id);
+		if (fd < 0)
+			continue;
+
+		/* only the name is wanted */
+		memset(&info, 0, sizeof(info));
+		len = sizeof(info);
+		err = bpf_obj_get_info_by_fd(fd, &info, &len);
+		if (!err && strcmp(info.name, name) == 0)
+			return fd;
+
+		close(fd);
+	}
+
+	return -1;
+}
+
 /* from bpftool */
 static int get_fd_type(int fd)
 {
@@ -15,11 +15,26 @@ enum bpf_obj_type {
 int load_obj_file(struct bpf_prog_load_attr *attr,
                   struct bpf_object **obj,
                   const char *objfile, bool user_set);
+/* override max_entries of a map for subsequent load_obj_file calls */
+int load_obj_set_max_entries(const char *name, __u32 max_entries);
+
+/* called for each map entry; non-0 return stops the walk */
+typedef int (*map_entry_fn)(const void *key, const void *value, void *arg);
+
+/* call fn for each entry in the map, reading entries in batches with
+ * BPF_MAP_LOOKUP_BATCH (LOOKUP_AND_DELETE_BATCH if delete is set) and
+ * falling back to get_next_key + lookup on kernels without batch
+ * support. For per-cpu maps value holds a value per possible cpu,
+ * each rounded up to 8 bytes. Returns 0 or negative errno.
+ */
+int bpf_map_walk(int fd, map_entry_fn fn, void *arg, bool delete);
 
 int bpf_map_get_fd_by_name(const char *name);
 int bpf_map_get_fd_by_path(const char *path);
 
 int bpf_prog_get_fd_by_path(const char *path);
+/* first loaded program with name; names are truncated to 15 chars */
+int bpf_prog_get_fd_by_name(const char *name);
 
 int attach_to_dev_generic(int idx, int prog_fd, const char *dev);
 int detach_from_dev_generic(int idx, const char *dev);
@@ -0,0 +1,441 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Minimal OpenMetrics exporter. Commands serve cumulative counters
+ * and histograms read from bpf maps on each scrape over a local
+ * HTTP endpoint or write them to a textfile collector file.
+ *
+ * Only a single scrape is handled at a time; this is meant for a
+ * local collector, not for serving arbitrary clients.
+ *
+ * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
+ */
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "metrics.h"
+
+#define MBUF_CHUNK	16384
+
+int mbuf_printf(struct mbuf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *buf;
+	int n;
+
+	if (mb->err)
+		return -1;
+
+	while (1) {
+		size_t avail = mb->size - mb->len;
+
+		va_start(ap, fmt);
+		n = vsnprintf(mb->buf + mb->len, avail, fmt, ap);
+		va_end(ap);
+
+		if (n < 0) {
+			mb->err = true;
+			return -1;
+		}
+		if ((size_t)n < avail)
+			break;
+
+		size = mb->size + n + MBUF_CHUNK;
+		buf = realloc(mb->buf, size);
+		if (!buf) {
+			/* old buffer is still valid; freed with the mbuf */
+			fprintf(stderr, "Failed to allocate metrics buffer\n");
+			mb->err = true;
+			return -1;
+		}
+		mb->buf = buf;
+		mb->size = size;
+	}
+	mb->len += n;
+
+	return 0;
+}
+
+static const char *type_str[] = {
+	[METRICS_COUNTER]   = "counter",
+	[METRICS_GAUGE]     = "gauge",
+	[METRICS_HISTOGRAM] = "histogram",
+};
+
+void metrics_family(struct mbuf *mb, const char *name, enum metrics_type type,
+		    const char *help)
+{
+	/* prometheus text format wants the sample name in TYPE for
+	 * counters; OpenMetrics wants the family name.
+	 */
+	const char *sfx = (mb->prom_text && type == METRICS_COUNTER) ?
+			  "_total" : "";
+
+	mbuf_printf(mb, "# TYPE %s%s %s\n", name, sfx, type_str[type]);
+	if (help)
+		mbuf_printf(mb, "# HELP %s%s %s\n", name, sfx, help);
+}
+
+void metrics_counter(struct mbuf *mb, const char *name, const char *labels,
+		     __u64 val)
+{
+	if (labels && *labels)
+		mbuf_printf(mb, "%s_total{%s} %llu\n", name, labels, val);
+	else
+		mbuf_printf(mb, "%s_total %llu\n", name, val);
+}
+
+void metrics_gauge(struct mbuf *mb, const char *name, const char *labels,
+		   double val)
+{
+	if (labels && *labels)
+		mbuf_printf(mb, "%s{%s} %g\n", name, labels, val);
+	else
+		mbuf_printf(mb, "%s %g\n", name, val);
+}
+
+void metrics_hist(struct mbuf *mb, const char *name, const char *labels,
+		  const double *le, const __u64 *buckets, int nbuckets,
+		  double sum)
+{
+	const char *sep = labels && *labels ? "," : "";
+	__u64 total = 0;
+	int i;
+
+	if (!labels)
+		labels = "";
+
+	for (i = 0; i < nbuckets; ++i) {
+		total += buckets[i];
+		if (i < nbuckets - 1)
+			mbuf_printf(mb, "%s_bucket{%s%sle=\"%g\"} %llu\n",
+				    name, labels, sep, le[i], total);
+		else
+			mbuf_printf(mb, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+				    name, labels, sep, total);
+	}
+
+	if (*labels) {
+		mbuf_printf(mb, "%s_count{%s} %llu\n", name, labels, total);
+		if (sum >= 0)
+			mbuf_printf(mb, "%s_sum{%s} %g\n", name, labels, sum);
+	} else {
+		mbuf_printf(mb, "%s_count %llu\n", name, total);
+		if (sum >= 0)
+			mbuf_printf(mb, "%s_sum %g\n", name, sum);
+	}
+}
+
+char *metrics_label_escape(char *dst, size_t len, const char *src)
+{
+	size_t i = 0;
+
+	for (; *src && i + 2 < len; ++src) {
+		switch (*src) {
+		case '\\':
+		case '"':
+			dst[i++] = '\\';
+			dst[i++] = *src;
+			break;
+		case '\n':
+			dst[i++] = '\\';
+			dst[i++] = 'n';
+			break;
+		default:
+			dst[i++] = *src;
+		}
+	}
+	dst[i] = '\0';
+
+	return dst;
+}
+
+static int collect(struct mbuf *mb, metrics_collect_fn fn, void *arg)
+{
+	if (fn(mb, arg))
+		return 1;
+
+	if (!mb->prom_text)
+		mbuf_printf(mb, "# EOF\n");
+
+	return mb->err ? 1 : 0;
+}
+
+static int listen_sd = -1;
+static metrics_collect_fn collect_fn;
+static void *collect_arg;
+
+static int parse_addr(const char *addr, char *host, size_t hlen,
+		      const char **port)
+{
+	const char *p;
+
+	host[0] = '\0';
+
+	if (*addr == '[') {
+		p = strchr(addr, ']');
+		if (!p || p[1] != ':' || p - addr - 1 >= hlen)
+			return -1;
+		memcpy(host, addr + 1, p - addr - 1);
+		host[p - addr - 1] = '\0';
+		*port = p + 2;
+		return 0;
+	}
+
+	p = strrchr(addr, ':');
+	if (!p) {
+		*port = addr;
+		return 0;
+	}
+	if (p - addr >= hlen)
+		return -1;
+
+	memcpy(host, addr, p - addr);
+	host[p - addr] = '\0';
+	*port = p + 1;
+
+	return 0;
+}
+
+int metrics_server_open(const char *addr, metrics_collect_fn fn, void *arg)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *res, *ai;
+	char host[INET6_ADDRSTRLEN + 1];
+	const char *port;
+	int one = 1;
+	int err;
+
+	if (parse_addr(addr, host, sizeof(host), &port) || !*port) {
+		fprintf(stderr, "Invalid metrics address \"%s\"\n", addr);
+		return 1;
+	}
+
+	err = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "Failed to resolve metrics address \"%s\": %s\n",
+			addr, gai_strerror(err));
+		return 1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		listen_sd = socket(ai->ai_family,
+				   ai->ai_socktype | SOCK_CLOEXEC, 0);
+		if (listen_sd < 0)
+			continue;
+
+		setsockopt(listen_sd, SOL_SOCKET, SO_REUSEADDR,
+			   &one, sizeof(one));
+
+		if (!bind(listen_sd, ai->ai_addr, ai->ai_addrlen) &&
+		    !listen(listen_sd, 16))
+			break;
+
+		close(listen_sd);
+		listen_sd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (listen_sd < 0) {
+		fprintf(stderr, "Failed to listen on metrics address \"%s\": %s\n",
+			addr, strerror(errno));
+		return 1;
+	}
+
+	collect_fn = fn;
+	collect_arg = arg;
+
+	return 0;
+}
+
+void metrics_server_close(void)
+{
+	if (listen_sd >= 0)
+		close(listen_sd);
+	listen_sd = -1;
+}
+
+static int write_all(int sd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(sd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void send_response(int sd, const char *status, const char *ctype,
+			  const char *body, size_t len)
+{
+	char hdr[256];
+	int n;
+
+	n = snprintf(hdr, sizeof(hdr),
+		     "HTTP/1.1 %s\r\n"
+		     "Content-Type: %s\r\n"
+		     "Content-Length: %zu\r\n"
+		     "Connection: close\r\n\r\n",
+		     status, ctype, len);
+
+	if (write_all(sd, hdr, n) == 0 && len)
+		write_all(sd, body, len);
+}
+
+static void handle_scrape(int sd)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	static struct mbuf mb;
+	char req[1024];
+	size_t len = 0;
+	ssize_t n;
+
+	setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* only the request line matters; headers are ignored */
+	while (len < sizeof(req) - 1) {
+		n = read(sd, req + len, sizeof(req) - 1 - len);
+		if (n <= 0)
+			return;
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	if (strncmp(req, "GET ", 4)) {
+		send_response(sd, "405 Method Not Allowed", "text/plain", "", 0);
+		return;
+	}
+	if (strncmp(req + 4, "/metrics", 8) ||
+	    (req[12] != ' ' && req[12] != '?')) {
+		send_response(sd, "404 Not Found", "text/plain", "", 0);
+		return;
+	}
+
+	/* buffer is reused across scrapes to avoid a realloc storm */
+	mb.len = 0;
+	mb.err = false;
+	mb.prom_text = false;
+	if (collect(&mb, collect_fn, collect_arg)) {
+		send_response(sd, "500 Internal Server Error", "text/plain",
+			      "", 0);
+		return;
+	}
+
+	send_response(sd, "200 OK",
+		      "application/openmetrics-text; version=1.0.0; charset=utf-8",
+		      mb.buf, mb.len);
+}
+
+int metrics_server_fd(void)
+{
+	return listen_sd;
+}
+
+int metrics_server_poll(int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd = listen_sd,
+		.events = POLLIN,
+	};
+	int sd;
+
+	if (listen_sd < 0)
+		return 0;
+
+	while (poll(&pfd, 1, timeout_ms) > 0) {
+		sd = accept(listen_sd, NULL, NULL);
+		if (sd < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == ECONNABORTED)
+				return 0;
+			fprintf(stderr, "accept failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		handle_scrape(sd);
+		close(sd);
+
+		/* drain anything else pending without blocking */
+		timeout_ms = 0;
+	}
+
+	return 0;
+}
+
+int metrics_server_run(bool *done)
+{
+	while (!*done) {
+		if (metrics_server_poll(1000))
+			return 1;
+	}
+
+	return 0;
+}
+
+int metrics_textfile_write(const char *path, metrics_collect_fn fn, void *arg)
+{
+	struct mbuf mb = { .prom_text = true };
+	char tmp[PATH_MAX];
+	int rc = 1;
+	FILE *fp;
+
+	/* textfile collector may read at any time; write to a
+	 * temp file and rename so it never sees a partial file
+	 */
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid()) >= sizeof(tmp)) {
+		fprintf(stderr, "metrics file path too long\n");
+		return 1;
+	}
+
+	if (collect(&mb, fn, arg))
+		goto out;
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		fprintf(stderr, "Failed to open %s: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+	if (fwrite(mb.buf, 1, mb.len, fp) != mb.len) {
+		fprintf(stderr, "Failed to write %s\n", tmp);
+		fclose(fp);
+		unlink(tmp);
+		goto out;
+	}
+	fclose(fp);
+
+	if (rename(tmp, path)) {
+		fprintf(stderr, "Failed to rename %s to %s: %s\n",
+			tmp, path, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	rc = 0;
+out:
+	free(mb.buf);
+	return rc;
+}
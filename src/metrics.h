@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <linux/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* growable output buffer for a single scrape */
+struct mbuf {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+	bool	prom_text;  /* prometheus text format vs OpenMetrics */
+	bool	err;
+};
+
+int mbuf_printf(struct mbuf *mb, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+enum metrics_type {
+	METRICS_COUNTER,
+	METRICS_GAUGE,
+	METRICS_HISTOGRAM,
+};
+
+/* emit # TYPE and # HELP lines for a metric family */
+void metrics_family(struct mbuf *mb, const char *name, enum metrics_type type,
+		    const char *help);
+
+/* counter sample; name is the family name without _total suffix.
+ * labels is a comma separated list of label="value" pairs or NULL.
+ */
+void metrics_counter(struct mbuf *mb, const char *name, const char *labels,
+		     __u64 val);
+
+/* gauge sample; labels as for metrics_counter */
+void metrics_gauge(struct mbuf *mb, const char *name, const char *labels,
+		   double val);
+
+/* histogram sample from per-range bucket counts. le[i] is the
+ * upper bound of buckets[i]; last bucket is +Inf and has no
+ * entry in le (i.e., le has nbuckets - 1 entries). Bucket counts
+ * are made cumulative here. sum < 0 means no _sum is emitted.
+ */
+void metrics_hist(struct mbuf *mb, const char *name, const char *labels,
+		  const double *le, const __u64 *buckets, int nbuckets,
+		  double sum);
+
+/* copy src to dst escaping characters not allowed in a label value */
+char *metrics_label_escape(char *dst, size_t len, const char *src);
+
+/* called on each scrape to fill in the response */
+typedef int (*metrics_collect_fn)(struct mbuf *mb, void *arg);
+
+/* addr is [host:]port; host can be a bracketed IPv6 address */
+int metrics_server_open(const char *addr, metrics_collect_fn fn, void *arg);
+void metrics_server_close(void);
+
+/* listen socket to poll for scrape requests; -1 if not open */
+int metrics_server_fd(void);
+
+/* serve any pending scrape requests, waiting up to timeout_ms */
+int metrics_server_poll(int timeout_ms);
+
+/* serve scrape requests until *done is set */
+int metrics_server_run(bool *done);
+
+/* write metrics to a node_exporter textfile collector file */
+int metrics_textfile_write(const char *path, metrics_collect_fn fn, void *arg);
+
+#endif
@@ -1,38 +1,24 @@
 // SPDX-License-Identifier: GPL-2.0
-/* Analyze latency of the OVS.
+/* Analyze packets processed per NAPI poll.
  *
  * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
  */
 #include <linux/bpf.h>
-#include <ctype.h>
-#include <signal.h>
+#include <linux/kernel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <libgen.h>
-#include <locale.h>
 #include <bpf/bpf.h>
 
 #include "napi_poll.h"
-#include "libbpf_helpers.h"
-#include "perf_events.h"
+#include "analyzer.h"
+#include "output.h"
 #include "timestamps.h"
 
-struct data {
-	__u64 time;
-	__u32 cpu;
-};
-
-static bool done;
-
-#include "perf_events.c"
-
-static void process_event(struct data *data)
-{
-	/* nothing to do */
-}
+static __u64 prev_buckets[NAPI_BUCKETS];
+static int hist_map_fd = -1;
 
 static void dump_buckets(__u64 *buckets, __u64 *prev_buckets)
 {
@@ -48,6 +34,15 @@ static void dump_buckets(__u64 *buckets, __u64 *prev_buckets)
 		prev_buckets[i] = buckets[i];
 	}
 
+	if (!out_text()) {
+		static const char * const labels[NAPI_BUCKETS] = {
+			"0", "1", "2", "3-4", "5-8", "9-16", "17-32", "33-63", "64",
+		};
+
+		out_hist("napi_poll", labels, diff, NAPI_BUCKETS);
+		return;
+	}
+
 	printf("%s: ", timestamp(buf, sizeof(buf), 0));
 	printf("Packets processed per NAPI poll\n");
 	printf("       0 :   %'8llu\n", diff[0]);
@@ -61,9 +56,8 @@ static void dump_buckets(__u64 *buckets, __u64 *prev_buckets)
 	printf("       64:   %'8llu\n", diff[8]);
 }
 
-static int napi_poll_dump_hist(int hist_map_fd)
+static int napi_poll_dump_hist(struct analyzer *a)
 {
-	static __u64 prev_buckets[NAPI_BUCKETS];
 	struct napi_poll_hist val;
 	__u32 idx = 0;
 
@@ -73,96 +67,65 @@ static int napi_poll_dump_hist(int hist_map_fd)
 	}
 
 	dump_buckets(val.buckets, prev_buckets);
-	printf("\n");
+	if (out_text())
+		printf("\n");
 
 	return 0;
 }
 
-static void sig_handler(int signo)
-{
-	printf("Terminating by signal %d\n", signo);
-	done = true;
-}
-
-static void print_usage(char *prog)
-{
-	printf(
-	"usage: %s OPTS\n\n"
-	"	-f bpf-file    bpf filename to load\n"
-	"	-t rate        time rate (seconds) to dump stats\n"
-	, basename(prog));
-}
-
-int main(int argc, char **argv)
+static int napi_poll_metrics(struct mbuf *mb, void *arg)
 {
-	struct bpf_prog_load_attr prog_load_attr = { };
-	const char *tps[] = {
-		"napi/napi_poll",
-		NULL
-	};
-	struct napi_poll_hist hist = {};
-	char *objfile = "napi_poll.o";
-	bool filename_set = false;
-	struct bpf_object *obj;
-	int display_rate = 10;
-	struct bpf_map *map;
-	int hist_map_fd;
+	static const double le[] = { 0, 1, 2, 4, 8, 16, 32, 63 };
+	struct napi_poll_hist val;
 	__u32 idx = 0;
-	int rc, tmp;
-
-	while ((rc = getopt(argc, argv, "f:t:")) != -1)
-	{
-		switch(rc) {
-		case 'f':
-			objfile = optarg;
-			filename_set = true;
-			break;
-		case 't':
-			tmp = atoi(optarg);
-			if (!tmp) {
-				fprintf(stderr, "Invalid display rate\n");
-				return 1;
-			}
-			display_rate = tmp;
-			break;
-		default:
-			print_usage(argv[0]);
-			return 1;
-		}
-	}
 
-	if (signal(SIGINT, sig_handler) ||
-	    signal(SIGHUP, sig_handler) ||
-	    signal(SIGTERM, sig_handler)) {
-		perror("signal");
+	if (bpf_map_lookup_elem(hist_map_fd, &idx, &val)) {
+		fprintf(stderr, "Failed to get hist values\n");
 		return 1;
 	}
 
-	setlinebuf(stdout);
-	setlinebuf(stderr);
-	setlocale(LC_NUMERIC, "en_US.utf-8");
+	metrics_family(mb, "napi_poll_packets", METRICS_HISTOGRAM,
+		       "Packets processed per NAPI poll");
+	metrics_hist(mb, "napi_poll_packets", NULL, le, val.buckets,
+		     NAPI_BUCKETS, -1);
 
-	if (load_obj_file(&prog_load_attr, &obj, objfile, filename_set))
-		return 1;
+	return 0;
+}
+
+static int napi_poll_init(struct analyzer *a)
+{
+	struct napi_poll_hist hist = {};
+	__u32 idx = 0;
 
-	map = bpf_object__find_map_by_name(obj, "napi_poll_map");
-	if (!map) {
-		printf("Failed to get histogram map in obj file\n");
+	hist_map_fd = analyzer_map_fd(a, "napi_poll_map");
+	if (hist_map_fd < 0)
 		return 1;
-	}
-	hist_map_fd = bpf_map__fd(map);
 
 	/* make sure index 0 entry exists */
 	bpf_map_update_elem(hist_map_fd, &idx, &hist, BPF_ANY);
+	memset(prev_buckets, 0, sizeof(prev_buckets));
 
-	if (do_tracepoint(obj, tps))
-		return 1;
+	return 0;
+}
 
-	while (!done) {
-		sleep(display_rate);
-		if (napi_poll_dump_hist(hist_map_fd))
-			break;
-	}
+static const char *tps[] = {
+	"napi/napi_poll",
+	NULL
+};
 
-	return 0;
+struct analyzer napi_poll_analyzer = {
+	.name		= "napi_poll",
+	.desc		= "packets processed per NAPI poll",
+	.objfile	= "napi_poll.o",
+	.tps		= tps,
+	.init		= napi_poll_init,
+	.dump		= napi_poll_dump_hist,
+	.metrics	= napi_poll_metrics,
+};
+
+#ifndef ANALYZER_NO_MAIN
+int main(int argc, char **argv)
+{
+	return analyzer_main(&napi_poll_analyzer, argc, argv);
 }
+#endif
@@ -4,35 +4,21 @@
  * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
  */
 #include <linux/bpf.h>
-#include <ctype.h>
-#include <signal.h>
+#include <linux/kernel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <locale.h>
-#include <libgen.h>
 #include <bpf/bpf.h>
 
 #include "net_rx_action.h"
-#include "libbpf_helpers.h"
-#include "perf_events.h"
+#include "analyzer.h"
+#include "output.h"
 #include "timestamps.h"
 
-struct data {
-	__u64 time;
-	__u32 cpu;
-};
-
-static bool done;
-
-#include "perf_events.c"
-
-static void process_event(struct data *data)
-{
-	/* nothing to do */
-}
+static __u64 prev_buckets[NET_RX_NUM_BKTS];
+static int hist_map_fd = -1;
 
 static void dump_buckets(__u64 *buckets, __u64 *prev_buckets)
 {
@@ -49,8 +35,19 @@ static void dump_buckets(__u64 *buckets, __u64 *prev_buckets)
 		prev_buckets[i] = buckets[i];
 	}
 
+	if (!out_text()) {
+		/* upper bound of each bucket in usec */
+		static const char * const labels[NET_RX_NUM_BKTS] = {
+			"5", "10", "25", "50", "100", "500", "1000", "2000",
+			"5000", "inf", "missed",
+		};
+
+		out_hist("net_rx_action", labels, diff, NET_RX_NUM_BKTS);
+		return;
+	}
+
 	printf("%s: ", timestamp(buf, sizeof(buf), 0));
-	printf("errors: %llu\n", diff[NET_RX_ERR_BKT]);
+	printf("missed: %llu\n", diff[NET_RX_MISS_BKT]);
 	printf("          time (usec)        count\n");
 	printf("         0   - %'7u:   %'8llu\n", NET_RX_BUCKET_0, diff[0]);
 	printf("   %'7u+  - %'7u:   %'8llu\n", NET_RX_BUCKET_0, NET_RX_BUCKET_1, diff[1]);
@@ -64,9 +61,8 @@ static void dump_buckets(__u64 *buckets, __u64 *prev_buckets)
 	printf("   %'7u+  -      up:   %'8llu\n", NET_RX_BUCKET_8, diff[9]);
 }
 
-static int net_rx_dump_hist(int hist_map_fd)
+static int net_rx_dump_hist(struct analyzer *a)
 {
-	static __u64 prev_buckets[NET_RX_NUM_BKTS];
 	struct net_rx_hist_val val;
 	__u32 idx = 0;
 
@@ -76,100 +72,77 @@ static int net_rx_dump_hist(int hist_map_fd)
 	}
 
 	dump_buckets(val.buckets, prev_buckets);
-	printf("\n");
+	if (out_text())
+		printf("\n");
 
 	return 0;
 }
 
-static void sig_handler(int signo)
+static int net_rx_metrics(struct mbuf *mb, void *arg)
 {
-	printf("Terminating by signal %d\n", signo);
-	done = true;
-}
-
-static void print_usage(char *prog)
-{
-	printf(
-	"usage: %s OPTS\n\n"
-	"	-f bpf-file    bpf filename to load\n"
-	"	-t rate        time rate (seconds) to dump stats\n"
-	, basename(prog));
-}
-
-int main(int argc, char **argv)
-{
-	struct bpf_prog_load_attr prog_load_attr = { };
-	struct net_rx_hist_val hist2 = {};
-	char *objfile = "net_rx_action.o";
-	struct kprobe_data probes[] = {
-		{ .func = "net_rx_action", .fd = -1 },
-		{ .func = "net_rx_action", .fd = -1, .retprobe = true },
+	static const double le[] = {
+		NET_RX_BUCKET_0 / 1e6, NET_RX_BUCKET_1 / 1e6,
+		NET_RX_BUCKET_2 / 1e6, NET_RX_BUCKET_3 / 1e6,
+		NET_RX_BUCKET_4 / 1e6, NET_RX_BUCKET_5 / 1e6,
+		NET_RX_BUCKET_6 / 1e6, NET_RX_BUCKET_7 / 1e6,
+		NET_RX_BUCKET_8 / 1e6,
 	};
-	bool filename_set = false;
-	struct bpf_object *obj;
-	int display_rate = 10;
-	struct bpf_map *map;
-	int hist_map_fd;
+	struct net_rx_hist_val val;
 	__u32 idx = 0;
-	int rc, tmp;
-
-	while ((rc = getopt(argc, argv, "f:t:")) != -1)
-	{
-		switch(rc) {
-		case 'f':
-			objfile = optarg;
-			filename_set = true;
-			break;
-		case 't':
-			tmp = atoi(optarg);
-			if (!tmp) {
-				fprintf(stderr, "Invalid display rate\n");
-				return 1;
-			}
-			display_rate = tmp;
-			break;
-		default:
-			print_usage(argv[0]);
-			return 1;
-		}
-	}
 
-	if (signal(SIGINT, sig_handler) ||
-	    signal(SIGHUP, sig_handler) ||
-	    signal(SIGTERM, sig_handler)) {
-		perror("signal");
+	if (bpf_map_lookup_elem(hist_map_fd, &idx, &val)) {
+		fprintf(stderr, "Failed to get hist values\n");
 		return 1;
 	}
 
-	setlinebuf(stdout);
-	setlinebuf(stderr);
-	setlocale(LC_NUMERIC, "en_US.utf-8");
+	metrics_family(mb, "net_rx_action_seconds", METRICS_HISTOGRAM,
+		       "Time to run net_rx_action");
+	metrics_hist(mb, "net_rx_action_seconds", NULL, le, val.buckets,
+		     NET_RX_MISS_BKT, -1);
 
-	if (load_obj_file(&prog_load_attr, &obj, objfile, filename_set))
-		return 1;
+	metrics_family(mb, "net_rx_action_missed", METRICS_COUNTER,
+		       "net_rx_action calls not timed");
+	metrics_counter(mb, "net_rx_action_missed", NULL,
+			val.buckets[NET_RX_MISS_BKT]);
+
+	return 0;
+}
+
+static int net_rx_init(struct analyzer *a)
+{
+	struct net_rx_hist_val hist = {};
+	__u32 idx = 0;
 
-	map = bpf_object__find_map_by_name(obj, "net_rx_map");
-	if (!map) {
-		printf("Failed to get histogram map in obj file\n");
+	hist_map_fd = analyzer_map_fd(a, "net_rx_map");
+	if (hist_map_fd < 0)
 		return 1;
-	}
-	hist_map_fd = bpf_map__fd(map);
 
 	/* make sure index 0 entry exists */
-	bpf_map_update_elem(hist_map_fd, &idx, &hist2, BPF_ANY);
+	bpf_map_update_elem(hist_map_fd, &idx, &hist, BPF_ANY);
+	memset(prev_buckets, 0, sizeof(prev_buckets));
 
-	rc = 1;
-	if (kprobe_init(obj, probes, ARRAY_SIZE(probes)))
-		goto out;
+	return 0;
+}
 
-	rc = 0;
-	while (!done) {
-		sleep(display_rate);
-		if (net_rx_dump_hist(hist_map_fd))
-			break;
-	}
-out:
-	kprobe_cleanup(probes, ARRAY_SIZE(probes));
+static struct kprobe_data probes[] = {
+	{ .func = "net_rx_action", .fd = -1 },
+	{ .func = "net_rx_action", .fd = -1, .retprobe = true },
+};
 
-	return rc;
+struct analyzer net_rx_action_analyzer = {
+	.name		= "net_rx_action",
+	.desc		= "time to run net_rx_action",
+	.objfile	= "net_rx_action.o",
+	.probes		= probes,
+	.nprobes	= ARRAY_SIZE(probes),
+	.init		= net_rx_init,
+	.dump		= net_rx_dump_hist,
+	.metrics	= net_rx_metrics,
+};
+
+#ifndef ANALYZER_NO_MAIN
+int main(int argc, char **argv)
+{
+	return analyzer_main(&net_rx_action_analyzer, argc, argv);
 }
+#endif
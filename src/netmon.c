@@ -6,6 +6,7 @@
  * Copyright (c) 2019-2020 David Ahern <dsahern@gmail.com>
  */
 #include <linux/bpf.h>
+#include <linux/list.h>
 #include <linux/if_arp.h>
 #include <linux/ipv6.h>
 #include <netinet/ip.h>
@@ -19,6 +20,7 @@
 #include <errno.h>
 #include <libgen.h>
 #include <locale.h>
+#include <unistd.h>
 #define PCAP_DONT_INCLUDE_PCAP_BPF_H
 #include <pcap.h>
 
@@ -28,12 +30,11 @@
 #include "flow.h"
 #include "libbpf_helpers.h"
 #include "ksyms.h"
+#include "output.h"
 #include "perf_events.h"
 #include "str_utils.h"
 #include "timestamps.h"
 
-#include "perf_events.c"
-
 static __u64 display_rate = 10;
 static bool update_display;
 static unsigned int drop_thresh = 1;
@@ -844,6 +845,40 @@ static struct ksym_s *find_ksym_droph(unsigned long addr)
 	return sym;
 }
 
+static void out_packet(struct data *data, struct ksym_s *sym)
+{
+	__u8 pkt_type = data->pkt_type & PKT_TYPE_MAX;
+	struct ksym_s *symns;
+	char buf[128];
+
+	out_begin();
+	out_u64("time", timestamp_ns(data->time));
+	out_u64("cpu", data->cpu);
+	out_u64("ifindex", data->ifindex);
+	out_str("type", drop_by_type_str[pkt_type]);
+
+	symns = find_ksym_droph(data->netns);
+	if (symns)
+		out_str("netns", symns->name);
+	else
+		out_hex("netns", data->netns);
+
+	out_u64("len", data->pkt_len);
+	out_u64("nr_frags", data->nr_frags);
+	out_u64("gso_size", data->gso_size);
+
+	if (sym) {
+		snprintf(buf, sizeof(buf), "%s+0x%llx", sym->name,
+			 data->location - sym->addr);
+		out_str("location", buf);
+	} else {
+		out_hex("location", data->location);
+	}
+	out_hex("protocol", ntohs(data->protocol));
+	out_u64("vlan", data->vlan_tci);
+	out_end();
+}
+
 static void show_packet(struct data *data, struct ksym_s *sym)
 {
 	__u8 pkt_type = data->pkt_type & PKT_TYPE_MAX;
@@ -896,12 +931,7 @@ static void show_packet(struct data *data, struct ksym_s *sym)
 	printf("\n");
 }
 
-static void process_event(struct data *data)
-{
-	/* nothing to do */
-}
-
-static int handle_bpf_output(void *_data, int size)
+static int handle_bpf_output(void *ctx, void *_data, int size)
 {
 	struct data *data = _data;
 	struct ksym_s *sym;
@@ -926,6 +956,8 @@ static int handle_bpf_output(void *_data, int size)
 		total_pkts++;
 		if (do_hist)
 			process_packet(data, sym);
+		else if (!out_text())
+			out_packet(data, sym);
 		else
 			show_packet(data, sym);
 		break;
@@ -942,9 +974,11 @@ out:
 	return LIBBPF_PERF_EVENT_CONT;
 }
 
-static int pktdrop_complete(void)
+static int pktdrop_complete(void *arg)
 {
-	process_events();
+	/* one write per round */
+	if (out_flush())
+		return 1;
 
 	if (do_hist && update_display) {
 		show_hist();
@@ -1000,6 +1034,7 @@ static void print_dropmon_usage(const char *prog)
 	"usage: %s OPTS\n\n"
 	"	-c count       Number of packets analyze\n"
 	"	-f bpf-file    bpf filename to load\n"
+	"	-F format      packet output format: text (default), json or csv\n"
 	"	-k kallsyms    load kernel symbols from this file\n"
 	"	-m count       set number of pages in perf buffers\n"
 	"	-o             only track ovs upcalls\n"
@@ -1025,12 +1060,17 @@ static int drop_monitor(const char *prog, int argc, char **argv)
 		"skb/kfree_skb",
 		NULL,
 	};
+	struct perf_channel_opts opts = {
+		PERF_CHANNEL_UNSORTED(struct data),
+		.handler = handle_bpf_output,
+		.nevents = 1000,
+		.cpu = -1,
+	};
+	struct perf_channel *ch = NULL;
 	struct bpf_object *obj;
-	int nevents = 1000;
-	int pg_cnt = 0;
 	int rc, r;
 
-	while ((rc = getopt(argc, argv, "c:f:k:m:oOr:s:t:TU")) != -1)
+	while ((rc = getopt(argc, argv, "c:f:F:k:m:oOr:s:t:TU")) != -1)
 	{
 		switch(rc) {
 		case 'c':
@@ -1044,11 +1084,15 @@ static int drop_monitor(const char *prog, int argc, char **argv)
 			objfile = optarg;
 			filename_set = true;
 			break;
+		case 'F':
+			if (out_set_format(optarg))
+				return 1;
+			break;
 		case 'k':
 			kallsyms = optarg;
 			break;
 		case 'm':
-			if (str_to_int(optarg, 64, 32768, &pg_cnt)) {
+			if (str_to_int(optarg, 64, 32768, &opts.page_cnt)) {
 				fprintf(stderr, "Invalid page count\n");
 				return 1;
 			}
@@ -1091,9 +1135,6 @@ static int drop_monitor(const char *prog, int argc, char **argv)
 		}
 	}
 
-	if (pg_cnt)
-		perf_set_page_cnt(pg_cnt);
-
 	if (set_reftime())
 		return 1;
 
@@ -1129,16 +1170,18 @@ static int drop_monitor(const char *prog, int argc, char **argv)
 		break;
 	}
 
-	if (configure_perf_event_channel(obj, nevents))
+	ch = perf_channel_open(obj, &opts);
+	if (!ch)
 		goto out;
 
 	if (do_hist)
 		alarm(display_rate);
 
 	/* main event loop */
-	rc = perf_event_loop(handle_bpf_output, NULL, pktdrop_complete);
+	rc = perf_event_loop(&ch, 1, NULL, pktdrop_complete, NULL);
+	out_flush();
 out:
-	close_perf_event_channel();
+	perf_channel_close(ch);
 	kprobe_cleanup(probes, ARRAY_SIZE(probes));
 	return rc;
 }
@@ -22,8 +22,6 @@
 #include "perf_events.h"
 #include "timestamps.h"
 
-#include "perf_events.c"
-
 static bool print_time = true;
 static bool print_dt;
 static bool done;
@@ -99,7 +97,7 @@ static void show_timestamps(__u64 start, __u64 end)
 	printf("  ");
 }
 
-static int print_bpf_output(void *_data, int size)
+static int print_bpf_output(void *ctx, void *_data, int size)
 {
 	struct data *data = _data;
 	struct task *task;
@@ -129,12 +127,7 @@ out:
 	return LIBBPF_PERF_EVENT_CONT;
 }
 
-static void process_event(struct data *data)
-{
-	/* nothing to do */
-}
-
-static int opensnoop_complete(void)
+static int opensnoop_complete(void *arg)
 {
 	return done;
 }
@@ -156,8 +149,14 @@ int main(int argc, char **argv)
 		{ .func = "do_sys_open", .fd = -1 },
 		{ .func = "do_sys_open", .fd = -1, .retprobe = true },
 	};
+	struct perf_channel_opts opts = {
+		PERF_CHANNEL_UNSORTED(struct data),
+		.handler = print_bpf_output,
+		.nevents = 1000,
+		.cpu = -1,
+	};
+	struct perf_channel *ch = NULL;
 	struct bpf_object *obj;
-	int nevents = 1000;
 	int rc;
 
 	if (argc > 1) {
@@ -186,15 +185,16 @@ int main(int argc, char **argv)
 	if (kprobe_init(obj, probes, ARRAY_SIZE(probes)))
 		goto out;
 
-	if (configure_perf_event_channel(obj, nevents))
+	ch = perf_channel_open(obj, &opts);
+	if (!ch)
 		goto out;
 
 	print_header();
 
 	/* main event loop */
-	rc = perf_event_loop(print_bpf_output, NULL, opensnoop_complete);
+	rc = perf_event_loop(&ch, 1, NULL, opensnoop_complete, NULL);
 out:
-	close_perf_event_channel();
+	perf_channel_close(ch);
 	kprobe_cleanup(probes, ARRAY_SIZE(probes));
 
 	return rc;
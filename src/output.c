@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Newline delimited JSON and CSV encoder for event and histogram
+ * output. Everything is formatted into fixed buffers allocated at
+ * start; the only syscall is the write() of a full batch.
+ *
+ * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
+ */
+#include <sys/time.h>
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "output.h"
+#include "timestamps.h"
+
+#define OUT_BATCH_SIZE	(256 * 1024)
+#define OUT_REC_SIZE	8192
+#define OUT_KEYS_SIZE	2048
+
+enum out_format out_format = OUT_TEXT;
+
+/* completed records waiting for write() */
+static char batch[OUT_BATCH_SIZE];
+static size_t batch_len;
+
+/* record being built and, for CSV, its field names */
+static char rec[OUT_REC_SIZE];
+static size_t rec_len;
+static char keys[OUT_KEYS_SIZE];
+static size_t keys_len;
+static char last_keys[OUT_KEYS_SIZE];
+static size_t last_keys_len;
+static bool rec_trunc;
+static int nfields;
+
+static unsigned long truncated;
+
+int out_set_format(const char *name)
+{
+	if (!strcmp(name, "text"))
+		out_format = OUT_TEXT;
+	else if (!strcmp(name, "json"))
+		out_format = OUT_JSON;
+	else if (!strcmp(name, "csv"))
+		out_format = OUT_CSV;
+	else {
+		fprintf(stderr, "Invalid output format \"%s\"\n", name);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void append(char *buf, size_t *len, size_t size,
+		   const char *s, size_t n)
+{
+	if (*len + n >= size) {
+		rec_trunc = true;
+		return;
+	}
+	memcpy(buf + *len, s, n);
+	*len += n;
+}
+
+static void rec_add(const char *s, size_t n)
+{
+	append(rec, &rec_len, sizeof(rec), s, n);
+}
+
+/* JSON string escaping; CSV quoting doubles the quote character */
+static void rec_add_str(const char *s)
+{
+	char esc[8];
+
+	rec_add("\"", 1);
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (out_format == OUT_CSV) {
+			if (c == '"')
+				rec_add("\"\"", 2);
+			else
+				rec_add(s, 1);
+			continue;
+		}
+
+		switch (c) {
+		case '"':
+			rec_add("\\\"", 2);
+			break;
+		case '\\':
+			rec_add("\\\\", 2);
+			break;
+		case '\n':
+			rec_add("\\n", 2);
+			break;
+		case '\t':
+			rec_add("\\t", 2);
+			break;
+		default:
+			if (c < 0x20) {
+				snprintf(esc, sizeof(esc), "\\u%04x", c);
+				rec_add(esc, 6);
+			} else {
+				rec_add(s, 1);
+			}
+		}
+	}
+	rec_add("\"", 1);
+}
+
+static void add_key(const char *key)
+{
+	if (out_format == OUT_CSV) {
+		if (nfields)
+			append(keys, &keys_len, sizeof(keys), ",", 1);
+		append(keys, &keys_len, sizeof(keys), key, strlen(key));
+		if (nfields)
+			rec_add(",", 1);
+	} else {
+		rec_add(nfields ? ",\"" : "\"", nfields ? 2 : 1);
+		rec_add(key, strlen(key));
+		rec_add("\":", 2);
+	}
+	nfields++;
+}
+
+void out_begin(void)
+{
+	rec_len = 0;
+	keys_len = 0;
+	nfields = 0;
+	rec_trunc = false;
+
+	if (out_format == OUT_JSON)
+		rec_add("{", 1);
+}
+
+void out_str(const char *key, const char *val)
+{
+	add_key(key);
+	rec_add_str(val ? : "");
+}
+
+void out_u64(const char *key, __u64 val)
+{
+	char buf[24];
+	int n;
+
+	add_key(key);
+	n = snprintf(buf, sizeof(buf), "%llu", val);
+	rec_add(buf, n);
+}
+
+void out_s64(const char *key, __s64 val)
+{
+	char buf[24];
+	int n;
+
+	add_key(key);
+	n = snprintf(buf, sizeof(buf), "%lld", val);
+	rec_add(buf, n);
+}
+
+void out_hex(const char *key, __u64 val)
+{
+	char buf[24];
+
+	snprintf(buf, sizeof(buf), "0x%llx", val);
+	out_str(key, buf);
+}
+
+void out_buckets(const char * const *labels, const __u64 *vals, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		out_u64(labels[i], vals[i]);
+}
+
+void out_hist(const char *name, const char * const *labels,
+	      const __u64 *vals, int n)
+{
+	out_begin();
+	out_u64("time", timestamp_ns(0));
+	out_str("hist", name);
+	out_buckets(labels, vals, n);
+	out_end();
+}
+
+static int batch_write(void)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < batch_len) {
+		n = write(STDOUT_FILENO, batch + off, batch_len - off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to write output: %s\n",
+				strerror(errno));
+			batch_len = 0;
+			return 1;
+		}
+		off += n;
+	}
+	batch_len = 0;
+
+	return 0;
+}
+
+static void batch_add(const char *s, size_t n)
+{
+	if (batch_len + n > sizeof(batch))
+		batch_write();
+	memcpy(batch + batch_len, s, n);
+	batch_len += n;
+}
+
+void out_end(void)
+{
+	if (out_format == OUT_JSON)
+		rec_add("}", 1);
+	rec_add("\n", 1);
+
+	if (rec_trunc) {
+		if (!truncated++)
+			fprintf(stderr, "Output record too long; dropped\n");
+		return;
+	}
+
+	if (out_format == OUT_CSV &&
+	    (keys_len != last_keys_len ||
+	     memcmp(keys, last_keys, keys_len))) {
+		memcpy(last_keys, keys, keys_len);
+		last_keys_len = keys_len;
+		batch_add(keys, keys_len);
+		batch_add("\n", 1);
+	}
+
+	batch_add(rec, rec_len);
+}
+
+int out_flush(void)
+{
+	if (out_format == OUT_TEXT || !batch_len)
+		return 0;
+
+	return batch_write();
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+#include <linux/types.h>
+#include <stdbool.h>
+
+/* Streaming record encoder for machine readable output. Records are
+ * built with out_begin, out_<type> per field and out_end and are
+ * accumulated in a preallocated batch buffer that is written to
+ * stdout with a single write() by out_flush (or when it fills up).
+ *
+ * JSON output is one object per line. CSV output emits a header line
+ * with the field names before the first record and again whenever
+ * the set of fields changes.
+ */
+enum out_format {
+	OUT_TEXT,	/* command's own printf output */
+	OUT_JSON,
+	OUT_CSV,
+};
+
+extern enum out_format out_format;
+
+/* "text", "json" or "csv" */
+int out_set_format(const char *name);
+
+static inline bool out_text(void)
+{
+	return out_format == OUT_TEXT;
+}
+
+void out_begin(void);
+void out_str(const char *key, const char *val);
+void out_u64(const char *key, __u64 val);
+void out_s64(const char *key, __s64 val);
+void out_hex(const char *key, __u64 val);
+/* one field per histogram bucket named by labels[i] */
+void out_buckets(const char * const *labels, const __u64 *vals, int n);
+void out_end(void);
+
+/* complete record for a histogram: time, hist name and buckets */
+void out_hist(const char *name, const char * const *labels,
+	      const __u64 *vals, int n);
+
+int out_flush(void);
+
+#endif
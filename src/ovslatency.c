@@ -1,41 +1,170 @@
 // SPDX-License-Identifier: GPL-2.0
-/* Analyze latency of the OVS.
+/* Analyze latency of the OVS per ingress vport.
  *
  * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
  */
 #include <linux/bpf.h>
-#include <ctype.h>
-#include <signal.h>
+#include <linux/kernel.h>
+#include <net/if.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <libgen.h>
-#include <locale.h>
 #include <bpf/bpf.h>
 
 #include "ovslatency.h"
+#include "analyzer.h"
 #include "libbpf_helpers.h"
-#include "perf_events.h"
+#include "output.h"
 #include "timestamps.h"
 
-struct data {
-	__u64 time;
-	__u32 cpu;
+/* upper bound of each bucket in usec; last is unbounded */
+static const unsigned int bucket_max[7] = {
+	OVS_BUCKET_0, OVS_BUCKET_1, OVS_BUCKET_2, OVS_BUCKET_3,
+	OVS_BUCKET_4, OVS_BUCKET_5, 0,
 };
 
-static bool done;
+struct ovslat_port {
+	struct ovslat_key key;
+	__u64 buckets[8];
+	__u64 prev_buckets[8];
+	bool seen;
+};
+
+static struct ovslat_port ports[OVSLAT_MAP_ENTRIES];
+static unsigned int nports;
+static bool by_upcall;
+static int hist_map_fd = -1;
+
+static const char *err_names[OVSLAT_ERR_MAX] = {
+	[OVSLAT_ERR_OVERFLOW]	= "overflow",
+	[OVSLAT_ERR_STALE]	= "stale",
+};
 
-#include "perf_events.c"
+static __u64 errs[OVSLAT_ERR_MAX];
+static __u64 prev_errs[OVSLAT_ERR_MAX];
+static int err_map_fd = -1;
 
-static void process_event(struct data *data)
+static struct ovslat_port *get_port(const struct ovslat_key *key)
 {
-	/* nothing to do */
+	unsigned int i;
+
+	for (i = 0; i < nports; i++) {
+		if (ports[i].key.ifindex == key->ifindex &&
+		    ports[i].key.upcall == key->upcall)
+			return &ports[i];
+	}
+
+	if (nports == OVSLAT_MAP_ENTRIES)
+		return NULL;
+
+	memset(&ports[nports], 0, sizeof(ports[nports]));
+	ports[nports].key = *key;
+
+	return &ports[nports++];
 }
 
-static void dump_buckets(__u64 *buckets, __u64 *prev_buckets)
+static int read_port(const void *_key, const void *value, void *arg)
 {
+	const struct ovslat_hist_val *val = value;
+	struct ovslat_key key;
+	struct ovslat_port *p;
+	int i;
+
+	memcpy(&key, _key, sizeof(key));
+
+	/* without upcall tracking the flag is always 0 */
+	if (!by_upcall)
+		key.upcall = 0;
+
+	p = get_port(&key);
+	if (!p)
+		return 0;
+
+	if (!p->seen)
+		memset(p->buckets, 0, sizeof(p->buckets));
+	p->seen = true;
+
+	for (i = 0; i < 8; i++)
+		p->buckets[i] += val->buckets[i];
+
+	return 0;
+}
+
+static int read_ports(void)
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < nports; i++)
+		ports[i].seen = false;
+
+	err = bpf_map_walk(hist_map_fd, read_port, NULL, false);
+	if (err) {
+		fprintf(stderr, "Failed to get hist values\n");
+		return 1;
+	}
+
+	for (i = 0; i < OVSLAT_ERR_MAX; i++) {
+		if (bpf_map_lookup_elem(err_map_fd, &i, &errs[i])) {
+			fprintf(stderr, "Failed to get error counters\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* estimate percentile pct (0-100) in usec assuming packets are
+ * spread evenly within a bucket. Returns 0 for no packets and
+ * UINT_MAX if it falls in the last, unbounded bucket.
+ */
+static unsigned int percentile(const __u64 *diff, __u64 total,
+			       unsigned int pct)
+{
+	__u64 rank, sum = 0;
+	unsigned int lo = 0;
+	int i;
+
+	if (!total)
+		return 0;
+
+	rank = (total * pct + 99) / 100;
+	for (i = 0; i < 6; i++) {
+		if (sum + diff[i] >= rank)
+			return lo + (bucket_max[i] - lo) *
+				    (rank - sum) / diff[i];
+		sum += diff[i];
+		lo = bucket_max[i];
+	}
+
+	return UINT_MAX;
+}
+
+static void print_pct(const char *name, unsigned int usecs)
+{
+	if (usecs == UINT_MAX)
+		printf(" %s >%u", name, OVS_BUCKET_5);
+	else
+		printf(" %s %u", name, usecs);
+}
+
+static void port_name(const struct ovslat_key *key, char *buf, int len)
+{
+	char dev[IFNAMSIZ];
+
+	if (!if_indextoname(key->ifindex, dev))
+		snprintf(dev, sizeof(dev), "-");
+
+	snprintf(buf, len, "%s/%u%s", dev, key->ifindex,
+		 by_upcall ? (key->upcall ? " upcall" : " fastpath") : "");
+}
+
+static void dump_buckets(struct ovslat_port *p)
+{
+	unsigned int p50, p90, p99;
 	__u64 diff[8];
 	char buf[64];
 	int i;
@@ -44,18 +173,45 @@ static void dump_buckets(__u64 *buckets, __u64 *prev_buckets)
 	 * new sample as old
 	 */
 	for (i = 0; i < 8; ++i) {
-		diff[i] = buckets[i] - prev_buckets[i];
+		diff[i] = p->buckets[i] - p->prev_buckets[i];
 
-		prev_buckets[i] = buckets[i];
+		p->prev_buckets[i] = p->buckets[i];
 	}
 
-	printf("%s: ", timestamp(buf, sizeof(buf), 0));
-	if (diff[7] == 0) {
-		printf("No packets\n");
+	p50 = percentile(diff, diff[7], 50);
+	p90 = percentile(diff, diff[7], 90);
+	p99 = percentile(diff, diff[7], 99);
+
+	if (!out_text()) {
+		/* upper bound of each bucket in usec */
+		static const char * const labels[8] = {
+			"10", "25", "50", "100", "250", "500", "inf", "total",
+		};
+
+		out_begin();
+		out_u64("time", timestamp_ns(0));
+		out_str("hist", "ovslatency");
+		out_u64("ifindex", p->key.ifindex);
+		if (by_upcall)
+			out_u64("upcall", p->key.upcall);
+		out_buckets(labels, diff, 8);
+		/* UINT_MAX means in the unbounded bucket */
+		out_u64("p50", p50);
+		out_u64("p90", p90);
+		out_u64("p99", p99);
+		out_end();
 		return;
 	}
 
-	printf("total number of packets %llu:\n", diff[7]);
+	if (diff[7] == 0)
+		return;
+
+	port_name(&p->key, buf, sizeof(buf));
+	printf("%s: total number of packets %llu, usec", buf, diff[7]);
+	print_pct("p50", p50);
+	print_pct("p90", p90);
+	print_pct("p99", p99);
+	printf(":\n");
 	printf("    time (usec)        count\n");
 	printf("       0  - %4u:   %'8llu\n", OVS_BUCKET_0, diff[0]);
 	printf("   %4u+  - %4u:   %'8llu\n", OVS_BUCKET_0, OVS_BUCKET_1, diff[1]);
@@ -66,112 +222,151 @@ static void dump_buckets(__u64 *buckets, __u64 *prev_buckets)
 	printf("   %4u+  -   up:   %'8llu\n", OVS_BUCKET_5, diff[6]);
 }
 
-static int ovslat_dump_hist(int hist_map_fd)
+/* calls not timed since the last dump */
+static void dump_errors(void)
 {
-	static __u64 prev_buckets[8];
-	struct ovslat_hist_val val;
-	__u32 idx = 0;
+	__u64 diff[OVSLAT_ERR_MAX];
+	int i;
 
-	if (bpf_map_lookup_elem(hist_map_fd, &idx, &val)) {
-		fprintf(stderr, "Failed to get hist values\n");
-		return 1;
+	for (i = 0; i < OVSLAT_ERR_MAX; i++) {
+		diff[i] = errs[i] - prev_errs[i];
+		prev_errs[i] = errs[i];
 	}
 
-	dump_buckets(val.buckets, prev_buckets);
-	printf("\n");
+	if (!out_text()) {
+		out_begin();
+		out_u64("time", timestamp_ns(0));
+		out_str("hist", "ovslatency_untimed");
+		for (i = 0; i < OVSLAT_ERR_MAX; i++)
+			out_u64(err_names[i], diff[i]);
+		out_end();
+		return;
+	}
 
-	return 0;
+	if (diff[OVSLAT_ERR_OVERFLOW] || diff[OVSLAT_ERR_STALE])
+		printf("not timed: nested too deep %llu, missed returns %llu\n",
+		       diff[OVSLAT_ERR_OVERFLOW], diff[OVSLAT_ERR_STALE]);
 }
 
-static void sig_handler(int signo)
+static int ovslat_dump_hist(struct analyzer *a)
 {
-	printf("Terminating by signal %d\n", signo);
-	done = true;
-}
+	char buf[64];
+	unsigned int i;
 
-static void print_usage(char *prog)
-{
-	printf(
-	"usage: %s OPTS\n\n"
-	"	-f bpf-file    bpf filename to load\n"
-	"	-t rate        time rate (seconds) to dump stats\n"
-	, basename(prog));
+	if (read_ports())
+		return 1;
+
+	if (out_text())
+		printf("%s:\n", timestamp(buf, sizeof(buf), 0));
+
+	for (i = 0; i < nports; i++) {
+		if (ports[i].seen)
+			dump_buckets(&ports[i]);
+	}
+
+	dump_errors();
+
+	if (out_text())
+		printf("\n");
+
+	return 0;
 }
 
-int main(int argc, char **argv)
+static int ovslat_metrics(struct mbuf *mb, void *arg)
 {
-	struct bpf_prog_load_attr prog_load_attr = { };
-	struct ovslat_hist_val hist2 = {};
-	char *objfile = "ovslatency.o";
-	struct kprobe_data probes[] = {
-		{ .func = "ovs_vport_receive", .fd = -1 },
-		{ .func = "ovs_vport_receive", .fd = -1, .retprobe = true },
+	static const double le[] = {
+		OVS_BUCKET_0 / 1e6, OVS_BUCKET_1 / 1e6, OVS_BUCKET_2 / 1e6,
+		OVS_BUCKET_3 / 1e6, OVS_BUCKET_4 / 1e6, OVS_BUCKET_5 / 1e6,
 	};
-	bool filename_set = false;
-	struct bpf_object *obj;
-	int display_rate = 10;
-	struct bpf_map *map;
-	int hist_map_fd;
-	__u32 idx = 0;
-	int rc, tmp;
-
-	while ((rc = getopt(argc, argv, "f:t:")) != -1)
-	{
-		switch(rc) {
-		case 'f':
-			objfile = optarg;
-			filename_set = true;
-			break;
-		case 't':
-			tmp = atoi(optarg);
-			if (!tmp) {
-				fprintf(stderr, "Invalid display rate\n");
-				return 1;
-			}
-			display_rate = tmp;
-			break;
-		default:
-			print_usage(argv[0]);
-			return 1;
-		}
-	}
+	char labels[128], dev[IFNAMSIZ];
+	struct ovslat_port *p;
+	unsigned int i;
 
-	if (signal(SIGINT, sig_handler) ||
-	    signal(SIGHUP, sig_handler) ||
-	    signal(SIGTERM, sig_handler)) {
-		perror("signal");
+	if (read_ports())
 		return 1;
+
+	metrics_family(mb, "ovslatency_vport_receive_seconds",
+		       METRICS_HISTOGRAM, "Time to run ovs_vport_receive");
+	for (i = 0; i < nports; i++) {
+		p = &ports[i];
+		if (!p->seen)
+			continue;
+
+		if (!if_indextoname(p->key.ifindex, dev))
+			snprintf(dev, sizeof(dev), "-");
+
+		if (by_upcall)
+			snprintf(labels, sizeof(labels),
+				 "ifindex=\"%u\",dev=\"%s\",upcall=\"%u\"",
+				 p->key.ifindex, dev, p->key.upcall);
+		else
+			snprintf(labels, sizeof(labels),
+				 "ifindex=\"%u\",dev=\"%s\"",
+				 p->key.ifindex, dev);
+
+		metrics_hist(mb, "ovslatency_vport_receive_seconds", labels,
+			     le, p->buckets, 7, -1);
 	}
 
-	setlinebuf(stdout);
-	setlinebuf(stderr);
-	setlocale(LC_NUMERIC, "en_US.utf-8");
+	metrics_family(mb, "ovslatency_untimed", METRICS_COUNTER,
+		       "Calls to ovs_vport_receive that were not timed");
+	for (i = 0; i < OVSLAT_ERR_MAX; i++) {
+		snprintf(labels, sizeof(labels), "reason=\"%s\"",
+			 err_names[i]);
+		metrics_counter(mb, "ovslatency_untimed", labels, errs[i]);
+	}
 
-	if (load_obj_file(&prog_load_attr, &obj, objfile, filename_set))
-		return 1;
+	return 0;
+}
 
-	map = bpf_object__find_map_by_name(obj, "ovslat_map");
-	if (!map) {
-		printf("Failed to get histogram map in obj file\n");
+static int ovslat_init(struct analyzer *a)
+{
+	hist_map_fd = analyzer_map_fd(a, "ovslat_map");
+	err_map_fd = analyzer_map_fd(a, "ovslat_err_map");
+	if (hist_map_fd < 0 || err_map_fd < 0)
 		return 1;
-	}
-	hist_map_fd = bpf_map__fd(map);
 
-	/* make sure index 0 entry exists */
-	bpf_map_update_elem(hist_map_fd, &idx, &hist2, BPF_ANY);
+	nports = 0;
+	memset(prev_errs, 0, sizeof(prev_errs));
+
+	return 0;
+}
 
-	rc = 1;
-	if (kprobe_init(obj, probes, ARRAY_SIZE(probes)))
-		goto out;
+static struct kprobe_data probes[] = {
+	{ .func = "ovs_vport_receive", .fd = -1 },
+	{ .func = "ovs_vport_receive", .fd = -1, .retprobe = true },
+	{ .func = "ovs_dp_upcall", .fd = -1 },
+};
 
-	rc = 0;
-	while (!done) {
-		sleep(display_rate);
-		if (ovslat_dump_hist(hist_map_fd))
-			break;
+static int ovslat_parse_opt(struct analyzer *a, int opt, const char *arg)
+{
+	switch (opt) {
+	case 'u':
+		by_upcall = true;
+		a->nprobes = ARRAY_SIZE(probes);
+		return 0;
 	}
 
-out:	
-	kprobe_cleanup(probes, ARRAY_SIZE(probes));
-	return rc;
+	return 1;
+}
+
+struct analyzer ovslatency_analyzer = {
+	.name		= "ovslatency",
+	.desc		= "time to run ovs_vport_receive",
+	.objfile	= "ovslatency.o",
+	.probes		= probes,
+	.nprobes	= 2,	/* upcall probe only with -u */
+	.optstr		= "u",
+	.usage		= "	-u             separate packets that went to userspace (upcall)\n",
+	.parse_opt	= ovslat_parse_opt,
+	.init		= ovslat_init,
+	.dump		= ovslat_dump_hist,
+	.metrics	= ovslat_metrics,
+};
+
+#ifndef ANALYZER_NO_MAIN
+int main(int argc, char **argv)
+{
+	return analyzer_main(&ovslatency_analyzer, argc, argv);
 }
+#endif
@@ -11,32 +11,46 @@
 #include <linux/rbtree.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/syscall.h>
-#include <sys/sysinfo.h>
-#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
-#include <limits.h>
-#include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
-#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <bpf/bpf.h>
 
 #include "perf_events.h"
+#include "timestamps.h"
+
+/* one PERF_EVENT_ARRAY map and the perf buffers backing it */
+struct perf_channel {
+	struct perf_channel_opts opts;
+
+	int			ncpus;		/* possible cpus covered by the map */
+	int			nbufs;		/* buffer slots; indexed by cpu */
+	int			map_fd;
+	int			cur_buf;	/* buffer being read */
+	int			*pmu_fds;
+	struct perf_event_mmap_page **headers;
+	int			page_size;
+	size_t			mmap_size;
+
+	/* time sorted list of events */
+	struct rb_root		events;
+	/* start of the last round; events before it are processed */
+	__u64			round_time;
+	/* with a reorder window: per buffer, time up to which all
+	 * events from that cpu are known to have been read
+	 */
+	__u64			*watermarks;
+	unsigned int		backlog;
 
-static const char *tracingfs = "/sys/kernel/debug/tracing";
-static int numcpus;
-static int page_size;
-static int page_cnt = 256;  /* pages per mmap */
-
-/* users of the generic caching API are expected to implement
- * process_event.
- */
-static void process_event(struct data *data);
-
-static int pmu_fds[MAX_CPUS];
-static struct perf_event_mmap_page *headers[MAX_CPUS];
+	__u64			lost;
+	__u64			overflow;
+};
 
 /*
  * time sorted list of events
@@ -44,21 +58,19 @@ static struct perf_event_mmap_page *headers[MAX_CPUS];
 struct event {
 	struct rb_node rb_node;
 	struct list_head list;
-	struct data data;      /* this struct varies by command;
-				* must contain time and cpu
-				*/
+	__u64 time;
+	char data[];		/* record; opts.rec_size bytes */
 };
 
-static struct rb_root events;
-
-static void remove_event(struct event *event)
+static void remove_event(struct perf_channel *ch, struct event *event)
 {
+	ch->backlog--;
 	free(event);
 }
 
-static void insert_event(struct event *e_new)
+static void insert_event(struct perf_channel *ch, struct event *e_new)
 {
-	struct rb_root *root = &events;
+	struct rb_root *root = &ch->events;
 	struct rb_node **node = &root->rb_node;
 	struct rb_node *parent = NULL;
 
@@ -67,13 +79,13 @@ static void insert_event(struct event *e_new)
 
 		parent = *node;
 		e = container_of(parent, struct event, rb_node);
-		if (e->data.time > e_new->data.time)
+		if (e->time > e_new->time)
 			node = &(*node)->rb_left;
-		else if (e->data.time < e_new->data.time)
+		else if (e->time < e_new->time)
 			node = &(*node)->rb_right;
 		else {
 			/* handle multiple events with the same timestamp */
-			list_add(&e_new->list, &e->list);
+			list_add_tail(&e_new->list, &e->list);
 			return;
 		}
 	}
@@ -82,46 +94,53 @@ static void insert_event(struct event *e_new)
 	rb_insert_color(&e_new->rb_node, root);
 }
 
-static void __process_event(struct event *event)
+static void __process_event(struct perf_channel *ch, struct event *event)
 {
+	struct perf_channel_opts *opts = &ch->opts;
 	struct event *e, *tmp;
 
-	if (!list_empty(&event->list)) {
-		list_for_each_entry_safe(e, tmp, &event->list, list) {
-			list_del(&e->list);
+	opts->handler(opts->ctx, event->data, opts->rec_size);
 
-			process_event(&e->data);
-			remove_event(e);
-		}
-	}
+	list_for_each_entry_safe(e, tmp, &event->list, list) {
+		list_del(&e->list);
 
-	process_event(&event->data);
+		opts->handler(opts->ctx, e->data, opts->rec_size);
+		remove_event(ch, e);
+	}
 }
 
-/* last event seen on this cpu */
-static __u64 round_time;
-
-/* mark the start of a round */
-static void set_round_time(void)
+/* oldest time any cpu with an open buffer can still deliver, less
+ * the reorder window. Drained buffers, including those of idle cpus,
+ * have their watermark at the time they were read so they do not
+ * hold back the others.
+ */
+static __u64 reorder_end_time(struct perf_channel *ch)
 {
-	struct timespec ts;
+	__u64 wmark = 0;
+	int i;
 
-	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
-		fprintf(stderr, "clock_gettime(CLOCK_MONOTONIC) failed\n");
-		return;
+	for (i = 0; i < ch->nbufs; i++) {
+		if (ch->pmu_fds[i] < 0)
+			continue;
+		if (!wmark || ch->watermarks[i] < wmark)
+			wmark = ch->watermarks[i];
 	}
 
-	round_time = (__u64) ts_to_ull(&ts);
+	return wmark > ch->opts.reorder_window ?
+		wmark - ch->opts.reorder_window : 0;
 }
 
-void process_events(void)
+void perf_channel_process_events(struct perf_channel *ch)
 {
-	__u64 end_time = round_time;
-	struct rb_root *rb_root = &events;
+	__u64 end_time = ch->round_time;
+	struct rb_root *rb_root = &ch->events;
 	struct rb_node *node;
 	struct event *event;
 
-	set_round_time();
+	/* mark the start of a round */
+	ch->round_time = get_time_ns(CLOCK_MONOTONIC);
+	if (ch->opts.reorder_window)
+		end_time = reorder_end_time(ch);
 
 	while (1) {
 		node = rb_first(rb_root);
@@ -129,74 +148,103 @@ void process_events(void)
 			break;
 
 		event = container_of(node, struct event, rb_node);
-		if (event->data.time >= end_time)
+		if (event->time >= end_time)
 			break;
 
 		rb_erase(&event->rb_node, rb_root);
-		__process_event(event);
-		remove_event(event);
+		__process_event(ch, event);
+		remove_event(ch, event);
 	}
 }
 
+static void flush_events(struct perf_channel *ch)
+{
+	struct rb_node *node;
+	struct event *event, *e, *tmp;
+
+	while ((node = rb_first(&ch->events)) != NULL) {
+		event = container_of(node, struct event, rb_node);
+		rb_erase(node, &ch->events);
+
+		list_for_each_entry_safe(e, tmp, &event->list, list) {
+			list_del(&e->list);
+			remove_event(ch, e);
+		}
+		remove_event(ch, event);
+	}
+}
+
+static unsigned int record_cpu(const struct perf_channel_opts *opts,
+			       const void *data)
+{
+	const void *p = data + opts->cpu_off;
+
+	switch (opts->cpu_size) {
+	case 1:
+		return *(const __u8 *)p;
+	case 2:
+		return *(const __u16 *)p;
+	}
+
+	return *(const __u32 *)p;
+}
+
 /*
  * Add event to time sorted backlog queue
  */
-static int __handle_bpf_output(void *_data, int size)
+static int queue_event(struct perf_channel *ch, void *data, int size)
 {
-	struct data *data = _data;
+	struct perf_channel_opts *opts = &ch->opts;
 	struct event *event;
 
-	if (numcpus && data->cpu >= numcpus) {
-		fprintf(stderr, "CPU in event (%d) is > numcpus (%d)\n",
-			data->cpu, numcpus);
+	if (size < opts->rec_size) {
+		fprintf(stderr,
+			"Event size %d is less than data size %zu\n",
+			size, opts->rec_size);
 		return LIBBPF_PERF_EVENT_ERROR;
 	}
 
-	if (size < sizeof(*data)) {
-		fprintf(stderr,
-			"Event size %d is less than data size %ld\n",
-			size, sizeof(*data));
-		return LIBBPF_PERF_EVENT_ERROR;
+	if (opts->cpu_off >= 0) {
+		unsigned int cpu = record_cpu(opts, data);
+
+		if (cpu >= ch->ncpus) {
+			fprintf(stderr, "CPU in event (%u) is > numcpus (%d)\n",
+				cpu, ch->ncpus);
+			return LIBBPF_PERF_EVENT_ERROR;
+		}
 	}
 
-	event = calloc(1, sizeof(*event));
+	event = malloc(sizeof(*event) + opts->rec_size);
 	if (!event) {
 		fprintf(stderr, "Failed to allocate memory for event\n");
 		return LIBBPF_PERF_EVENT_ERROR;
 	}
+	memset(&event->rb_node, 0, sizeof(event->rb_node));
 	INIT_LIST_HEAD(&event->list);
 
-	memcpy(&event->data, data, sizeof(*data));
-	insert_event(event);
-
-	return LIBBPF_PERF_EVENT_CONT;
-}
-
-static int sys_perf_event_open(struct perf_event_attr *attr,
-			       int cpu, unsigned long flags)
-{
-	pid_t pid = -1;
-	int group_fd = -1;
-
-	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
-}
+	memcpy(event->data, data, opts->rec_size);
+	memcpy(&event->time, data + opts->time_off, sizeof(event->time));
+	insert_event(ch, event);
+	ch->backlog++;
 
-static int perf_event_mmap_header(int fd, struct perf_event_mmap_page **header)
-{
-	void *base;
-	int mmap_size;
+	if (ch->watermarks && event->time > ch->watermarks[ch->cur_buf])
+		ch->watermarks[ch->cur_buf] = event->time;
 
-	page_size = getpagesize();
-	mmap_size = page_size * (page_cnt + 1);
+	/* over the limit: hand the oldest event to the handler now even
+	 * though an older one may still arrive from another cpu
+	 */
+	if (opts->max_backlog && ch->backlog > opts->max_backlog) {
+		struct rb_node *node = rb_first(&ch->events);
+		unsigned int backlog = ch->backlog;
 
-	base = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (base == MAP_FAILED) {
-		fprintf(stderr, "mmap err\n");
-		return -1;
+		event = container_of(node, struct event, rb_node);
+		rb_erase(node, &ch->events);
+		__process_event(ch, event);
+		remove_event(ch, event);
+		ch->overflow += backlog - ch->backlog;
 	}
 
-	*header = base;
-	return 0;
+	return LIBBPF_PERF_EVENT_CONT;
 }
 
 struct perf_event_sample {
@@ -209,11 +257,14 @@ static enum bpf_perf_event_ret
 bpf_perf_event_print(struct perf_event_header *hdr, void *private_data)
 {
 	struct perf_event_sample *e = (struct perf_event_sample *)hdr;
-	perf_event_print_fn fn = private_data;
+	struct perf_channel *ch = private_data;
 	int ret;
 
 	if (e->header.type == PERF_RECORD_SAMPLE) {
-		ret = fn(e->data, e->size);
+		if (ch->opts.time_off >= 0)
+			ret = queue_event(ch, e->data, e->size);
+		else
+			ret = ch->opts.handler(ch->opts.ctx, e->data, e->size);
 		if (ret != LIBBPF_PERF_EVENT_CONT)
 			return ret;
 	} else if (e->header.type == PERF_RECORD_LOST) {
@@ -223,6 +274,7 @@ bpf_perf_event_print(struct perf_event_header *hdr, void *private_data)
 			__u64 lost;
 		} *lost = (void *) e;
 		fprintf(stderr, "lost %lld events\n", lost->lost);
+		ch->lost += lost->lost;
 	} else {
 		fprintf(stderr, "unknown event type=%d size=%d\n",
 		       e->header.type, e->header.size);
@@ -231,549 +283,440 @@ bpf_perf_event_print(struct perf_event_header *hdr, void *private_data)
 	return LIBBPF_PERF_EVENT_CONT;
 }
 
-static int perf_event_poller_multi(int *fds,
-				   int num_fds, perf_event_print_fn output_fn,
-				   void (*round_start_fn)(void),
-				   int (*round_complete_fn)(void))
+static int perf_event_mmap_header(struct perf_channel *ch, int idx)
 {
-	enum bpf_perf_event_ret ret = LIBBPF_PERF_EVENT_DONE;
-	struct pollfd *pfds;
-	int timeout = 1000;
-	void *buf = NULL;
-	size_t len = 0;
-	int i;
+	void *base;
 
-	if (!output_fn)
-		output_fn = __handle_bpf_output;
+	base = mmap(NULL, ch->mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    ch->pmu_fds[idx], 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "mmap err\n");
+		return -1;
+	}
 
-	pfds = calloc(num_fds, sizeof(*pfds));
-	if (!pfds)
-		return LIBBPF_PERF_EVENT_ERROR;
+	ch->headers[idx] = base;
+	return 0;
+}
 
-	for (i = 0; i < num_fds; i++) {
-		pfds[i].fd = fds[i];
-		pfds[i].events = POLLIN;
-	}
+/* parse a cpu list (e.g., "0-3,8,10-11") as used in sysfs */
+static int read_cpu_list(const char *file, bool *mask, int n)
+{
+	char buf[4096], *p;
+	int a, b, len;
+	FILE *fp;
 
-	for (;;) {
-		poll(pfds, num_fds, timeout);
+	fp = fopen(file, "r");
+	if (!fp)
+		return -1;
 
-		if (round_start_fn)
-			round_start_fn();
-
-		for (i = 0; i < num_fds; i++) {
-			ret = bpf_perf_event_read_simple(headers[i],
-							 page_cnt * page_size,
-							 page_size, &buf, &len,
-							 bpf_perf_event_print,
-							 output_fn);
-			if (ret != LIBBPF_PERF_EVENT_CONT)
-				break;
-		}
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (!p)
+		return -1;
 
-		if (round_complete_fn && round_complete_fn())
-			break;
+	memset(mask, 0, n * sizeof(*mask));
+	while (*p && *p != '\n') {
+		if (sscanf(p, "%d%n", &a, &len) != 1)
+			return -1;
+		p += len;
+		b = a;
+		if (*p == '-') {
+			if (sscanf(p + 1, "%d%n", &b, &len) != 1)
+				return -1;
+			p += len + 1;
+		}
+		for (; a <= b && a < n; a++)
+			mask[a] = true;
+		if (*p == ',')
+			p++;
 	}
-	free(buf);
-	free(pfds);
 
-	return ret;
+	return 0;
 }
 
-static int output_perf_event_cpu(int map_fd, int cpu, int nevents)
+static int output_perf_event(struct perf_channel *ch, int map_fd, int idx,
+			     int cpu)
 {
 	struct perf_event_attr attr = {
 		.sample_type = PERF_SAMPLE_RAW,
 		.type = PERF_TYPE_SOFTWARE,
 		.config = PERF_COUNT_SW_BPF_OUTPUT,
 		.size = sizeof(attr),
-		.wakeup_events = nevents, /* get an fd notification for every event */
+		.wakeup_events = ch->opts.nevents, /* fd notification every N events */
 	};
 	int key = cpu;
 
-	pmu_fds[0] = sys_perf_event_open(&attr, cpu, 0);
-	if (pmu_fds[0] < 0) {
+	ch->pmu_fds[idx] = sys_perf_event_open(&attr, cpu, 0);
+	if (ch->pmu_fds[idx] < 0) {
 		fprintf(stderr, "sys_perf_event_open failed: %d: %s\n",
 			errno, strerror(errno));
 		return -1;
 	}
-	if (bpf_map_update_elem(map_fd, &key, &pmu_fds[0], BPF_ANY)) {
+	if (bpf_map_update_elem(map_fd, &key, &ch->pmu_fds[idx], BPF_ANY)) {
 		fprintf(stderr, "bpf_map_update_elem failed\n");
 		return -1;
 	}
+	ioctl(ch->pmu_fds[idx], PERF_EVENT_IOC_ENABLE, 0);
 
-	ioctl(pmu_fds[0], PERF_EVENT_IOC_ENABLE, 0);
-
-	return 0;
-}
-
-static int output_perf_event(int map_fd, int ncpus, int nevents)
-{
-	struct perf_event_attr attr = {
-		.sample_type = PERF_SAMPLE_RAW,
-		.type = PERF_TYPE_SOFTWARE,
-		.config = PERF_COUNT_SW_BPF_OUTPUT,
-		.size = sizeof(attr),
-		.wakeup_events = nevents, /* get an fd notification for every event */
-	};
-	int i;
-
-	for (i = 0; i < ncpus; i++) {
-		int key = i;
-
-		pmu_fds[i] = sys_perf_event_open(&attr, i, 0);
-		if (pmu_fds[i] < 0) {
-			fprintf(stderr, "sys_perf_event_open failed: %d: %s\n",
-				errno, strerror(errno));
-			return -1;
-		}
-		if (bpf_map_update_elem(map_fd, &key, &pmu_fds[i], BPF_ANY)) {
-			fprintf(stderr, "bpf_map_update_elem failed\n");
-			return -1;
-		}
-		ioctl(pmu_fds[i], PERF_EVENT_IOC_ENABLE, 0);
-	}
-
-	return 0;
+	return perf_event_mmap_header(ch, idx);
 }
 
-/*
- * obj is expected to have a map named "channel".
- * attach event channel to perf event to get output
- */
-int configure_perf_event_channel_cpu(struct bpf_object *obj, int nevents,
-				     int cpu)
+/* cpu backing buffer slot idx */
+static int buf_cpu(const struct perf_channel *ch, int idx)
 {
-	struct bpf_map *map;
-	int map_fd;
-
-	map = bpf_object__find_map_by_name(obj, "channel");
-	if (!map) {
-		fprintf(stderr, "Failed to get channel map in obj file\n");
-		return 1;
-	}
-
-	map_fd = bpf_map__fd(map);
-
-	if (output_perf_event_cpu(map_fd, cpu, nevents) ||
-	    perf_event_mmap_header(pmu_fds[0], &headers[0]) < 0)
-		return 1;
-
-	return 0;
+	return ch->opts.cpu >= 0 ? ch->opts.cpu : idx;
 }
 
-int configure_perf_event_channel(struct bpf_object *obj, int nevents)
+static void close_cpu_buffer(struct perf_channel *ch, int idx)
 {
-	struct bpf_map *map;
-	int map_fd, i;
-
-	numcpus = get_nprocs();
-	if (numcpus > MAX_CPUS)
-		numcpus = MAX_CPUS;
-
-	map = bpf_object__find_map_by_name(obj, "channel");
-	if (!map) {
-		fprintf(stderr, "Failed to get channel map in obj file\n");
-		return 1;
+	if (ch->headers[idx]) {
+		munmap(ch->headers[idx], ch->mmap_size);
+		ch->headers[idx] = NULL;
 	}
+	if (ch->pmu_fds[idx] >= 0) {
+		int key = buf_cpu(ch, idx);
 
-	map_fd = bpf_map__fd(map);
-
-	if (output_perf_event(map_fd, numcpus, nevents))
-		return 1;
-
-	for (i = 0; i < numcpus; i++) {
-		if (perf_event_mmap_header(pmu_fds[i], &headers[i]) < 0)
-			return 1;
+		ioctl(ch->pmu_fds[idx], PERF_EVENT_IOC_DISABLE, 0);
+		/* map entry holds a reference to the event */
+		bpf_map_delete_elem(ch->map_fd, &key);
+		close(ch->pmu_fds[idx]);
+		ch->pmu_fds[idx] = -1;
 	}
-
-	return 0;
 }
 
-void close_perf_event_channel(void)
+void perf_channel_get_stats(struct perf_channel *ch,
+			    struct perf_channel_stats *stats)
 {
-	int i;
-
-	for (i = 0; i < numcpus; i++) {
-		ioctl(pmu_fds[i], PERF_EVENT_IOC_DISABLE, 0);
-		close(pmu_fds[i]);
-	}
+	stats->lost = ch->lost;
+	stats->overflow = ch->overflow;
+	stats->backlog = ch->backlog;
 }
 
-static int tp_perf_event(int prog_fd, __u64 config)
+int perf_channel_update_cpus(struct perf_channel *ch)
 {
-	struct perf_event_attr attr = {
-		.sample_type = PERF_SAMPLE_RAW,
-		.type = PERF_TYPE_TRACEPOINT,
-		.size = sizeof(attr),
-		.wakeup_events = 1, /* get an fd notification for every event */
-		.sample_period = 1,
-		.config = config,
-	};
-	int fd, err;
-
-	fd = sys_perf_event_open(&attr, 0, PERF_FLAG_FD_CLOEXEC);
-	if (fd < 0) {
-		fprintf(stderr, "Failed to open syscall event: %d %s\n",
-			fd, strerror(errno));
-		return fd;
-	}
+	bool *online;
+	int i, cpu, changes = 0;
 
-	err = ioctl(fd, PERF_EVENT_IOC_SET_BPF, prog_fd);
-	if (err) {
-		fprintf(stderr, "failed to attach bpf: %d %s\n",
-			err, strerror(errno));
-		close(fd);
+	online = calloc(ch->ncpus, sizeof(*online));
+	if (!online)
 		return -1;
-	}
-
-	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
-
-	return fd;
-}
 
-static int tp_event_id(const char *event, bool probe)
-{
-	char filename[PATH_MAX];
-	int fd, n, id = -1;
-	char buf[64] = {};
-
-	if (probe)
-		snprintf(filename, sizeof(filename), "%s/events/probe/%s/id",
-			 tracingfs, event);
-	else
-		snprintf(filename, sizeof(filename), "%s/events/%s/id",
-			 tracingfs, event);
-
-	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "Failed to open '%s' to learn id for tracing event '%s'\n",
-			filename, event);
+	if (read_cpu_list("/sys/devices/system/cpu/online", online,
+			  ch->ncpus)) {
+		free(online);
 		return -1;
 	}
 
-	n = read(fd, buf, sizeof(buf)-1);
-	if (n < 0) {
-		fprintf(stderr, "Failed to open '%s' to learn kprobe type\n",
-			filename);
-	} else {
-		id = atoi(buf);
+	for (i = 0; i < ch->nbufs; i++) {
+		cpu = buf_cpu(ch, i);
+
+		if (online[cpu] && ch->pmu_fds[i] < 0) {
+			if (output_perf_event(ch, ch->map_fd, i, cpu)) {
+				fprintf(stderr,
+					"Failed to open buffer for cpu %d\n",
+					cpu);
+				close_cpu_buffer(ch, i);
+				continue;
+			}
+			changes++;
+		} else if (!online[cpu] && ch->pmu_fds[i] >= 0) {
+			/* remaining events were read in this round */
+			close_cpu_buffer(ch, i);
+			changes++;
+		}
 	}
-	close(fd);
+	free(online);
 
-	return id;
+	return changes;
 }
 
-int tracepoint_perf_event(int prog_fd, const char *name)
+void perf_channel_close(struct perf_channel *ch)
 {
-	int id;
+	int i;
 
-	id = tp_event_id(name, false);
-	if (id < 0)
-		return 1;
+	if (!ch)
+		return;
 
-	return tp_perf_event(prog_fd, id);
+	for (i = 0; i < ch->nbufs; i++)
+		close_cpu_buffer(ch, i);
+	flush_events(ch);
+	free(ch->watermarks);
+	free(ch->headers);
+	free(ch->pmu_fds);
+	free(ch);
 }
 
-/* tps is a NULL terminated array of tracepoint names.
- * bpf program is expected to be named tracepoint/%s
+/*
+ * attach event channel to perf event to get output
  */
-int do_tracepoint(struct bpf_object *obj, const char *tps[])
+struct perf_channel *perf_channel_open(struct bpf_object *obj,
+				       const struct perf_channel_opts *opts)
 {
-        struct bpf_program *prog;
-        int prog_fd, fd;
-        int i;
-
-        for (i = 0; tps[i]; ++i) {
-                char buf[256];
-
-                snprintf(buf, sizeof(buf), "tracepoint/%s", tps[i]);
+	struct perf_channel *ch;
+	bool *online = NULL;
+	struct bpf_map *map;
+	int map_fd, i, n;
 
-		prog = bpf_object__find_program_by_title(obj, buf);
-		if (!prog) {
-			printf("Failed to get prog in obj file\n");
-			return 1;
-		}
-		prog_fd = bpf_program__fd(prog);
-
-		fd = tracepoint_perf_event(prog_fd, tps[i]);
-		if (fd < 0) {
-			fprintf(stderr,
-				"Failed to create perf_event on %s: %d %s\n",
-				tps[i], fd, strerror(errno));
-			return 1;
-		}
+	if (!opts->handler) {
+		fprintf(stderr, "perf channel requires a handler\n");
+		return NULL;
 	}
 
-	return 0;
-}
-
-static int kprobes_event_id(const char *event)
-{
-	char filename[PATH_MAX];
-	int fd, n, id = -1;
-	char buf[64] = {};
+	ch = calloc(1, sizeof(*ch));
+	if (!ch) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return NULL;
+	}
 
-	snprintf(filename, sizeof(filename), "%s/events/kprobes/%s/id",
-		 tracingfs, event);
+	ch->opts = *opts;
+	if (!ch->opts.map_name)
+		ch->opts.map_name = "channel";
+	if (!ch->opts.page_cnt)
+		ch->opts.page_cnt = 256;
+	if (!ch->opts.nevents)
+		ch->opts.nevents = 1;
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "Failed to open '%s' to learn id for tracing event '%s'\n",
-			filename, event);
-		return -1;
+	map = bpf_object__find_map_by_name(obj, ch->opts.map_name);
+	if (!map) {
+		fprintf(stderr, "Failed to get %s map in obj file\n",
+			ch->opts.map_name);
+		goto err;
 	}
+	map_fd = bpf_map__fd(map);
+	ch->map_fd = map_fd;
 
-	n = read(fd, buf, sizeof(buf)-1);
+	/* one buffer per possible cpu; load_obj_file sizes the channel
+	 * map to match. Objects loaded some other way can have a smaller
+	 * map, in which case events from the higher cpus are lost.
+	 */
+	n = libbpf_num_possible_cpus();
 	if (n < 0) {
-		fprintf(stderr, "Failed to open '%s' to learn kprobe type\n",
-			filename);
+		fprintf(stderr, "Failed to get number of possible cpus\n");
+		goto err;
+	}
+	if (n > bpf_map__max_entries(map)) {
+		fprintf(stderr,
+			"%s map has %u entries; events from cpus >= %u are not read\n",
+			ch->opts.map_name, bpf_map__max_entries(map),
+			bpf_map__max_entries(map));
+		n = bpf_map__max_entries(map);
+	}
+
+	ch->ncpus = n;
+	ch->nbufs = ch->opts.cpu >= 0 ? 1 : n;
+	ch->page_size = getpagesize();
+	ch->mmap_size = ch->page_size * (ch->opts.page_cnt + 1);
+
+	ch->pmu_fds = calloc(ch->nbufs, sizeof(*ch->pmu_fds));
+	ch->headers = calloc(ch->nbufs, sizeof(*ch->headers));
+	online = calloc(n, sizeof(*online));
+	if (ch->opts.reorder_window)
+		ch->watermarks = calloc(ch->nbufs, sizeof(*ch->watermarks));
+	if (!ch->pmu_fds || !ch->headers || !online ||
+	    (ch->opts.reorder_window && !ch->watermarks)) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		ch->nbufs = 0;
+		goto err;
+	}
+	for (i = 0; i < ch->nbufs; i++)
+		ch->pmu_fds[i] = -1;
+
+	/* assume all possible cpus are online if the list is unavailable */
+	if (read_cpu_list("/sys/devices/system/cpu/online", online, n)) {
+		for (i = 0; i < n; i++)
+			online[i] = true;
+	}
+
+	if (ch->opts.cpu >= 0) {
+		if (ch->opts.cpu >= n || !online[ch->opts.cpu]) {
+			fprintf(stderr, "Invalid cpu %d\n", ch->opts.cpu);
+			goto err;
+		}
+		if (output_perf_event(ch, map_fd, 0, ch->opts.cpu))
+			goto err;
 	} else {
-		id = atoi(buf);
+		for (i = 0; i < ch->nbufs; i++) {
+			/* offline cpus do not generate events */
+			if (!online[i])
+				continue;
+			if (output_perf_event(ch, map_fd, i, i))
+				goto err;
+		}
 	}
-	close(fd);
+	free(online);
 
-	return id;
+	return ch;
+err:
+	free(online);
+	perf_channel_close(ch);
+	return NULL;
 }
 
-static int do_kprobe_event(const char *event)
+/* kobject uevents announce cpus going online and offline */
+static int hotplug_socket(void)
 {
-	char filename[PATH_MAX];
-	int rc = 0;
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,
+	};
 	int fd;
 
-	snprintf(filename, sizeof(filename), "%s/kprobe_events", tracingfs);
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
 
-	fd = open(filename, O_WRONLY|O_APPEND);
-	if (fd < 0) {
-		fprintf(stderr, "Failed to open '%s' to learn id for event '%s'\n",
-			filename, event);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
 		return -1;
 	}
-	if (write(fd, event, strlen(event)) != strlen(event)) {
-		fprintf(stderr, "Failed writing event '%s' to '%s'\n",
-			event, filename);
-		rc = -1;
-	}
-	close(fd);
 
-	return rc;
+	return fd;
 }
 
-static int kprobe_perf_event_legacy(int prog_fd, const char *func,
-				    bool retprobe)
+/* drain pending uevents; returns true if any were for a cpu */
+static bool hotplug_pending(int fd)
 {
-	char event[128], pname[64];
-	char t = 'p';
-	int id;
+	bool cpu_event = false;
+	char buf[4096];
+	ssize_t n;
 
-	if (strlen(func) + 10 > sizeof(pname)) {
-		fprintf(stderr,
-			"buf size too small in kprobe_perf_event_legacy\n");
-		return -1;
+	while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[n] = '\0';
+		/* header is ACTION@DEVPATH */
+		if (strstr(buf, "@/devices/system/cpu/cpu"))
+			cpu_event = true;
 	}
-	if (retprobe)
-		t = 'r';
 
-	/*    probe: p:kprobes/p_<func>_<pid>
-	 * retprobe: r:kprobes/r_<func>_<pid>
-	 *  delete:  -:kprobes/<p>_<func>_<pid>
-	 */
-	snprintf(pname, sizeof(pname), "%c_%s_%d", t, func, getpid());
-	if (prog_fd < 0)
-		snprintf(event, sizeof(event), "-:kprobes/%s", pname);
-	else
-		snprintf(event, sizeof(event), "%c:kprobes/%s %s", t, pname, func);
+	return cpu_event;
+}
 
-	if (do_kprobe_event(event))
-		return -1;
+static int fill_pollfds(struct pollfd *pfds, struct perf_channel **chs,
+			int nch, int hp_fd, int fd)
+{
+	int i, j, n = 0;
+
+	for (i = 0; i < nch; i++) {
+		for (j = 0; j < chs[i]->nbufs; j++) {
+			if (chs[i]->pmu_fds[j] < 0)
+				continue;
+			pfds[n].fd = chs[i]->pmu_fds[j];
+			pfds[n].events = POLLIN;
+			n++;
+		}
+	}
 
-	if (prog_fd < 0)
-		return 0;
+	if (hp_fd >= 0) {
+		pfds[n].fd = hp_fd;
+		pfds[n].events = POLLIN;
+		n++;
+	}
 
-	id = kprobes_event_id(pname);
-	if (id < 0) {
-		fprintf(stderr, "Failed to get id for '%s'\n", pname);
-		return -1;
+	if (fd >= 0) {
+		pfds[n].fd = fd;
+		pfds[n].events = POLLIN;
+		n++;
 	}
 
-	return tp_perf_event(prog_fd, id);
+	return n;
 }
 
-static int kprobe_event_type(void)
+int perf_event_loop_fd(struct perf_channel **chs, int nch, int fd,
+		       void (*start_fn)(void *arg),
+		       int (*complete_fn)(void *arg), void *arg)
 {
-	static int kprobe_type = -1;
-	static bool checked = false;
-	char filename[] = "/sys/bus/event_source/devices/kprobe/type";
-	char buf[64] = {};
-	int fd, n;
+	enum bpf_perf_event_ret ret = LIBBPF_PERF_EVENT_DONE;
+	struct pollfd *pfds;
+	int timeout = 1000;
+	void *buf = NULL;
+	size_t len = 0;
+	int i, j, num_fds = 2;
+	bool hotplug;
+	int hp_fd;
 
-	if (checked)
-		return kprobe_type;
+	for (i = 0; i < nch; i++) {
+		__u64 window = chs[i]->opts.reorder_window;
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		return -1;
+		num_fds += chs[i]->nbufs;
 
-	n = read(fd, buf, sizeof(buf)-1);
-	if (n < 0) {
-		fprintf(stderr, "Failed to open '%s' to learn kprobe type\n",
-			filename);
-	} else {
-		kprobe_type = atoi(buf);
+		/* wake up often enough to release events on time */
+		if (window && window / NSEC_PER_MSEC < timeout)
+			timeout = window / NSEC_PER_MSEC ? : 1;
 	}
-	close(fd);
 
-	checked = true;
+	pfds = calloc(num_fds, sizeof(*pfds));
+	if (!pfds)
+		return LIBBPF_PERF_EVENT_ERROR;
 
-	return kprobe_type;
-}
+	/* without uevents (e.g., no permission) the online list is
+	 * checked every round instead
+	 */
+	hp_fd = hotplug_socket();
+	num_fds = fill_pollfds(pfds, chs, nch, hp_fd, fd);
 
-/* modern way to do ebpf with kprobe - create the probe
- * with perf_event_open and attach program
- */
-int kprobe_perf_event(int prog_fd, const char *func, int retprobe,
-		      int attr_type)
-{
-	struct perf_event_attr attr = {
-		.sample_type = PERF_SAMPLE_RAW,
-		.size = sizeof(attr),
-		.wakeup_events = 1, /* get an fd notification for every event */
-		.sample_period = 1,
-		.config = retprobe ? 1ULL : 0, /* 0 for kprobe; 1 for retprobe */
-		.kprobe_func = (uint64_t) (unsigned long) func,
-		.type = attr_type,
-	};
-	int fd, err;
-
-	fd = sys_perf_event_open(&attr, 0, PERF_FLAG_FD_CLOEXEC);
-	if (fd < 0) {
-		fprintf(stderr, "Failed to open kprobe event: %d %s\n",
-			fd, strerror(errno));
-		return fd;
-	}
-	err = ioctl(fd, PERF_EVENT_IOC_SET_BPF, prog_fd);
-	if (err) {
-		fprintf(stderr, "failed to attach bpf: %d %s\n",
-			err, strerror(errno));
-		close(fd);
-		return -1;
-	}
+	for (;;) {
+		poll(pfds, num_fds, timeout);
 
-	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		hotplug = hp_fd < 0 || hotplug_pending(hp_fd);
 
-	return fd;
-}
+		if (start_fn)
+			start_fn(arg);
 
-/* probes is a NULL terminated array of function names to put
- * kprobe. bpf program is expected to be named kprobe/%s.
- * If retprobe is set, bpf program name is expected to be
- * "kprobe/%s_ret"
- */
-int kprobe_init(struct bpf_object *obj, struct kprobe_data *probes,
-		unsigned int count)
-{
-	struct bpf_program *prog;
-	int prog_fd, attr_type;
-	unsigned int i;
-	int rc = 0;
-
-	attr_type = kprobe_event_type();
-
-	for (i = 0; i < count; ++i) {
-		char buf[256];
-
-		if (probes[i].prog) {
-			snprintf(buf, sizeof(buf), "%s", probes[i].prog);
-		} else {
-			snprintf(buf, sizeof(buf), "kprobe/%s%s",
-				 probes[i].func,
-				 probes[i].retprobe ? "_ret" : "");
-		}
+		for (i = 0; i < nch; i++) {
+			struct perf_channel *ch = chs[i];
 
-		prog = bpf_object__find_program_by_title(obj, buf);
-		if (!prog) {
-			printf("Failed to get prog in obj file\n");
-			rc = 1;
-			continue;
-		}
-		prog_fd = bpf_program__fd(prog);
-
-
-		if (attr_type < 0) {
-			probes[i].fd = kprobe_perf_event_legacy(prog_fd,
-								probes[i].func,
-								probes[i].retprobe);
-		} else {
-			probes[i].fd = kprobe_perf_event(prog_fd,
-							 probes[i].func,
-							 probes[i].retprobe,
-							 attr_type);
-		}
-		if (probes[i].fd < 0) {
-			fprintf(stderr,
-				"Failed to create perf_event on %s\n",
-				probes[i].func);
-			rc = 1;
-		}
-	}
+			for (j = 0; j < ch->nbufs; j++) {
+				if (!ch->headers[j])
+					continue;
 
-	return rc;
-}
+				ch->cur_buf = j;
+				if (ch->watermarks) {
+					__u64 now = get_time_ns(CLOCK_MONOTONIC);
 
-void kprobe_cleanup(struct kprobe_data *probes, unsigned int count)
-{
-	unsigned int i;
-	int attr_type;
+					if (now > ch->watermarks[j])
+						ch->watermarks[j] = now;
+				}
 
-	attr_type = kprobe_event_type();
-	for (i = 0; i < count; ++i) {
-		if (probes[i].fd < 0)
-			continue;
+				ret = bpf_perf_event_read_simple(ch->headers[j],
+						ch->opts.page_cnt * ch->page_size,
+						ch->page_size, &buf, &len,
+						bpf_perf_event_print, ch);
+				if (ret != LIBBPF_PERF_EVENT_CONT)
+					goto out;
+			}
 
-		close(probes[i].fd);
-		if (attr_type < 0) {
-			kprobe_perf_event_legacy(-1, probes[i].func,
-						 probes[i].retprobe);
+			if (ch->opts.time_off >= 0)
+				perf_channel_process_events(ch);
 		}
-	}
-}
-
-static int syscall_event_id(const char *name)
-{
-	char sysname[PATH_MAX];
-
-	snprintf(sysname, sizeof(sysname), "syscalls/%s", name);
 
-	return tp_event_id(sysname, false);
-}
-
-int syscall_perf_event(int prog_fd, const char *name)
-{
-	int id;
-
-	id = syscall_event_id(name);
-	if (id < 0)
-		return 1;
-
-	return tp_perf_event(prog_fd, id);
-}
+		/* buffers of cpus going offline were drained above */
+		if (hotplug) {
+			bool changed = false;
+
+			for (i = 0; i < nch; i++) {
+				if (perf_channel_update_cpus(chs[i]) > 0)
+					changed = true;
+			}
+			if (changed)
+				num_fds = fill_pollfds(pfds, chs, nch, hp_fd,
+						       fd);
+		}
 
-void perf_set_page_cnt(int cnt)
-{
-	page_cnt = cnt;
-}
+		if (complete_fn && complete_fn(arg))
+			break;
+	}
+out:
+	if (hp_fd >= 0)
+		close(hp_fd);
+	free(buf);
+	free(pfds);
 
-int perf_event_loop(perf_event_print_fn output_fn,
-		    void (*start_fn)(void), int (*complete_fn)(void))
-{
-	return perf_event_poller_multi(pmu_fds, numcpus,
-				       output_fn, start_fn, complete_fn);
+	return ret;
 }
 
-int perf_event_loop_cpu(perf_event_print_fn output_fn,
-			 void (*start_fn)(void), int (*complete_fn)(void))
+int perf_event_loop(struct perf_channel **chs, int nch,
+		    void (*start_fn)(void *arg),
+		    int (*complete_fn)(void *arg), void *arg)
 {
-	return perf_event_poller_multi(pmu_fds, 1,
-                                       output_fn, start_fn, complete_fn);
+	return perf_event_loop_fd(chs, nch, -1, start_fn, complete_fn, arg);
 }
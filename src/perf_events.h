@@ -3,6 +3,7 @@
 #define __PERF_EVENTS_H
 
 #include <linux/perf_event.h>
+#include <stddef.h>
 #include <bpf/libbpf.h>
 
 struct kprobe_data {
@@ -15,24 +16,107 @@ struct kprobe_data {
 int kprobe_init(struct bpf_object *obj, struct kprobe_data *probes,
 		unsigned int count);
 void kprobe_cleanup(struct kprobe_data *probes, unsigned int count);
+int kprobe_event_type(void);
+int kprobe_perf_event(int prog_fd, const char *func, int retprobe,
+		      int attr_type);
 
-typedef enum bpf_perf_event_ret (*perf_event_print_fn)(void *data, int size);
+int tracepoint_init(struct bpf_object *obj, const char *tps[], int *fds);
+void tracepoint_cleanup(int *fds, unsigned int count);
+int do_tracepoint(struct bpf_object *obj, const char *tps[]);
+int tracepoint_perf_event(int prog_fd, const char *name);
+int syscall_perf_event(int prog_fd, const char *name);
 
-/* attach channel map to perf */
-int configure_perf_event_channel(struct bpf_object *obj, int nevents);
-int configure_perf_event_channel_cpu(struct bpf_object *obj, int nevents,
-				     int cpu);
+int sys_perf_event_open(struct perf_event_attr *attr,
+			int cpu, unsigned long flags);
 
-void perf_set_page_cnt(int cnt);
+/* handler for records read from a channel. Returns one of
+ * LIBBPF_PERF_EVENT_{CONT,DONE,ERROR}.
+ */
+typedef int (*perf_event_handler_fn)(void *ctx, void *data, int size);
+
+struct perf_channel_opts {
+	const char	*map_name;	/* PERF_EVENT_ARRAY map; default "channel" */
+	int		nevents;	/* wakeup after this many events */
+	int		page_cnt;	/* pages per cpu buffer; default 256 */
+	int		cpu;		/* only open this cpu; -1 for all */
+
+	/* Record layout. If time_off is >= 0 records are queued and
+	 * handed to handler in time order across all cpus by
+	 * perf_channel_process_events; otherwise handler is called
+	 * as records are read. cpu_off < 0 means no cpu field.
+	 */
+	size_t		rec_size;
+	int		time_off;
+	int		cpu_off;
+	int		cpu_size;
+
+	/* Time sorted channels only. With a reorder window (nsec) events
+	 * are released once every cpu has been read past the event time
+	 * plus the window rather than once per poll round. max_backlog
+	 * caps the number of queued events; beyond it the oldest event is
+	 * released early and counted as an overflow. 0 means no limit.
+	 */
+	__u64		reorder_window;
+	unsigned int	max_backlog;
+
+	perf_event_handler_fn handler;
+	void		*ctx;
+};
+
+/* describe a record type with time and cpu fields for time sorting */
+#define PERF_CHANNEL_RECORD(type, time_field, cpu_field)	\
+	.rec_size = sizeof(type),				\
+	.time_off = offsetof(type, time_field),			\
+	.cpu_off  = offsetof(type, cpu_field),			\
+	.cpu_size = sizeof(((type *)0)->cpu_field)
+
+/* records are delivered as read; no sorting */
+#define PERF_CHANNEL_UNSORTED(type)				\
+	.rec_size = sizeof(type),				\
+	.time_off = -1,						\
+	.cpu_off  = -1
 
-int perf_event_loop(perf_event_print_fn output_fn,
-                    void (*round_start_fn)(void),
-		    int (*round_complete_fn)(void));
+struct perf_channel;
+
+struct perf_channel_stats {
+	__u64		lost;		/* dropped by the kernel */
+	__u64		overflow;	/* released early due to max_backlog */
+	unsigned int	backlog;	/* currently queued */
+};
 
-/* if output_fn == NULL default output function is used to
- * queue events to a time sorted event log
+/* attach a channel map in obj to per-cpu perf buffers */
+struct perf_channel *perf_channel_open(struct bpf_object *obj,
+				       const struct perf_channel_opts *opts);
+void perf_channel_close(struct perf_channel *ch);
+
+void perf_channel_get_stats(struct perf_channel *ch,
+			    struct perf_channel_stats *stats);
+
+/* re-read the online cpus and open or close per-cpu buffers to
+ * match. perf_event_loop does this on cpu hotplug uevents. Returns
+ * the number of buffers opened or closed.
  */
-int perf_event_loop_cpu(perf_event_print_fn output_fn,
-			void (*round_start_fn)(void),
-			int (*round_complete_fn)(void));
+int perf_channel_update_cpus(struct perf_channel *ch);
+
+/* hand queued events older than the start of the last round to the
+ * channel handler
+ */
+void perf_channel_process_events(struct perf_channel *ch);
+
+/* read all channels until complete_fn returns non-0 or a handler
+ * returns something other than LIBBPF_PERF_EVENT_CONT. Time sorted
+ * events are processed at the end of each round before complete_fn.
+ */
+int perf_event_loop(struct perf_channel **chs, int nch,
+		    void (*start_fn)(void *arg),
+		    int (*complete_fn)(void *arg), void *arg);
+
+/* same, also ending a round as soon as fd is readable (e.g., the
+ * metrics listen socket); complete_fn is expected to service it.
+ * fd < 0 is ignored.
+ */
+int perf_event_loop_fd(struct perf_channel **chs, int nch, int fd,
+		       void (*start_fn)(void *arg),
+		       int (*complete_fn)(void *arg), void *arg);
+
 #endif
@@ -0,0 +1,414 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Helpers to attach bpf programs to tracepoints and kprobes using
+ * perf_event_open.
+ *
+ * Split from perf_events.c so commands that only collect data in
+ * maps do not need the perf event channel.
+ */
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "perf_events.h"
+
+static const char *tracingfs = "/sys/kernel/debug/tracing";
+
+int sys_perf_event_open(struct perf_event_attr *attr,
+			       int cpu, unsigned long flags)
+{
+	pid_t pid = -1;
+	int group_fd = -1;
+
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static int tp_perf_event(int prog_fd, __u64 config)
+{
+	struct perf_event_attr attr = {
+		.sample_type = PERF_SAMPLE_RAW,
+		.type = PERF_TYPE_TRACEPOINT,
+		.size = sizeof(attr),
+		.wakeup_events = 1, /* get an fd notification for every event */
+		.sample_period = 1,
+		.config = config,
+	};
+	int fd, err;
+
+	fd = sys_perf_event_open(&attr, 0, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open syscall event: %d %s\n",
+			fd, strerror(errno));
+		return fd;
+	}
+
+	err = ioctl(fd, PERF_EVENT_IOC_SET_BPF, prog_fd);
+	if (err) {
+		fprintf(stderr, "failed to attach bpf: %d %s\n",
+			err, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+	return fd;
+}
+
+static int tp_event_id(const char *event, bool probe)
+{
+	char filename[PATH_MAX];
+	int fd, n, id = -1;
+	char buf[64] = {};
+
+	if (probe)
+		snprintf(filename, sizeof(filename), "%s/events/probe/%s/id",
+			 tracingfs, event);
+	else
+		snprintf(filename, sizeof(filename), "%s/events/%s/id",
+			 tracingfs, event);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open '%s' to learn id for tracing event '%s'\n",
+			filename, event);
+		return -1;
+	}
+
+	n = read(fd, buf, sizeof(buf)-1);
+	if (n < 0) {
+		fprintf(stderr, "Failed to open '%s' to learn kprobe type\n",
+			filename);
+	} else {
+		id = atoi(buf);
+	}
+	close(fd);
+
+	return id;
+}
+
+int tracepoint_perf_event(int prog_fd, const char *name)
+{
+	int id;
+
+	id = tp_event_id(name, false);
+	if (id < 0)
+		return -1;
+
+	return tp_perf_event(prog_fd, id);
+}
+
+/* tps is a NULL terminated array of tracepoint names.
+ * bpf program is expected to be named tracepoint/%s.
+ * If fds is given, the perf event fd for each tracepoint is saved
+ * so the program can be detached with tracepoint_cleanup.
+ */
+int tracepoint_init(struct bpf_object *obj, const char *tps[], int *fds)
+{
+	struct bpf_program *prog;
+	int prog_fd, fd;
+	int i;
+
+	for (i = 0; tps[i]; ++i) {
+		char buf[256];
+
+		snprintf(buf, sizeof(buf), "tracepoint/%s", tps[i]);
+
+		prog = bpf_object__find_program_by_title(obj, buf);
+		if (!prog) {
+			printf("Failed to get prog in obj file\n");
+			return 1;
+		}
+		prog_fd = bpf_program__fd(prog);
+
+		fd = tracepoint_perf_event(prog_fd, tps[i]);
+		if (fd < 0) {
+			fprintf(stderr,
+				"Failed to create perf_event on %s: %d %s\n",
+				tps[i], fd, strerror(errno));
+			return 1;
+		}
+		if (fds)
+			fds[i] = fd;
+	}
+
+	return 0;
+}
+
+int do_tracepoint(struct bpf_object *obj, const char *tps[])
+{
+	return tracepoint_init(obj, tps, NULL);
+}
+
+void tracepoint_cleanup(int *fds, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		if (fds[i] < 0)
+			continue;
+
+		ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+static int kprobes_event_id(const char *event)
+{
+	char filename[PATH_MAX];
+	int fd, n, id = -1;
+	char buf[64] = {};
+
+	snprintf(filename, sizeof(filename), "%s/events/kprobes/%s/id",
+		 tracingfs, event);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open '%s' to learn id for tracing event '%s'\n",
+			filename, event);
+		return -1;
+	}
+
+	n = read(fd, buf, sizeof(buf)-1);
+	if (n < 0) {
+		fprintf(stderr, "Failed to open '%s' to learn kprobe type\n",
+			filename);
+	} else {
+		id = atoi(buf);
+	}
+	close(fd);
+
+	return id;
+}
+
+static int do_kprobe_event(const char *event)
+{
+	char filename[PATH_MAX];
+	int rc = 0;
+	int fd;
+
+	snprintf(filename, sizeof(filename), "%s/kprobe_events", tracingfs);
+
+	fd = open(filename, O_WRONLY|O_APPEND);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open '%s' to learn id for event '%s'\n",
+			filename, event);
+		return -1;
+	}
+	if (write(fd, event, strlen(event)) != strlen(event)) {
+		fprintf(stderr, "Failed writing event '%s' to '%s'\n",
+			event, filename);
+		rc = -1;
+	}
+	close(fd);
+
+	return rc;
+}
+
+static int kprobe_perf_event_legacy(int prog_fd, const char *func,
+				    bool retprobe)
+{
+	char event[128], pname[64];
+	char t = 'p';
+	int id;
+
+	if (strlen(func) + 10 > sizeof(pname)) {
+		fprintf(stderr,
+			"buf size too small in kprobe_perf_event_legacy\n");
+		return -1;
+	}
+	if (retprobe)
+		t = 'r';
+
+	/*    probe: p:kprobes/p_<func>_<pid>
+	 * retprobe: r:kprobes/r_<func>_<pid>
+	 *  delete:  -:kprobes/<p>_<func>_<pid>
+	 */
+	snprintf(pname, sizeof(pname), "%c_%s_%d", t, func, getpid());
+	if (prog_fd < 0)
+		snprintf(event, sizeof(event), "-:kprobes/%s", pname);
+	else
+		snprintf(event, sizeof(event), "%c:kprobes/%s %s", t, pname, func);
+
+	if (do_kprobe_event(event))
+		return -1;
+
+	if (prog_fd < 0)
+		return 0;
+
+	id = kprobes_event_id(pname);
+	if (id < 0) {
+		fprintf(stderr, "Failed to get id for '%s'\n", pname);
+		return -1;
+	}
+
+	return tp_perf_event(prog_fd, id);
+}
+
+int kprobe_event_type(void)
+{
+	static int kprobe_type = -1;
+	static bool checked = false;
+	char filename[] = "/sys/bus/event_source/devices/kprobe/type";
+	char buf[64] = {};
+	int fd, n;
+
+	if (checked)
+		return kprobe_type;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	n = read(fd, buf, sizeof(buf)-1);
+	if (n < 0) {
+		fprintf(stderr, "Failed to open '%s' to learn kprobe type\n",
+			filename);
+	} else {
+		kprobe_type = atoi(buf);
+	}
+	close(fd);
+
+	checked = true;
+
+	return kprobe_type;
+}
+
+/* modern way to do ebpf with kprobe - create the probe
+ * with perf_event_open and attach program
+ */
+int kprobe_perf_event(int prog_fd, const char *func, int retprobe,
+		      int attr_type)
+{
+	struct perf_event_attr attr = {
+		.sample_type = PERF_SAMPLE_RAW,
+		.size = sizeof(attr),
+		.wakeup_events = 1, /* get an fd notification for every event */
+		.sample_period = 1,
+		.config = retprobe ? 1ULL : 0, /* 0 for kprobe; 1 for retprobe */
+		.kprobe_func = (uint64_t) (unsigned long) func,
+		.type = attr_type,
+	};
+	int fd, err;
+
+	fd = sys_perf_event_open(&attr, 0, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open kprobe event: %d %s\n",
+			fd, strerror(errno));
+		return fd;
+	}
+	err = ioctl(fd, PERF_EVENT_IOC_SET_BPF, prog_fd);
+	if (err) {
+		fprintf(stderr, "failed to attach bpf: %d %s\n",
+			err, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+	return fd;
+}
+
+/* probes is a NULL terminated array of function names to put
+ * kprobe. bpf program is expected to be named kprobe/%s.
+ * If retprobe is set, bpf program name is expected to be
+ * "kprobe/%s_ret"
+ */
+int kprobe_init(struct bpf_object *obj, struct kprobe_data *probes,
+		unsigned int count)
+{
+	struct bpf_program *prog;
+	int prog_fd, attr_type;
+	unsigned int i;
+	int rc = 0;
+
+	attr_type = kprobe_event_type();
+
+	for (i = 0; i < count; ++i) {
+		char buf[256];
+
+		if (probes[i].prog) {
+			snprintf(buf, sizeof(buf), "%s", probes[i].prog);
+		} else {
+			snprintf(buf, sizeof(buf), "kprobe/%s%s",
+				 probes[i].func,
+				 probes[i].retprobe ? "_ret" : "");
+		}
+
+		prog = bpf_object__find_program_by_title(obj, buf);
+		if (!prog) {
+			printf("Failed to get prog in obj file\n");
+			rc = 1;
+			continue;
+		}
+		prog_fd = bpf_program__fd(prog);
+
+
+		if (attr_type < 0) {
+			probes[i].fd = kprobe_perf_event_legacy(prog_fd,
+								probes[i].func,
+								probes[i].retprobe);
+		} else {
+			probes[i].fd = kprobe_perf_event(prog_fd,
+							 probes[i].func,
+							 probes[i].retprobe,
+							 attr_type);
+		}
+		if (probes[i].fd < 0) {
+			fprintf(stderr,
+				"Failed to create perf_event on %s\n",
+				probes[i].func);
+			rc = 1;
+		}
+	}
+
+	return rc;
+}
+
+void kprobe_cleanup(struct kprobe_data *probes, unsigned int count)
+{
+	unsigned int i;
+	int attr_type;
+
+	attr_type = kprobe_event_type();
+	for (i = 0; i < count; ++i) {
+		if (probes[i].fd < 0)
+			continue;
+
+		close(probes[i].fd);
+		if (attr_type < 0) {
+			kprobe_perf_event_legacy(-1, probes[i].func,
+						 probes[i].retprobe);
+		}
+		probes[i].fd = -1;
+	}
+}
+
+static int syscall_event_id(const char *name)
+{
+	char sysname[PATH_MAX];
+
+	snprintf(sysname, sizeof(sysname), "syscalls/%s", name);
+
+	return tp_event_id(sysname, false);
+}
+
+int syscall_perf_event(int prog_fd, const char *name)
+{
+	int id;
+
+	id = syscall_event_id(name);
+	if (id < 0)
+		return -1;
+
+	return tp_perf_event(prog_fd, id);
+}
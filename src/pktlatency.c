@@ -1,13 +1,16 @@
 // SPDX-License-Identifier: GPL-2.0
 /* Analyze latency of the host networking stack using PTP timestamps.
- * Works for virtual machines using tap devices for networking.
+ * Works for virtual machines using tap devices for networking and
+ * for local tcp and udp sockets.
  *
  * Copyright (c) 2019-2020 David Ahern <dsahern@gmail.com>
  */
 #include <linux/bpf.h>
 #include <linux/perf_event.h>
 #include <linux/rbtree.h>
+#include <linux/kernel.h>
 #include <sys/time.h>
+#include <net/if.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,35 +18,89 @@
 #include <signal.h>
 #include <errno.h>
 #include <libgen.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 #include <locale.h>
 
 #include <bpf/bpf.h>
 
 #include "pktlatency.h"
+#include "analyzer.h"
 #include "flow.h"
 #include "libbpf_helpers.h"
+#include "metrics.h"
+#include "output.h"
 #include "perf_events.h"
 #include "timestamps.h"
 
-#include "perf_events.c"
-
 struct task {
 	struct rb_node rb_node;
 
-	__u32 pid;
+	struct pktlat_hist_key key;
 	char comm[16];
 
 	/* previous histogram buckets */
 	__u64 buckets[PKTLAT_MAX_BUCKETS];
 };
 
-static bool done;
-static __u64 display_rate = 10 * NSEC_PER_SEC;
 static __u64 latency_gen_sample = 200;
 static pid_t disp_pid;
+static __u32 hooks = 1 << PKTLAT_HOOK_TAP;
+
+static const char *hook_names[PKTLAT_HOOK_MAX] = {
+	[PKTLAT_HOOK_TAP]	= "tap",
+	[PKTLAT_HOOK_TCP]	= "tcp",
+	[PKTLAT_HOOK_UDP]	= "udp",
+	[PKTLAT_HOOK_TUN_XMIT]	= "tun_xmit",
+};
+
+static const char *hook_name(__u8 hook)
+{
+	return hook < PKTLAT_HOOK_MAX ? hook_names[hook] : "unknown";
+}
+
+#ifndef ANALYZER_NO_MAIN
+/* comma separated list of hook names */
+static int parse_hooks(char *str)
+{
+	char *name, *save = NULL;
+	int i;
+
+	hooks = 0;
+	for (name = strtok_r(str, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < PKTLAT_HOOK_MAX; i++) {
+			if (!strcmp(name, hook_names[i]))
+				break;
+		}
+		if (i == PKTLAT_HOOK_MAX) {
+			fprintf(stderr, "Invalid measurement point %s\n", name);
+			return 1;
+		}
+		hooks |= 1 << i;
+	}
+
+	return 0;
+}
+#endif
 
 static struct rb_root all_tasks;
 
+static int task_cmp(const struct pktlat_hist_key *k1,
+		    const struct pktlat_hist_key *k2)
+{
+	if (k1->pid != k2->pid)
+		return k1->pid > k2->pid ? 1 : -1;
+	if (k1->ifindex != k2->ifindex)
+		return k1->ifindex > k2->ifindex ? 1 : -1;
+	if (k1->hook != k2->hook)
+		return k1->hook > k2->hook ? 1 : -1;
+
+	return 0;
+}
+
 static void remove_task(struct task *task)
 {
 	rb_erase(&task->rb_node, &all_tasks);
@@ -57,12 +114,14 @@ static int insert_task(struct rb_root *root, struct task *new_task)
 
 	while (*node != NULL) {
 		struct task *task;
+		int rc;
 
 		parent = *node;
 		task = container_of(parent, struct task, rb_node);
-		if (task->pid > new_task->pid)
+		rc = task_cmp(&task->key, &new_task->key);
+		if (rc > 0)
 			node = &(*node)->rb_left;
-		else if (task->pid < new_task->pid)
+		else if (rc < 0)
 			node = &(*node)->rb_right;
 		else
 			return -EEXIST;
@@ -83,10 +142,19 @@ static void get_task_name(struct task *task)
 	int fd = -1;
 	char *nl;
 
+	/* per device entry */
+	if (!task->key.pid) {
+		char dev[IFNAMSIZ];
+
+		if (if_indextoname(task->key.ifindex, dev))
+			snprintf(task->comm, sizeof(task->comm), "%s", dev);
+		return;
+	}
+
 	if (snprintf(fname, sizeof(fname),
-		     "/proc/%d/status", task->pid) >= sizeof(fname)) {
+		     "/proc/%d/status", task->key.pid) >= sizeof(fname)) {
 		fprintf(stderr, "fname buffer too small for pid %d\n",
-			task->pid);
+			task->key.pid);
 		goto out;
 	}
 
@@ -100,7 +168,7 @@ static void get_task_name(struct task *task)
 	len = read(fd, buf, sizeof(buf)-1);
 	if (len < 0) {
 		fprintf(stderr, "failed to read status file for pid %d\n",
-			task->pid);
+			task->key.pid);
 		goto out;
 	}
 	buf[len] = '\0';
@@ -108,7 +176,7 @@ static void get_task_name(struct task *task)
 	name = strstr(buf, "Name:");
 	if (!name) {
 		fprintf(stderr, "failed to find name for pid %d\n",
-			task->pid);
+			task->key.pid);
 		name = "";
 		goto out;
 	}
@@ -135,19 +203,21 @@ out:
 		close(fd);
 }
 
-static struct task *get_task(__u32 pid, bool create)
+static struct task *get_task(const struct pktlat_hist_key *key, bool create)
 {
 	struct rb_node **p = &all_tasks.rb_node;
 	struct rb_node *parent = NULL;
 	struct task *task;
+	int rc;
 
 	while (*p != NULL) {
 		parent = *p;
 
 		task = container_of(parent, struct task, rb_node);
-		if (task->pid > pid)
+		rc = task_cmp(&task->key, key);
+		if (rc > 0)
 			p = &(*p)->rb_left;
-		else if (task->pid < pid)
+		else if (rc < 0)
 			p = &(*p)->rb_right;
 		else
 			return task;
@@ -158,7 +228,7 @@ static struct task *get_task(__u32 pid, bool create)
 
 	task = calloc(1, sizeof(*task));
 	if (task) {
-		task->pid = pid;
+		task->key = *key;
 		get_task_name(task);
 
 		insert_task(&all_tasks, task);
@@ -167,6 +237,20 @@ static struct task *get_task(__u32 pid, bool create)
 	return task;
 }
 
+/* process exited; drop the entries for its hooks */
+static void remove_pid(__u32 pid)
+{
+	struct pktlat_hist_key key = { .pid = pid };
+	struct task *task;
+
+	for (key.hook = PKTLAT_HOOK_TAP; key.hook <= PKTLAT_HOOK_UDP;
+	     key.hook++) {
+		task = get_task(&key, false);
+		if (task)
+			remove_task(task);
+	}
+}
+
 static void print_header(void)
 {
 	printf("\n%15s  %3s  %5s  %3s  %5s  %s\n",
@@ -175,75 +259,495 @@ static void print_header(void)
 		"", "", "", "", "", "(msec)");
 }
 
-static __u64 ptp_mono_ref, ptp_ref;
+/* (ptp, monotonic) pairs kept per clock for the drift estimate;
+ * references are updated every second
+ */
+#define PTP_SAMPLES		64
+/* reads per cross timestamp; the one with least uncertainty is used */
+#define PTP_XTS_READS		5
+/* sanity bound on the estimated drift */
+#define PTP_MAX_DRIFT_PPB	500000
+
+struct ptp_clock {
+	int		index;		/* /dev/ptpN */
+	clockid_t	clkid;
+	enum phc_xtstamp_mode mode;
+
+	/* uncertainty of the last cross timestamp and the largest
+	 * distance of a sample from the fit
+	 */
+	__u64		xts_err;
+	double		residual;
+
+	__u64		ptp[PTP_SAMPLES];
+	__u64		mono[PTP_SAMPLES];
+	unsigned int	nsamples;
+	unsigned int	next;
+	unsigned int	rejects;
 
-static int update_ptp_reftime(void)
+	struct pktlat_ptp_ref ref;
+};
+
+struct ptp_dev {
+	char		name[IFNAMSIZ];
+	__u32		ifindex;
+	struct ptp_clock *clk;
+
+	/* bond master: reference follows the active slave */
+	bool		bond;
+	/* hardware timestamping enabled by us; disable on exit */
+	bool		hwtstamp;
+};
+
+static struct ptp_clock ptp_clocks[PKTLAT_MAX_DEVS];
+static unsigned int nclocks;
+static struct ptp_dev ptp_devs[PKTLAT_MAX_DEVS];
+static unsigned int ndevs;
+static struct ptp_clock *ptp_default;
+static int ptp_map_fd = -1;
+
+static struct ptp_clock *get_ptp_clock(int index)
+{
+	struct ptp_clock *clk;
+	char phc[32];
+	unsigned int i;
+
+	for (i = 0; i < nclocks; i++) {
+		if (ptp_clocks[i].index == index)
+			return &ptp_clocks[i];
+	}
+
+	if (nclocks == PKTLAT_MAX_DEVS) {
+		fprintf(stderr, "Too many ptp clocks\n");
+		return NULL;
+	}
+
+	snprintf(phc, sizeof(phc), "/dev/ptp%d", index);
+
+	clk = &ptp_clocks[nclocks];
+	clk->index = index;
+	clk->clkid = phc_open(phc);
+	if (clk->clkid == CLOCK_INVALID) {
+		fprintf(stderr, "Failed to open ptp clock %s\n", phc);
+		return NULL;
+	}
+	nclocks++;
+
+	return clk;
+}
+
+static struct ptp_dev *find_ptp_dev(__u32 ifindex)
+{
+	unsigned int i;
+
+	for (i = 0; i < ndevs; i++) {
+		if (ptp_devs[i].ifindex == ifindex)
+			return &ptp_devs[i];
+	}
+
+	return NULL;
+}
+
+static struct ptp_dev *new_ptp_dev(const char *name)
+{
+	struct ptp_dev *dev;
+	__u32 ifindex;
+
+	ifindex = if_nametoindex(name);
+	if (!ifindex) {
+		fprintf(stderr, "Invalid device %s\n", name);
+		return NULL;
+	}
+
+	dev = find_ptp_dev(ifindex);
+	if (dev)
+		return dev;
+
+	if (ndevs == PKTLAT_MAX_DEVS) {
+		fprintf(stderr, "Too many devices\n");
+		return NULL;
+	}
+
+	dev = &ptp_devs[ndevs++];
+	strncpy(dev->name, name, IFNAMSIZ - 1);
+	dev->ifindex = ifindex;
+
+	return dev;
+}
+
+static int read_bond_file(const char *bond, const char *file,
+			  char *buf, int len)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/bonding/%s",
+		 bond, file);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+
+	buf[n] = '\0';
+	if (n && buf[n - 1] == '\n')
+		buf[n - 1] = '\0';
+
+	return 0;
+}
+
+static int add_ptp_dev(const char *name);
+
+/* timestamps on packets received through a bond come from the PHC of
+ * a slave, but skb_iif is the bond. Add the slaves and point the bond
+ * at the clock of the active slave (or the first one).
+ */
+static int add_bond_dev(const char *name)
 {
-	static clockid_t ptp_clkid = CLOCK_INVALID;
-	__u64 ptp_mono_ref_new, ptp_ref_new, dt_mon, dt_ptp, dt;
+	char buf[1024], *slave, *save = NULL;
+	struct ptp_dev *dev;
+
+	if (read_bond_file(name, "slaves", buf, sizeof(buf)))
+		return 1;
 
-	if (ptp_clkid == CLOCK_INVALID) {
-		ptp_clkid = phc_open("/dev/ptp0");
-		if (ptp_clkid == CLOCK_INVALID) {
-			fprintf(stderr, "Failed to get ptp clock id\n");
+	for (slave = strtok_r(buf, " ", &save); slave;
+	     slave = strtok_r(NULL, " ", &save)) {
+		if (add_ptp_dev(slave))
 			return 1;
-		}
 	}
 
-	/* PTP clock takes MUCH longer to read (many usec).
-	 * MONOTONIC is fast (< 1 usec)
+	dev = new_ptp_dev(name);
+	if (!dev)
+		return 1;
+
+	dev->bond = true;
+
+	return 0;
+}
+
+static int add_ptp_dev(const char *name)
+{
+	struct ptp_clock *clk;
+	struct ptp_dev *dev;
+	char path[PATH_MAX];
+	int index;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/bonding", name);
+	if (access(path, F_OK) == 0)
+		return add_bond_dev(name);
+
+	index = get_phc_index(name);
+	if (index < 0) {
+		fprintf(stderr, "Device %s does not have a ptp clock\n", name);
+		return 1;
+	}
+
+	clk = get_ptp_clock(index);
+	if (!clk)
+		return 1;
+
+	dev = new_ptp_dev(name);
+	if (!dev)
+		return 1;
+
+	dev->clk = clk;
+
+	return 0;
+}
+
+/* no devices given; use every device with a ptp clock */
+static int find_ptp_devs(void)
+{
+	struct if_nameindex *ifs, *i;
+	char path[PATH_MAX];
+
+	ifs = if_nameindex();
+	if (!ifs) {
+		fprintf(stderr, "Failed to get list of devices\n");
+		return 1;
+	}
+
+	for (i = ifs; i->if_index; i++) {
+		snprintf(path, sizeof(path), "/sys/class/net/%s/bonding",
+			 i->if_name);
+		if (get_phc_index(i->if_name) < 0 && access(path, F_OK))
+			continue;
+
+		if (add_ptp_dev(i->if_name))
+			fprintf(stderr, "Skipping device %s\n", i->if_name);
+	}
+	if_freenameindex(ifs);
+
+	if (!ndevs) {
+		fprintf(stderr, "No devices with a ptp clock\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* predicted monotonic time for a ptp time */
+static __u64 ptp_to_mono(const struct pktlat_ptp_ref *ref, __u64 tstamp)
+{
+	__u64 dt, adj;
+
+	if (tstamp > ref->ptp_ref)
+		dt = tstamp - ref->ptp_ref;
+	else
+		dt = ref->ptp_ref - tstamp;
+
+	if (ref->drift_ppb < 0) {
+		adj = dt * (__u64)(-ref->drift_ppb) / NSEC_PER_SEC;
+		dt -= adj;
+	} else {
+		adj = dt * (__u64)ref->drift_ppb / NSEC_PER_SEC;
+		dt += adj;
+	}
+
+	if (tstamp > ref->ptp_ref)
+		return ref->mono_ref + dt;
+
+	return ref->mono_ref - dt;
+}
+
+/* least squares fit of monotonic vs ptp time over the saved samples.
+ * Values are taken relative to the newest sample to keep precision.
+ */
+static void ptp_clock_fit(struct ptp_clock *clk)
+{
+	unsigned int last = (clk->next + PTP_SAMPLES - 1) % PTP_SAMPLES;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, x, y, n, slope, drift;
+	double b, r, rmax = 0;
+	unsigned int i;
+
+	for (i = 0; i < clk->nsamples; i++) {
+		x = (double)(__s64)(clk->ptp[i] - clk->ptp[last]);
+		y = (double)(__s64)(clk->mono[i] - clk->mono[last]);
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	n = clk->nsamples;
+	slope = 1;
+	if (n > 1 && n * sxx - sx * sx > 0)
+		slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+
+	drift = (slope - 1) * 1e9;
+	if (drift > PTP_MAX_DRIFT_PPB)
+		drift = PTP_MAX_DRIFT_PPB;
+	else if (drift < -PTP_MAX_DRIFT_PPB)
+		drift = -PTP_MAX_DRIFT_PPB;
+
+	slope = 1 + drift / 1e9;
+	b = (sy - slope * sx) / n;
+
+	for (i = 0; i < clk->nsamples; i++) {
+		x = (double)(__s64)(clk->ptp[i] - clk->ptp[last]);
+		y = (double)(__s64)(clk->mono[i] - clk->mono[last]);
+		r = y - (b + slope * x);
+		if (r < 0)
+			r = -r;
+		if (r > rmax)
+			rmax = r;
+	}
+	clk->residual = rmax;
+
+	/* fitted line evaluated at the newest ptp sample */
+	clk->ref.ptp_ref = clk->ptp[last];
+	clk->ref.mono_ref = clk->mono[last] + (__s64)b;
+	clk->ref.drift_ppb = (__s64)drift;
+}
+
+static int ptp_clock_sample(struct ptp_clock *clk)
+{
+	struct phc_xtstamp xts;
+	__u64 mono, ptp, est, dt;
+
+	/* reading the PHC takes many usec; use a cross timestamp from
+	 * the driver if there is one, else the read with the smallest
+	 * MONOTONIC window around it
 	 */
-	ptp_ref_new = get_time_ns(ptp_clkid);
-	ptp_mono_ref_new = get_time_ns(CLOCK_MONOTONIC);
-	if (!ptp_ref_new || !ptp_mono_ref_new || (ptp_ref_new < ptp_ref)) {
+	if (phc_cross_tstamp(clk->clkid, &clk->mode, PTP_XTS_READS, &xts)) {
 		fprintf(stderr, "Failed to update PTP reference time\n");
 		return 1;
 	}
+	ptp = xts.ptp;
+	mono = xts.mono;
+	clk->xts_err = xts.err;
 
-	/* make sure both clock updates are reasonably sane */
-	if (ptp_ref) {
-		dt_ptp = ptp_ref_new - ptp_ref;
-		dt_mon = ptp_mono_ref_new - ptp_mono_ref;
-		dt = dt_ptp > dt_mon ? dt_ptp - dt_mon : dt_mon - dt_ptp;
-		if (dt > 1 * NSEC_PER_MSEC)
-			return 1;
+	/* make sure the sample is reasonably sane against the fit. If
+	 * it keeps failing the clock was stepped; start over.
+	 */
+	if (clk->nsamples) {
+		est = ptp_to_mono(&clk->ref, ptp);
+		dt = est > mono ? est - mono : mono - est;
+		if (ptp < clk->ref.ptp_ref || dt > 1 * NSEC_PER_MSEC) {
+			if (++clk->rejects < 3)
+				return 1;
+			clk->nsamples = 0;
+			clk->next = 0;
+		}
 	}
+	clk->rejects = 0;
 
-	ptp_ref = ptp_ref_new;
-	ptp_mono_ref = ptp_mono_ref_new;
+	clk->ptp[clk->next] = ptp;
+	clk->mono[clk->next] = mono;
+	clk->next = (clk->next + 1) % PTP_SAMPLES;
+	if (clk->nsamples < PTP_SAMPLES)
+		clk->nsamples++;
+
+	ptp_clock_fit(clk);
 
 	return 0;
 }
 
-static void hwtimestamp(__u64 hwtime, __u64 stime)
-{
-	__u64 dt = 0;
-
-	if (ptp_ref) {
-		__u64 hw_mono;
-
-		/* logic:
-		 * ----|------|--------|----
-		 *  hwtime  stime     ptp_ref
-		 * <hw_mono>        ptp_mono_ref
-		 *
-		 * hwtime is the PTP time value from the skb.
-		 * stime is the monotonic time from the bpf sample
-		 *
-		 * ptp_ref and ptp_mono_ref are the reference times
-		 * used to correlate PTP time to MONOTONIC times.
-		 *
-		 * Idea here is to compute the nanosecond delta in ptp
-		 * times and then transfer that to the monotonic time
-		 * to estimate hw_mono to some accuracy (< 10 usec)
-		 */
-		if (hwtime > ptp_ref)
-			hw_mono = ptp_mono_ref + (hwtime - ptp_ref);
-		else
-			hw_mono = ptp_mono_ref - (ptp_ref - hwtime);
-		dt = stime - hw_mono;
+/* bond master uses the clock of its active slave */
+static void update_bond_clock(struct ptp_dev *dev)
+{
+	struct ptp_dev *slave = NULL;
+	char buf[IFNAMSIZ + 1];
+	unsigned int i;
+
+	if (!read_bond_file(dev->name, "active_slave", buf, sizeof(buf)) &&
+	    buf[0])
+		slave = find_ptp_dev(if_nametoindex(buf));
+
+	/* no active slave (e.g., 802.3ad); use the first one */
+	for (i = 0; !slave && i < ndevs; i++) {
+		char master[PATH_MAX], link[PATH_MAX];
+		ssize_t n;
+
+		if (ptp_devs[i].bond)
+			continue;
+
+		snprintf(link, sizeof(link), "/sys/class/net/%s/master",
+			 ptp_devs[i].name);
+		n = readlink(link, master, sizeof(master) - 1);
+		if (n < 0)
+			continue;
+		master[n] = '\0';
+
+		if (!strcmp(basename(master), dev->name))
+			slave = &ptp_devs[i];
+	}
+
+	dev->clk = slave ? slave->clk : NULL;
+}
+
+/* sample each clock and push the device references to the kernel.
+ * Key 0 holds the reference of the first device, used for packets
+ * with an ingress device not in the map (e.g., vlans).
+ */
+static int update_ptp_reftime(void)
+{
+	__u32 key = 0;
+	unsigned int i;
+	int rc = 0;
+
+	for (i = 0; i < nclocks; i++)
+		ptp_clock_sample(&ptp_clocks[i]);
+
+	for (i = 0; i < ndevs; i++) {
+		struct ptp_dev *dev = &ptp_devs[i];
+
+		if (dev->bond)
+			update_bond_clock(dev);
+
+		if (!dev->clk || !dev->clk->nsamples) {
+			bpf_map_delete_elem(ptp_map_fd, &dev->ifindex);
+			continue;
+		}
+
+		if (!ptp_default)
+			ptp_default = dev->clk;
+
+		if (bpf_map_update_elem(ptp_map_fd, &dev->ifindex,
+					&dev->clk->ref, BPF_ANY)) {
+			fprintf(stderr,
+				"Failed to update ptp reference for %s\n",
+				dev->name);
+			rc = 1;
+		}
+	}
+
+	if (ptp_default &&
+	    bpf_map_update_elem(ptp_map_fd, &key, &ptp_default->ref,
+				BPF_ANY)) {
+		fprintf(stderr, "Failed to update default ptp reference\n");
+		rc = 1;
+	}
+
+	return rc;
+}
+
+static int enable_ptp_devs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ndevs; i++) {
+		if (ptp_devs[i].bond)
+			continue;
+
+		if (enable_hw_tstamp(ptp_devs[i].name))
+			return 1;
+		ptp_devs[i].hwtstamp = true;
 	}
 
+	return 0;
+}
+
+static void disable_ptp_devs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ndevs; i++) {
+		if (ptp_devs[i].hwtstamp)
+			disable_hw_tstamp(ptp_devs[i].name);
+		ptp_devs[i].hwtstamp = false;
+	}
+}
+
+/* latency from hardware timestamp to stime in nsec; 0 if unknown */
+static __u64 hw_latency(__u32 iif, __u64 hwtime, __u64 stime)
+{
+	struct ptp_dev *dev = find_ptp_dev(iif);
+	struct ptp_clock *clk;
+
+	clk = dev && dev->clk ? dev->clk : ptp_default;
+
+	/* logic:
+	 * ----|------|--------|----
+	 *  hwtime  stime     ptp_ref
+	 * <hw_mono>        mono_ref
+	 *
+	 * hwtime is the PTP time value from the skb.
+	 * stime is the monotonic time from the bpf sample
+	 *
+	 * ptp_ref and mono_ref are the reference times used to
+	 * correlate the PTP time of the ingress device to MONOTONIC
+	 * times, with drift_ppb the rate difference between them.
+	 *
+	 * Idea here is to compute the nanosecond delta in ptp
+	 * times and then transfer that to the monotonic time
+	 * to estimate hw_mono to some accuracy (< 10 usec)
+	 */
+	if (!clk || !clk->nsamples)
+		return 0;
+
+	return stime - ptp_to_mono(&clk->ref, hwtime);
+}
+
+static void hwtimestamp(__u32 iif, __u64 hwtime, __u64 stime)
+{
+	__u64 dt = hw_latency(iif, hwtime, stime);
+
 	if (0) {
 		struct timeval tv_hwtime = ns_to_timeval(hwtime);
 		struct timeval tv_stime = ns_to_timeval(stime);
@@ -262,19 +766,35 @@ static void hwtimestamp(__u64 hwtime, __u64 stime)
 	}
 }
 
-static void process_event(struct data *data)
+static int process_event(void *ctx, void *_data, int size)
 {
 	static unsigned char num_events;
-	struct task *task;
+	struct data *data = _data;
 	char buf[64];
 
 	switch (data->event_type) {
 	case EVENT_SAMPLE:
 		if (!data->tstamp)
-			return;
+			break;
 
 		if (disp_pid && data->pid != disp_pid)
-			return;
+			break;
+
+		if (!out_text()) {
+			out_begin();
+			out_u64("time", timestamp_ns(data->time));
+			out_u64("cpu", data->cpu);
+			out_str("hook", hook_name(data->hook));
+			out_u64("pid", data->pid);
+			out_u64("ifindex", data->ifindex);
+			out_u64("iif", data->iif);
+			out_u64("len", data->pkt_len);
+			out_u64("latency", hw_latency(data->iif, data->tstamp,
+						      data->time));
+			out_hex("protocol", ntohs(data->protocol));
+			out_end();
+			break;
+		}
 
 		/* unsigned char means print header every 255 events */
 		if (!num_events)
@@ -284,7 +804,9 @@ static void process_event(struct data *data)
 		printf("%15s  %3u  %5u  %3u  %5u ",
 		       timestamp(buf, sizeof(buf), data->time), data->cpu,
 		       data->pid, data->ifindex, data->pkt_len);
-		hwtimestamp(data->tstamp, data->time);
+		hwtimestamp(data->iif, data->tstamp, data->time);
+		if (data->hook != PKTLAT_HOOK_TAP)
+			printf("%s ", hook_name(data->hook));
 
 		if (data->protocol) {
 			__u32 len = data->pkt_len;
@@ -296,11 +818,11 @@ static void process_event(struct data *data)
 		}
 		break;
 	case EVENT_EXIT:
-		task = get_task(data->pid, false);
-		if (task)
-			remove_task(task);
+		remove_pid(data->pid);
 		break;
 	}
+
+	return LIBBPF_PERF_EVENT_CONT;
 }
 
 static void dump_buckets(struct task *task, __u64 *buckets)
@@ -316,7 +838,31 @@ static void dump_buckets(struct task *task, __u64 *buckets)
 		task->buckets[i] = buckets[i];
 	}
 
-	printf("\n%s[%u]", task->comm, task->pid);
+	if (!out_text()) {
+		/* upper bound of each bucket in usec */
+		static const char * const labels[PKTLAT_MAX_BUCKETS] = {
+			"25", "50", "75", "100", "250", "500", "inf",
+			"missing", "sum",
+		};
+
+		out_begin();
+		out_u64("time", timestamp_ns(0));
+		out_str("hist", "pktlatency");
+		out_str("hook", hook_name(task->key.hook));
+		out_u64("pid", task->key.pid);
+		out_u64("ifindex", task->key.ifindex);
+		out_str("comm", task->comm);
+		out_buckets(labels, diff, PKTLAT_MAX_BUCKETS);
+		out_end();
+		return;
+	}
+
+	if (task->key.pid)
+		printf("\n%s[%u] %s", task->comm, task->key.pid,
+		       hook_name(task->key.hook));
+	else
+		printf("\n%s/%u %s", task->comm, task->key.ifindex,
+		       hook_name(task->key.hook));
 	printf(":\n");
 
 	if (npkts == 0) {
@@ -339,43 +885,211 @@ static void dump_buckets(struct task *task, __u64 *buckets)
 }
 
 static int hist_map_fd;
+static __u32 hist_map_entries = PKTLAT_MAP_ENTRIES;
+static int ncpus;
+
+/* per-process histograms summed across cpus */
+struct pktlat_entry {
+	struct pktlat_hist_key key;
+	struct pktlat_hist_val val;
+};
+
+static struct pktlat_entry *entries;
+static int nentries;
+
+static int pktlat_alloc_entries(void)
+{
+	ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 0) {
+		fprintf(stderr, "Failed to get number of possible cpus\n");
+		return 1;
+	}
+
+	entries = calloc(hist_map_entries, sizeof(*entries));
+	if (!entries) {
+		fprintf(stderr, "Failed to allocate memory for map entries\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int sum_cpus(const void *key, const void *value, void *arg)
+{
+	const struct pktlat_hist_val *percpu = value;
+	struct pktlat_entry *e;
+	int cpu, i;
+
+	if (nentries == hist_map_entries)
+		return 1;
+
+	e = &entries[nentries++];
+	memcpy(&e->key, key, sizeof(e->key));
+	memset(&e->val, 0, sizeof(e->val));
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		for (i = 0; i < PKTLAT_MAX_BUCKETS; i++)
+			e->val.buckets[i] += percpu[cpu].buckets[i];
+	}
+
+	return 0;
+}
+
+/* read the histogram map into entries; returns number of entries */
+static int pktlat_read_map(void)
+{
+	int err;
+
+	nentries = 0;
+	err = bpf_map_walk(hist_map_fd, sum_cpus, NULL, false);
+	if (err < 0)
+		fprintf(stderr, "Failed to read histogram map: %s\n",
+			strerror(-err));
+
+	return nentries;
+}
 
 static void pktlat_dump_hist(void)
 {
-	struct pktlat_hist_key key = {}, next_key = {};
-	struct pktlat_hist_val val;
-	bool last_key = false;
+	struct pktlat_entry *e;
 	struct task *task;
 	char buf[64];
+	int i, n;
 
-	printf("%s:\n", timestamp(buf, sizeof(buf), 0));
+	if (out_text())
+		printf("%s:\n", timestamp(buf, sizeof(buf), 0));
 
-	while (!last_key) {
-		if (bpf_map_get_next_key(hist_map_fd, &key, &next_key))
-			last_key = true;
+	n = pktlat_read_map();
+	for (i = 0; i < n; i++) {
+		e = &entries[i];
 
-		//printf("key %u next_key %u\n", key.pid, next_key.pid);
-		if (bpf_map_lookup_elem(hist_map_fd, &key, &val))
-			goto next;
+		if (disp_pid && disp_pid != e->key.pid)
+			continue;
 
-		if (disp_pid && disp_pid != key.pid)
-			goto next;
-
-		task = get_task(key.pid, true);
+		task = get_task(&e->key, true);
 		if (!task) {
 			fprintf(stderr,
 				"Failed to create task entry for pid %u\n",
-				key.pid);
-			goto next;
+				e->key.pid);
+			continue;
 		}
 
-		dump_buckets(task, val.buckets);
-		printf("\n");
-next:
-		key = next_key;
+		dump_buckets(task, e->val.buckets);
+		if (out_text())
+			printf("\n");
 	}
 }
 
+static void pktlat_metrics_pass(struct mbuf *mb, int n, bool hist)
+{
+	static const double le[] = {
+		PKTLAT_BUCKET_0 / 1e6, PKTLAT_BUCKET_1 / 1e6,
+		PKTLAT_BUCKET_2 / 1e6, PKTLAT_BUCKET_3 / 1e6,
+		PKTLAT_BUCKET_4 / 1e6, PKTLAT_BUCKET_5 / 1e6,
+	};
+	char labels[128], comm[40];
+	struct pktlat_entry *e;
+	struct task *task;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		e = &entries[i];
+
+		if (disp_pid && disp_pid != e->key.pid)
+			continue;
+
+		task = get_task(&e->key, true);
+		snprintf(labels, sizeof(labels),
+			 "hook=\"%s\",pid=\"%u\",ifindex=\"%u\",comm=\"%s\"",
+			 hook_name(e->key.hook), e->key.pid, e->key.ifindex,
+			 metrics_label_escape(comm, sizeof(comm),
+					      task ? task->comm : ""));
+
+		if (hist)
+			metrics_hist(mb, "pktlatency_seconds", labels, le,
+				     e->val.buckets, 7, e->val.buckets[8] / 1e6);
+		else
+			metrics_counter(mb, "pktlatency_missing_timestamp",
+					labels, e->val.buckets[7]);
+	}
+}
+
+/* quality of the PHC to MONOTONIC conversion per clock */
+static void pktlat_dump_clocks(void)
+{
+	struct ptp_clock *clk;
+	unsigned int i;
+
+	for (i = 0; i < nclocks; i++) {
+		clk = &ptp_clocks[i];
+		if (!clk->nsamples)
+			continue;
+
+		if (!out_text()) {
+			out_begin();
+			out_u64("time", timestamp_ns(0));
+			out_str("hist", "pktlatency_ptp");
+			out_u64("phc", clk->index);
+			out_str("method", phc_xtstamp_name(clk->mode));
+			out_u64("uncertainty", clk->xts_err);
+			out_u64("residual", (__u64)clk->residual);
+			out_s64("drift_ppb", clk->ref.drift_ppb);
+			out_end();
+			continue;
+		}
+
+		printf("ptp%d: %s cross timestamp, uncertainty %llu nsec, "
+		       "fit residual %llu nsec, drift %lld ppb\n",
+		       clk->index, phc_xtstamp_name(clk->mode), clk->xts_err,
+		       (__u64)clk->residual, clk->ref.drift_ppb);
+	}
+}
+
+static void pktlat_metrics_clocks(struct mbuf *mb, bool uncertainty)
+{
+	struct ptp_clock *clk;
+	char labels[64];
+	unsigned int i;
+
+	for (i = 0; i < nclocks; i++) {
+		clk = &ptp_clocks[i];
+		if (!clk->nsamples)
+			continue;
+
+		snprintf(labels, sizeof(labels), "phc=\"ptp%d\",method=\"%s\"",
+			 clk->index, phc_xtstamp_name(clk->mode));
+		if (uncertainty)
+			metrics_gauge(mb, "pktlatency_ptp_uncertainty_seconds",
+				      labels, clk->xts_err / 1e9);
+		else
+			metrics_gauge(mb, "pktlatency_ptp_residual_seconds",
+				      labels, clk->residual / 1e9);
+	}
+}
+
+static int pktlat_metrics(struct mbuf *mb, void *arg)
+{
+	int n = pktlat_read_map();
+
+	/* families can not be interleaved, so walk the entries per family */
+	metrics_family(mb, "pktlatency_seconds", METRICS_HISTOGRAM,
+		       "Time from NIC timestamp to copy to userspace");
+	pktlat_metrics_pass(mb, n, true);
+
+	metrics_family(mb, "pktlatency_missing_timestamp", METRICS_COUNTER,
+		       "Packets without a hardware timestamp");
+	pktlat_metrics_pass(mb, n, false);
+
+	metrics_family(mb, "pktlatency_ptp_uncertainty_seconds", METRICS_GAUGE,
+		       "Uncertainty of the last PHC to monotonic sample");
+	pktlat_metrics_clocks(mb, true);
+
+	metrics_family(mb, "pktlatency_ptp_residual_seconds", METRICS_GAUGE,
+		       "Largest distance of a PHC sample from the drift fit");
+	pktlat_metrics_clocks(mb, false);
+
+	return 0;
+}
+
 static int ctl_map_fd;
 static int gen_samples;
 
@@ -385,14 +1099,10 @@ static int pktlat_setup_ctl_map(void)
 	__u32 idx = 0;
 	int err;
 
-	if (update_ptp_reftime())
-		return 1;
-
-	ctl.ptp_ref = ptp_ref;
-	ctl.mono_ref = ptp_mono_ref;
 	ctl.ifindex_min = 4;
 	ctl.gen_samples = gen_samples;
 	ctl.latency_gen_sample = latency_gen_sample;
+	ctl.hooks = hooks;
 
 	err = bpf_map_update_elem(ctl_map_fd, &idx, &ctl, BPF_ANY);
 	if (err) {
@@ -403,17 +1113,153 @@ static int pktlat_setup_ctl_map(void)
 	return 0;
 }
 
-static int pktlat_process_events(void)
+/* refresh the PHC to MONOTONIC references once a second */
+static int pktlat_poll(struct analyzer *a)
+{
+	static __u64 t_ref;
+	__u64 t_mono = get_time_ns(CLOCK_MONOTONIC);
+
+	if (t_mono > t_ref + NSEC_PER_SEC) {
+		t_ref = t_mono;
+		update_ptp_reftime();
+	}
+
+	return 0;
+}
+
+static int pktlat_dump(struct analyzer *a)
+{
+	pktlat_dump_hist();
+	pktlat_dump_clocks();
+
+	return 0;
+}
+
+/* probes per hook; the read and recvmsg probes tell the copy
+ * tracepoint which hook a copy belongs to
+ */
+static const struct {
+	__u32 hook;
+	const char *func;
+	bool retprobe;
+} hook_probes[] = {
+	{ PKTLAT_HOOK_TAP,	"tun_chr_read_iter",	false },
+	{ PKTLAT_HOOK_TAP,	"tun_chr_read_iter",	true },
+	{ PKTLAT_HOOK_TAP,	"tun_recvmsg",		false },
+	{ PKTLAT_HOOK_TAP,	"tun_recvmsg",		true },
+	{ PKTLAT_HOOK_TCP,	"tcp_recvmsg",		false },
+	{ PKTLAT_HOOK_TCP,	"tcp_recvmsg",		true },
+	{ PKTLAT_HOOK_UDP,	"udp_recvmsg",		false },
+	{ PKTLAT_HOOK_UDP,	"udp_recvmsg",		true },
+	{ PKTLAT_HOOK_UDP,	"udpv6_recvmsg",	false },
+	{ PKTLAT_HOOK_UDP,	"udpv6_recvmsg",	true },
+	{ PKTLAT_HOOK_TUN_XMIT,	"tun_net_xmit",		false },
+};
+
+static struct kprobe_data pktlat_probes[ARRAY_SIZE(hook_probes)];
+
+/* attach only the probes of the selected hooks */
+static void pktlat_select_probes(struct analyzer *a)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(hook_probes); i++) {
+		if (!(hooks & (1 << hook_probes[i].hook)))
+			continue;
+
+		pktlat_probes[n].func = hook_probes[i].func;
+		pktlat_probes[n].retprobe = hook_probes[i].retprobe;
+		pktlat_probes[n].fd = -1;
+		n++;
+	}
+
+	a->probes = pktlat_probes;
+	a->nprobes = n;
+}
+
+static int pktlat_init(struct analyzer *a)
+{
+	pktlat_select_probes(a);
+
+	if (!ndevs && find_ptp_devs())
+		return 1;
+
+	if (!entries && pktlat_alloc_entries())
+		return 1;
+
+	ctl_map_fd = analyzer_map_fd(a, "pktlat_ctl_map");
+	ptp_map_fd = analyzer_map_fd(a, "pktlat_ptp_map");
+	hist_map_fd = analyzer_map_fd(a, "pktlat_map");
+	if (ctl_map_fd < 0 || ptp_map_fd < 0 || hist_map_fd < 0)
+		return 1;
+
+	if (update_ptp_reftime() || pktlat_setup_ctl_map())
+		return 1;
+
+	return enable_ptp_devs();
+}
+
+static void pktlat_fini(struct analyzer *a)
+{
+	disable_ptp_devs();
+}
+
+static const char *pktlat_tps[] = {
+	"skb/skb_copy_datagram_iovec",
+	"sched/sched_process_exit",
+	NULL,
+};
+
+static struct perf_channel_opts pktlat_events = {
+	PERF_CHANNEL_RECORD(struct data, time, cpu),
+	.handler = process_event,
+	.nevents = 1000,
+	.cpu = -1,
+};
+
+struct analyzer pktlatency_analyzer = {
+	.name		= "pktlatency",
+	.desc		= "latency from NIC timestamp to copy to userspace",
+	.objfile	= "pktlatency.o",
+	.tps		= pktlat_tps,
+	.events		= &pktlat_events,
+	.init		= pktlat_init,
+	.fini		= pktlat_fini,
+	.poll		= pktlat_poll,
+	.dump		= pktlat_dump,
+	.metrics	= pktlat_metrics,
+};
+
+#ifndef ANALYZER_NO_MAIN
+static __u64 display_rate = 10 * NSEC_PER_SEC;
+static const char *metrics_addr;
+static const char *metrics_file;
+static bool done;
+
+static int pktlat_process_events(void *arg)
 {
+	static __u64 t_last;
 	__u64 t_mono = get_time_ns(CLOCK_MONOTONIC);
 
-	process_events();
+	pktlat_poll(&pktlatency_analyzer);
 
-	if (t_mono > ptp_mono_ref + display_rate) {
+	if (t_mono > t_last + display_rate) {
+		t_last = t_mono;
 		pktlat_setup_ctl_map();
-		pktlat_dump_hist();
+		if (metrics_file)
+			metrics_textfile_write(metrics_file, pktlat_metrics,
+					       NULL);
+		else if (!metrics_addr)
+			pktlat_dump(&pktlatency_analyzer);
 	}
 
+	/* one write per round */
+	if (out_flush())
+		return 1;
+
+	if (metrics_server_poll(0))
+		return 1;
+
 	return done;
 }
 
@@ -426,9 +1272,6 @@ static void sig_handler(int signo)
 
 	printf("Terminating by signal %d\n", signo);
 
-	disable_hw_tstamp("eth0");
-	disable_hw_tstamp("eth1");
-
 	done = 1;
 }
 
@@ -437,34 +1280,36 @@ static void print_usage(char *prog)
 	printf(
 	"usage: %s OPTS\n\n"
 	"	-f bpf-file    bpf filename to load\n"
+	"	-i dev         device with hardware timestamps; can be repeated\n"
+	"	               (default: all devices with a ptp clock)\n"
 	"	-p pid         only show data for specific pid\n"
+	"	-H points      measurement points: tap, tcp, udp, tun_xmit\n"
+	"	               (comma separated, default: tap)\n"
+	"	-m entries     max number of processes tracked (default %u)\n"
 	"	-l time        latency at which to generate samples (usec, default: 200)\n"
 	"	-t rate        time rate (seconds) to dump stats\n"
 	"	-s             show samples\n"
-	, basename(prog));
+	"	-e [addr:]port export OpenMetrics over http\n"
+	"	-E file        write metrics to textfile every rate seconds\n"
+	"	-O format      output format: text (default), json or csv\n"
+	, basename(prog), PKTLAT_MAP_ENTRIES);
 }
 
 int main(int argc, char **argv)
 {
-	struct bpf_prog_load_attr prog_load_attr = { };
-	char *objfile = "pktlatency.o";
-	const char *tps[] = {
-		"skb/skb_copy_datagram_iovec",
-		"sched/sched_process_exit",
-		NULL,
-	};
-	bool filename_set = false;
-	struct bpf_object *obj;
-	struct bpf_map *map;
-	int nevents = 1000;
+	struct analyzer *a = &pktlatency_analyzer;
+	const char *objfile = NULL;
 	int rc, tmp;
 
-	while ((rc = getopt(argc, argv, "f:p:t:l:s")) != -1)
+	while ((rc = getopt(argc, argv, "f:i:p:H:m:t:l:se:E:O:")) != -1)
 	{
 		switch(rc) {
 		case 'f':
 			objfile = optarg;
-			filename_set = true;
+			break;
+		case 'i':
+			if (add_ptp_dev(optarg))
+				return 1;
 			break;
 		case 'p':
 			tmp = atoi(optarg);
@@ -474,6 +1319,18 @@ int main(int argc, char **argv)
 			}
 			disp_pid = tmp;
 			break;
+		case 'H':
+			if (parse_hooks(optarg))
+				return 1;
+			break;
+		case 'm':
+			tmp = atoi(optarg);
+			if (tmp <= 0) {
+				fprintf(stderr, "Invalid number of map entries\n");
+				return 1;
+			}
+			hist_map_entries = tmp;
+			break;
 		case 't':
 			tmp = atoi(optarg);
 			if (!tmp) {
@@ -488,6 +1345,16 @@ int main(int argc, char **argv)
 		case 's':
 			gen_samples = true;
 			break;
+		case 'e':
+			metrics_addr = optarg;
+			break;
+		case 'E':
+			metrics_file = optarg;
+			break;
+		case 'O':
+			if (out_set_format(optarg))
+				return 1;
+			break;
 		default:
 			print_usage(argv[0]);
 			return 1;
@@ -501,47 +1368,36 @@ int main(int argc, char **argv)
 	if (set_reftime())
 		return 1;
 
-	if (load_obj_file(&prog_load_attr, &obj, objfile, filename_set))
+	if (!ndevs && find_ptp_devs())
 		return 1;
 
-	rc = do_tracepoint(obj, tps);
-	if (rc)
-		return rc;
-
-	/*
-	 * get fd to the control map and histogram map
-	 */
-	map = bpf_object__find_map_by_name(obj, "pktlat_ctl_map");
-	if (!map) {
-		printf("Failed to get control map in obj file\n");
-		return 1;
-	}
-	ctl_map_fd = bpf_map__fd(map);
-	if (pktlat_setup_ctl_map())
+	if (load_obj_set_max_entries("pktlat_map", hist_map_entries) ||
+	    pktlat_alloc_entries())
 		return 1;
 
-	map = bpf_object__find_map_by_name(obj, "pktlat_map");
-	if (!map) {
-		printf("Failed to get histogram map in obj file\n");
+	if (metrics_addr &&
+	    metrics_server_open(metrics_addr, pktlat_metrics, NULL))
 		return 1;
-	}
-	hist_map_fd = bpf_map__fd(map);
 
-	if (enable_hw_tstamp("eth0") ||
-	    enable_hw_tstamp("eth1"))
+	if (analyzer_enable(a, objfile))
 		return 1;
 
+	rc = 1;
 	if (signal(SIGINT, sig_handler) ||
 	    signal(SIGHUP, sig_handler) ||
 	    signal(SIGUSR1, sig_handler) ||
 	    signal(SIGTERM, sig_handler)) {
 		perror("signal");
-		return 1;
+		goto out;
 	}
 
-	if (configure_perf_event_channel(obj, nevents))
-		return 1;
-
 	/* main event loop */
-	return perf_event_loop(NULL, NULL, pktlat_process_events);
+	rc = perf_event_loop_fd(&a->ch, 1, metrics_server_fd(), NULL,
+				pktlat_process_events, NULL);
+out:
+	metrics_server_close();
+	analyzer_disable(a);
+
+	return rc;
 }
+#endif
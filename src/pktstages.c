@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Break down rx latency of the host stack by stage.
+ *
+ * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
+ */
+#include <linux/bpf.h>
+#include <linux/kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <bpf/bpf.h>
+
+#include "pktstages.h"
+#include "analyzer.h"
+#include "libbpf_helpers.h"
+#include "output.h"
+#include "timestamps.h"
+
+#define PKTSTAGE_NHIST	(PKTSTAGE_MAX + 1)
+
+static const char *stage_names[PKTSTAGE_NHIST] = {
+	[PKTSTAGE_GRO]		= "gro",
+	[PKTSTAGE_NETIF]	= "netif",
+	[PKTSTAGE_OVS]		= "ovs",
+	[PKTSTAGE_TUN]		= "tun",
+	[PKTSTAGE_COPY]		= "copy",
+	[PKTSTAGE_TOTAL]	= "total",
+};
+
+static struct pktstage_hist_val hists[PKTSTAGE_NHIST];
+static __u64 prev_buckets[PKTSTAGE_NHIST][PKTSTAGE_MAX_BUCKETS];
+static int hist_map_fd = -1;
+static int ncpus;
+
+/* sum the per-cpu values of a stage */
+static int sum_cpus(const void *key, const void *value, void *arg)
+{
+	const struct pktstage_hist_val *percpu = value;
+	__u32 idx = *(const __u32 *)key;
+	int cpu, i;
+
+	if (idx >= PKTSTAGE_NHIST)
+		return 0;
+
+	memset(&hists[idx], 0, sizeof(hists[idx]));
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		for (i = 0; i < PKTSTAGE_MAX_BUCKETS; i++)
+			hists[idx].buckets[i] += percpu[cpu].buckets[i];
+	}
+
+	return 0;
+}
+
+static int read_hists(void)
+{
+	int err;
+
+	err = bpf_map_walk(hist_map_fd, sum_cpus, NULL, false);
+	if (err) {
+		fprintf(stderr, "Failed to read histogram map: %s\n",
+			strerror(-err));
+		return 1;
+	}
+
+	return 0;
+}
+
+static void dump_buckets(int stage, __u64 *buckets, __u64 *prev_buckets)
+{
+	__u64 diff[PKTSTAGE_MAX_BUCKETS], npkts = 0;
+	int i;
+
+	for (i = 0; i < PKTSTAGE_MAX_BUCKETS; ++i) {
+		diff[i] = buckets[i] - prev_buckets[i];
+		if (i < PKTSTAGE_MAX_BUCKETS - 1)
+			npkts += diff[i];
+
+		prev_buckets[i] = buckets[i];
+	}
+
+	if (!out_text()) {
+		/* upper bound of each bucket in usec */
+		static const char * const labels[PKTSTAGE_MAX_BUCKETS] = {
+			"1", "2", "5", "10", "25", "50", "100", "500", "inf",
+			"sum_nsec",
+		};
+		char name[32];
+
+		snprintf(name, sizeof(name), "pktstages_%s", stage_names[stage]);
+		out_hist(name, labels, diff, PKTSTAGE_MAX_BUCKETS);
+		return;
+	}
+
+	if (npkts == 0)
+		return;
+
+	printf("%s: %'llu packets, average %'llu nsec\n",
+	       stage_names[stage], npkts, diff[9] / npkts);
+	printf("       0  - %4u:   %'8llu\n", PKTSTAGE_BUCKET_0, diff[0]);
+	printf("   %4u+  - %4u:   %'8llu\n", PKTSTAGE_BUCKET_0, PKTSTAGE_BUCKET_1, diff[1]);
+	printf("   %4u+  - %4u:   %'8llu\n", PKTSTAGE_BUCKET_1, PKTSTAGE_BUCKET_2, diff[2]);
+	printf("   %4u+  - %4u:   %'8llu\n", PKTSTAGE_BUCKET_2, PKTSTAGE_BUCKET_3, diff[3]);
+	printf("   %4u+  - %4u:   %'8llu\n", PKTSTAGE_BUCKET_3, PKTSTAGE_BUCKET_4, diff[4]);
+	printf("   %4u+  - %4u:   %'8llu\n", PKTSTAGE_BUCKET_4, PKTSTAGE_BUCKET_5, diff[5]);
+	printf("   %4u+  - %4u:   %'8llu\n", PKTSTAGE_BUCKET_5, PKTSTAGE_BUCKET_6, diff[6]);
+	printf("   %4u+  - %4u:   %'8llu\n", PKTSTAGE_BUCKET_6, PKTSTAGE_BUCKET_7, diff[7]);
+	printf("   %4u+  -   up:   %'8llu\n", PKTSTAGE_BUCKET_7, diff[8]);
+}
+
+static int pktstages_dump(struct analyzer *a)
+{
+	char buf[64];
+	int i;
+
+	if (read_hists())
+		return 1;
+
+	if (out_text())
+		printf("%s:\n", timestamp(buf, sizeof(buf), 0));
+
+	/* time to reach each stage from the previous one, then total */
+	for (i = 0; i < PKTSTAGE_NHIST; i++)
+		dump_buckets(i, hists[i].buckets, prev_buckets[i]);
+
+	if (out_text())
+		printf("\n");
+
+	return 0;
+}
+
+static int pktstages_metrics(struct mbuf *mb, void *arg)
+{
+	static const double le[] = {
+		PKTSTAGE_BUCKET_0 / 1e6, PKTSTAGE_BUCKET_1 / 1e6,
+		PKTSTAGE_BUCKET_2 / 1e6, PKTSTAGE_BUCKET_3 / 1e6,
+		PKTSTAGE_BUCKET_4 / 1e6, PKTSTAGE_BUCKET_5 / 1e6,
+		PKTSTAGE_BUCKET_6 / 1e6, PKTSTAGE_BUCKET_7 / 1e6,
+	};
+	char labels[32];
+	int i;
+
+	if (read_hists())
+		return 1;
+
+	metrics_family(mb, "pktstages_seconds", METRICS_HISTOGRAM,
+		       "Time from the previous rx stage to this one");
+	for (i = 0; i < PKTSTAGE_NHIST; i++) {
+		snprintf(labels, sizeof(labels), "stage=\"%s\"",
+			 stage_names[i]);
+		metrics_hist(mb, "pktstages_seconds", labels, le,
+			     hists[i].buckets, 9, hists[i].buckets[9] / 1e9);
+	}
+
+	return 0;
+}
+
+static int pktstages_init(struct analyzer *a)
+{
+	ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 0) {
+		fprintf(stderr, "Failed to get number of possible cpus\n");
+		return 1;
+	}
+
+	hist_map_fd = analyzer_map_fd(a, "pktstage_hist_map");
+	if (hist_map_fd < 0)
+		return 1;
+
+	memset(prev_buckets, 0, sizeof(prev_buckets));
+
+	return 0;
+}
+
+/* kprobe stages; netif and copy are tracepoints and always on.
+ * ovs is off by default since it needs the openvswitch module.
+ */
+static struct {
+	const char	*name;
+	const char	*func;
+	bool		enabled;
+} kprobe_stages[] = {
+	{ "gro", "napi_gro_receive", true },
+	{ "ovs", "ovs_vport_receive", false },
+	{ "tun", "tun_net_xmit", true },
+};
+
+static struct kprobe_data probes[ARRAY_SIZE(kprobe_stages)] = {
+	{ .func = "napi_gro_receive", .fd = -1 },
+	{ .func = "tun_net_xmit", .fd = -1 },
+};
+
+static const char *tps[] = {
+	"net/netif_receive_skb",
+	"skb/skb_copy_datagram_iovec",
+	NULL
+};
+
+/* comma separated list of kprobe stages to enable */
+static int set_stages(struct analyzer *a, const char *arg)
+{
+	char *str, *name, *save = NULL;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(kprobe_stages); i++)
+		kprobe_stages[i].enabled = false;
+
+	str = strdup(arg);
+	if (!str)
+		return 1;
+
+	for (name = strtok_r(str, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < ARRAY_SIZE(kprobe_stages); i++) {
+			if (!strcmp(name, kprobe_stages[i].name))
+				break;
+		}
+		if (i == ARRAY_SIZE(kprobe_stages)) {
+			fprintf(stderr, "Invalid stage %s\n", name);
+			free(str);
+			return 1;
+		}
+		kprobe_stages[i].enabled = true;
+	}
+	free(str);
+
+	for (i = 0; i < ARRAY_SIZE(kprobe_stages); i++) {
+		if (!kprobe_stages[i].enabled)
+			continue;
+
+		probes[n].func = kprobe_stages[i].func;
+		probes[n].fd = -1;
+		n++;
+	}
+	a->nprobes = n;
+	a->probes = n ? probes : NULL;
+
+	return 0;
+}
+
+static int pktstages_parse_opt(struct analyzer *a, int opt, const char *arg)
+{
+	int n;
+
+	switch (opt) {
+	case 'S':
+		return set_stages(a, arg);
+	case 'm':
+		n = atoi(arg);
+		if (n <= 0) {
+			fprintf(stderr, "Invalid number of map entries\n");
+			return 1;
+		}
+		return load_obj_set_max_entries("pktstage_skb_map", n);
+	}
+
+	return 1;
+}
+
+struct analyzer pktstages_analyzer = {
+	.name		= "pktstages",
+	.desc		= "rx latency by stage of the host stack",
+	.objfile	= "pktstages.o",
+	.probes		= probes,
+	.nprobes	= 2,
+	.tps		= tps,
+	.optstr		= "S:m:",
+	.usage		=
+	"	-S stages      kprobe stages to trace: gro, ovs, tun\n"
+	"	               (comma separated, default: gro,tun)\n"
+	"	-m entries     max number of packets in flight tracked\n",
+	.parse_opt	= pktstages_parse_opt,
+	.init		= pktstages_init,
+	.dump		= pktstages_dump,
+	.metrics	= pktstages_metrics,
+};
+
+#ifndef ANALYZER_NO_MAIN
+int main(int argc, char **argv)
+{
+	return analyzer_main(&pktstages_analyzer, argc, argv);
+}
+#endif
@@ -11,6 +11,7 @@
 #include <net/if.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <unistd.h>
 #include <errno.h>
 #include <libgen.h>
 
@@ -18,14 +19,12 @@
 #include <bpf/libbpf.h>
 
 #include "tcp_probe.h"
+#include "analyzer.h"
 #include "libbpf_helpers.h"
+#include "output.h"
 #include "perf_events.h"
 #include "timestamps.h"
 
-#include "perf_events.c"
-
-static bool done;
-
 static void print_header(void)
 {
 	printf("%15s %16s/%4s %16s/%4s %5s %8s %8s %8s\n",
@@ -61,6 +60,48 @@ static void log_address(struct sockaddr *sa)
 	}
 }
 
+static void out_address(const char *key, struct sockaddr *sa)
+{
+	char addrstr[INET6_ADDRSTRLEN + 8];
+	char buf[INET6_ADDRSTRLEN];
+
+	if (sa->sa_family == AF_INET) {
+		struct sockaddr_in *s = (struct sockaddr_in *) sa;
+
+		snprintf(addrstr, sizeof(addrstr), "%s:%d",
+			 inet_ntop(AF_INET, &s->sin_addr, buf, sizeof(buf)),
+			 ntohs(s->sin_port));
+	} else if (sa->sa_family == AF_INET6) {
+		struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) sa;
+
+		snprintf(addrstr, sizeof(addrstr), "[%s]:%d",
+			 inet_ntop(AF_INET6, &s6->sin6_addr, buf, sizeof(buf)),
+			 ntohs(s6->sin6_port));
+	} else {
+		addrstr[0] = '\0';
+	}
+
+	out_str(key, addrstr);
+}
+
+static void out_event(struct data *data)
+{
+	out_begin();
+	out_u64("time", timestamp_ns(data->time));
+	out_u64("cpu", data->cpu);
+	out_address("src", &data->s_addr);
+	out_address("dst", &data->d_addr);
+	out_u64("len", data->data_len);
+	out_u64("mark", data->mark);
+	out_u64("snd_nxt", data->snd_nxt);
+	out_u64("snd_una", data->snd_una);
+	out_u64("snd_cwnd", data->snd_cwnd);
+	out_u64("snd_wnd", data->snd_wnd);
+	out_u64("rcv_wnd", data->rcv_wnd);
+	out_u64("srtt", data->srtt);
+	out_end();
+}
+
 static bool addr_uses_port(struct sockaddr *sa, __u16 port)
 {
 	if (sa->sa_family == AF_INET) {
@@ -76,11 +117,18 @@ static bool addr_uses_port(struct sockaddr *sa, __u16 port)
 	return false;
 }
 
-static void process_event(struct data *data)
+static int process_event(void *ctx, void *_data, int size)
 {
+	struct data *data = _data;
+
 	if (addr_uses_port(&data->s_addr, 22) ||
 	    addr_uses_port(&data->d_addr, 22))
-		return;
+		return LIBBPF_PERF_EVENT_CONT;
+
+	if (!out_text()) {
+		out_event(data);
+		return LIBBPF_PERF_EVENT_CONT;
+	}
 
 	show_timestamps(data->time);
 
@@ -91,11 +139,48 @@ static void process_event(struct data *data)
 		data->data_len, data->mark, data->snd_nxt, data->snd_una,
 		data->snd_cwnd, data->snd_wnd, data->rcv_wnd);
 	fflush(stdout);
+
+	return LIBBPF_PERF_EVENT_CONT;
 }
 
-static int tcpprobe_complete(void)
+static const char *tcp_probe_tps[] = {
+	"tcp/tcp_probe",
+	NULL
+};
+
+static struct perf_channel_opts tcp_probe_events = {
+	PERF_CHANNEL_RECORD(struct data, time, cpu),
+	.handler = process_event,
+	.nevents = 1000,
+	.cpu = -1,
+};
+
+static int tcp_probe_init(struct analyzer *a)
 {
-	process_events();
+	if (out_text())
+		print_header();
+
+	return 0;
+}
+
+struct analyzer tcp_probe_analyzer = {
+	.name		= "tcp_probe",
+	.desc		= "tcp_probe tracepoint events",
+	.objfile	= "tcp_probe.o",
+	.tps		= tcp_probe_tps,
+	.events		= &tcp_probe_events,
+	.init		= tcp_probe_init,
+};
+
+#ifndef ANALYZER_NO_MAIN
+static bool done;
+
+static int tcpprobe_complete(void *arg)
+{
+	/* one write per round */
+	if (out_flush())
+		return 1;
+
 	return done;
 }
 
@@ -110,28 +195,45 @@ static void print_usage(char *prog)
 	printf(
 	"usage: %s OPTS\n\n"
 	"	-f bpf-file    bpf filename to load\n"
+	"	-w msec        reorder window for sorting events across cpus\n"
+	"	-B num         max events queued for sorting (default unlimited)\n"
+	"	-O format      output format: text (default), json or csv\n"
 	, basename(prog));
 }
 
 int main(int argc, char **argv)
 {
-	char *objfile = "tcp_probe.o";
-	struct bpf_prog_load_attr prog_load_attr = { };
-	const char *tps[] = {
-		"tcp/tcp_probe",
-		NULL
-	};
-	bool filename_set = false;
-	struct bpf_object *obj;
-	int nevents = 1000;
-	int rc;
-
-	while ((rc = getopt(argc, argv, "f:tTD")) != -1)
+	struct perf_channel_opts *opts = &tcp_probe_events;
+	struct analyzer *a = &tcp_probe_analyzer;
+	struct perf_channel_stats stats;
+	const char *objfile = NULL;
+	int rc, tmp;
+
+	while ((rc = getopt(argc, argv, "f:w:B:O:")) != -1)
 	{
 		switch(rc) {
 		case 'f':
 			objfile = optarg;
-			filename_set = true;
+			break;
+		case 'w':
+			tmp = atoi(optarg);
+			if (tmp <= 0) {
+				fprintf(stderr, "Invalid reorder window\n");
+				return 1;
+			}
+			opts->reorder_window = tmp * NSEC_PER_MSEC;
+			break;
+		case 'B':
+			tmp = atoi(optarg);
+			if (tmp <= 0) {
+				fprintf(stderr, "Invalid backlog limit\n");
+				return 1;
+			}
+			opts->max_backlog = tmp;
+			break;
+		case 'O':
+			if (out_set_format(optarg))
+				return 1;
 			break;
 		default:
 			print_usage(argv[0]);
@@ -142,27 +244,32 @@ int main(int argc, char **argv)
 	if (set_reftime())
 		return 1;
 
-	if (load_obj_file(&prog_load_attr, &obj, objfile, filename_set))
-		return 1;
-
-	if (do_tracepoint(obj, tps))
+	if (analyzer_enable(a, objfile))
 		return 1;
 
 	if (signal(SIGINT, sig_handler) ||
 	    signal(SIGHUP, sig_handler) ||
 	    signal(SIGTERM, sig_handler)) {
 		perror("signal");
+		analyzer_disable(a);
 		return 1;
 	}
 
 	setlinebuf(stdout);
 	setlinebuf(stderr);
 
-	if (configure_perf_event_channel(obj, nevents))
-		return 1;
+	/* main event loop */
+	rc = perf_event_loop(&a->ch, 1, NULL, tcpprobe_complete, NULL);
 
-	print_header();
+	out_flush();
 
-	/* main event loop */
-	return perf_event_loop(NULL, NULL, tcpprobe_complete);
+	perf_channel_get_stats(a->ch, &stats);
+	if (stats.lost || stats.overflow)
+		fprintf(stderr, "%llu events lost, %llu released out of order\n",
+			stats.lost, stats.overflow);
+
+	analyzer_disable(a);
+
+	return rc;
 }
+#endif
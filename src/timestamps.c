@@ -7,7 +7,9 @@
  *
  * David Ahern <dsahern@gmail.com>
  */
+#include <linux/ethtool.h>
 #include <linux/net_tstamp.h>
+#include <linux/ptp_clock.h>
 #include <linux/sockios.h>
 #include <linux/types.h>
 #include <sys/ioctl.h>
@@ -76,6 +78,26 @@ char *timestamp(char *buf, int len, __u64 stime)
 	return timestamp_tv(&tv, buf, len);
 }
 
+/* realtime in nsec for a monotonic timestamp; stime of 0 is now */
+__u64 timestamp_ns(__u64 stime)
+{
+	struct timespec ts;
+	__u64 tod;
+
+	if (!stime) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return ts_to_ull(&ts);
+	}
+
+	/* no reference (set_reftime not called); leave as monotonic */
+	if (!mono_ref)
+		return stime;
+
+	tod = tod_ref.tv_sec * NSEC_PER_SEC + tod_ref.tv_usec * NSEC_PER_USEC;
+
+	return tod + stime - mono_ref;
+}
+
 char *timestamp_tv(const struct timeval *tv, char *buf, int len)
 {
 	struct tm ltime;
@@ -162,6 +184,34 @@ int disable_hw_tstamp(const char *dev)
 	return do_hw_tstamp(dev, HWTSTAMP_FILTER_NONE, HWTSTAMP_TX_OFF);
 }
 
+/* index of the PTP hardware clock for a device (/dev/ptpN) or -1 */
+int get_phc_index(const char *dev)
+{
+	struct ethtool_ts_info info = {
+		.cmd = ETHTOOL_GET_TS_INFO,
+	};
+	struct ifreq ifr = {};
+
+	if (tstamp_sd < 1) {
+		tstamp_sd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (tstamp_sd < 0) {
+			fprintf(stderr, "Failed to open ipv4 datagram socket\n");
+			return -1;
+		}
+	}
+
+	strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+	ifr.ifr_data = (caddr_t)&info;
+
+	if (ioctl(tstamp_sd, SIOCETHTOOL, &ifr))
+		return -1;
+
+	if (!(info.so_timestamping & SOF_TIMESTAMPING_RAW_HARDWARE))
+		return -1;
+
+	return info.phc_index;
+}
+
 int enable_sw_tstamp(void)
 {
 	int val = SOF_TIMESTAMPING_RX_SOFTWARE;
@@ -197,6 +247,7 @@ int enable_sw_tstamp(void)
 
 #define CLOCKFD 3
 #define FD_TO_CLOCKID(fd)       ((clockid_t) ((((unsigned int) ~fd) << 3) | CLOCKFD))
+#define CLOCKID_TO_FD(clk)      ((unsigned int) ~((clk) >> 3))
 
 static inline int clock_adjtime(clockid_t id, struct timex *tx)
 {
@@ -230,3 +281,154 @@ clockid_t phc_open(const char *phc)
 }
 
 /* end copied from linuxptp */
+
+static __u64 ptp_time_ns(const struct ptp_clock_time *t)
+{
+	return t->sec * NSEC_PER_SEC + t->nsec;
+}
+
+/* offset of CLOCK_REALTIME from CLOCK_MONOTONIC, best of a few reads;
+ * *err is half the window of the best read
+ */
+static __s64 realtime_mono_offset(__u64 *err)
+{
+	__u64 m1, m2, rt, w, best = ~0ULL;
+	__s64 off = 0;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		m1 = get_time_ns(CLOCK_MONOTONIC);
+		rt = get_time_ns(CLOCK_REALTIME);
+		m2 = get_time_ns(CLOCK_MONOTONIC);
+
+		w = m2 - m1;
+		if (w < best) {
+			best = w;
+			off = rt - (m1 + w / 2);
+		}
+	}
+
+	*err = best / 2;
+
+	return off;
+}
+
+/* PHC and system time latched together by the hardware */
+static int xtstamp_precise(int fd, struct phc_xtstamp *xts)
+{
+	struct ptp_sys_offset_precise pso = {};
+	__u64 off_err;
+	__s64 off;
+
+	if (ioctl(fd, PTP_SYS_OFFSET_PRECISE, &pso))
+		return -1;
+
+	off = realtime_mono_offset(&off_err);
+
+	xts->ptp = ptp_time_ns(&pso.device);
+	xts->mono = ptp_time_ns(&pso.sys_realtime) - off;
+	xts->err = off_err;
+
+	return 0;
+}
+
+/* driver reads the PHC between two system time reads; keep the
+ * sample with the smallest window
+ */
+static int xtstamp_extended(int fd, int nsamples, struct phc_xtstamp *xts)
+{
+	struct ptp_sys_offset_extended pse = {};
+	__u64 t1, t2, w, best = ~0ULL;
+	__u64 off_err;
+	__s64 off;
+	int i;
+
+	if (nsamples > PTP_MAX_SAMPLES)
+		nsamples = PTP_MAX_SAMPLES;
+	pse.n_samples = nsamples;
+
+	if (ioctl(fd, PTP_SYS_OFFSET_EXTENDED, &pse))
+		return -1;
+
+	off = realtime_mono_offset(&off_err);
+
+	for (i = 0; i < pse.n_samples; i++) {
+		t1 = ptp_time_ns(&pse.ts[i][0]);
+		t2 = ptp_time_ns(&pse.ts[i][2]);
+		w = t2 - t1;
+		if (w < best) {
+			best = w;
+			xts->ptp = ptp_time_ns(&pse.ts[i][1]);
+			xts->mono = t1 + w / 2 - off;
+		}
+	}
+	xts->err = best / 2 + off_err;
+
+	return 0;
+}
+
+/* clock_gettime on the PHC bracketed by MONOTONIC reads */
+static int xtstamp_read(clockid_t clk, int nsamples, struct phc_xtstamp *xts)
+{
+	__u64 m1, m2, ptp, w, best = ~0ULL;
+	int i;
+
+	for (i = 0; i < nsamples; i++) {
+		m1 = get_time_ns(CLOCK_MONOTONIC);
+		ptp = get_time_ns(clk);
+		m2 = get_time_ns(CLOCK_MONOTONIC);
+		if (!m1 || !ptp || !m2)
+			return -1;
+
+		w = m2 - m1;
+		if (w < best) {
+			best = w;
+			xts->ptp = ptp;
+			xts->mono = m1 + w / 2;
+		}
+	}
+	xts->err = best / 2;
+
+	return 0;
+}
+
+static const char *xtstamp_names[] = {
+	[PHC_XTS_PRECISE]	= "precise",
+	[PHC_XTS_EXTENDED]	= "extended",
+	[PHC_XTS_READ]		= "read",
+};
+
+const char *phc_xtstamp_name(enum phc_xtstamp_mode mode)
+{
+	if (mode > PHC_XTS_READ)
+		return "unknown";
+
+	return xtstamp_names[mode];
+}
+
+int phc_cross_tstamp(clockid_t clk, enum phc_xtstamp_mode *mode,
+		     int nsamples, struct phc_xtstamp *xts)
+{
+	int fd = CLOCKID_TO_FD(clk);
+
+	xts->mode = *mode;
+	switch (*mode) {
+	case PHC_XTS_PRECISE:
+		if (!xtstamp_precise(fd, xts))
+			return 0;
+		*mode = PHC_XTS_EXTENDED;
+		/* fall through */
+	case PHC_XTS_EXTENDED:
+		xts->mode = *mode;
+		if (!xtstamp_extended(fd, nsamples, xts))
+			return 0;
+		*mode = PHC_XTS_READ;
+		/* fall through */
+	case PHC_XTS_READ:
+		xts->mode = *mode;
+		if (!xtstamp_read(clk, nsamples, xts))
+			return 0;
+	}
+
+	return 1;
+}
@@ -49,11 +49,36 @@ static inline void print_time_usecs(unsigned long long nsecs)
 int set_reftime(void);
 char *timestamp(char *buf, int len, __u64 stime);
 char *timestamp_tv(const struct timeval *tv, char *buf, int len);
+__u64 timestamp_ns(__u64 stime);
 
 int enable_sw_tstamp(void);
 int enable_hw_tstamp(const char *dev);
 int disable_hw_tstamp(const char *dev);
+int get_phc_index(const char *dev);
 
 clockid_t phc_open(const char *phc);
 __u64 get_time_ns(clockid_t clk);
+
+/* ways to correlate a PHC with CLOCK_MONOTONIC, best first */
+enum phc_xtstamp_mode {
+	PHC_XTS_PRECISE,	/* PTP_SYS_OFFSET_PRECISE (hw cross timestamp) */
+	PHC_XTS_EXTENDED,	/* PTP_SYS_OFFSET_EXTENDED */
+	PHC_XTS_READ,		/* clock_gettime bracketed by MONOTONIC */
+};
+
+struct phc_xtstamp {
+	__u64	ptp;
+	__u64	mono;
+	__u64	err;	/* uncertainty of mono, nsec */
+	enum phc_xtstamp_mode mode;
+};
+
+/* take a PHC / MONOTONIC pair using the best method available,
+ * keeping the best of nsamples reads where the method allows.
+ * mode is the method to try first; it is moved down on failure so
+ * later calls skip methods the driver does not support.
+ */
+int phc_cross_tstamp(clockid_t clk, enum phc_xtstamp_mode *mode,
+		     int nsamples, struct phc_xtstamp *xts);
+const char *phc_xtstamp_name(enum phc_xtstamp_mode mode);
 #endif
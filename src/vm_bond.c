@@ -0,0 +1,467 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Manage the egress bond of xdp_vmegress: members, hash and the list
+ * of members with link up.
+ *
+ * Copyright (c) 2020 David Ahern <dsahern@gmail.com>
+ */
+
+#include <linux/bpf.h>
+#include <linux/rtnetlink.h>
+#include <limits.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <poll.h>
+#include <bpf/bpf.h>
+
+#include "xdp_bond.h"
+#include "str_utils.h"
+#include "libbpf_helpers.h"
+
+static const char *hash_names[BOND_HASH_MAX] = {
+	[BOND_HASH_XOR]		= "xor",
+	[BOND_HASH_JHASH]	= "jhash",
+	[BOND_HASH_TOEPLITZ]	= "toeplitz",
+};
+
+/* default RSS key of most NICs (Microsoft RSS spec) */
+static const __u8 default_rss_key[BOND_RSS_KEY_LEN] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static int get_config(int fd, struct bond_config *cfg)
+{
+	__u32 idx = 0;
+
+	if (bpf_map_lookup_elem(fd, &idx, cfg)) {
+		fprintf(stderr, "Failed to read bond config: %s: %d\n",
+			strerror(errno), errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int set_config(int fd, const struct bond_config *cfg)
+{
+	__u32 idx = 0;
+
+	if (bpf_map_update_elem(fd, &idx, cfg, BPF_ANY)) {
+		fprintf(stderr, "Failed to update bond config: %s: %d\n",
+			strerror(errno), errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+static bool link_up(int sd, __u32 ifindex)
+{
+	struct ifreq ifr = {};
+
+	if (!if_indextoname(ifindex, ifr.ifr_name))
+		return false;
+
+	if (ioctl(sd, SIOCGIFFLAGS, &ifr) < 0)
+		return false;
+
+	return (ifr.ifr_flags & (IFF_UP | IFF_RUNNING)) ==
+	       (IFF_UP | IFF_RUNNING);
+}
+
+/* rebuild the active list from the members with link up, in member
+ * order so the same set of links always maps flows the same way.
+ * Returns true if the list changed.
+ */
+static bool update_active(struct bond_config *cfg)
+{
+	__u32 active[BOND_MAX_MEMBERS] = {};
+	__u32 i, n = 0;
+	int sd;
+
+	sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	for (i = 0; i < cfg->n_members && i < BOND_MAX_MEMBERS; i++) {
+		if (sd >= 0 && link_up(sd, cfg->members[i]))
+			active[n++] = cfg->members[i];
+	}
+	if (sd >= 0)
+		close(sd);
+
+	if (n == cfg->n_active &&
+	    !memcmp(active, cfg->active, sizeof(active)))
+		return false;
+
+	memcpy(cfg->active, active, sizeof(active));
+	cfg->n_active = n;
+
+	return true;
+}
+
+/* members must be in the ports map to be redirected to. The map may
+ * be shared with other programs (e.g., xdp_l2fwd); existing entries
+ * are left alone.
+ */
+static int add_member(struct bond_config *cfg, int ports_fd, __u32 ifindex)
+{
+	struct bpf_devmap_val pval = {
+		.ifindex = ifindex,
+		.bpf_prog.fd = -1,
+	};
+	__u32 i;
+
+	for (i = 0; i < cfg->n_members; i++) {
+		if (cfg->members[i] == ifindex)
+			return 0;
+	}
+
+	if (cfg->n_members == BOND_MAX_MEMBERS) {
+		fprintf(stderr, "Bond has max number of members (%d)\n",
+			BOND_MAX_MEMBERS);
+		return 1;
+	}
+
+	if (bpf_map_update_elem(ports_fd, &ifindex, &pval, BPF_NOEXIST) &&
+	    errno != EEXIST) {
+		fprintf(stderr, "Failed to add device to ports map: %s: %d\n",
+			strerror(errno), errno);
+		return 1;
+	}
+
+	cfg->members[cfg->n_members++] = ifindex;
+
+	return 0;
+}
+
+static int del_member(struct bond_config *cfg, __u32 ifindex)
+{
+	__u32 i;
+
+	for (i = 0; i < cfg->n_members; i++) {
+		if (cfg->members[i] == ifindex)
+			break;
+	}
+
+	if (i == cfg->n_members) {
+		fprintf(stderr, "Device is not a bond member\n");
+		return 1;
+	}
+
+	for (; i + 1 < cfg->n_members; i++)
+		cfg->members[i] = cfg->members[i + 1];
+	cfg->members[i] = 0;
+	cfg->n_members--;
+
+	return 0;
+}
+
+/* 40 bytes in hex, optionally colon separated as ethtool -x shows it */
+static int parse_rss_key(const char *arg, __u8 *key)
+{
+	unsigned int byte;
+	int i;
+
+	for (i = 0; i < BOND_RSS_KEY_LEN; i++) {
+		if (*arg == ':')
+			arg++;
+		if (sscanf(arg, "%2x", &byte) != 1 || strlen(arg) < 2)
+			return 1;
+		key[i] = byte;
+		arg += 2;
+	}
+
+	return *arg ? 1 : 0;
+}
+
+static const char *devname(__u32 ifindex, char *buf)
+{
+	if (!if_indextoname(ifindex, buf))
+		snprintf(buf, IFNAMSIZ, "%u", ifindex);
+
+	return buf;
+}
+
+static void show_config(const struct bond_config *cfg)
+{
+	char buf[IFNAMSIZ];
+	__u32 i;
+
+	printf("hash %s", cfg->hash < BOND_HASH_MAX ?
+	       hash_names[cfg->hash] : "?");
+	if (cfg->hash == BOND_HASH_JHASH)
+		printf(" seed %u", cfg->seed);
+	printf("\nmembers:");
+	for (i = 0; i < cfg->n_members && i < BOND_MAX_MEMBERS; i++)
+		printf(" %s", devname(cfg->members[i], buf));
+	printf("\nactive: ");
+	for (i = 0; i < cfg->n_active && i < BOND_MAX_MEMBERS; i++)
+		printf(" %s", devname(cfg->active[i], buf));
+	printf("\n");
+
+	if (cfg->hash == BOND_HASH_TOEPLITZ) {
+		printf("rss key:");
+		for (i = 0; i < BOND_RSS_KEY_LEN; i++)
+			printf("%s%02x", i ? ":" : " ", cfg->rss_key[i]);
+		printf("\n");
+	}
+}
+
+static int rtnl_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open netlink socket: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Failed to bind netlink socket: %s\n",
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* follow link changes of the members until killed. The config is
+ * re-read on each event so member changes by other vm_bond commands
+ * are picked up.
+ */
+static int watch_links(int fd)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	struct bond_config cfg;
+	char buf[16384];
+	ssize_t len;
+
+	pfd.fd = rtnl_open();
+	if (pfd.fd < 0)
+		return 1;
+
+	while (1) {
+		if (get_config(fd, &cfg))
+			break;
+		if (update_active(&cfg) && set_config(fd, &cfg))
+			break;
+
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		/* content does not matter; on overrun re-check as well */
+		do {
+			len = recv(pfd.fd, buf, sizeof(buf), MSG_DONTWAIT);
+		} while (len > 0 || (len < 0 && errno == ENOBUFS));
+
+		if (len < 0 && errno != EAGAIN && errno != EINTR) {
+			fprintf(stderr, "netlink recv failed: %s\n",
+				strerror(errno));
+			break;
+		}
+	}
+
+	close(pfd.fd);
+
+	return 1;
+}
+
+static int get_ifindex(const char *arg, __u32 *ifindex)
+{
+	int val;
+
+	*ifindex = if_nametoindex(arg);
+	if (*ifindex)
+		return 0;
+
+	if (str_to_int(arg, 1, INT_MAX, &val)) {
+		fprintf(stderr, "Invalid device\n");
+		return 1;
+	}
+	*ifindex = val;
+
+	return 0;
+}
+
+static int get_map_fd(__u32 id, const char *name)
+{
+	int fd;
+
+	if (id)
+		fd = bpf_map_get_fd_by_id(id);
+	else
+		fd = bpf_map_get_fd_by_name(name);
+	if (fd < 0)
+		fprintf(stderr, "Failed to get fd for %s map: %s: %d\n",
+			name, strerror(errno), errno);
+
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [OPTS]\n"
+		"\nOPTS:\n"
+		"    -I id          bond config map id (default: by name bond_config)\n"
+		"    -E id          egress ports map id (default: by name xdp_fwd_ports)\n"
+		"    -a device      add bond member\n"
+		"    -r device      remove bond member\n"
+		"    -H hash        xor, jhash or toeplitz\n"
+		"    -s seed        jhash seed\n"
+		"    -k key         toeplitz key, 40 bytes in hex (default: common\n"
+		"                   NIC RSS key)\n"
+		"    -w             update active members on link changes until\n"
+		"                   killed\n"
+		"    -P             print config\n"
+		, prog);
+}
+
+int main(int argc, char **argv)
+{
+	__u32 add[BOND_MAX_MEMBERS], del[BOND_MAX_MEMBERS];
+	__u32 map_id = 0, ports_id = 0;
+	int nadd = 0, ndel = 0, hash = -1;
+	bool print_config = false;
+	static const __u8 zero_key[BOND_RSS_KEY_LEN];
+	__u8 key[BOND_RSS_KEY_LEN];
+	bool key_set = false;
+	bool watch = false;
+	struct bond_config cfg;
+	unsigned long tmp;
+	long long seed = -1;
+	int fd, ports_fd, opt, i;
+
+	while ((opt = getopt(argc, argv, ":I:E:a:r:H:s:k:wP")) != -1) {
+		switch (opt) {
+		case 'I':
+		case 'E':
+			if (str_to_ulong(optarg, &tmp)) {
+				fprintf(stderr, "Invalid map id\n");
+				return 1;
+			}
+			if (opt == 'I')
+				map_id = (__u32)tmp;
+			else
+				ports_id = (__u32)tmp;
+			break;
+		case 'a':
+			if (nadd == BOND_MAX_MEMBERS) {
+				fprintf(stderr, "Too many devices\n");
+				return 1;
+			}
+			if (get_ifindex(optarg, &add[nadd++]))
+				return 1;
+			break;
+		case 'r':
+			if (ndel == BOND_MAX_MEMBERS) {
+				fprintf(stderr, "Too many devices\n");
+				return 1;
+			}
+			if (get_ifindex(optarg, &del[ndel++]))
+				return 1;
+			break;
+		case 'H':
+			for (hash = 0; hash < BOND_HASH_MAX; hash++) {
+				if (!strcmp(optarg, hash_names[hash]))
+					break;
+			}
+			if (hash == BOND_HASH_MAX) {
+				fprintf(stderr, "Invalid hash\n");
+				return 1;
+			}
+			break;
+		case 's':
+			if (str_to_ulong(optarg, &tmp) || tmp > UINT_MAX) {
+				fprintf(stderr, "Invalid seed\n");
+				return 1;
+			}
+			seed = tmp;
+			break;
+		case 'k':
+			if (parse_rss_key(optarg, key)) {
+				fprintf(stderr, "Invalid key\n");
+				return 1;
+			}
+			key_set = true;
+			break;
+		case 'w':
+			watch = true;
+			break;
+		case 'P':
+			print_config = true;
+			break;
+		default:
+			usage(basename(argv[0]));
+			return 1;
+		}
+	}
+
+	fd = get_map_fd(map_id, "bond_config");
+	if (fd < 0)
+		return 1;
+
+	if (get_config(fd, &cfg))
+		return 1;
+
+	if (print_config) {
+		show_config(&cfg);
+		return 0;
+	}
+
+	if (nadd) {
+		ports_fd = get_map_fd(ports_id, "xdp_fwd_ports");
+		if (ports_fd < 0)
+			return 1;
+
+		for (i = 0; i < nadd; i++) {
+			if (add_member(&cfg, ports_fd, add[i]))
+				return 1;
+		}
+	}
+
+	for (i = 0; i < ndel; i++) {
+		if (del_member(&cfg, del[i]))
+			return 1;
+	}
+
+	if (hash >= 0) {
+		cfg.hash = hash;
+		if (hash == BOND_HASH_TOEPLITZ && !key_set &&
+		    !memcmp(cfg.rss_key, zero_key, BOND_RSS_KEY_LEN))
+			memcpy(cfg.rss_key, default_rss_key, BOND_RSS_KEY_LEN);
+	}
+	if (seed >= 0)
+		cfg.seed = seed;
+	if (key_set)
+		memcpy(cfg.rss_key, key, BOND_RSS_KEY_LEN);
+
+	update_active(&cfg);
+	if (set_config(fd, &cfg))
+		return 1;
+
+	if (watch)
+		return watch_links(fd);
+
+	return 0;
+}
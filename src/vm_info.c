@@ -22,15 +22,71 @@
 #include "str_utils.h"
 #include "libbpf_helpers.h"
 
-static int show_entries(int fd, bool cli_arg)
+struct show_ctx {
+	bool	cli_arg;
+	int	rx_acl_fd;
+	int	tx_acl_fd;
+};
+
+/* id of the VM's ACL table in a hash of maps; 0 if none */
+static __u32 acl_map_id(int fd, __u32 ifindex)
 {
-	__u32 *key, *prev_key = NULL;
-	struct bpf_map_info info = {};
-	struct vm_info val;
+	__u32 id;
+
+	if (fd < 0 || bpf_map_lookup_elem(fd, &ifindex, &id))
+		return 0;
+
+	return id;
+}
+
+static int show_entry(const void *_key, const void *value, void *arg)
+{
+	const struct vm_info *val = value;
+	struct show_ctx *ctx = arg;
+	const __u32 *key = _key;
+	bool cli_arg = ctx->cli_arg;
+	__u32 rx_id, tx_id;
 	char buf[IFNAMSIZ];
 	char v4str[64];
 	char v6str[64];
-	int err, i;
+
+	if (if_indextoname(*key, buf) == NULL) {
+		fprintf(stderr, "WARNING: stale device index\n");
+		snprintf(buf, IFNAMSIZ, "-");
+	}
+
+	inet_ntop(AF_INET, &val->v4addr, v4str, sizeof(v4str));
+	inet_ntop(AF_INET6, &val->v6addr, v6str, sizeof(v6str));
+
+	if (cli_arg) {
+		printf("    -i %u -d %u -m ", val->vmid, *key);
+		print_mac(val->mac, false);
+		if (val->vlan_TCI)
+			printf(" -v %u", ntohs(val->vlan_TCI));
+		printf(" -4 %s -6 %s\n", v4str, v6str);
+	} else {
+		printf("    device key %u / %s vm %u mac ",
+			*key, buf, val->vmid);
+		print_mac(val->mac, false);
+		if (val->vlan_TCI)
+			printf(" vlan %u", ntohs(val->vlan_TCI));
+		printf(" v4 %s v6 %s", v4str, v6str);
+
+		rx_id = acl_map_id(ctx->rx_acl_fd, *key);
+		tx_id = acl_map_id(ctx->tx_acl_fd, *key);
+		if (rx_id)
+			printf(" rx-acl map %u", rx_id);
+		if (tx_id)
+			printf(" tx-acl map %u", tx_id);
+		printf("\n");
+	}
+
+	return 0;
+}
+
+static int show_entries(int fd, struct show_ctx *ctx)
+{
+	struct bpf_map_info info = {};
 	__u32 len;
 
 	len = sizeof(info);
@@ -47,59 +103,70 @@ static int show_entries(int fd, bool cli_arg)
 		return 1;
 	}
 
-	key = calloc(1, sizeof(*key));
-	if (!key) {
-		fprintf(stderr, "Failed to allocate memory for key\n");
+	return bpf_map_walk(fd, show_entry, ctx, false) ? 1 : 0;
+}
+
+/* outer maps of the per-VM ACL tables; optional */
+static int acl_maps_fd(const char *name, bool required)
+{
+	int fd;
+
+	fd = bpf_map_get_fd_by_name(name);
+	if (fd < 0 && required)
+		fprintf(stderr, "Failed to get fd for %s map: %s: %d\n",
+			name, strerror(errno), errno);
+
+	return fd;
+}
+
+/* point the device's entry in the hash of maps at a pinned ACL table */
+static int set_acl_map(const char *name, __u32 ifindex, const char *path)
+{
+	int fd, acl_fd, rc;
+
+	fd = acl_maps_fd(name, true);
+	if (fd < 0)
+		return 1;
+
+	acl_fd = bpf_map_get_fd_by_path(path);
+	if (acl_fd < 0) {
+		fprintf(stderr, "Failed to get fd for ACL map %s\n", path);
+		close(fd);
 		return 1;
 	}
 
-	for (i = 0; ; ++i) {
-		err = bpf_map_get_next_key(fd, prev_key, key);
-		if (err) {
-			if (errno == ENOENT)
-				err = 0;
-			break;
-		}
+	rc = bpf_map_update_elem(fd, &ifindex, &acl_fd, BPF_ANY);
+	if (rc)
+		fprintf(stderr, "Failed to add ACL map to %s: %s: %d\n",
+			name, strerror(errno), errno);
 
-		memset(&val, 0, sizeof(val));
-		if (bpf_map_lookup_elem(fd, key, &val))
-			goto next_key;
+	close(acl_fd);
+	close(fd);
 
+	return rc ? 1 : 0;
+}
 
-		if (if_indextoname(*key, buf) == NULL) {
-			fprintf(stderr, "WARNING: stale device index\n");
-			snprintf(buf, IFNAMSIZ, "-");
-		}
+static void remove_acl_map(const char *name, __u32 ifindex)
+{
+	int fd;
 
-		inet_ntop(AF_INET, &val.v4addr, v4str, sizeof(v4str));
-		inet_ntop(AF_INET6, &val.v6addr, v6str, sizeof(v6str));
-
-		if (cli_arg) {
-			printf("    -i %u -d %u -m ", val.vmid, *key);
-			print_mac(val.mac, false);
-			if (val.vlan_TCI)
-				printf(" -v %u", ntohs(val.vlan_TCI));
-			printf(" -4 %s -6 %s\n", v4str, v6str);
-		} else {
-			printf("    device key %u / %s vm %u mac ",
-				*key, buf, val.vmid);
-			print_mac(val.mac, false);
-			if (val.vlan_TCI)
-				printf(" vlan %u", ntohs(val.vlan_TCI));
-			printf(" v4 %s v6 %s\n", v4str, v6str);
-		}
-next_key:
-		prev_key = key;
-	}
+	fd = acl_maps_fd(name, false);
+	if (fd < 0)
+		return;
 
-	free(key);
-	return err;
+	if (bpf_map_delete_elem(fd, &ifindex) && errno != ENOENT)
+		fprintf(stderr, "Failed to delete ACL map from %s\n", name);
+
+	close(fd);
 }
 
 static int remove_entry(int fd, __u32 idx)
 {
 	int rc;
 
+	remove_acl_map("rx_acl_maps", idx);
+	remove_acl_map("tx_acl_maps", idx);
+
 	rc = bpf_map_delete_elem(fd, &idx);
 	if (rc)
 		fprintf(stderr, "Failed to delete VM entry\n");
@@ -153,6 +220,8 @@ static void usage(const char *prog)
 		"    -m mac         mac address for VM\n"
 		"    -d device      tap device for VM\n"
 		"    -v vlan        egress vlan tci\n"
+		"    -R path        pinned ACL map for packets from the VM\n"
+		"    -T path        pinned ACL map for packets to the VM\n"
 		"    -r             remove entry (only device arg needed)\n"
 		"    -P             print map entries\n"
 		, prog);
@@ -161,14 +230,15 @@ static void usage(const char *prog)
 int main(int argc, char **argv)
 {
 	__u32 map_id = 0, ifindex = 0;
+	const char *rx_acl = NULL, *tx_acl = NULL;
+	struct show_ctx ctx = {};
 	bool print_entries = false;
-	bool cli_arg = false;
 	struct vm_info vi = {};
 	bool delete = false;
 	unsigned long tmp;
 	int fd, opt, ret;
 
-	while ((opt = getopt(argc, argv, ":I:i:4:6:m:v:d:rPC")) != -1) {
+	while ((opt = getopt(argc, argv, ":I:i:4:6:m:v:d:R:T:rPC")) != -1) {
 		switch (opt) {
 		case 'I':
 			if (str_to_ulong(optarg, &tmp)) {
@@ -219,11 +289,17 @@ int main(int argc, char **argv)
 				ifindex = (__u32)ret;
 			}
 			break;
+		case 'R':
+			rx_acl = optarg;
+			break;
+		case 'T':
+			tx_acl = optarg;
+			break;
 		case 'r':
 			delete = true;
 			break;
 		case 'C':
-			cli_arg = true;
+			ctx.cli_arg = true;
 			/* fallthrough */
 		case 'P':
 			print_entries = true;
@@ -251,8 +327,11 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (print_entries)
-		return show_entries(fd, cli_arg);
+	if (print_entries) {
+		ctx.rx_acl_fd = acl_maps_fd("rx_acl_maps", false);
+		ctx.tx_acl_fd = acl_maps_fd("tx_acl_maps", false);
+		return show_entries(fd, &ctx);
+	}
 
 	if (!ifindex) {
 		fprintf(stderr, "Device index required\n");
@@ -262,6 +341,14 @@ int main(int argc, char **argv)
 	if (delete)
 		return remove_entry(fd, ifindex);
 
+	/* ACL tables can be set for an existing entry */
+	if (rx_acl && set_acl_map("rx_acl_maps", ifindex, rx_acl))
+		return 1;
+	if (tx_acl && set_acl_map("tx_acl_maps", ifindex, tx_acl))
+		return 1;
+	if ((rx_acl || tx_acl) && !vi.vmid)
+		return 0;
+
 	if (!vi.vmid) {
 		fprintf(stderr, "VM id required\n");
 		return 1;
@@ -288,13 +288,22 @@ static void dump_entry(struct acl_key *key, struct acl_val *val)
 		printf("\n");
 }
 
+static int show_acl_entry(const void *key, const void *value, void *arg)
+{
+	struct acl_key k;
+	struct acl_val v;
+
+	memcpy(&k, key, sizeof(k));
+	memcpy(&v, value, sizeof(v));
+	dump_entry(&k, &v);
+
+	return 0;
+}
+
 static int show_acl_entries(int map_fd)
 {
 	struct bpf_map_info info = {};
-	struct acl_key *key, *prev_key;
-	struct acl_val val;
 	__u32 len;
-	int err;
 
 	len = sizeof(info);
 	if (bpf_obj_get_info_by_fd(map_fd, &info, &len)) {
@@ -310,30 +319,7 @@ static int show_acl_entries(int map_fd)
 		return 1;
 	}
 
-	key = calloc(1, sizeof(*key));
-	if (!key) {
-		fprintf(stderr, "Failed to allocate memory for key\n");
-		return 1;
-	}
-
-	prev_key = NULL;
-	while (1) {
-		err = bpf_map_get_next_key(map_fd, prev_key, key);
-		if (err) {
-			if (errno == ENOENT)
-				err = 0;
-			break;
-		}
-
-		memset(&val, 0, sizeof(val));
-		if (!bpf_map_lookup_elem(map_fd, key, &val))
-			dump_entry(key, &val);
-
-		prev_key = key;
-	}
-
-	free(key);
-	return err;
+	return bpf_map_walk(map_fd, show_acl_entry, NULL, false) ? 1 : 0;
 }
 
 static void usage(const char *prog)
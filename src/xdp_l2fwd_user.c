@@ -12,6 +12,7 @@
 
 #include <linux/bpf.h>
 #include <linux/if_link.h>
+#include <linux/kernel.h>
 #include <limits.h>
 #include <net/if.h>
 #include <errno.h>
@@ -22,6 +23,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <time.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -29,6 +31,9 @@
 #include "xdp_fdb.h"
 #include "str_utils.h"
 #include "libbpf_helpers.h"
+#include "timestamps.h"
+
+#define FDB_PIN_DIR	"/sys/fs/bpf/map"
 
 static bool fdb_map_verify(int map_fd)
 {
@@ -43,7 +48,7 @@ static bool fdb_map_verify(int map_fd)
 
 	if (info.type != BPF_MAP_TYPE_HASH ||
 	    info.key_size != sizeof(struct fdb_key) ||
-	    info.value_size != sizeof(__u32)) {
+	    info.value_size != sizeof(struct fdb_val)) {
 		fprintf(stderr, "Incompatible map\n");
 		return false;
 	}
@@ -75,157 +80,387 @@ static bool ports_map_verify(int ports_fd, bool *with_prog)
 	return true;
 }
 
-static int show_entries_cli(int fdb_fd, int ports_fd)
+static const char *action_names[FDB_ACT_MAX] = {
+	[FDB_ACT_STRIP]		= "strip",
+	[FDB_ACT_KEEP]		= "keep",
+	[FDB_ACT_POP_OUTER]	= "pop-outer",
+	[FDB_ACT_REWRITE]	= "rewrite",
+	[FDB_ACT_PUSH]		= "push",
+};
+
+/* action as given to -a: name, plus :vlan for rewrite and push */
+static void print_action(const struct fdb_val *val)
+{
+	if (val->action >= FDB_ACT_MAX) {
+		printf("%u", val->action);
+		return;
+	}
+
+	printf("%s", action_names[val->action]);
+	if (val->action == FDB_ACT_REWRITE || val->action == FDB_ACT_PUSH)
+		printf(":%u", val->vlan);
+}
+
+/* vlan part of an fdb key: vlan or outer.inner */
+static void print_vlans(const struct fdb_key *key)
 {
-	struct fdb_key *key, *prev_key = NULL;
+	if (key->outer_vlan)
+		printf("%u.", key->outer_vlan);
+	printf("%u", key->vlan);
+}
+
+struct show_ctx {
+	int	ports_fd;
+	bool	with_prog;
+	int	idx;
+};
+
+static int show_entry_cli(const void *_key, const void *value, void *arg)
+{
+	const struct fdb_val *val = value;
+	const struct fdb_key *key = _key;
+	__u32 fval = val->ifindex;
+	struct show_ctx *ctx = arg;
 	struct bpf_devmap_val pval;
-	bool with_prog = false;
 	char buf[IFNAMSIZ];
-	int err, i;
-	__u32 fval;
 
+	if (if_indextoname(fval, buf) == NULL) {
+		fprintf(stderr, "WARNING: stale device index\n");
+		snprintf(buf, IFNAMSIZ, "-");
+	}
 
-	if (!fdb_map_verify(fdb_fd) ||
-	    !ports_map_verify(ports_fd, &with_prog))
-		return 1;
+	printf("-v %u", key->vlan);
+	if (key->outer_vlan)
+		printf(" -o %u", key->outer_vlan);
+	printf(" -m ");
+	print_mac(key->mac, false);
+	printf(" -d %s", buf);
+	if (val->action != FDB_ACT_STRIP) {
+		printf(" -a ");
+		print_action(val);
+	}
 
-	key = calloc(1, sizeof(*key));
-	if (!key) {
-		fprintf(stderr, "Failed to allocate memory for key\n");
-		return 1;
+	memset(&pval, 0, sizeof(pval));
+	if (bpf_map_lookup_elem(ctx->ports_fd, &fval, &pval)) {
+		fprintf(stderr,
+			"No ports entry for device %s/%d\n", buf, fval);
+		goto end_entry;
 	}
 
-	for (i = 0; ; ++i) {
-		err = bpf_map_get_next_key(fdb_fd, prev_key, key);
-		if (err) {
-			if (errno == ENOENT)
-				err = 0;
-			break;
-		}
+	if (ctx->with_prog)
+		printf(" -p %u", pval.bpf_prog.id);
+end_entry:
+	printf("\n");
 
-		fval = 0;
-		memset(&pval, 0, sizeof(pval));
-		if (bpf_map_lookup_elem(fdb_fd, key, &fval))
-			goto next_key;
+	return 0;
+}
 
-		if (if_indextoname(fval, buf) == NULL) {
-			fprintf(stderr, "WARNING: stale device index\n");
-			snprintf(buf, IFNAMSIZ, "-");
-		}
+static int show_entries_cli(int fdb_fd, int ports_fd)
+{
+	struct show_ctx ctx = { .ports_fd = ports_fd };
 
-		printf("-v %u -m ", key->vlan);
-		print_mac(key->mac, false);
-		printf(" -d %s", buf);
+	if (!fdb_map_verify(fdb_fd) ||
+	    !ports_map_verify(ports_fd, &ctx.with_prog))
+		return 1;
 
-		if (bpf_map_lookup_elem(ports_fd, &fval, &pval)) {
-			fprintf(stderr,
-				"No ports entry for device %s/%d\n", buf, fval);
-			goto end_entry;
-		}
+	return bpf_map_walk(fdb_fd, show_entry_cli, &ctx, false) ? 1 : 0;
+}
 
-		if (with_prog)
-			printf(" -p %u", pval.bpf_prog.id);
-end_entry:
-		printf("\n");
-next_key:
-		prev_key = key;
+static int show_ports_entry(const void *_key, const void *value, void *arg)
+{
+	const __u32 *key = _key;
+	struct show_ctx *ctx = arg;
+	struct bpf_devmap_val val;
+	char buf[IFNAMSIZ];
+
+	/* value is only an ifindex if the map has no prog support */
+	memset(&val, 0, sizeof(val));
+	if (ctx->with_prog)
+		memcpy(&val, value, sizeof(val));
+	else
+		memcpy(&val.ifindex, value, sizeof(val.ifindex));
+
+	if (if_indextoname(val.ifindex, buf) == NULL) {
+		fprintf(stderr, "WARNING: stale device index\n");
+		snprintf(buf, IFNAMSIZ, "-");
 	}
 
-	free(key);
-	return err;
+	printf("index %u -> device %s/%u", *key, buf, val.ifindex);
+	if (ctx->with_prog && val.bpf_prog.id)
+		printf(", prog id %u", val.bpf_prog.id);
+	printf("\n");
+
+	return 0;
 }
 
 static int show_ports_entries(int map_fd)
 {
-	__u32 *key, *prev_key = NULL;
-	struct bpf_devmap_val val;
-	bool with_prog = false;
-	int err;
+	struct show_ctx ctx = {};
 
-	if (!ports_map_verify(map_fd, &with_prog))
+	if (!ports_map_verify(map_fd, &ctx.with_prog))
 		return 1;
 
-	key = calloc(1, sizeof(*key));
-	if (!key) {
-		fprintf(stderr, "Failed to allocate memory for key\n");
+	printf("\nPorts map:\n");
+	return bpf_map_walk(map_fd, show_ports_entry, &ctx, false) ? 1 : 0;
+}
+
+static int show_fdb_entry(const void *_key, const void *value, void *arg)
+{
+	const struct fdb_val *val = value;
+	const struct fdb_key *key = _key;
+	struct show_ctx *ctx = arg;
+	char buf[IFNAMSIZ];
+
+	if (if_indextoname(val->ifindex, buf) == NULL) {
+		fprintf(stderr, "WARNING: stale device index\n");
+		snprintf(buf, IFNAMSIZ, "-");
+	}
+
+	printf("entry %d: < ", ctx->idx++);
+	print_vlans(key);
+	printf(", ");
+	print_mac(key->mac, false);
+	printf(" > --> device %s/%u, ", buf, val->ifindex);
+	print_action(val);
+	printf("\n");
+
+	return 0;
+}
+
+static int show_fdb_entries(int map_fd)
+{
+	struct show_ctx ctx = {};
+
+	if (!fdb_map_verify(map_fd))
 		return 1;
+
+	printf("FDB map:\n");
+	return bpf_map_walk(map_fd, show_fdb_entry, &ctx, false) ? 1 : 0;
+}
+
+struct learn_ctx {
+	__u64	now;
+	__u64	age;		/* nsec; 0 to show entries */
+	int	fd;
+	int	idx;
+	int	nexpired;
+};
+
+static int learn_entry(const void *_key, const void *value, void *arg)
+{
+	const struct fdb_learn_val *val = value;
+	const struct fdb_key *key = _key;
+	struct learn_ctx *ctx = arg;
+	__u64 idle = 0;
+	char buf[IFNAMSIZ];
+
+	if (ctx->now > val->last_seen)
+		idle = ctx->now - val->last_seen;
+
+	if (ctx->age) {
+		if (idle > ctx->age &&
+		    bpf_map_delete_elem(ctx->fd, key) == 0)
+			ctx->nexpired++;
+		return 0;
 	}
 
-	printf("\nPorts map:\n");
-	while(1) {
-		err = bpf_map_get_next_key(map_fd, prev_key, key);
-		if (err) {
-			if (errno == ENOENT)
-				err = 0;
+	if (if_indextoname(val->ifindex, buf) == NULL)
+		snprintf(buf, IFNAMSIZ, "-");
+
+	printf("learned %d: < ", ctx->idx++);
+	print_vlans(key);
+	printf(", ");
+	print_mac(key->mac, false);
+	printf(" > --> device %s/%u, idle %llu sec\n", buf, val->ifindex,
+	       idle / NSEC_PER_SEC);
+
+	return 0;
+}
+
+static int show_learn_entries(int map_fd)
+{
+	struct learn_ctx ctx = { .fd = map_fd };
+
+	ctx.now = get_time_ns(CLOCK_MONOTONIC);
+
+	printf("\nLearned FDB map:\n");
+	return bpf_map_walk(map_fd, learn_entry, &ctx, false) ? 1 : 0;
+}
+
+/* remove learned entries not seen for age seconds; runs until killed */
+static int age_learn_entries(int map_fd, unsigned int age)
+{
+	struct learn_ctx ctx = {
+		.fd = map_fd,
+		.age = age * NSEC_PER_SEC,
+	};
+	unsigned int interval;
+
+	/* expire entries within 25% of the age */
+	interval = age / 4 ? : 1;
+
+	while (1) {
+		ctx.now = get_time_ns(CLOCK_MONOTONIC);
+		if (bpf_map_walk(map_fd, learn_entry, &ctx, false))
+			return 1;
+
+		sleep(interval);
+	}
+
+	return 0;
+}
+
+static const char *verdict_names[L2FWD_VERDICT_MAX] = {
+	[L2FWD_FWD]		 = "fwd",
+	[L2FWD_FWD_LEARNED]	 = "fwd-learned",
+	[L2FWD_FLOOD]		 = "flood",
+	[L2FWD_PASS_NO_VLAN]	 = "pass-no-vlan",
+	[L2FWD_PASS_VLAN0]	 = "pass-vlan0",
+	[L2FWD_PASS_FDB_MISS]	 = "pass-fdb-miss",
+	[L2FWD_PASS_NO_DEV]	 = "pass-no-dev",
+	[L2FWD_PASS_DEVMAP_MISS] = "pass-devmap-miss",
+	[L2FWD_PASS_SAME_PORT]	 = "pass-same-port",
+	[L2FWD_PASS_ADJUST_HEAD] = "pass-adjust-head",
+	[L2FWD_DROP_MALFORMED]	 = "drop-malformed",
+};
+
+struct stats_entry {
+	struct xdp_stats_key	key;
+	struct xdp_stats	cur;
+	struct xdp_stats	prev;
+};
+
+struct stats_ctx {
+	struct stats_entry	*entries;
+	int			n;
+	int			size;
+	int			ncpus;
+};
+
+/* sum the per-cpu values of an entry */
+static int stats_entry(const void *_key, const void *value, void *arg)
+{
+	const struct xdp_stats *percpu = value;
+	const struct xdp_stats_key *key = _key;
+	struct stats_ctx *ctx = arg;
+	struct stats_entry *e;
+	int i;
+
+	for (i = 0; i < ctx->n; i++) {
+		if (!memcmp(&ctx->entries[i].key, key, sizeof(*key)))
 			break;
-		}
+	}
 
-		memset(&val, 0, sizeof(val));
-		if (!bpf_map_lookup_elem(map_fd, key, &val)) {
-			char buf[IFNAMSIZ];
+	if (i == ctx->n) {
+		if (ctx->n == ctx->size) {
+			int size = ctx->size ? ctx->size * 2 : 64;
 
-			if (if_indextoname(val.ifindex, buf) == NULL) {
-				fprintf(stderr, "WARNING: stale device index\n");
-				snprintf(buf, IFNAMSIZ, "-");
+			e = realloc(ctx->entries, size * sizeof(*e));
+			if (!e) {
+				fprintf(stderr, "Failed to allocate stats\n");
+				return -ENOMEM;
 			}
-
-			printf("index %u -> device %s/%u",
-			       *key, buf, val.ifindex);
-			if (with_prog && val.bpf_prog.id)
-				printf(", prog id %u", val.bpf_prog.id);
-			printf("\n");
+			ctx->entries = e;
+			ctx->size = size;
 		}
+		memset(&ctx->entries[i], 0, sizeof(ctx->entries[i]));
+		ctx->entries[i].key = *key;
+		ctx->n++;
+	}
 
-		prev_key = key;
+	e = &ctx->entries[i];
+	memset(&e->cur, 0, sizeof(e->cur));
+	for (i = 0; i < ctx->ncpus; i++) {
+		e->cur.bytes += percpu[i].bytes;
+		e->cur.pkts += percpu[i].pkts;
 	}
 
-	free(key);
-	return err;
+	return 0;
 }
 
-static int show_fdb_entries(int map_fd)
+static void print_stats(struct stats_ctx *ctx, unsigned int interval)
 {
-	struct fdb_key *key, *prev_key = NULL;
-	int err, i;
-	__u32 val;
+	char in[IFNAMSIZ], out[IFNAMSIZ];
+	struct stats_entry *e;
+	__u64 pkts, bytes;
+	int i;
 
-	if (!fdb_map_verify(map_fd))
-		return 1;
+	printf("%-16s %-16s %-18s %14s %16s", "ingress", "egress",
+	       "verdict", "packets", "bytes");
+	if (interval)
+		printf(" %12s %10s", "pps", "Mbps");
+	printf("\n");
+
+	for (i = 0; i < ctx->n; i++) {
+		e = &ctx->entries[i];
 
-	key = calloc(1, sizeof(*key));
-	if (!key) {
-		fprintf(stderr, "Failed to allocate memory for key\n");
+		pkts = e->cur.pkts - e->prev.pkts;
+		bytes = e->cur.bytes - e->prev.bytes;
+		e->prev = e->cur;
+
+		if (interval && !pkts)
+			continue;
+
+		if (!if_indextoname(e->key.ifindex_in, in))
+			snprintf(in, sizeof(in), "%u", e->key.ifindex_in);
+		if (!e->key.ifindex_out)
+			snprintf(out, sizeof(out), "-");
+		else if (!if_indextoname(e->key.ifindex_out, out))
+			snprintf(out, sizeof(out), "%u", e->key.ifindex_out);
+
+		printf("%-16s %-16s %-18s %14llu %16llu", in, out,
+		       e->key.verdict < L2FWD_VERDICT_MAX ?
+		       verdict_names[e->key.verdict] : "?",
+		       pkts, bytes);
+		if (interval)
+			printf(" %12llu %10.1f", pkts / interval,
+			       bytes * 8. / interval / 1e6);
+		printf("\n");
+	}
+}
+
+/* print counters summed across cpus; with an interval, print the
+ * change and rates every interval seconds until killed
+ */
+static int show_stats(int stats_fd, unsigned int interval)
+{
+	struct stats_ctx ctx = {};
+	char buf[64];
+	int i;
+
+	ctx.ncpus = libbpf_num_possible_cpus();
+	if (ctx.ncpus < 0) {
+		fprintf(stderr, "Failed to get number of possible cpus\n");
 		return 1;
 	}
 
-	printf("FDB map:\n");
-	for (i = 0; ; ++i) {
-		err = bpf_map_get_next_key(map_fd, prev_key, key);
-		if (err) {
-			if (errno == ENOENT)
-				err = 0;
-			break;
-		}
+	if (bpf_map_walk(stats_fd, stats_entry, &ctx, false))
+		goto err;
+
+	if (!interval) {
+		print_stats(&ctx, 0);
+		free(ctx.entries);
+		return 0;
+	}
 
-		val = 0;
-		if (!bpf_map_lookup_elem(map_fd, key, &val)) {
-			char buf[IFNAMSIZ];
+	/* rates are relative to the previous read */
+	for (i = 0; i < ctx.n; i++)
+		ctx.entries[i].prev = ctx.entries[i].cur;
 
-			if (if_indextoname(val, buf) == NULL) {
-				fprintf(stderr, "WARNING: stale device index\n");
-				snprintf(buf, IFNAMSIZ, "-");
-			}
+	while (1) {
+		sleep(interval);
 
-			printf("entry %d: < %u, ", i, key->vlan);
-			print_mac(key->mac, false);
-			printf(" > --> device %s/%u\n", buf, val);
-		}
+		if (bpf_map_walk(stats_fd, stats_entry, &ctx, false))
+			goto err;
 
-		prev_key = key;
+		printf("%s:\n", timestamp(buf, sizeof(buf), 0));
+		print_stats(&ctx, interval);
+		printf("\n");
 	}
 
-	free(key);
-	return err;
+err:
+	free(ctx.entries);
+	return 1;
 }
 
 /* remove from fdb then remove device */
@@ -244,6 +479,655 @@ static int remove_entries(int fdb_fd, struct fdb_key *key,
 	return rc;
 }
 
+/* kernel internal; returned for maps without batch support */
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+struct fdb_entry {
+	struct fdb_key	key;
+	__u32		ifindex;
+	__u16		action;
+	__u16		act_vlan;
+	__u32		prog_id;
+	char		*prog_path;
+	int		lineno;		/* line in entry file */
+};
+
+/* strip, keep, pop-outer, rewrite:vlan or push:vlan */
+static int parse_action(const char *arg, struct fdb_entry *e)
+{
+	const char *vlan = strchr(arg, ':');
+	size_t len = vlan ? (size_t)(vlan - arg) : strlen(arg);
+	int i, ret;
+
+	for (i = 0; i < FDB_ACT_MAX; i++) {
+		if (strlen(action_names[i]) == len &&
+		    !strncmp(arg, action_names[i], len))
+			break;
+	}
+	if (i == FDB_ACT_MAX) {
+		fprintf(stderr, "Invalid action: '%s'\n", arg);
+		return 1;
+	}
+	e->action = i;
+
+	if (i == FDB_ACT_REWRITE || i == FDB_ACT_PUSH) {
+		if (!vlan || str_to_int(vlan + 1, 1, 4095, &ret)) {
+			fprintf(stderr, "Action %s needs a vlan: %s:vlan\n",
+				action_names[i], action_names[i]);
+			return 1;
+		}
+		e->act_vlan = (__u16)ret;
+	} else if (vlan) {
+		fprintf(stderr, "Action %s does not take a vlan\n",
+			action_names[i]);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void entry_val(const struct fdb_entry *e, struct fdb_val *val)
+{
+	memset(val, 0, sizeof(*val));
+	val->ifindex = e->ifindex;
+	val->action = e->action;
+	val->vlan = e->act_vlan;
+}
+
+/* options describing an fdb entry; shared by the command line and
+ * entry files
+ */
+static int parse_entry_opt(int opt, const char *arg, struct fdb_entry *e)
+{
+	unsigned long tmp;
+	int ret;
+
+	switch (opt) {
+	case 'd':
+		e->ifindex = if_nametoindex(arg);
+		if (!e->ifindex) {
+			if (str_to_int(arg, 0, INT_MAX, &ret)) {
+				fprintf(stderr, "Invalid device\n");
+				return 1;
+			}
+			e->ifindex = (__u32)ret;
+		}
+		break;
+	case 'm':
+		if (str_to_mac(arg, e->key.mac)) {
+			fprintf(stderr, "Invalid mac address\n");
+			return 1;
+		}
+		break;
+	case 'v':
+		if (str_to_int(arg, 0, 4095, &ret)) {
+			fprintf(stderr, "Invalid vlan\n");
+			return 1;
+		}
+		e->key.vlan = (__u16)ret;
+		break;
+	case 'o':
+		if (str_to_int(arg, 1, 4095, &ret)) {
+			fprintf(stderr, "Invalid outer vlan\n");
+			return 1;
+		}
+		e->key.outer_vlan = (__u16)ret;
+		break;
+	case 'a':
+		return parse_action(arg, e);
+	case 'p':
+		if (str_to_ulong(arg, &tmp) == 0) {
+			e->prog_id = (__u32)tmp;
+		} else if (*arg == '/') {
+			free(e->prog_path);
+			e->prog_path = strdup(arg);
+			if (!e->prog_path)
+				return 1;
+		} else {
+			fprintf(stderr, "Invalid program id: '%s'\n", arg);
+			return 1;
+		}
+		break;
+	default:
+		return 1;
+	}
+
+	return 0;
+}
+
+static int entry_prog_fd(const struct fdb_entry *e)
+{
+	int fd = -1;
+
+	if (e->prog_id) {
+		fd = bpf_prog_get_fd_by_id(e->prog_id);
+		if (fd < 0)
+			fprintf(stderr, "Failed to get fd for prog id: %s: %d\n",
+				strerror(errno), errno);
+	} else if (e->prog_path) {
+		fd = bpf_prog_get_fd_by_path(e->prog_path);
+		if (fd < 0)
+			fprintf(stderr, "Failed to get fd for program: %s: %d\n",
+				strerror(errno), errno);
+	}
+
+	return fd;
+}
+
+static void free_entries(struct fdb_entry *entries, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		free(entries[i].prog_path);
+	free(entries);
+}
+
+/* order by key, then by line so the first of duplicates comes first */
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct fdb_entry *e1 = *(const struct fdb_entry **)a;
+	const struct fdb_entry *e2 = *(const struct fdb_entry **)b;
+	int rc;
+
+	rc = memcmp(&e1->key, &e2->key, sizeof(e1->key));
+
+	return rc ? : e1->lineno - e2->lineno;
+}
+
+/* report the first duplicate <outer vlan, vlan, mac> key */
+static int check_duplicates(const char *file, struct fdb_entry *entries,
+			    int n)
+{
+	struct fdb_entry **sorted;
+	int i, rc = 0;
+
+	if (n < 2)
+		return 0;
+
+	sorted = calloc(n, sizeof(*sorted));
+	if (!sorted) {
+		fprintf(stderr, "Failed to allocate entries\n");
+		return 1;
+	}
+
+	for (i = 0; i < n; i++)
+		sorted[i] = &entries[i];
+	qsort(sorted, n, sizeof(*sorted), entry_cmp);
+
+	for (i = 1; i < n; i++) {
+		if (!memcmp(&sorted[i - 1]->key, &sorted[i]->key,
+			    sizeof(sorted[i]->key))) {
+			fprintf(stderr, "%s:%d: duplicate of entry on line %d\n",
+				file, sorted[i]->lineno, sorted[i - 1]->lineno);
+			rc = 1;
+			break;
+		}
+	}
+
+	free(sorted);
+	return rc;
+}
+
+/* read entries, one per line, in the format printed by -C:
+ *     -v vlan -m mac -d device [-p progid]
+ * Blank lines and lines starting with '#' are skipped. All entries
+ * are validated before any is applied: each needs a device and a mac,
+ * vlan 0 only with an outer vlan, and keys must be unique.
+ */
+static int read_entries(const char *file, struct fdb_entry **pentries,
+			int *pn)
+{
+	struct fdb_entry *entries = NULL, *e;
+	int n = 0, size = 0, lineno = 0;
+	char line[256], *tok, *arg, *save;
+	bool have_mac;
+	FILE *fp;
+
+	if (!strcmp(file, "-")) {
+		fp = stdin;
+	} else {
+		fp = fopen(file, "r");
+		if (!fp) {
+			fprintf(stderr, "Failed to open %s: %s\n",
+				file, strerror(errno));
+			return 1;
+		}
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+
+		tok = strtok_r(line, " \t\n", &save);
+		if (!tok || *tok == '#')
+			continue;
+
+		if (n == size) {
+			size = size ? size * 2 : 256;
+			e = realloc(entries, size * sizeof(*entries));
+			if (!e) {
+				fprintf(stderr, "Failed to allocate entries\n");
+				goto err;
+			}
+			entries = e;
+		}
+		e = &entries[n++];
+		memset(e, 0, sizeof(*e));
+		e->lineno = lineno;
+		have_mac = false;
+
+		for (; tok; tok = strtok_r(NULL, " \t\n", &save)) {
+			arg = strtok_r(NULL, " \t\n", &save);
+			if (tok[0] != '-' || !tok[1] || tok[2] || !arg ||
+			    parse_entry_opt(tok[1], arg, e)) {
+				fprintf(stderr, "%s:%d: invalid entry\n",
+					file, lineno);
+				goto err;
+			}
+			if (tok[1] == 'm')
+				have_mac = true;
+		}
+
+		if (!e->ifindex) {
+			fprintf(stderr, "%s:%d: device not given\n",
+				file, lineno);
+			goto err;
+		}
+
+		if (!have_mac) {
+			fprintf(stderr, "%s:%d: mac address not given\n",
+				file, lineno);
+			goto err;
+		}
+
+		/* the program passes vlan 0 frames to the stack */
+		if (!e->key.vlan && !e->key.outer_vlan) {
+			fprintf(stderr, "%s:%d: vlan 0 needs an outer vlan\n",
+				file, lineno);
+			goto err;
+		}
+	}
+
+	if (check_duplicates(file, entries, n))
+		goto err;
+
+	if (fp != stdin)
+		fclose(fp);
+
+	*pentries = entries;
+	*pn = n;
+	return 0;
+err:
+	if (fp != stdin)
+		fclose(fp);
+	free_entries(entries, n);
+	return 1;
+}
+
+static int fdb_update_batch(int fdb_fd, struct fdb_key *keys,
+			    struct fdb_val *vals, __u32 n)
+{
+	DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts,
+		.elem_flags = BPF_ANY,
+	);
+	__u32 count = n, i;
+
+	if (!bpf_map_update_batch(fdb_fd, keys, vals, &count, &opts))
+		return 0;
+
+	if (errno != EINVAL && errno != ENOTSUPP && errno != EOPNOTSUPP) {
+		fprintf(stderr, "Failed to add fdb entries: %s: %d\n",
+			strerror(errno), errno);
+		return 1;
+	}
+
+	/* kernel without batch support */
+	for (i = 0; i < n; i++) {
+		if (bpf_map_update_elem(fdb_fd, &keys[i], &vals[i], BPF_ANY)) {
+			fprintf(stderr, "Failed to add fdb entry: %s: %d\n",
+				strerror(errno), errno);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* add devices to the port map, then the fdb entries in one batch */
+static int apply_entries(int fdb_fd, int ports_fd,
+			 struct fdb_entry *entries, int n)
+{
+	struct bpf_devmap_val pval;
+	struct fdb_val *vals;
+	struct fdb_key *keys;
+	int i, j, ret = 1;
+
+	for (i = 0; i < n; i++) {
+		/* once per device; first entry sets the program */
+		for (j = 0; j < i; j++) {
+			if (entries[j].ifindex == entries[i].ifindex)
+				break;
+		}
+		if (j < i)
+			continue;
+
+		memset(&pval, 0, sizeof(pval));
+		pval.ifindex = entries[i].ifindex;
+		pval.bpf_prog.fd = -1;
+		if (entries[i].prog_id || entries[i].prog_path) {
+			pval.bpf_prog.fd = entry_prog_fd(&entries[i]);
+			if (pval.bpf_prog.fd < 0)
+				return 1;
+		}
+
+		ret = bpf_map_update_elem(ports_fd, &pval.ifindex, &pval, 0);
+		if (pval.bpf_prog.fd >= 0)
+			close(pval.bpf_prog.fd);
+		if (ret) {
+			fprintf(stderr, "Failed to add ports entry: %s: %d\n",
+				strerror(errno), errno);
+			return 1;
+		}
+	}
+
+	if (n <= 0)
+		return 0;
+
+	keys = calloc(n, sizeof(*keys));
+	vals = calloc(n, sizeof(*vals));
+	if (!keys || !vals) {
+		fprintf(stderr, "Failed to allocate memory for entries\n");
+		ret = 1;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		keys[i] = entries[i].key;
+		entry_val(&entries[i], &vals[i]);
+	}
+
+	ret = fdb_update_batch(fdb_fd, keys, vals, n);
+out:
+	free(keys);
+	free(vals);
+	return ret;
+}
+
+/* entries are removed by the walk */
+static int flush_entry(const void *key, const void *value, void *arg)
+{
+	return 0;
+}
+
+static int get_config(int config_fd, struct fdb_config *cfg)
+{
+	__u32 idx = 0;
+
+	memset(cfg, 0, sizeof(*cfg));
+	if (bpf_map_lookup_elem(config_fd, &idx, cfg)) {
+		fprintf(stderr, "Failed to read config map: %s: %d\n",
+			strerror(errno), errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int set_config(int config_fd, const struct fdb_config *cfg)
+{
+	__u32 idx = 0;
+
+	if (bpf_map_update_elem(config_fd, &idx, cfg, BPF_ANY)) {
+		fprintf(stderr, "Failed to update config map: %s: %d\n",
+			strerror(errno), errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* fill the inactive static FDB with entries and make it active */
+static int replace_entries(int config_fd, int ports_fd,
+			   struct fdb_entry *entries, int n)
+{
+	int fdb_fd, shadow_fd, new_fd, old_fd;
+	struct fdb_config cfg;
+
+	fdb_fd = bpf_map_get_fd_by_name("fdb_map");
+	shadow_fd = bpf_map_get_fd_by_name("fdb_map_shadow");
+	if (config_fd < 0 || fdb_fd < 0 || shadow_fd < 0) {
+		fprintf(stderr, "Program does not support replacing the FDB\n");
+		return 1;
+	}
+
+	if (get_config(config_fd, &cfg))
+		return 1;
+
+	new_fd = cfg.active ? fdb_fd : shadow_fd;
+	old_fd = cfg.active ? shadow_fd : fdb_fd;
+
+	if (bpf_map_walk(new_fd, flush_entry, NULL, true) ||
+	    apply_entries(new_fd, ports_fd, entries, n))
+		return 1;
+
+	cfg.active = !cfg.active;
+	if (set_config(config_fd, &cfg))
+		return 1;
+
+	/* keep the inactive copy empty */
+	return bpf_map_walk(old_fd, flush_entry, NULL, true) ? 1 : 0;
+}
+
+struct flood_ctx {
+	struct flood_member_key	key;
+	bool			port_used;
+	bool			vlan_used;
+};
+
+static int show_flood_member(const void *_key, const void *value, void *arg)
+{
+	const struct flood_member_key *key = _key;
+	const struct flood_member *m = value;
+	char buf[IFNAMSIZ];
+
+	if (if_indextoname(key->ifindex, buf) == NULL)
+		snprintf(buf, IFNAMSIZ, "-");
+
+	printf("vlan %u: device %s/%u%s\n", key->vlan, buf, key->ifindex,
+	       m->flags & FLOOD_F_UNTAG ? " untagged" : "");
+
+	return 0;
+}
+
+static int show_flood_members(int member_fd)
+{
+	printf("\nFlood groups:\n");
+	return bpf_map_walk(member_fd, show_flood_member, NULL, false) ? 1 : 0;
+}
+
+/* note whether another member uses the port or vlan */
+static int flood_member_used(const void *_key, const void *value, void *arg)
+{
+	const struct flood_member_key *key = _key;
+	struct flood_ctx *ctx = arg;
+
+	if (key->ifindex == ctx->key.ifindex)
+		ctx->port_used = true;
+	if (key->vlan == ctx->key.vlan)
+		ctx->vlan_used = true;
+
+	return 0;
+}
+
+static int flood_maps(int *ports_fd, int *member_fd, int *vlan_fd)
+{
+	*ports_fd = bpf_map_get_fd_by_name("xdp_flood_ports");
+	*member_fd = bpf_map_get_fd_by_name("flood_mbr_map");
+	*vlan_fd = bpf_map_get_fd_by_name("flood_vlan_map");
+	if (*ports_fd < 0 || *member_fd < 0 || *vlan_fd < 0) {
+		fprintf(stderr,
+			"Program does not support flooding; needs a kernel with devmap broadcast\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* add port to the flood group of vlan. The port runs the flood
+ * program, xdp_l2fwd_flood unless another is given with -p.
+ */
+static int flood_add(const struct fdb_entry *e, bool untag)
+{
+	struct bpf_devmap_val pval = { .ifindex = e->ifindex };
+	struct flood_member_key key = {
+		.ifindex = e->ifindex,
+		.vlan = e->key.vlan,
+	};
+	struct flood_member m = { .flags = untag ? FLOOD_F_UNTAG : 0 };
+	int ports_fd, member_fd, vlan_fd;
+	__u32 vlan = e->key.vlan, on = 1;
+	int ret;
+
+	if (flood_maps(&ports_fd, &member_fd, &vlan_fd))
+		return 1;
+
+	if (e->prog_id || e->prog_path) {
+		pval.bpf_prog.fd = entry_prog_fd(e);
+	} else {
+		pval.bpf_prog.fd = bpf_prog_get_fd_by_name("xdp_l2fwd_flood");
+		if (pval.bpf_prog.fd < 0)
+			fprintf(stderr, "Failed to find flood program\n");
+	}
+	if (pval.bpf_prog.fd < 0)
+		return 1;
+
+	ret = bpf_map_update_elem(ports_fd, &pval.ifindex, &pval, 0);
+	close(pval.bpf_prog.fd);
+	if (ret) {
+		fprintf(stderr, "Failed to add flood ports entry: %s: %d\n",
+			strerror(errno), errno);
+		return 1;
+	}
+
+	if (bpf_map_update_elem(member_fd, &key, &m, BPF_ANY)) {
+		fprintf(stderr, "Failed to add flood member: %s: %d\n",
+			strerror(errno), errno);
+		return 1;
+	}
+
+	/* start flooding once the group has a member */
+	if (bpf_map_update_elem(vlan_fd, &vlan, &on, BPF_ANY)) {
+		fprintf(stderr, "Failed to enable flooding for vlan: %s: %d\n",
+			strerror(errno), errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int flood_del(const struct fdb_entry *e)
+{
+	struct flood_ctx ctx = {
+		.key.ifindex = e->ifindex,
+		.key.vlan = e->key.vlan,
+	};
+	int ports_fd, member_fd, vlan_fd;
+	__u32 vlan = e->key.vlan, off = 0;
+
+	if (flood_maps(&ports_fd, &member_fd, &vlan_fd))
+		return 1;
+
+	if (bpf_map_delete_elem(member_fd, &ctx.key)) {
+		fprintf(stderr, "Failed to delete flood member\n");
+		return 1;
+	}
+
+	if (bpf_map_walk(member_fd, flood_member_used, &ctx, false))
+		return 1;
+
+	if (!ctx.vlan_used &&
+	    bpf_map_update_elem(vlan_fd, &vlan, &off, BPF_ANY)) {
+		fprintf(stderr, "Failed to disable flooding for vlan\n");
+		return 1;
+	}
+
+	if (!ctx.port_used && bpf_map_delete_elem(ports_fd, &ctx.key.ifindex)) {
+		fprintf(stderr, "Failed to delete flood ports entry\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* The program is loaded with bpftool, so FDB sizes can not be set at
+ * load time here. Instead create the FDB maps with the wanted sizes and
+ * pin them in dir; prog load reuses them with map name NAME pinned PATH.
+ */
+static int create_fdb_maps(const char *dir, int nstatic, int nlearn)
+{
+	const struct {
+		const char *name;
+		enum bpf_map_type type;
+		int value_size;
+		int entries;
+	} maps[] = {
+		{ "fdb_map", BPF_MAP_TYPE_HASH,
+		  sizeof(struct fdb_val), nstatic },
+		{ "fdb_map_shadow", BPF_MAP_TYPE_HASH,
+		  sizeof(struct fdb_val), nstatic },
+		{ "fdb_learn_map", BPF_MAP_TYPE_LRU_HASH,
+		  sizeof(struct fdb_learn_val), nlearn },
+	};
+	char path[PATH_MAX];
+	int i, fd;
+
+	for (i = 0; i < ARRAY_SIZE(maps); i++) {
+		if (snprintf(path, sizeof(path), "%s/%s",
+			     dir, maps[i].name) >= sizeof(path)) {
+			fprintf(stderr, "Pin path too long\n");
+			return 1;
+		}
+
+		fd = bpf_create_map_name(maps[i].type, maps[i].name,
+					 sizeof(struct fdb_key),
+					 maps[i].value_size, maps[i].entries, 0);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to create %s: %s: %d\n",
+				maps[i].name, strerror(errno), errno);
+			return 1;
+		}
+
+		if (bpf_obj_pin(fd, path)) {
+			fprintf(stderr, "Failed to pin %s at %s: %s: %d\n",
+				maps[i].name, path, strerror(errno), errno);
+			close(fd);
+			return 1;
+		}
+		close(fd);
+
+		printf("%s: %d entries pinned at %s\n",
+		       maps[i].name, maps[i].entries, path);
+	}
+
+	return 0;
+}
+
+/* static[,learned] */
+static int parse_fdb_size(char *arg, int *nstatic, int *nlearn)
+{
+	char *p = strchr(arg, ',');
+
+	if (p) {
+		*p++ = '\0';
+		if (str_to_int(p, 1, INT_MAX, nlearn))
+			return 1;
+	}
+
+	return str_to_int(arg, 1, INT_MAX, nstatic);
+}
+
 static void usage(const char *prog)
 {
 	fprintf(stderr,
@@ -253,27 +1137,63 @@ static void usage(const char *prog)
 		"    -t id          devmap id for tx ports\n"
 		"    -d device      device to redirect\n"
 		"    -m mac         mac address for entry\n"
-		"    -v vlan        vlan for entry\n"
+		"    -v vlan        vlan for entry (inner vlan with -o)\n"
+		"    -o vlan        802.1ad outer vlan for entry\n"
+		"    -a action      what to do with the tags on egress: strip\n"
+		"                   (default), keep, pop-outer, rewrite:vlan\n"
+		"                   (outermost tag) or push:vlan (802.1ad tag)\n"
 		"    -r             remove entries\n"
 		"    -p progid      bpf program id to attach to entry\n"
 		"    -P             print map entries\n"
-		, prog);
+		"    -l 0|1         disable or enable learning\n"
+		"    -A age         age out learned entries idle for age seconds\n"
+		"                   (0 for default of %u); runs until killed\n"
+		"    -F             flush learned entries\n"
+		"    -b file        add entries from file ('-' for stdin), one per\n"
+		"                   line as printed by -C: -v vlan -m mac -d device\n"
+		"                   [-o vlan] [-a action]\n"
+		"    -R             with -b, atomically replace all static entries\n"
+		"    -G             add (or with -r remove) device to the flood\n"
+		"                   group for broadcast and multicast on vlan\n"
+		"    -U             with -G, pop the VLAN tag on the device\n"
+		"    -s secs        show forwarding counters; with secs > 0 show\n"
+		"                   rates every secs seconds until killed\n"
+		"    -S num[,num]   create and pin FDB maps for prog load with\n"
+		"                   num static (default %u) and learned (default\n"
+		"                   %u) entries\n"
+		"    -D dir         directory to pin FDB maps in (default %s)\n"
+		, prog, FDB_AGE_DEFAULT, FDB_STATIC_ENTRIES, FDB_LEARN_ENTRIES,
+		FDB_PIN_DIR);
 }
 
 int main(int argc, char **argv)
 {
 	struct bpf_devmap_val pval = { .bpf_prog.fd = -1 };
-	__u32 fdb_id = 0, ports_id = 0, bpf_prog_id = 0;
-	const char *bpf_prog_path = NULL;
+	int fdb_fd, ports_fd, learn_fd, config_fd, member_fd;
+	__u32 fdb_id = 0, ports_id = 0;
+	struct fdb_entry *entries = NULL;
+	const char *entry_file = NULL;
 	bool print_entries = false;
-	struct fdb_key key = {};
-	int fdb_fd, ports_fd;
+	const char *pin_dir = FDB_PIN_DIR;
+	int nstatic = FDB_STATIC_ENTRIES;
+	int nlearn = FDB_LEARN_ENTRIES;
+	struct fdb_entry ent = {};
+	struct fdb_config cfg;
+	bool create = false;
+	struct fdb_val fval;
+	bool replace = false;
 	bool delete = false;
+	bool flood = false;
+	bool untag = false;
 	bool cli_arg = false;
+	bool flush = false;
+	int stats_interval = -1;
+	int learn = -1;
+	int age = -1;
 	unsigned long tmp;
-	int opt, ret;
+	int opt, ret, n;
 
-	while ((opt = getopt(argc, argv, ":f:t:d:m:v:p:rPC")) != -1) {
+	while ((opt = getopt(argc, argv, ":f:t:d:m:v:o:a:p:rPCl:A:Fb:Rs:GUS:D:")) != -1) {
 		switch (opt) {
 		case 'f':
 			if (str_to_ulong(optarg, &tmp)) {
@@ -290,37 +1210,13 @@ int main(int argc, char **argv)
 			ports_id = (__u32)tmp;
 			break;
 		case 'd':
-			pval.ifindex = if_nametoindex(optarg);
-			if (!pval.ifindex) {
-				if (str_to_int(optarg, 0, INT_MAX, &ret)) {
-					fprintf(stderr, "Invalid device\n");
-					return 1;
-				}
-				pval.ifindex = (__u32)ret;
-			}
-			break;
 		case 'm':
-			if (str_to_mac(optarg, key.mac)) {
-				fprintf(stderr, "Invalid mac address\n");
-				return 1;
-			}
-			break;
 		case 'v':
-			if (str_to_int(optarg, 0, 4095, &ret)) {
-				fprintf(stderr, "Invalid vlan\n");
-				return 1;
-			}
-			key.vlan = (__u16)ret;
-			break;
+		case 'o':
+		case 'a':
 		case 'p':
-			if (str_to_ulong(optarg, &tmp) == 0) {
-				bpf_prog_id = (__u32)tmp;
-			} else if (*optarg == '/') {
-				bpf_prog_path = optarg;
-			} else {
-				fprintf(stderr, "Invalid program id: '%s'\n", optarg);
+			if (parse_entry_opt(opt, optarg, &ent))
 				return 1;
-			}
 			break;
 		case 'r':
 			delete = true;
@@ -331,12 +1227,90 @@ int main(int argc, char **argv)
 		case 'P':
 			print_entries = true;
 			break;
+		case 'l':
+			if (str_to_int(optarg, 0, 1, &learn)) {
+				fprintf(stderr, "Invalid learning setting\n");
+				return 1;
+			}
+			break;
+		case 'A':
+			if (str_to_int(optarg, 0, INT_MAX, &age)) {
+				fprintf(stderr, "Invalid age\n");
+				return 1;
+			}
+			if (!age)
+				age = FDB_AGE_DEFAULT;
+			break;
+		case 'F':
+			flush = true;
+			break;
+		case 'b':
+			entry_file = optarg;
+			break;
+		case 'R':
+			replace = true;
+			break;
+		case 'G':
+			flood = true;
+			break;
+		case 'U':
+			untag = true;
+			break;
+		case 's':
+			if (str_to_int(optarg, 0, INT_MAX, &stats_interval)) {
+				fprintf(stderr, "Invalid stats interval\n");
+				return 1;
+			}
+			break;
+		case 'S':
+			if (parse_fdb_size(optarg, &nstatic, &nlearn)) {
+				fprintf(stderr, "Invalid FDB size\n");
+				return 1;
+			}
+			create = true;
+			break;
+		case 'D':
+			pin_dir = optarg;
+			break;
 		default:
 			usage(basename(argv[0]));
 			return 1;
 		}
 	}
 
+	if (create)
+		return create_fdb_maps(pin_dir, nstatic, nlearn);
+
+	if (replace && !entry_file) {
+		fprintf(stderr, "Replace requires a file of entries (-b)\n");
+		return 1;
+	}
+
+	if (flood) {
+		if (!ent.ifindex || !ent.key.vlan) {
+			fprintf(stderr, "Flood group needs device and vlan\n");
+			return 1;
+		}
+
+		return delete ? flood_del(&ent) : flood_add(&ent, untag);
+	}
+
+	if (stats_interval >= 0) {
+		int stats_fd;
+
+		stats_fd = bpf_map_get_fd_by_name("xdp_stats_map");
+		if (stats_fd < 0) {
+			fprintf(stderr, "Failed to get fd for stats map\n");
+			return 1;
+		}
+
+		return show_stats(stats_fd, stats_interval);
+	}
+
+	/* optional; older programs do not have these maps */
+	config_fd = bpf_map_get_fd_by_name("fdb_config_map");
+	learn_fd = bpf_map_get_fd_by_name("fdb_learn_map");
+
 	if (fdb_id) {
 		fdb_fd = bpf_map_get_fd_by_id(fdb_id);
 		if (fdb_fd < 0 && errno != ENOENT) {
@@ -346,7 +1320,12 @@ int main(int argc, char **argv)
 			return 1;
 		}
 	} else {
-		fdb_fd = bpf_map_get_fd_by_name("fdb_map");
+		/* entries go to the static FDB in use */
+		if (config_fd >= 0 && get_config(config_fd, &cfg) == 0 &&
+		    cfg.active)
+			fdb_fd = bpf_map_get_fd_by_name("fdb_map_shadow");
+		else
+			fdb_fd = bpf_map_get_fd_by_name("fdb_map");
 		if (fdb_fd < 0 && errno != ENOENT) {
 			fprintf(stderr, "Failed to get fd for fdb map: %s: %d\n",
 				strerror(errno), errno);
@@ -372,6 +1351,31 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (learn >= 0 || age >= 0 || flush) {
+		if (learn_fd < 0) {
+			fprintf(stderr, "Failed to get fd for learned fdb map\n");
+			return 1;
+		}
+
+		if (learn >= 0) {
+			if (config_fd < 0) {
+				fprintf(stderr,
+					"Failed to get fd for fdb config map\n");
+				return 1;
+			}
+			if (get_config(config_fd, &cfg))
+				return 1;
+			cfg.learn = learn;
+			if (set_config(config_fd, &cfg))
+				return 1;
+		}
+
+		if (flush && bpf_map_walk(learn_fd, flush_entry, NULL, true))
+			return 1;
+
+		return age >= 0 ? age_learn_entries(learn_fd, age) : 0;
+	}
+
 	if (cli_arg)
 		return show_entries_cli(fdb_fd, ports_fd);
 
@@ -381,50 +1385,62 @@ int main(int argc, char **argv)
 		else
 			ret = 0;
 
+		if (learn_fd > 0)
+			ret = show_learn_entries(learn_fd) ? : ret;
+
+		member_fd = bpf_map_get_fd_by_name("flood_mbr_map");
+		if (member_fd > 0)
+			ret = show_flood_members(member_fd) ? : ret;
+
 		return show_ports_entries(ports_fd) ? : ret;
 	}
 
 	if (fdb_fd < 0)
 		return 1;
 
-	if (bpf_prog_id) {
-		pval.bpf_prog.fd = bpf_prog_get_fd_by_id(bpf_prog_id);
-		if (pval.bpf_prog.fd < 0) {
-			fprintf(stderr, "Failed to get fd for prog id: %s: %d\n",
-				strerror(errno), errno);
+	if (entry_file) {
+		if (read_entries(entry_file, &entries, &n))
 			return 1;
-		}
-	} else if (bpf_prog_path) {
-		pval.bpf_prog.fd = bpf_prog_get_fd_by_path(bpf_prog_path);
-		if (pval.bpf_prog.fd < 0) {
-			fprintf(stderr, "Failed to get fd for program: %s: %d\n",
-				strerror(errno), errno);
+
+		if (replace)
+			ret = replace_entries(config_fd, ports_fd, entries, n);
+		else
+			ret = apply_entries(fdb_fd, ports_fd, entries, n);
+
+		free_entries(entries, n);
+		return ret;
+	}
+
+	if (ent.prog_id || ent.prog_path) {
+		pval.bpf_prog.fd = entry_prog_fd(&ent);
+		if (pval.bpf_prog.fd < 0)
 			return 1;
-		}
 	}
 
+	pval.ifindex = ent.ifindex;
 	if (!pval.ifindex) {
 		fprintf(stderr, "Device index not given\n");
 		return 1;
 	}
 
 	if (delete)
-		return remove_entries(fdb_fd, &key, ports_fd, pval.ifindex);
+		return remove_entries(fdb_fd, &ent.key, ports_fd, pval.ifindex);
 
 	/* add device to port map and then add fdb entry */
 	ret = bpf_map_update_elem(ports_fd, &pval.ifindex, &pval, 0);
 	if (ret) {
 		fprintf(stderr, "Failed to add ports entry: %s: %d\n",
 			strerror(errno), errno);
-		remove_entries(fdb_fd, &key, ports_fd, pval.ifindex);
+		remove_entries(fdb_fd, &ent.key, ports_fd, pval.ifindex);
 		return ret;
 	}
 
-	ret = bpf_map_update_elem(fdb_fd, &key, &pval.ifindex, BPF_ANY);
+	entry_val(&ent, &fval);
+	ret = bpf_map_update_elem(fdb_fd, &ent.key, &fval, BPF_ANY);
 	if (ret) {
 		fprintf(stderr, "Failed to add fdb entry: %s: %d\n",
 			strerror(errno), errno);
-		remove_entries(fdb_fd, &key, ports_fd, pval.ifindex);
+		remove_entries(fdb_fd, &ent.key, ports_fd, pval.ifindex);
 		return ret;
 	}
 
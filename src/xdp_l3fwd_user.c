@@ -6,8 +6,12 @@
 
 #include <linux/bpf.h>
 #include <linux/if_link.h>
+#include <linux/kernel.h>
 #include <linux/limits.h>
+#include <limits.h>
+#include <linux/rtnetlink.h>
 #include <net/if.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,38 +20,487 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 
 #include "libbpf_helpers.h"
 #include "str_utils.h"
+#include "timestamps.h"
+#include "xdp_l3fwd.h"
 
-static int do_attach(int idx, int prog_fd, int map_fd, const char *name)
+/* minimum time between cache flushes; a burst of route or neighbor
+ * updates invalidates the cache once
+ */
+#define L3FWD_CACHE_HOLDOFF_MS	100
+
+/* kernel internal; returned for maps without batch support */
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+static bool done;
+
+struct l3fwd_dev {
+	const char	*name;
+	__u32		ifindex;
+	__u16		vlan;
+};
+
+/* interface-list entries are dev[:vlan] */
+static int parse_dev(char *arg, struct l3fwd_dev *dev)
+{
+	char *vlan = strchr(arg, ':');
+	int val;
+
+	if (vlan) {
+		*vlan++ = '\0';
+		if (str_to_int(vlan, 1, 4094, &val)) {
+			fprintf(stderr, "Invalid vlan for %s: %s\n", arg, vlan);
+			return 1;
+		}
+		dev->vlan = val;
+	}
+
+	dev->name = arg;
+	dev->ifindex = get_ifidx(arg);
+	if (!dev->ifindex) {
+		fprintf(stderr, "Invalid device: %s\n", arg);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* one BPF_MAP_UPDATE_BATCH call; per element on kernels without it */
+static int map_update_batch(int fd, __u32 *keys, void *vals, size_t vsize,
+			    __u32 n, const char *desc)
+{
+	DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts,
+		.elem_flags = BPF_ANY,
+	);
+	__u32 count = n, i;
+
+	if (!n || !bpf_map_update_batch(fd, keys, vals, &count, &opts))
+		return 0;
+
+	if (errno != EINVAL && errno != ENOTSUPP && errno != EOPNOTSUPP) {
+		fprintf(stderr, "Failed to add %s entries: %s: %d\n",
+			desc, strerror(errno), errno);
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (bpf_map_update_elem(fd, &keys[i], (char *)vals + i * vsize,
+					BPF_ANY)) {
+			fprintf(stderr, "Failed to add %s entry: %s: %d\n",
+				desc, strerror(errno), errno);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* add port settings, then the devices to the ports map, so a port is
+ * complete before packets can be redirected to it
+ */
+static int add_ports(struct bpf_object *obj, struct l3fwd_dev *devs, int n)
+{
+	struct bpf_devmap_val *pvals = NULL;
+	struct l3fwd_port *vvals = NULL;
+	int ports_fd, port_fd, vlan_prog_fd = -1;
+	__u32 *pkeys = NULL, *vkeys = NULL;
+	int i, nvlan = 0, ret = 1;
+
+	ports_fd = bpf_map__fd(bpf_object__find_map_by_name(obj,
+							"xdp_l3fwd_ports"));
+	port_fd = bpf_map__fd(bpf_object__find_map_by_name(obj,
+							"l3fwd_port_map"));
+	if (ports_fd < 0 || port_fd < 0) {
+		fprintf(stderr, "Failed to find ports maps in obj file\n");
+		return 1;
+	}
+
+	pkeys = calloc(n, sizeof(*pkeys));
+	pvals = calloc(n, sizeof(*pvals));
+	vkeys = calloc(n, sizeof(*vkeys));
+	vvals = calloc(n, sizeof(*vvals));
+	if (!pkeys || !pvals || !vkeys || !vvals) {
+		fprintf(stderr, "Failed to allocate ports\n");
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		pkeys[i] = devs[i].ifindex;
+		pvals[i].ifindex = devs[i].ifindex;
+		pvals[i].bpf_prog.fd = -1;
+
+		if (!devs[i].vlan)
+			continue;
+
+		if (vlan_prog_fd < 0) {
+			struct bpf_program *prog;
+
+			prog = bpf_object__find_program_by_title(obj,
+						"xdp_devmap/l3fwd_vlan");
+			vlan_prog_fd = prog ? bpf_program__fd(prog) : -1;
+			if (vlan_prog_fd < 0) {
+				fprintf(stderr,
+					"No devmap program in obj file for vlan of %s\n",
+					devs[i].name);
+				goto out;
+			}
+		}
+		pvals[i].bpf_prog.fd = vlan_prog_fd;
+
+		vkeys[nvlan] = devs[i].ifindex;
+		vvals[nvlan].vlan = devs[i].vlan;
+		nvlan++;
+	}
+
+	if (map_update_batch(port_fd, vkeys, vvals, sizeof(*vvals), nvlan,
+			     "port") ||
+	    map_update_batch(ports_fd, pkeys, pvals, sizeof(*pvals), n,
+			     "TX-port"))
+		goto out;
+
+	ret = 0;
+out:
+	free(pkeys);
+	free(pvals);
+	free(vkeys);
+	free(vvals);
+	return ret;
+}
+
+static __u64 now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int cache_set_config(int fd, struct l3fwd_cache_cfg *cfg)
+{
+	__u32 idx = 0;
+
+	if (bpf_map_update_elem(fd, &idx, cfg, BPF_ANY)) {
+		fprintf(stderr, "Failed to update cache config: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* entries are tagged with the generation they were added in, so
+ * bumping it flushes the cache without walking it. 0 is skipped since
+ * it is the value of unused per-cpu slots.
+ */
+static int cache_flush(int fd, struct l3fwd_cache_cfg *cfg)
+{
+	if (++cfg->gen == 0)
+		cfg->gen = 1;
+
+	return cache_set_config(fd, cfg);
+}
+
+static int rtnl_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK | RTMGRP_NEIGH |
+			     RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+			     RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open netlink socket: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Failed to bind netlink socket: %s\n",
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void sig_handler(int signo)
+{
+	done = true;
+}
+
+/* invalidate the cache on any link, address, neighbor or route change.
+ * The content of the messages does not matter; on overrun (ENOBUFS)
+ * events were lost, so flush as well. rtnl_fd is opened before the
+ * first flush so no change is missed. Runs until SIGINT or SIGTERM;
+ * on any exit the cache is disabled since nothing invalidates it.
+ */
+static int cache_monitor(int rtnl_fd, int cfg_fd, struct l3fwd_cache_cfg *cfg)
+{
+	struct pollfd pfd = { .fd = rtnl_fd, .events = POLLIN };
+	__u64 last = 0, now;
+	bool pending = false;
+	char buf[16384];
+	int timeout;
+	ssize_t len;
+	int ret = 1;
+
+	if (signal(SIGINT, sig_handler) == SIG_ERR ||
+	    signal(SIGTERM, sig_handler) == SIG_ERR) {
+		perror("signal");
+		goto out;
+	}
+
+	while (!done) {
+		timeout = -1;
+		if (pending) {
+			now = now_ms();
+			if (now - last >= L3FWD_CACHE_HOLDOFF_MS) {
+				if (cache_flush(cfg_fd, cfg))
+					goto out;
+				last = now;
+				pending = false;
+			} else {
+				timeout = L3FWD_CACHE_HOLDOFF_MS - (now - last);
+			}
+		}
+
+		if (poll(&pfd, 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			goto out;
+		}
+
+		if (!(pfd.revents & POLLIN))
+			continue;
+
+		/* drain the socket */
+		do {
+			len = recv(pfd.fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (len > 0 || (len < 0 && errno == ENOBUFS))
+				pending = true;
+		} while (len > 0 || (len < 0 && errno == ENOBUFS));
+
+		if (len < 0 && errno != EAGAIN && errno != EINTR) {
+			fprintf(stderr, "netlink recv failed: %s\n",
+				strerror(errno));
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	cfg->flags &= ~L3FWD_CACHE_F_ENABLED;
+	if (cache_set_config(cfg_fd, cfg))
+		ret = 1;
+
+	return ret;
+}
+
+static const char *verdict_names[L3FWD_VERDICT_MAX] = {
+	[L3FWD_FWD]		 = "fwd",
+	[L3FWD_FWD_CACHED]	 = "fwd-cached",
+	[L3FWD_PASS_TTL]	 = "pass-ttl",
+	[L3FWD_PASS_PROTO]	 = "pass-proto",
+	[L3FWD_PASS_FIB]	 = "pass-fib",
+	[L3FWD_PASS_DEVMAP_MISS] = "pass-devmap-miss",
+	[L3FWD_DROP_MALFORMED]	 = "drop-malformed",
+};
+
+static const char *fib_rc_names[] = {
+	[BPF_FIB_LKUP_RET_SUCCESS]	= "success",
+	[BPF_FIB_LKUP_RET_BLACKHOLE]	= "blackhole",
+	[BPF_FIB_LKUP_RET_UNREACHABLE]	= "unreachable",
+	[BPF_FIB_LKUP_RET_PROHIBIT]	= "prohibit",
+	[BPF_FIB_LKUP_RET_NOT_FWDED]	= "not-fwded",
+	[BPF_FIB_LKUP_RET_FWD_DISABLED]	= "fwd-disabled",
+	[BPF_FIB_LKUP_RET_UNSUPP_LWT]	= "unsupp-lwt",
+	[BPF_FIB_LKUP_RET_NO_NEIGH]	= "no-neigh",
+	[BPF_FIB_LKUP_RET_FRAG_NEEDED]	= "frag-needed",
+};
+
+struct stats_entry {
+	struct l3fwd_stats_key	key;
+	struct l3fwd_stats	cur;
+	struct l3fwd_stats	prev;
+};
+
+struct stats_ctx {
+	struct stats_entry	*entries;
+	int			n;
+	int			size;
+	int			ncpus;
+};
+
+/* sum the per-cpu values of an entry */
+static int stats_entry(const void *_key, const void *value, void *arg)
+{
+	const struct l3fwd_stats *percpu = value;
+	const struct l3fwd_stats_key *key = _key;
+	struct stats_ctx *ctx = arg;
+	struct stats_entry *e;
+	int i;
+
+	for (i = 0; i < ctx->n; i++) {
+		if (!memcmp(&ctx->entries[i].key, key, sizeof(*key)))
+			break;
+	}
+
+	if (i == ctx->n) {
+		if (ctx->n == ctx->size) {
+			int size = ctx->size ? ctx->size * 2 : 64;
+
+			e = realloc(ctx->entries, size * sizeof(*e));
+			if (!e) {
+				fprintf(stderr, "Failed to allocate stats\n");
+				return -ENOMEM;
+			}
+			ctx->entries = e;
+			ctx->size = size;
+		}
+		memset(&ctx->entries[i], 0, sizeof(ctx->entries[i]));
+		ctx->entries[i].key = *key;
+		ctx->n++;
+	}
+
+	e = &ctx->entries[i];
+	memset(&e->cur, 0, sizeof(e->cur));
+	for (i = 0; i < ctx->ncpus; i++) {
+		e->cur.bytes += percpu[i].bytes;
+		e->cur.pkts += percpu[i].pkts;
+	}
+
+	return 0;
+}
+
+static void print_stats(struct stats_ctx *ctx, unsigned int interval)
+{
+	char in[IFNAMSIZ], out[IFNAMSIZ];
+	struct stats_entry *e;
+	__u64 pkts, bytes;
+	const char *fib;
+	int i;
+
+	printf("%-16s %-16s %-18s %-14s %14s %16s", "ingress", "egress",
+	       "verdict", "fib", "packets", "bytes");
+	if (interval)
+		printf(" %12s %10s", "pps", "Mbps");
+	printf("\n");
+
+	for (i = 0; i < ctx->n; i++) {
+		e = &ctx->entries[i];
+
+		pkts = e->cur.pkts - e->prev.pkts;
+		bytes = e->cur.bytes - e->prev.bytes;
+		e->prev = e->cur;
+
+		if (interval && !pkts)
+			continue;
+
+		if (!if_indextoname(e->key.ifindex_in, in))
+			snprintf(in, sizeof(in), "%u", e->key.ifindex_in);
+		if (!e->key.ifindex_out)
+			snprintf(out, sizeof(out), "-");
+		else if (!if_indextoname(e->key.ifindex_out, out))
+			snprintf(out, sizeof(out), "%u", e->key.ifindex_out);
+
+		/* fib result only means something once a lookup is done */
+		if (e->key.verdict != L3FWD_PASS_FIB &&
+		    e->key.verdict != L3FWD_PASS_DEVMAP_MISS)
+			fib = "-";
+		else if (e->key.fib_rc < ARRAY_SIZE(fib_rc_names) &&
+			 fib_rc_names[e->key.fib_rc])
+			fib = fib_rc_names[e->key.fib_rc];
+		else
+			fib = "?";
+
+		printf("%-16s %-16s %-18s %-14s %14llu %16llu", in, out,
+		       e->key.verdict < L3FWD_VERDICT_MAX ?
+		       verdict_names[e->key.verdict] : "?",
+		       fib, pkts, bytes);
+		if (interval)
+			printf(" %12llu %10.1f", pkts / interval,
+			       bytes * 8. / interval / 1e6);
+		printf("\n");
+	}
+}
+
+/* print counters summed across cpus; with an interval, print the
+ * change and rates every interval seconds until killed
+ */
+static int show_stats(int stats_fd, unsigned int interval)
 {
-	int err;
+	struct stats_ctx ctx = {};
+	char buf[64];
+	int i;
+
+	ctx.ncpus = libbpf_num_possible_cpus();
+	if (ctx.ncpus < 0) {
+		fprintf(stderr, "Failed to get number of possible cpus\n");
+		return 1;
+	}
+
+	if (bpf_map_walk(stats_fd, stats_entry, &ctx, false))
+		goto err;
 
-	err = attach_to_dev(idx, prog_fd, name);
-	if (err < 0)
-		return err;
+	if (!interval) {
+		print_stats(&ctx, 0);
+		free(ctx.entries);
+		return 0;
+	}
+
+	/* rates are relative to the previous read */
+	for (i = 0; i < ctx.n; i++)
+		ctx.entries[i].prev = ctx.entries[i].cur;
+
+	while (1) {
+		sleep(interval);
 
-	/* Adding ifindex as a possible egress TX port */
-	err = bpf_map_update_elem(map_fd, &idx, &idx, 0);
-	if (err)
-		printf("ERROR: failed using device %s as TX-port\n", name);
+		if (bpf_map_walk(stats_fd, stats_entry, &ctx, false))
+			goto err;
+
+		printf("%s:\n", timestamp(buf, sizeof(buf), 0));
+		print_stats(&ctx, interval);
+		printf("\n");
+	}
 
-	return err;
+err:
+	free(ctx.entries);
+	return 1;
 }
 
 static void usage(const char *prog)
 {
 	fprintf(stderr,
-		"usage: %s [OPTS] interface-list\n"
+		"usage: %s [OPTS] dev[:vlan] ...\n"
+		"       %s -s secs\n"
 		"\nOPTS:\n"
 		"    -f bpf-file    bpf filename to load\n"
 		"    -d             detach program\n"
-		"    -D             direct table lookups (skip fib rules)\n",
-		prog);
+		"    -D             direct table lookups (skip fib rules)\n"
+		"    -c flow|dst    cache fib lookups per flow or per destination\n"
+		"                   and invalidate on network changes (stays in\n"
+		"                   foreground)\n"
+		"    -m entries     max number of cache entries per cpu\n"
+		"    -p entries     max number of ports (default %d)\n"
+		"    -s secs        show counters by device, verdict and fib\n"
+		"                   result; every secs seconds if not 0\n"
+		"\nA vlan after a device tags packets forwarded out of it.\n",
+		prog, prog, L3FWD_PORTS);
 }
 
 int main(int argc, char **argv)
@@ -55,17 +508,20 @@ int main(int argc, char **argv)
 	struct bpf_prog_load_attr prog_load_attr = {
 		.prog_type	= BPF_PROG_TYPE_XDP,
 	};
-	const char *objfile = "xdp_l3fwd_kern.o";
+	struct l3fwd_cache_cfg cache_cfg = {};
+	const char *objfile = "xdp_l3fwd.o";
 	const char *prog_name = "xdp_l3fwd";
 	bool filename_set = false;
+	struct l3fwd_dev *devs = NULL;
 	struct bpf_program *prog;
-	int prog_fd, map_fd = -1;
+	int prog_fd = -1, cfg_fd = -1, rtnl_fd = -1;
 	struct bpf_object *obj;
-	int opt, i, idx, err;
+	int opt, i, err, n, ndevs;
+	int stats_interval = -1;
 	bool attach = true;
 	int ret = 0;
 
-	while ((opt = getopt(argc, argv, ":dDf:")) != -1) {
+	while ((opt = getopt(argc, argv, ":c:dDf:m:p:s:")) != -1) {
 		switch (opt) {
 		case 'f':
 			objfile = optarg;
@@ -77,49 +533,131 @@ int main(int argc, char **argv)
 		case 'D':
 			prog_name = "xdp_l3fwd_direct";
 			break;
+		case 'c':
+			cache_cfg.flags = L3FWD_CACHE_F_ENABLED;
+			if (!strcmp(optarg, "dst")) {
+				cache_cfg.flags |= L3FWD_CACHE_F_DST_ONLY;
+			} else if (strcmp(optarg, "flow")) {
+				fprintf(stderr, "Invalid cache key: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			n = atoi(optarg);
+			if (n <= 0) {
+				fprintf(stderr, "Invalid number of cache entries\n");
+				return 1;
+			}
+			if (load_obj_set_max_entries("l3fwd_cache_map", n))
+				return 1;
+			break;
+		case 'p':
+			n = atoi(optarg);
+			if (n <= 0) {
+				fprintf(stderr, "Invalid number of ports\n");
+				return 1;
+			}
+			if (load_obj_set_max_entries("xdp_l3fwd_ports", n) ||
+			    load_obj_set_max_entries("l3fwd_port_map", n))
+				return 1;
+			break;
+		case 's':
+			if (str_to_int(optarg, 0, INT_MAX, &stats_interval)) {
+				fprintf(stderr, "Invalid stats interval\n");
+				return 1;
+			}
+			break;
 		default:
 			usage(basename(argv[0]));
 			return 1;
 		}
 	}
 
+	if (stats_interval >= 0) {
+		int stats_fd;
+
+		stats_fd = bpf_map_get_fd_by_name("l3fwd_stats_map");
+		if (stats_fd < 0) {
+			fprintf(stderr, "Failed to get fd for stats map\n");
+			return 1;
+		}
+
+		return show_stats(stats_fd, stats_interval);
+	}
+
 	if (optind == argc) {
 		usage(basename(argv[0]));
 		return 1;
 	}
 
+	ndevs = argc - optind;
+	devs = calloc(ndevs, sizeof(*devs));
+	if (!devs) {
+		fprintf(stderr, "Failed to allocate devices\n");
+		return 1;
+	}
+	for (i = 0; i < ndevs; i++) {
+		if (parse_dev(argv[optind + i], &devs[i]))
+			goto out;
+	}
+
 	if (attach) {
+		ret = 1;
 		if (load_obj_file(&prog_load_attr, &obj, objfile, filename_set))
-			return 1;
+			goto out;
 
 		prog = bpf_object__find_program_by_title(obj, prog_name);
 		prog_fd = bpf_program__fd(prog);
 		if (prog_fd < 0) {
 			printf("program not found: %s\n", strerror(prog_fd));
-			return 1;
+			goto out;
 		}
-		map_fd = bpf_map__fd(bpf_object__find_map_by_name(obj,
-							"xdp_tx_ports"));
-		if (map_fd < 0) {
-			printf("map not found: %s\n", strerror(map_fd));
-			return 1;
+
+		if (cache_cfg.flags) {
+			cfg_fd = bpf_map__fd(bpf_object__find_map_by_name(obj,
+							"l3fwd_cache_cfg_map"));
+			if (cfg_fd < 0) {
+				printf("map not found: %s\n", strerror(cfg_fd));
+				goto out;
+			}
+
+			/* listen before the first flush and before ports
+			 * are added so no change is missed
+			 */
+			rtnl_fd = rtnl_open();
+			if (rtnl_fd < 0)
+				goto out;
+
+			if (cache_flush(cfg_fd, &cache_cfg))
+				goto out;
 		}
+
+		if (add_ports(obj, devs, ndevs))
+			goto out;
+		ret = 0;
 	}
 
-	for (i = optind; i < argc; ++i) {
-		idx = get_ifidx(argv[i]);
-		if (!idx) {
-			fprintf(stderr, "Invalid arg\n");
-			return 1;
-		}
+	for (i = 0; i < ndevs; ++i) {
 		if (attach)
-			err = do_attach(idx, prog_fd, map_fd, argv[i]);
+			err = attach_to_dev(devs[i].ifindex, prog_fd,
+					    devs[i].name);
 		else
-			err = detach_from_dev(idx, argv[i]);
+			err = detach_from_dev(devs[i].ifindex, devs[i].name);
 
 		if (err)
 			ret = err;
 	}
 
+	if (rtnl_fd >= 0 && !ret)
+		ret = cache_monitor(rtnl_fd, cfg_fd, &cache_cfg);
+out:
+	/* attach failed after the cache was enabled */
+	if (cfg_fd >= 0 && (cache_cfg.flags & L3FWD_CACHE_F_ENABLED)) {
+		cache_cfg.flags &= ~L3FWD_CACHE_F_ENABLED;
+		cache_set_config(cfg_fd, &cache_cfg);
+	}
+	if (rtnl_fd >= 0)
+		close(rtnl_fd);
+	free(devs);
 	return ret;
 }